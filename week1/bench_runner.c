@@ -0,0 +1,1499 @@
+// bench_runner.c - week1 各个工具的基准测试
+// 生成测试数据 (大文件、大目录、表达式语料、大日志), 每个用例分别运行工具的快速路径和对照
+// (系统自带的同类工具, 或者工具自己的慢路径), 记录耗时、最大常驻内存和系统调用次数,
+// 和保存的基线比较. 有用例比基线差时退出码为 1, 用来决定一个性能改动能不能合进来
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ptrace.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+// 规模为 1 时各个数据集的大小
+#define TEXT_BYTES (512LL * 1024 * 1024)
+#define LOG_BYTES (2048LL * 1024 * 1024)
+#define SMALL_FILES 2000
+#define FLAT_FILES 100000
+#define TREE_DIRS 200
+#define TREE_FILES_PER_DIR 250
+#define EXPR_LINES 2000000
+#define LOG_PATTERNS 40
+
+// 回显服务器的用例: 连接数, 每个连接往返的次数 (乘规模), 每条消息的字节数
+#define ECHO_PORT 8080
+#define ECHO_CONNECTIONS 32
+#define ECHO_ROUNDS 2000
+#define ECHO_MESSAGE 64
+
+// 数据目录下的路径; 目录里的文件名再多留一点余量
+#define PATH_LEN 4096
+#define MAX_ARGS 64
+#define MAX_CASES 32
+#define SYSCALL_SLOTS 512
+#define TOP_SYSCALLS 3
+
+// 和基线相差不到这么多秒的不算变慢, 太短的用例计时误差比容差还大
+#define TIME_NOISE 0.005
+
+enum
+{
+    DATA_TEXT = 1 << 0,
+    DATA_SMALL = 1 << 1,
+    DATA_FLAT = 1 << 2,
+    DATA_TREE = 1 << 3,
+    DATA_EXPR = 1 << 4,
+    DATA_LOG = 1 << 5,
+    DATA_EXPR_CACHE = 1 << 6,
+};
+
+typedef enum
+{
+    CASE_COMMAND, // 运行命令, 输出丢弃
+    CASE_ECHO,    // 启动回显服务器, 由 runner 自己发请求
+    CASE_MICRO,   // 工具自带的 --bench, 输出原样打印, 不和基线比较
+} case_kind_t;
+
+// 命令模板按空格切分. %B 换成构建目录, %D 换成数据目录, 单独的 %F 展开成所有小文件
+typedef struct
+{
+    const char *name;
+    const char *desc;
+    case_kind_t kind;
+    int data;
+    const char *fast;
+    const char *baseline; // NULL 表示没有对照
+} bench_case_t;
+
+typedef struct
+{
+    double wall; // 秒, 多次运行取最快的一次
+    double user;
+    double sys;
+    long max_rss; // KB
+    long syscalls; // -1 表示没有统计
+    long top_nr[TOP_SYSCALLS];
+    long top_count[TOP_SYSCALLS];
+    int ok;
+} measure_t;
+
+// 基线文件里的一行
+typedef struct
+{
+    char name[64];
+    char variant[16];
+    double wall;
+    long max_rss;
+    long syscalls;
+} baseline_t;
+
+static const bench_case_t g_cases[] = {
+    { "cat_text", "mini_cat 整个大文件 (零拷贝)", CASE_COMMAND, DATA_TEXT, "%B/mini_cat %D/text.txt", "cat %D/text.txt" },
+    { "cat_stream", "mini_cat -S 流式读", CASE_COMMAND, DATA_TEXT, "%B/mini_cat -S %D/text.txt", "cat %D/text.txt" },
+    { "cat_number", "mini_cat -n 行号", CASE_COMMAND, DATA_TEXT, "%B/mini_cat -n %D/text.txt", "cat -n %D/text.txt" },
+    { "cat_many", "mini_cat -p 16 大量小文件", CASE_COMMAND, DATA_SMALL, "%B/mini_cat -p 16 %F", "cat %F" },
+    { "ls_flat", "mini_ls -U 大目录", CASE_COMMAND, DATA_FLAT, "%B/mini_ls -U %D/flat", "ls -U %D/flat" },
+    { "ls_long", "mini_ls -l 大目录", CASE_COMMAND, DATA_FLAT, "%B/mini_ls -l %D/flat", "ls -l %D/flat" },
+    { "ls_recursive", "mini_ls -R 目录树", CASE_COMMAND, DATA_TREE, "%B/mini_ls -R %D/tree", "ls -R %D/tree" },
+    { "du_tree", "mini_ls -D -I 增量 du", CASE_COMMAND, DATA_TREE, "%B/mini_ls -D -I %D/tree.idx %D/tree", "du -d 1 %D/tree" },
+    { "expr_bulk", "str_parser -f 批量求值", CASE_COMMAND, DATA_EXPR, "%B/str_parser -f %D/exprs.txt",
+      "%B/str_parser -f %D/exprs.txt -t 1 -c 0" },
+    { "expr_unique", "str_parser -f 几乎不重复 (缓存自动绕过)", CASE_COMMAND, DATA_EXPR_CACHE,
+      "%B/str_parser -f %D/exprs_unique.txt", "%B/str_parser -f %D/exprs_unique.txt -c 0" },
+    { "expr_hot", "str_parser -f 九成重复 (缓存命中)", CASE_COMMAND, DATA_EXPR_CACHE, "%B/str_parser -f %D/exprs_hot.txt",
+      "%B/str_parser -f %D/exprs_hot.txt -c 0" },
+    { "log_keyword", "log_filter -k 关键字统计", CASE_COMMAND, DATA_LOG, "%B/log_filter -k ERROR -S %D/app.log",
+      "grep -c -i -F ERROR %D/app.log" },
+    { "log_window", "log_filter -I 时间窗口", CASE_COMMAND, DATA_LOG, "%B/log_filter -I -s 2024-03-01 -e 2024-03-03 -S %D/app.log",
+      "%B/log_filter -s 2024-03-01 -e 2024-03-03 -S %D/app.log" },
+    { "log_patterns", "log_filter -K 多模式", CASE_COMMAND, DATA_LOG, "%B/log_filter -K %D/patterns.txt -S %D/app.log",
+      "grep -c -i -F -f %D/patterns.txt %D/app.log" },
+    { "echo_roundtrip", "echo_sever 多连接往返", CASE_ECHO, 0, "%B/echo_sever", NULL },
+    { "micro_expr", "str_parser --bench", CASE_MICRO, 0, "%B/str_parser --bench 2000000", NULL },
+    { "micro_search", "log_filter --bench 查找核", CASE_MICRO, DATA_LOG, "%B/log_filter --bench %D/app.log ERROR", NULL },
+};
+#define CASE_COUNT (int)(sizeof(g_cases) / sizeof(g_cases[0]))
+
+static const char *g_program = "bench_runner";
+static const char *g_build_dir = "build/release";
+static const char *g_data_dir = "/tmp/week1_bench";
+static const char *g_baseline_path = "bench_baseline.txt";
+static double g_scale = 1.0;
+static int g_runs = 3;
+static double g_tolerance = 0.10;
+static int g_write_baseline = 0;
+static int g_count_syscalls = 1;
+static int g_verbose = 0;
+
+static char **g_small_files;
+static int g_small_count;
+
+void show_help(void)
+{
+    printf("用法: %s [选项] [用例...]\n", g_program);
+    printf("不给用例时运行全部用例, 用例名可以只写前缀 (比如 log)\n\n");
+    printf("选项:\n");
+    printf("  -B <目录>   被测程序所在的构建目录 (默认 %s)\n", g_build_dir);
+    printf("  -d <目录>   测试数据目录, 不存在或者规模变了时重新生成 (默认 %s)\n", g_data_dir);
+    printf("  -s <规模>   数据集规模, 1 表示 512 MB 文本、2 GB 日志、10 万个文件的目录 (默认 1)\n");
+    printf("  -r <次数>   每个版本测量的次数, 取最快的一次; 之前还有一次预热 (默认 %d)\n", g_runs);
+    printf("  -b <文件>   基线文件 (默认 %s)\n", g_baseline_path);
+    printf("  -w          把这次的结果写成新的基线\n");
+    printf("  -T <百分比> 超过基线多少算变差 (默认 %.0f)\n", g_tolerance * 100);
+    printf("  -n          不统计系统调用 (统计要多跑一遍 ptrace)\n");
+    printf("  -v          列出最多的几种系统调用\n");
+    printf("  -l          列出所有用例\n");
+    printf("  -h          显示帮助信息\n");
+}
+
+double now_seconds(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// xorshift64*, 数据集每次生成出来都一样
+static inline uint64_t next_random(uint64_t *state)
+{
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545f4914f6cdd1dULL;
+}
+
+int write_all(int fd, const char *buf, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n < 0)
+        {
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// ======================== 测试数据 ========================
+
+static int remove_entry(const char *path, const struct stat *st, int type, struct FTW *ftw)
+{
+    (void)st;
+    (void)type;
+    (void)ftw;
+    return remove(path);
+}
+
+static int remove_tree(const char *path)
+{
+    if (access(path, F_OK) != 0)
+    {
+        return 0;
+    }
+    return nftw(path, remove_entry, 64, FTW_DEPTH | FTW_PHYS);
+}
+
+// 数据集旁边的 .<名字> 文件记着生成它时的规模, 对得上就不用重新生成
+static int dataset_ready(const char *name)
+{
+    char path[PATH_LEN];
+    char text[64];
+    char want[64];
+
+    snprintf(path, sizeof(path), "%s/.%s", g_data_dir, name);
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL)
+    {
+        return 0;
+    }
+    int ok = fgets(text, sizeof(text), fp) != NULL;
+    fclose(fp);
+    snprintf(want, sizeof(want), "%g\n", g_scale);
+    return ok && strcmp(text, want) == 0;
+}
+
+static int mark_dataset(const char *name)
+{
+    char path[PATH_LEN];
+
+    snprintf(path, sizeof(path), "%s/.%s", g_data_dir, name);
+    FILE *fp = fopen(path, "w");
+    if (fp == NULL)
+    {
+        return -1;
+    }
+    fprintf(fp, "%g\n", g_scale);
+    return fclose(fp);
+}
+
+static void unmark_dataset(const char *name)
+{
+    char path[PATH_LEN];
+
+    snprintf(path, sizeof(path), "%s/.%s", g_data_dir, name);
+    unlink(path);
+}
+
+static long scaled(long long n)
+{
+    long long v = (long long)(n * g_scale);
+    return v < 1 ? 1 : v;
+}
+
+// 带缓冲地写一个生成出来的文件, 写满一块才 write
+typedef struct
+{
+    int fd;
+    char *data;
+    size_t len;
+    size_t cap;
+    long long total;
+    int failed;
+} gen_file_t;
+
+static int gen_open(gen_file_t *file, const char *path)
+{
+    memset(file, 0, sizeof(*file));
+    file->cap = 1024 * 1024;
+    file->data = malloc(file->cap);
+    file->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (file->data == NULL || file->fd < 0)
+    {
+        free(file->data);
+        if (file->fd >= 0)
+        {
+            close(file->fd);
+        }
+        return -1;
+    }
+    return 0;
+}
+
+static void gen_append(gen_file_t *file, const char *s, size_t len)
+{
+    if (file->len + len > file->cap)
+    {
+        file->failed |= write_all(file->fd, file->data, file->len) != 0;
+        file->len = 0;
+    }
+    memcpy(file->data + file->len, s, len);
+    file->len += len;
+    file->total += len;
+}
+
+static int gen_close(gen_file_t *file)
+{
+    file->failed |= write_all(file->fd, file->data, file->len) != 0;
+    file->failed |= close(file->fd) != 0;
+    free(file->data);
+    return file->failed ? -1 : 0;
+}
+
+static const char *const g_words[] = {
+    "the", "quick", "brown", "fox", "jumps", "over", "lazy", "dog", "lorem", "ipsum", "dolor", "sit", "amet",
+    "buffer", "kernel", "page", "cache", "thread", "socket", "vector", "branch", "memory", "latency", "queue",
+};
+#define WORD_COUNT (sizeof(g_words) / sizeof(g_words[0]))
+
+// 文本: 长短不一的单词行, 夹着一些空行, -n/-s 都有东西可做
+static int gen_text(const char *path)
+{
+    gen_file_t file;
+    uint64_t seed = 0x1234567;
+    long long target = scaled(TEXT_BYTES);
+
+    if (gen_open(&file, path) != 0)
+    {
+        return -1;
+    }
+    while (file.total < target && !file.failed)
+    {
+        char line[512];
+        size_t len = 0;
+        int words = next_random(&seed) % 16;
+        for (int i = 0; i < words; i++)
+        {
+            const char *word = g_words[next_random(&seed) % WORD_COUNT];
+            size_t n = strlen(word);
+            memcpy(line + len, word, n);
+            len += n;
+            line[len++] = i + 1 < words ? ' ' : '\n';
+        }
+        if (words == 0)
+        {
+            line[len++] = '\n';
+        }
+        gen_append(&file, line, len);
+    }
+    return gen_close(&file);
+}
+
+// 小文件: 1 KB 到 64 KB
+static int gen_small(const char *dir)
+{
+    uint64_t seed = 0x7654321;
+    char *block = malloc(64 * 1024);
+    long count = scaled(SMALL_FILES);
+
+    if (block == NULL || mkdir(dir, 0755) != 0)
+    {
+        free(block);
+        return -1;
+    }
+    for (size_t i = 0; i < 64 * 1024; i++)
+    {
+        block[i] = i % 64 == 63 ? '\n' : 'a' + next_random(&seed) % 26;
+    }
+    for (long i = 0; i < count; i++)
+    {
+        char path[PATH_LEN + 32];
+        snprintf(path, sizeof(path), "%s/f%06ld", dir, i);
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        size_t size = 1024 + next_random(&seed) % (63 * 1024);
+        if (fd < 0 || write_all(fd, block, size) != 0 || close(fd) != 0)
+        {
+            free(block);
+            return -1;
+        }
+    }
+    free(block);
+    return 0;
+}
+
+// 一个目录里放很多空文件, 名字打乱, 排序有事可做
+static int gen_flat(const char *dir)
+{
+    uint64_t seed = 0x2468ace;
+    long count = scaled(FLAT_FILES);
+
+    if (mkdir(dir, 0755) != 0)
+    {
+        return -1;
+    }
+    for (long i = 0; i < count; i++)
+    {
+        char path[PATH_LEN + 32];
+        snprintf(path, sizeof(path), "%s/%08llx_%ld", dir, (unsigned long long)(next_random(&seed) & 0xffffffff), i);
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0 || close(fd) != 0)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// 两层的目录树, 文件 0 到 4 KB, -R 和 -D 用
+static int gen_tree(const char *dir)
+{
+    uint64_t seed = 0x13579bd;
+    char block[4096];
+    long dirs = scaled(TREE_DIRS);
+
+    memset(block, 'x', sizeof(block));
+    if (mkdir(dir, 0755) != 0)
+    {
+        return -1;
+    }
+    for (long d = 0; d < dirs; d++)
+    {
+        char sub[PATH_LEN + 32];
+        snprintf(sub, sizeof(sub), "%s/d%04ld", dir, d);
+        if (mkdir(sub, 0755) != 0)
+        {
+            return -1;
+        }
+        for (int i = 0; i < TREE_FILES_PER_DIR; i++)
+        {
+            char path[PATH_LEN + 64];
+            snprintf(path, sizeof(path), "%s/f%04d", sub, i);
+            int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            size_t size = next_random(&seed) % sizeof(block);
+            if (fd < 0 || write_all(fd, block, size) != 0 || close(fd) != 0)
+            {
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+// 随机生成一个表达式, depth 控制括号嵌套
+static size_t gen_expression(char *out, uint64_t *seed, int depth)
+{
+    static const char ops[] = "+-*/";
+    size_t len = 0;
+    int terms = 2 + next_random(seed) % 4;
+
+    for (int i = 0; i < terms; i++)
+    {
+        if (i > 0)
+        {
+            len += sprintf(out + len, " %c ", ops[next_random(seed) % 4]);
+        }
+        if (depth > 0 && next_random(seed) % 4 == 0)
+        {
+            out[len++] = '(';
+            len += gen_expression(out + len, seed, depth - 1);
+            out[len++] = ')';
+        }
+        else
+        {
+            uint64_t r = next_random(seed);
+            len += r % 3 == 0 ? sprintf(out + len, "%u.%02u", (unsigned)(r >> 8) % 1000, (unsigned)(r >> 20) % 100)
+                              : sprintf(out + len, "%u", (unsigned)(r >> 8) % 100000 + 1);
+        }
+    }
+    return len;
+}
+
+// 表达式语料: 十行里有 repeat_tenths 行从 pool 个表达式的池子里重复出现, 让缓存有命中
+static int gen_exprs(const char *path, uint64_t seed, int repeat_tenths, unsigned pool)
+{
+    gen_file_t file;
+    long lines = scaled(EXPR_LINES);
+
+    if (gen_open(&file, path) != 0)
+    {
+        return -1;
+    }
+    for (long i = 0; i < lines && !file.failed; i++)
+    {
+        char line[2048];
+        uint64_t pool_seed = 0x5eed0000 + next_random(&seed) % pool;
+        size_t len = (int)(next_random(&seed) % 10) < repeat_tenths ? gen_expression(line, &pool_seed, 2)
+                                                                    : gen_expression(line, &seed, 2);
+        line[len++] = '\n';
+        gen_append(&file, line, len);
+    }
+    return gen_close(&file);
+}
+
+// 缓存的两头: 几乎没有重复的 (缓存应该自己让开) 和九成重复、池子放得进默认缓存的
+static int gen_cache_exprs(const char *unique_path, const char *hot_path)
+{
+    if (gen_exprs(unique_path, 0xc0ffee, 0, 1) != 0)
+    {
+        return -1;
+    }
+    return gen_exprs(hot_path, 0xbadcafe, 9, 20000);
+}
+
+// 大日志: 时间递增 (2024-03-01 起每行 1 秒左右), 级别和 IP 按固定比例分布, 另附 -K 用的模式文件
+static int gen_log(const char *path, const char *pattern_path)
+{
+    static const char *const levels[] = { "INFO", "INFO", "INFO", "INFO", "DEBUG", "WARN", "ERROR", "TRACE" };
+    static const char *const messages[] = { "user login", "request done", "cache miss", "db error", "timeout", "retry" };
+    gen_file_t file;
+    uint64_t seed = 0xabcdef12;
+    long long target = scaled(LOG_BYTES);
+    time_t t = 1709251200; // 2024-03-01 00:00:00 UTC
+    // 一行大约 90 字节. 日期窗口用例选的是开头三天, 行少的时候把间隔拉大, 让日志至少跨 30 天, 窗口外也有数据
+    long lines = target / 90 + 1;
+    long step = lines < 86400L * 30 ? 86400L * 30 / lines : 1;
+
+    if (gen_open(&file, path) != 0)
+    {
+        return -1;
+    }
+    while (file.total < target && !file.failed)
+    {
+        struct tm tm;
+        char line[256];
+        uint64_t r = next_random(&seed);
+        gmtime_r(&t, &tm);
+        size_t len = strftime(line, sizeof(line), "%Y-%m-%d %H:%M:%S ", &tm);
+        len += sprintf(line + len, "[%s] %s from 10.%u.%u.%u id=%u latency=%ums\n", levels[r % 8], messages[(r >> 3) % 6],
+                       (unsigned)(r >> 8) % 4, (unsigned)(r >> 16) % 256, (unsigned)(r >> 24) % 256,
+                       (unsigned)(r >> 32) % 100000, (unsigned)(r >> 48) % 2000);
+        gen_append(&file, line, len);
+        t += r % 7 == 0 ? step + 1 : step;
+    }
+    if (gen_close(&file) != 0)
+    {
+        return -1;
+    }
+
+    FILE *fp = fopen(pattern_path, "w");
+    if (fp == NULL)
+    {
+        return -1;
+    }
+    for (int i = 0; i < LOG_PATTERNS; i++)
+    {
+        fprintf(fp, "id=%u\n", (unsigned)(next_random(&seed) % 100000));
+    }
+    fprintf(fp, "db error\n");
+    return fclose(fp);
+}
+
+// 小文件的列表展开 %F 用, 按名字排序
+static int list_small_files(void)
+{
+    char dir[PATH_LEN];
+    struct dirent **entries;
+
+    snprintf(dir, sizeof(dir), "%s/small", g_data_dir);
+    int n = scandir(dir, &entries, NULL, alphasort);
+    if (n < 0)
+    {
+        return -1;
+    }
+    g_small_files = calloc(n + 1, sizeof(char *));
+    for (int i = 0; i < n; i++)
+    {
+        if (g_small_files != NULL && entries[i]->d_name[0] != '.')
+        {
+            size_t len = strlen(dir) + strlen(entries[i]->d_name) + 2;
+            char *path = malloc(len);
+            if (path != NULL)
+            {
+                snprintf(path, len, "%s/%s", dir, entries[i]->d_name);
+                g_small_files[g_small_count++] = path;
+            }
+        }
+        free(entries[i]);
+    }
+    free(entries);
+    return g_small_files == NULL ? -1 : 0;
+}
+
+// 准备 needed 里的数据集. 规模对不上的先删掉再生成
+int prepare_data(int needed)
+{
+    static const struct
+    {
+        int bit;
+        const char *name;
+        const char *path;
+    } sets[] = {
+        { DATA_TEXT, "text", "text.txt" }, { DATA_SMALL, "small", "small" }, { DATA_FLAT, "flat", "flat" },
+        { DATA_TREE, "tree", "tree" },     { DATA_EXPR, "exprs", "exprs.txt" }, { DATA_LOG, "log", "app.log" },
+        { DATA_EXPR_CACHE, "exprs_cache", "exprs_unique.txt" },
+    };
+
+    if (mkdir(g_data_dir, 0755) != 0 && errno != EEXIST)
+    {
+        fprintf(stderr, "%s: %s\n", g_data_dir, strerror(errno));
+        return -1;
+    }
+    for (size_t i = 0; i < sizeof(sets) / sizeof(sets[0]); i++)
+    {
+        char path[PATH_LEN];
+        char extra[PATH_LEN];
+        if (!(needed & sets[i].bit) || dataset_ready(sets[i].name))
+        {
+            continue;
+        }
+        snprintf(path, sizeof(path), "%s/%s", g_data_dir, sets[i].path);
+        printf("生成数据集 %s (规模 %g)...\n", path, g_scale);
+        fflush(stdout);
+        unmark_dataset(sets[i].name);
+        remove_tree(path);
+
+        double start = now_seconds();
+        int ret = -1;
+        switch (sets[i].bit)
+        {
+        case DATA_TEXT:
+            ret = gen_text(path);
+            break;
+        case DATA_SMALL:
+            ret = gen_small(path);
+            break;
+        case DATA_FLAT:
+            ret = gen_flat(path);
+            break;
+        case DATA_TREE:
+            // 索引是针对旧的目录树建的, 一起删掉
+            snprintf(extra, sizeof(extra), "%s/tree.idx", g_data_dir);
+            unlink(extra);
+            ret = gen_tree(path);
+            break;
+        case DATA_EXPR:
+            ret = gen_exprs(path, 0xfeedbeef, 3, 1000);
+            break;
+        case DATA_LOG:
+            snprintf(extra, sizeof(extra), "%s/app.log.idx", g_data_dir);
+            unlink(extra);
+            snprintf(extra, sizeof(extra), "%s/patterns.txt", g_data_dir);
+            ret = gen_log(path, extra);
+            break;
+        case DATA_EXPR_CACHE:
+            snprintf(extra, sizeof(extra), "%s/exprs_hot.txt", g_data_dir);
+            ret = gen_cache_exprs(path, extra);
+            break;
+        }
+        if (ret != 0 || mark_dataset(sets[i].name) != 0)
+        {
+            fprintf(stderr, "%s: 生成失败: %s\n", path, strerror(errno));
+            return -1;
+        }
+        printf("  用时 %.1f s\n", now_seconds() - start);
+    }
+    if ((needed & DATA_SMALL) && list_small_files() != 0)
+    {
+        fprintf(stderr, "%s/small: %s\n", g_data_dir, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+// ======================== 运行和测量 ========================
+
+// 把命令模板展开成 argv, 字符串存在 storage 里. %F 展开出来的指针指向 g_small_files
+static int build_argv(const char *template, char *storage, size_t storage_size, char ***argv_out)
+{
+    char **argv = malloc((MAX_ARGS + g_small_count + 1) * sizeof(char *));
+    int argc = 0;
+    size_t used = 0;
+    const char *p = template;
+
+    if (argv == NULL)
+    {
+        return -1;
+    }
+    while (*p != '\0')
+    {
+        while (*p == ' ')
+        {
+            p++;
+        }
+        if (*p == '\0')
+        {
+            break;
+        }
+        if (strncmp(p, "%F", 2) == 0 && (p[2] == ' ' || p[2] == '\0'))
+        {
+            for (int i = 0; i < g_small_count; i++)
+            {
+                argv[argc++] = g_small_files[i];
+            }
+            p += 2;
+            continue;
+        }
+        char *arg = storage + used;
+        while (*p != '\0' && *p != ' ')
+        {
+            const char *insert = NULL;
+            size_t n = 1;
+            if (p[0] == '%' && p[1] == 'B')
+            {
+                insert = g_build_dir;
+            }
+            else if (p[0] == '%' && p[1] == 'D')
+            {
+                insert = g_data_dir;
+            }
+            if (insert != NULL)
+            {
+                n = strlen(insert);
+                p += 2;
+            }
+            else
+            {
+                insert = p++;
+            }
+            if (used + n + 1 >= storage_size || argc >= MAX_ARGS)
+            {
+                free(argv);
+                return -1;
+            }
+            memcpy(storage + used, insert, n);
+            used += n;
+        }
+        storage[used++] = '\0';
+        argv[argc++] = arg;
+    }
+    argv[argc] = NULL;
+    *argv_out = argv;
+    return argc > 0 ? 0 : -1;
+}
+
+// 子进程: 输出接到 out_fd (-1 表示保留原来的), 需要统计系统调用时先停下来等父进程接上 ptrace
+static pid_t spawn(char **argv, int traced, int out_fd)
+{
+    pid_t pid = fork();
+
+    if (pid != 0)
+    {
+        return pid;
+    }
+    int null_fd = open("/dev/null", O_RDONLY);
+    if (null_fd >= 0)
+    {
+        dup2(null_fd, STDIN_FILENO);
+        close(null_fd);
+    }
+    if (out_fd >= 0)
+    {
+        dup2(out_fd, STDOUT_FILENO);
+        dup2(out_fd, STDERR_FILENO);
+    }
+    if (traced)
+    {
+        if (ptrace(PTRACE_TRACEME, 0, NULL, NULL) != 0)
+        {
+            _exit(126);
+        }
+        raise(SIGSTOP);
+    }
+    execvp(argv[0], argv);
+    _exit(127);
+}
+
+// 被测程序的输出接到管道上, 由这个线程 splice 到 /dev/null. 不能直接重定向到 /dev/null:
+// GNU grep 发现输出是 /dev/null 时找到第一个匹配就退出, 而且零拷贝的路径也会和真实场景不一样
+static void *drain_output(void *arg)
+{
+    int fd = *(int *)arg;
+    int null_fd = open("/dev/null", O_WRONLY);
+    char buf[65536];
+
+    while (null_fd >= 0 && splice(fd, NULL, null_fd, NULL, 1 << 20, SPLICE_F_MOVE) > 0)
+    {
+    }
+    while (read(fd, buf, sizeof(buf)) > 0)
+    {
+    }
+    if (null_fd >= 0)
+    {
+        close(null_fd);
+    }
+    return NULL;
+}
+
+// 跟着子进程和它所有的线程、子进程, 数系统调用的入口. 返回子进程的退出状态, ptrace 不可用时返回 -1
+static int trace_syscalls(pid_t pid, long *counts, long *total)
+{
+    int status;
+
+    if (waitpid(pid, &status, 0) != pid || !WIFSTOPPED(status))
+    {
+        return -1;
+    }
+    long options = PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACECLONE | PTRACE_O_TRACEFORK | PTRACE_O_TRACEVFORK
+                   | PTRACE_O_TRACEEXEC | PTRACE_O_EXITKILL;
+    if (ptrace(PTRACE_SETOPTIONS, pid, NULL, (void *)options) != 0 || ptrace(PTRACE_SYSCALL, pid, NULL, NULL) != 0)
+    {
+        kill(pid, SIGKILL);
+        waitpid(pid, &status, 0);
+        return -1;
+    }
+
+    int exit_status = -1;
+    *total = 0;
+    for (;;)
+    {
+        pid_t tid = waitpid(-1, &status, __WALL);
+        if (tid < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            break;
+        }
+        if (WIFEXITED(status) || WIFSIGNALED(status))
+        {
+            if (tid == pid)
+            {
+                exit_status = status;
+            }
+            continue;
+        }
+        int sig = 0;
+        if (WSTOPSIG(status) == (SIGTRAP | 0x80))
+        {
+            struct __ptrace_syscall_info info;
+            if (ptrace(PTRACE_GET_SYSCALL_INFO, tid, (void *)sizeof(info), &info) > 0 && info.op == PTRACE_SYSCALL_INFO_ENTRY)
+            {
+                (*total)++;
+                counts[info.entry.nr < SYSCALL_SLOTS ? info.entry.nr : SYSCALL_SLOTS - 1]++;
+            }
+        }
+        else if (status >> 16 == 0 && WSTOPSIG(status) != SIGSTOP && WSTOPSIG(status) != SIGTRAP)
+        {
+            // 真正的信号要转交给被跟踪的进程; 新线程开始时的 SIGSTOP 和事件停止吞掉
+            sig = WSTOPSIG(status);
+        }
+        ptrace(PTRACE_SYSCALL, tid, NULL, (void *)(long)sig);
+    }
+    return exit_status;
+}
+
+static const char *syscall_name(long nr)
+{
+    static const struct
+    {
+        long nr;
+        const char *name;
+    } names[] = {
+        { SYS_read, "read" },
+        { SYS_write, "write" },
+        { SYS_openat, "openat" },
+        { SYS_close, "close" },
+        { SYS_mmap, "mmap" },
+        { SYS_munmap, "munmap" },
+        { SYS_brk, "brk" },
+        { SYS_pread64, "pread64" },
+        { SYS_writev, "writev" },
+        { SYS_sendfile, "sendfile" },
+        { SYS_splice, "splice" },
+#ifdef SYS_copy_file_range
+        { SYS_copy_file_range, "copy_file_range" },
+#endif
+        { SYS_getdents64, "getdents64" },
+        { SYS_statx, "statx" },
+#ifdef SYS_newfstatat
+        { SYS_newfstatat, "newfstatat" },
+#endif
+#ifdef SYS_fstat
+        { SYS_fstat, "fstat" },
+#endif
+        { SYS_lseek, "lseek" },
+#ifdef SYS_fadvise64
+        { SYS_fadvise64, "fadvise64" },
+#endif
+        { SYS_madvise, "madvise" },
+        { SYS_futex, "futex" },
+        { SYS_clone, "clone" },
+#ifdef SYS_clone3
+        { SYS_clone3, "clone3" },
+#endif
+#ifdef SYS_epoll_wait
+        { SYS_epoll_wait, "epoll_wait" },
+#endif
+        { SYS_epoll_ctl, "epoll_ctl" },
+        { SYS_accept, "accept" },
+        { SYS_recvfrom, "recvfrom" },
+        { SYS_sendto, "sendto" },
+#ifdef SYS_io_uring_enter
+        { SYS_io_uring_enter, "io_uring_enter" },
+#endif
+        { SYS_mprotect, "mprotect" },
+        { SYS_rt_sigprocmask, "rt_sigprocmask" },
+    };
+    static char buf[32];
+
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++)
+    {
+        if (names[i].nr == nr)
+        {
+            return names[i].name;
+        }
+    }
+    snprintf(buf, sizeof(buf), "#%ld", nr);
+    return buf;
+}
+
+static void keep_top_syscalls(measure_t *m, const long *counts)
+{
+    for (int k = 0; k < TOP_SYSCALLS; k++)
+    {
+        m->top_nr[k] = -1;
+        m->top_count[k] = 0;
+    }
+    for (long nr = 0; nr < SYSCALL_SLOTS; nr++)
+    {
+        for (int k = 0; k < TOP_SYSCALLS; k++)
+        {
+            if (counts[nr] > m->top_count[k])
+            {
+                memmove(&m->top_nr[k + 1], &m->top_nr[k], (TOP_SYSCALLS - 1 - k) * sizeof(long));
+                memmove(&m->top_count[k + 1], &m->top_count[k], (TOP_SYSCALLS - 1 - k) * sizeof(long));
+                m->top_nr[k] = nr;
+                m->top_count[k] = counts[nr];
+                break;
+            }
+        }
+    }
+}
+
+// 回显服务器的负载: 一组连接轮流发一条消息、等它原样回来. 在单独的线程里跑, 主线程要等 (或者跟踪) 服务器进程
+typedef struct
+{
+    pid_t server;
+    int rounds;
+    double elapsed;
+    int ok;
+} echo_load_t;
+
+static int connect_server(void)
+{
+    for (int attempt = 0; attempt < 200; attempt++)
+    {
+        struct sockaddr_in addr;
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(ECHO_PORT);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (fd >= 0 && connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+        {
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            return fd;
+        }
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        usleep(10000);
+    }
+    return -1;
+}
+
+static void *echo_load(void *arg)
+{
+    echo_load_t *load = arg;
+    int fds[ECHO_CONNECTIONS];
+    int opened = 0;
+    char message[ECHO_MESSAGE];
+    char reply[ECHO_MESSAGE];
+
+    memset(message, 'e', sizeof(message));
+    message[sizeof(message) - 1] = '\n';
+    load->ok = 0;
+    for (; opened < ECHO_CONNECTIONS; opened++)
+    {
+        fds[opened] = connect_server();
+        if (fds[opened] < 0)
+        {
+            break;
+        }
+    }
+
+    double start = now_seconds();
+    int ok = opened == ECHO_CONNECTIONS;
+    for (int round = 0; ok && round < load->rounds; round++)
+    {
+        for (int c = 0; ok && c < opened; c++)
+        {
+            ok = write_all(fds[c], message, sizeof(message)) == 0;
+        }
+        for (int c = 0; ok && c < opened; c++)
+        {
+            size_t got = 0;
+            while (ok && got < sizeof(reply))
+            {
+                ssize_t n = read(fds[c], reply + got, sizeof(reply) - got);
+                ok = n > 0 || (n < 0 && errno == EINTR);
+                got += n > 0 ? n : 0;
+            }
+        }
+    }
+    load->elapsed = now_seconds() - start;
+    load->ok = ok;
+    for (int c = 0; c < opened; c++)
+    {
+        close(fds[c]);
+    }
+    kill(load->server, SIGTERM);
+    return NULL;
+}
+
+// 运行一次. traced 时只数系统调用, 时间不准不记
+static int run_once(const bench_case_t *bc, char **argv, int traced, measure_t *m)
+{
+    long counts[SYSCALL_SLOTS];
+    struct rusage usage;
+    echo_load_t load;
+    pthread_t load_thread, drain_thread;
+    int out[2] = { -1, -1 };
+    int status = -1;
+
+    memset(counts, 0, sizeof(counts));
+    if (bc->kind != CASE_MICRO && pipe2(out, O_CLOEXEC) != 0)
+    {
+        return -1;
+    }
+    double start = now_seconds();
+    pid_t pid = spawn(argv, traced, out[1]);
+    if (out[1] >= 0)
+    {
+        close(out[1]);
+    }
+    if (pid < 0 || (out[0] >= 0 && pthread_create(&drain_thread, NULL, drain_output, &out[0]) != 0))
+    {
+        if (pid > 0)
+        {
+            kill(pid, SIGKILL);
+            waitpid(pid, &status, 0);
+        }
+        if (out[0] >= 0)
+        {
+            close(out[0]);
+        }
+        return -1;
+    }
+    if (bc->kind == CASE_ECHO)
+    {
+        load.server = pid;
+        load.rounds = scaled(ECHO_ROUNDS);
+        // 被跟踪时服务器要等 trace_syscalls 接上才会开始运行, 负载线程连不上会重试
+        if (pthread_create(&load_thread, NULL, echo_load, &load) != 0)
+        {
+            kill(pid, SIGTERM);
+            load.ok = 0;
+        }
+        else
+        {
+            load.ok = 1;
+        }
+    }
+
+    long total = 0;
+    if (traced)
+    {
+        status = trace_syscalls(pid, counts, &total);
+        memset(&usage, 0, sizeof(usage));
+    }
+    else
+    {
+        while (wait4(pid, &status, 0, &usage) < 0 && errno == EINTR)
+        {
+        }
+    }
+    double elapsed = now_seconds() - start;
+    if (out[0] >= 0)
+    {
+        pthread_join(drain_thread, NULL);
+        close(out[0]);
+    }
+    if (bc->kind == CASE_ECHO && load.ok)
+    {
+        pthread_join(load_thread, NULL);
+        elapsed = load.elapsed;
+    }
+    if (bc->kind == CASE_ECHO && !load.ok)
+    {
+        return -1;
+    }
+    // 回显服务器是被 SIGTERM 停下的, 正常退出; grep -c 没找到时退出码是 1, str_parser -f 有出错的行时也是 1
+    const char *tool = strrchr(argv[0], '/') != NULL ? strrchr(argv[0], '/') + 1 : argv[0];
+    int ok_code = strncmp(tool, "grep", 4) == 0 || strcmp(tool, "str_parser") == 0 ? 1 : 0;
+    if (status < 0 || !WIFEXITED(status) || WEXITSTATUS(status) > ok_code)
+    {
+        return -1;
+    }
+
+    if (traced)
+    {
+        m->syscalls = total;
+        keep_top_syscalls(m, counts);
+    }
+    else if (!m->ok || elapsed < m->wall)
+    {
+        m->wall = elapsed;
+        m->user = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6;
+        m->sys = usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+        m->max_rss = m->max_rss > usage.ru_maxrss ? m->max_rss : usage.ru_maxrss;
+        m->ok = 1;
+    }
+    return 0;
+}
+
+// 一个版本: 预热一次, 测 g_runs 次取最快, 再跟踪一次数系统调用
+int measure(const bench_case_t *bc, const char *template, measure_t *m)
+{
+    char storage[8192];
+    char **argv;
+
+    memset(m, 0, sizeof(*m));
+    m->syscalls = -1;
+    if (build_argv(template, storage, sizeof(storage), &argv) != 0)
+    {
+        fprintf(stderr, "%s: 命令太长: %s\n", bc->name, template);
+        return -1;
+    }
+    int ret = 0;
+    if (bc->kind == CASE_MICRO)
+    {
+        fflush(stdout);
+        ret = run_once(bc, argv, 0, m);
+        free(argv);
+        return ret;
+    }
+    for (int i = 0; ret == 0 && i <= g_runs; i++)
+    {
+        measure_t warmup;
+        memset(&warmup, 0, sizeof(warmup));
+        ret = run_once(bc, argv, 0, i == 0 ? &warmup : m);
+    }
+    if (ret == 0 && g_count_syscalls && run_once(bc, argv, 1, m) != 0)
+    {
+        // ptrace 不可用 (比如容器禁止了) 时只是没有系统调用数
+        m->syscalls = -1;
+    }
+    if (ret != 0)
+    {
+        fprintf(stderr, "%s: 运行失败: %s\n", bc->name, argv[0]);
+    }
+    free(argv);
+    return ret;
+}
+
+// ======================== 基线 ========================
+
+static baseline_t *g_baselines;
+static int g_baseline_count;
+static double g_baseline_scale = -1;
+
+int load_baseline(void)
+{
+    FILE *fp = fopen(g_baseline_path, "r");
+    char line[512];
+    int cap = 0;
+
+    if (fp == NULL)
+    {
+        return -1;
+    }
+    while (fgets(line, sizeof(line), fp) != NULL)
+    {
+        baseline_t b;
+        if (sscanf(line, "# scale %lf", &g_baseline_scale) == 1 || line[0] == '#')
+        {
+            continue;
+        }
+        if (sscanf(line, "%63s %15s %lf %ld %ld", b.name, b.variant, &b.wall, &b.max_rss, &b.syscalls) != 5)
+        {
+            continue;
+        }
+        if (g_baseline_count == cap)
+        {
+            cap = cap ? cap * 2 : 32;
+            baseline_t *grown = realloc(g_baselines, cap * sizeof(baseline_t));
+            if (grown == NULL)
+            {
+                break;
+            }
+            g_baselines = grown;
+        }
+        g_baselines[g_baseline_count++] = b;
+    }
+    fclose(fp);
+    return 0;
+}
+
+static const baseline_t *find_baseline(const char *name, const char *variant)
+{
+    for (int i = 0; i < g_baseline_count; i++)
+    {
+        if (strcmp(g_baselines[i].name, name) == 0 && strcmp(g_baselines[i].variant, variant) == 0)
+        {
+            return &g_baselines[i];
+        }
+    }
+    return NULL;
+}
+
+// 先写临时文件再改名, 中途失败不会把旧基线弄坏
+int save_baseline(const bench_case_t **cases, measure_t (*results)[2], int count)
+{
+    size_t len = strlen(g_baseline_path) + 32;
+    char *tmp = malloc(len);
+
+    if (tmp == NULL)
+    {
+        return -1;
+    }
+    snprintf(tmp, len, "%s.%ld", g_baseline_path, (long)getpid());
+    FILE *fp = fopen(tmp, "w");
+    if (fp == NULL)
+    {
+        free(tmp);
+        return -1;
+    }
+    fprintf(fp, "# week1 基准测试基线: 用例 版本 耗时(s) 最大常驻内存(KB) 系统调用数\n");
+    fprintf(fp, "# scale %g\n", g_scale);
+    for (int i = 0; i < count; i++)
+    {
+        for (int v = 0; v < 2; v++)
+        {
+            const measure_t *m = &results[i][v];
+            if (m->ok)
+            {
+                fprintf(fp, "%s %s %.4f %ld %ld\n", cases[i]->name, v == 0 ? "fast" : "baseline", m->wall, m->max_rss, m->syscalls);
+            }
+        }
+    }
+    // 没跑的用例保留原来的基线
+    for (int i = 0; i < g_baseline_count; i++)
+    {
+        int rerun = 0;
+        for (int k = 0; k < count; k++)
+        {
+            rerun |= strcmp(cases[k]->name, g_baselines[i].name) == 0;
+        }
+        if (!rerun && g_baseline_scale == g_scale)
+        {
+            const baseline_t *b = &g_baselines[i];
+            fprintf(fp, "%s %s %.4f %ld %ld\n", b->name, b->variant, b->wall, b->max_rss, b->syscalls);
+        }
+    }
+    if (fclose(fp) != 0 || rename(tmp, g_baseline_path) != 0)
+    {
+        int saved_errno = errno;
+        unlink(tmp);
+        free(tmp);
+        errno = saved_errno;
+        return -1;
+    }
+    free(tmp);
+    return 0;
+}
+
+// 和基线比, 返回变差的项数. 时间、内存、系统调用数任何一项超过容差都算
+static int compare_baseline(const char *name, const char *variant, const measure_t *m, char *note, size_t note_size)
+{
+    const baseline_t *b = find_baseline(name, variant);
+
+    note[0] = '\0';
+    if (b == NULL || g_baseline_scale != g_scale)
+    {
+        return 0;
+    }
+    int worse = 0;
+    size_t len = snprintf(note, note_size, "%+.1f%%", (m->wall / b->wall - 1) * 100);
+    if (m->wall > b->wall * (1 + g_tolerance) && m->wall - b->wall > TIME_NOISE)
+    {
+        len += snprintf(note + len, note_size - len, " 变慢");
+        worse++;
+    }
+    if (b->max_rss > 0 && m->max_rss > b->max_rss * (1 + g_tolerance))
+    {
+        len += snprintf(note + len, note_size - len, " 内存 %+.0f%%", (m->max_rss / (double)b->max_rss - 1) * 100);
+        worse++;
+    }
+    if (b->syscalls > 0 && m->syscalls > b->syscalls * (1 + g_tolerance))
+    {
+        snprintf(note + len, note_size - len, " 系统调用 %+.0f%%", (m->syscalls / (double)b->syscalls - 1) * 100);
+        worse++;
+    }
+    return worse;
+}
+
+static void print_row(const char *name, const char *variant, const measure_t *m, const char *note)
+{
+    char syscalls[32];
+
+    if (m->syscalls >= 0)
+    {
+        snprintf(syscalls, sizeof(syscalls), "%ld", m->syscalls);
+    }
+    else
+    {
+        snprintf(syscalls, sizeof(syscalls), "-");
+    }
+    printf("%-15s %-8s %9.3f %8.3f %8.3f %10ld %10s  %s\n", name, variant, m->wall, m->user, m->sys, m->max_rss, syscalls, note);
+    if (g_verbose && m->syscalls > 0)
+    {
+        printf("%24s", "");
+        for (int k = 0; k < TOP_SYSCALLS && m->top_nr[k] >= 0; k++)
+        {
+            printf(" %s %ld", syscall_name(m->top_nr[k]), m->top_count[k]);
+        }
+        printf("\n");
+    }
+}
+
+static int case_selected(const bench_case_t *bc, char **names, int name_count)
+{
+    if (name_count == 0)
+    {
+        return 1;
+    }
+    for (int i = 0; i < name_count; i++)
+    {
+        if (strncmp(bc->name, names[i], strlen(names[i])) == 0)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    int opt;
+
+    g_program = argv[0];
+    while ((opt = getopt(argc, argv, "B:d:s:r:b:wT:nvlh")) != -1)
+    {
+        switch (opt)
+        {
+        case 'B':
+            g_build_dir = optarg;
+            break;
+        case 'd':
+            g_data_dir = optarg;
+            break;
+        case 's':
+            g_scale = atof(optarg);
+            break;
+        case 'r':
+            g_runs = atoi(optarg);
+            break;
+        case 'b':
+            g_baseline_path = optarg;
+            break;
+        case 'w':
+            g_write_baseline = 1;
+            break;
+        case 'T':
+            g_tolerance = atof(optarg) / 100;
+            break;
+        case 'n':
+            g_count_syscalls = 0;
+            break;
+        case 'v':
+            g_verbose = 1;
+            break;
+        case 'l':
+            for (int i = 0; i < CASE_COUNT; i++)
+            {
+                printf("%-15s %s\n", g_cases[i].name, g_cases[i].desc);
+            }
+            return 0;
+        case 'h':
+            show_help();
+            return 0;
+        default:
+            show_help();
+            return 2;
+        }
+    }
+    if (g_scale <= 0 || g_runs < 1 || g_tolerance < 0 || strchr(g_data_dir, ' ') != NULL || strchr(g_build_dir, ' ') != NULL)
+    {
+        fprintf(stderr, "错误: 参数无效 (规模和次数要大于 0, 目录名里不能有空格)\n");
+        return 2;
+    }
+
+    const bench_case_t *cases[MAX_CASES];
+    int count = 0;
+    int needed = 0;
+    for (int i = 0; i < CASE_COUNT; i++)
+    {
+        if (case_selected(&g_cases[i], argv + optind, argc - optind))
+        {
+            cases[count++] = &g_cases[i];
+            needed |= g_cases[i].data;
+        }
+    }
+    if (count == 0)
+    {
+        fprintf(stderr, "错误: 没有匹配的用例, 用 -l 查看\n");
+        return 2;
+    }
+    if (prepare_data(needed) != 0)
+    {
+        return 2;
+    }
+    if (load_baseline() == 0 && g_baseline_scale != g_scale)
+    {
+        printf("基线 %s 的规模是 %g, 和这次的 %g 不同, 不做比较\n", g_baseline_path, g_baseline_scale, g_scale);
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    measure_t (*results)[2] = calloc(count, sizeof(*results));
+    int worse = 0;
+    int failed = 0;
+    if (results == NULL)
+    {
+        perror("malloc");
+        return 2;
+    }
+    printf("\n%-15s %-8s %9s %8s %8s %10s %10s  %s\n", "用例", "版本", "耗时(s)", "用户", "系统", "RSS(KB)", "系统调用", "对比基线");
+    for (int i = 0; i < count; i++)
+    {
+        const bench_case_t *bc = cases[i];
+        char note[128];
+
+        if (bc->kind == CASE_MICRO)
+        {
+            printf("\n--- %s: %s ---\n", bc->name, bc->desc);
+            failed += measure(bc, bc->fast, &results[i][0]) != 0;
+            results[i][0].ok = 0;
+            printf("\n");
+            continue;
+        }
+        fflush(stdout);
+        if (measure(bc, bc->fast, &results[i][0]) != 0)
+        {
+            failed++;
+            continue;
+        }
+        worse += compare_baseline(bc->name, "fast", &results[i][0], note, sizeof(note));
+        print_row(bc->name, "fast", &results[i][0], note);
+        if (bc->baseline == NULL)
+        {
+            continue;
+        }
+        fflush(stdout);
+        if (measure(bc, bc->baseline, &results[i][1]) != 0)
+        {
+            failed++;
+            continue;
+        }
+        compare_baseline(bc->name, "baseline", &results[i][1], note, sizeof(note));
+        // 对照的变化只是参考 (系统工具升级、机器负载), 不算进结果; 后面附上快速路径的加速比
+        size_t len = strlen(note);
+        snprintf(note + len, sizeof(note) - len, "%s快速路径 %.2fx", len > 0 ? "  " : "", results[i][1].wall / results[i][0].wall);
+        print_row("", "baseline", &results[i][1], note);
+    }
+
+    if (g_write_baseline)
+    {
+        if (save_baseline(cases, results, count) != 0)
+        {
+            fprintf(stderr, "%s: %s\n", g_baseline_path, strerror(errno));
+            failed++;
+        }
+        else
+        {
+            printf("\n基线已写入 %s\n", g_baseline_path);
+        }
+    }
+    else if (worse > 0)
+    {
+        printf("\n%d 项比基线差 (容差 %.0f%%)\n", worse, g_tolerance * 100);
+    }
+
+    for (int i = 0; i < g_small_count; i++)
+    {
+        free(g_small_files[i]);
+    }
+    free(g_small_files);
+    free(g_baselines);
+    free(results);
+    return failed > 0 ? 2 : worse > 0 && !g_write_baseline ? 1 : 0;
+}
@@ -0,0 +1,73 @@
+#!/bin/sh
+
+# check.sh - week1 各个工具的回归检查, make check 调用
+# 用法: check.sh [构建目录]  (默认 build/release)
+# 每一项把工具的输出和期望结果比较, 全部通过时退出码为 0
+
+bin=${1:-build/release}
+tmp=$(mktemp -d "${TMPDIR:-/tmp}/week1_check.XXXXXX") || exit 1
+trap 'rm -rf "$tmp"' EXIT
+failed=0
+
+# pass <名字> <期望文件> <实际文件>
+pass() {
+    if cmp -s "$2" "$3"; then
+        printf "ok   %s\n" "$1"
+    else
+        printf "FAIL %s\n" "$1"
+        diff "$2" "$3" | head -10
+        failed=$((failed + 1))
+    fi
+}
+
+# ---- mini_cat: -p 预读不能吃掉管道和 FIFO 的数据 ----
+printf 'a\nb\n' > "$tmp/ab"
+
+mkfifo "$tmp/fifo"
+( (printf 'a\n'; sleep 0.3; printf 'b\n') > "$tmp/fifo" & )
+"$bin/mini_cat" -p 4 "$tmp/fifo" > "$tmp/out"
+pass "mini_cat -p FIFO" "$tmp/ab" "$tmp/out"
+
+(printf 'a\n'; sleep 0.3; printf 'b\n') | "$bin/mini_cat" -p 2 /dev/stdin > "$tmp/out"
+pass "mini_cat -p 管道" "$tmp/ab" "$tmp/out"
+
+(printf 'b\n'; sleep 0.3; printf 'b\n') | "$bin/mini_cat" -p 2 "$tmp/ab" - "$tmp/ab" > "$tmp/out"
+printf 'a\nb\nb\nb\na\nb\n' > "$tmp/expect"
+pass "mini_cat -p 文件和 stdin 混合" "$tmp/expect" "$tmp/out"
+
+# ---- mini_ls: -R 多线程遍历的输出和单线程一致 ----
+mkdir -p "$tmp/tree/a/b/c" "$tmp/tree/d/e" "$tmp/tree/f"
+touch "$tmp/tree/a/x" "$tmp/tree/a/b/y" "$tmp/tree/d/e/z" "$tmp/tree/f/w"
+"$bin/mini_ls" -R -j 1 "$tmp/tree" > "$tmp/expect" 2>&1
+"$bin/mini_ls" -R -j 4 "$tmp/tree" > "$tmp/out" 2>&1
+pass "mini_ls -R -j 4" "$tmp/expect" "$tmp/out"
+
+# ---- log_filter: 正则预筛不能漏掉 grep -E 能匹配的行 ----
+printf 'ac\nabc\nabbbbc\nxx\nabc{\n' > "$tmp/re.log"
+for re in 'ab{,3}c' 'ab{0,2}c' 'ab{1,}c' 'xab?c' 'ab{2}c|xx'; do
+    grep -E "$re" "$tmp/re.log" > "$tmp/expect"
+    "$bin/log_filter" -c -r "$re" -o "$tmp/out" "$tmp/re.log" > /dev/null
+    pass "log_filter -r '$re'" "$tmp/expect" "$tmp/out"
+done
+
+# ---- log_filter: 多个输入 (含 gzip) 按时间归并, 比归并读缓冲区还长的行也要完整 ----
+long=$(head -c 600000 /dev/zero | tr '\0' x)
+printf '2024-01-01 10:00:00 INFO a0\n2024-01-01 10:00:02 INFO %s\n2024-01-01 10:00:04 INFO a4\n' "$long" > "$tmp/a.log"
+printf '2024-01-01 10:00:01 INFO b1\n2024-01-01 10:00:03 INFO b3\n' | gzip -c > "$tmp/b.log.gz"
+printf '2024-01-01 10:00:00 INFO a0\n2024-01-01 10:00:01 INFO b1\n2024-01-01 10:00:02 INFO %s\n2024-01-01 10:00:03 INFO b3\n2024-01-01 10:00:04 INFO a4\n' "$long" > "$tmp/expect"
+"$bin/log_filter" -k INFO -o "$tmp/out" "$tmp/a.log" "$tmp/b.log.gz" > /dev/null
+pass "log_filter 多文件归并" "$tmp/expect" "$tmp/out"
+gzip -dc "$tmp/b.log.gz" > "$tmp/expect"
+"$bin/log_filter" -k INFO -o "$tmp/out" "$tmp/b.log.gz" > /dev/null
+pass "log_filter 单个 gzip -o" "$tmp/expect" "$tmp/out"
+
+# ---- str_parser: -f - 从管道按块读, 生产者慢的时候结果也不能丢或乱序 ----
+printf '3\n6\nERROR\n' > "$tmp/expect"
+(printf '1+2\n'; sleep 0.3; printf '2*3\n'; sleep 0.3; printf '1/0\n') | "$bin/str_parser" -f - -t 2 > "$tmp/out" 2> /dev/null
+pass "str_parser -f 管道" "$tmp/expect" "$tmp/out"
+
+if [ "$failed" -ne 0 ]; then
+    printf "%d 项失败\n" "$failed"
+    exit 1
+fi
+printf "全部通过\n"
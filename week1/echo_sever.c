@@ -536,7 +536,12 @@ void handle_client(int client_fd, int epoll_fd)
         cleanup_connection(client_fd);
         return;
     }
-    size_t bytes_read = recv(client_fd, buffer, BUFFER_SIZE - 1, 0);
+    ssize_t bytes_read = recv(client_fd, buffer, BUFFER_SIZE - 1, 0);
+    if (bytes_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    {
+        memory_pool_free(g_server->memory_pool, buffer);
+        return;
+    }
     if (bytes_read <= 0)
     {
         if (bytes_read == 0)
@@ -0,0 +1,4468 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <pthread.h>
+#include <regex.h>
+#include <zlib.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/uio.h>
+#include <sys/inotify.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+// 每次 read 的块大小, 放不下一整行时翻倍. 1 MB 能留在 L2 里, 查找和统计读它时不用再去内存取
+#define READ_BLOCK (1024 * 1024)
+
+// 过滤结果攒到这么大才 write 一次
+#define OUT_FLUSH_SIZE (1024 * 1024)
+
+// 并行扫描时每块的大小 (之后延伸到下一个换行符), 每个线程的在途块数, 以及线程数上限
+#define SCAN_CHUNK (1024 * 1024)
+#define SLOTS_PER_THREAD 2
+#define MAX_THREADS 64
+
+// 统计的日志级别个数和输出的 IP 个数
+#define LEVEL_COUNT 6
+#define TOP_IPS 10
+
+// 规范化后的时间戳 "YYYY-MM-DD HH:MM:SS" 的长度
+#define TIME_LEN 19
+
+// IP 计数表的初始槽位数 (2 的幂), 默认最多精确跟踪的不同 IP 个数, 以及非正常写法的键的标记位
+#define IP_TABLE_INIT 1024
+#define IP_TRACK_LIMIT 65536
+#define IP_KEY_RAW (1ULL << 63)
+
+// 稀疏时间索引 (-I): 每块至少这么大, 延伸到换行符为止; 文件指纹取索引开头和结尾各这么多字节
+#define INDEX_BLOCK (4 * 1024 * 1024)
+#define INDEX_HASH_BYTES 4096
+
+// 从正则里取出的必需字面串最长这么多字节; 多模式的 AVX2 预筛看字面串的前几个字节
+#define PATTERN_MAX 256
+#define AC_PREFIX 3
+
+// -f: 没有 inotify 事件时也每隔这么久检查一次日志, 检查点最多每隔这么久写一次
+#define FOLLOW_POLL_SECONDS 1
+#define CHECKPOINT_INTERVAL 1.0
+
+// gzip 输入: 解压线程和扫描线程之间轮流使用的块数 (每块 READ_BLOCK 字节), 以及每次读入的压缩数据大小
+#define GZ_SLOTS 4
+#define GZ_INPUT_SIZE (64 * 1024)
+
+// 多个输入归并时, 每个输入的过滤结果从临时文件里按这么大一块一块读回来
+#define MERGE_BLOCK (256 * 1024)
+
+// --bench 每个查找核重复扫描的次数, 取最快的一次
+#define BENCH_ROUNDS 3
+
+// fd 为 -1 时只在内存里攒, 并行扫描的每一块先写到这里, 再按块的顺序写出去
+typedef struct
+{
+    int fd;
+    char *data;
+    size_t len;
+    size_t cap;
+} out_buf_t;
+
+// grep -o 取出的 IP 按字符串计数 (001.2.3.4 和 1.2.3.4 算两个). 正常写法的地址 (每段 0-255, 没有前导 0)
+// 键就是 32 位的地址本身; 其余的串打上 IP_KEY_RAW, 每段用 12 位记下位数和数值, 一样能原样还原
+typedef struct
+{
+    uint64_t key;
+    uint64_t count; // 0 表示空槽
+    uint64_t error; // 近似模式下替换进来时继承的次数, 真实次数在 [count - error, count] 之间
+    uint32_t heap_pos;
+} ip_entry_t;
+
+// 不同 IP 的个数达到 g_ip_limit 后转成 Space-Saving: 表不再变大, 新 IP 替换掉次数最少的那个
+typedef struct
+{
+    ip_entry_t *slots;
+    size_t mask;
+    size_t count;
+    uint32_t *heap; // 近似模式下按次数排的最小堆, 存槽位下标
+    int approximate;
+} ip_table_t;
+
+// 预处理过的关键字. 候选位置先看首字节和末字节: 字节或上 *_or 之后等于 *_value 才算命中.
+// 不区分大小写时字母的 *_or 是 0x20 (大小写字母或上 0x20 都是小写), 其他字节的 *_or 是 0, 原样比较
+typedef struct
+{
+    const char *text;
+    char *folded;
+    size_t len;
+    int fold;
+    int impossible;
+    unsigned char first_value;
+    unsigned char first_or;
+    unsigned char last_value;
+    unsigned char last_or;
+} needle_t;
+
+typedef const char *(*find_keyword_t)(const needle_t *, const char *, const char *, unsigned long *);
+
+// 和顺序无关的计数: 并行扫描时每个线程一份, 最后加在一起
+typedef struct
+{
+    unsigned long levels[LEVEL_COUNT];
+    ip_table_t ips;
+    unsigned long *hits; // 多模式时每个模式命中的行数, 用到时才分配
+} counts_t;
+
+// 多模式 (-k 多次, -K, -r) 时所有字面串编成的 Aho-Corasick 自动机, 见 ac_build
+typedef struct
+{
+    uint32_t *next;         // 状态数 x 字节类数, 存的是目标状态的行首下标 (状态编号 x 字节类数)
+    uint8_t byte_class[256];
+    uint32_t class_count;
+    uint32_t state_count;
+    uint32_t root;          // 根状态的行首下标
+    uint32_t accept_limit;  // 行首下标小于它的状态有输出
+    uint32_t *out_start;    // 按状态编号, 输出在 out_ids 里的范围
+    uint32_t *out_ids;      // 模式编号
+    uint32_t max_len;       // 最长字面串的长度
+    // AVX2 预筛 (见 ac_find_avx2): 字面串前 3 个字节按低/高半字节查出所属分组的位图, 两者相与不为 0 才可能是开头
+    uint8_t prefix_lo[AC_PREFIX][16];
+    uint8_t prefix_hi[AC_PREFIX][16];
+} ac_automaton_t;
+
+typedef const char *(*ac_find_t)(const ac_automaton_t *, const char *, const char *);
+
+enum
+{
+    PATTERN_LITERAL,
+    PATTERN_REGEX,
+    PATTERN_FILE // 只出现在命令行参数里, 展开成文件里的每一行
+};
+
+typedef struct
+{
+    const char *text;
+    int kind;
+    regex_t regex;
+    int compiled;
+    int in_automaton; // 字面串或者正则的必需字面串编进了自动机
+    char *owned;      // 从模式文件读进来的, 要释放
+} pattern_t;
+
+// 要按文件顺序合并的部分: 每块一份, 首末时间取第一块和最后一块有过滤结果的
+typedef struct
+{
+    unsigned long total_lines;
+    unsigned long filtered_lines;
+    char first_time[TIME_LEN + 1];
+    char last_time[TIME_LEN + 1];
+} line_stats_t;
+
+typedef struct
+{
+    line_stats_t lines;
+    counts_t counts;
+} stats_t;
+
+// 要扫描的一段 [begin, end), 两端都在行首
+typedef struct
+{
+    size_t begin;
+    size_t end;
+} scan_range_t;
+
+// 映射进来的文件不用拷贝过滤结果, 只记下要输出的几段: 每段是相邻的若干行, end 处是换行符或者文件末尾
+typedef struct
+{
+    scan_range_t *items;
+    size_t count;
+    size_t cap;
+} range_list_t;
+
+// 扫描一段输入时往哪里记: runs 不为 NULL 时按相对 base 的位置记下过滤结果, 否则拷进 out;
+// 两个都为 NULL 表示不输出过滤结果 (-S)
+typedef struct
+{
+    line_stats_t *lines;
+    counts_t *counts;
+    out_buf_t *out;
+    range_list_t *runs;
+    const char *base;
+} scan_ctx_t;
+
+enum
+{
+    SLOT_FREE,
+    SLOT_BUSY,
+    SLOT_DONE
+};
+
+typedef struct
+{
+    int state;
+    long index;
+    const char *begin;
+    const char *end;
+    line_stats_t lines;
+    range_list_t runs;
+    int failed;
+} scan_slot_t;
+
+typedef struct
+{
+    scan_slot_t *slots;
+    int slot_count;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    long next_chunk;
+    long chunk_count; // 切完之后才知道, 之前是 -1
+    const char *map;
+    const scan_range_t *ranges;
+    int range_count;
+    int range_index;
+    size_t cursor;
+    uintptr_t page_mask;
+    int want_output;
+} scan_job_t;
+
+typedef struct
+{
+    scan_job_t *job;
+    counts_t counts;
+} scan_worker_t;
+
+// 索引文件 (<日志文件>.idx) 的格式: 文件头后面跟 count 个索引项, 都按本机字节序存放.
+// 每个索引项描述一块: 行数, 合法时间戳的最小值和最大值, 以及没有合法时间戳的行数.
+// 这些行不受日期过滤影响, 有这种行的块永远不能跳过
+typedef struct
+{
+    char magic[8];
+    uint64_t block_size;
+    uint64_t indexed_end; // 已经建了索引的部分 [0, indexed_end), 后面不完整的一块每次都扫描
+    uint64_t count;
+    uint64_t head_hash; // 文件开头和 indexed_end 前面各 INDEX_HASH_BYTES 字节的指纹, 对不上说明日志被轮转或者截断了
+    uint64_t tail_hash;
+} index_header_t;
+
+typedef struct
+{
+    uint64_t offset;
+    uint64_t lines;
+    uint64_t undated;
+    int64_t min_time; // 块里没有合法时间戳时 min_time > max_time
+    int64_t max_time;
+} index_entry_t;
+
+typedef struct
+{
+    index_header_t header;
+    index_entry_t *entries;
+    size_t cap;
+} time_index_t;
+
+// 检查点文件 (-C) 的格式: 文件头后面跟 ip_count 个 IP 计数项和 hit_count 个模式命中数, 都按本机字节序存放.
+// 记着处理到了哪个文件的哪个位置, 以及到那里为止累计的统计
+typedef struct
+{
+    char magic[8];
+    uint64_t params_hash; // 过滤条件的指纹, 条件变了之前累计的统计就对不上了
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t offset;    // 总在行首, 末尾没写完的半行留到下次
+    uint64_t head_hash; // 文件开头 min(offset, INDEX_HASH_BYTES) 字节的指纹, 对不上说明文件被截断后重写了
+    line_stats_t lines;
+    unsigned long levels[LEVEL_COUNT];
+    uint64_t ip_count;
+    uint64_t approximate;
+    uint64_t hit_count;
+} checkpoint_header_t;
+
+typedef struct
+{
+    uint64_t key;
+    uint64_t count;
+    uint64_t error;
+} checkpoint_ip_t;
+
+typedef struct
+{
+    char *data;
+    size_t len;
+    int full; // 解压线程填好了, 扫描线程还没用完
+    int last; // 这是最后一块
+} gz_block_t;
+
+typedef struct
+{
+    int fd;
+    gz_block_t blocks[GZ_SLOTS];
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int cancel; // 扫描出错, 解压线程不用再往下做
+    int error;  // 解压线程的 errno, -1 表示压缩数据损坏或不完整
+} gz_pipe_t;
+
+// 多个输入文件时每个文件一份统计和过滤结果, 最后按时间合并.
+// out.fd 是这个文件的过滤结果要写去的地方: 单个输入直接写 -o 的文件时就是它, 否则是临时文件
+typedef struct
+{
+    const char *path;
+    int order; // 在命令行上的顺序
+    stats_t stats;
+    out_buf_t out;
+    int error;
+} input_t;
+
+typedef struct
+{
+    input_t *inputs;
+    int count;
+    int next;
+    pthread_mutex_t lock;
+} input_job_t;
+
+// 归并时读一个输入的临时文件: [p, end) 是缓冲区里还没输出的部分, 总是从一行的开头开始
+typedef struct
+{
+    int fd;
+    char *data;
+    size_t cap;
+    const char *p;
+    const char *end;
+    long long key; // 当前这一行的时间
+} merge_cursor_t;
+
+static const char g_index_magic[8] = "LFIDX01";
+static const char g_checkpoint_magic[8] = "LFCKP02";
+
+static const char *const g_level_names[LEVEL_COUNT] = { "ERROR", "WARN", "INFO", "DEBUG", "TRACE", "FATAL" };
+
+static const char *g_program = "log_filter";
+static const char *g_log_file = NULL;
+static const char **g_inputs = NULL;
+static int g_input_count = 0;
+static const char *g_keyword = NULL;
+static pattern_t *g_pattern_args = NULL;
+static int g_pattern_arg_count = 0;
+static const char *g_start_date = NULL;
+static const char *g_end_date = NULL;
+static const char *g_output_file = NULL;
+static int g_case_sensitive = 0;
+static int g_stats_only = 0;
+static int g_verbose = 0;
+static int g_threads = 0;
+static int g_use_index = 0;
+static size_t g_ip_limit = IP_TRACK_LIMIT;
+static int g_follow = 0;
+static const char *g_checkpoint_file = NULL;
+
+// -f 时由信号处理函数设置: 退出, 打印一次当前的统计
+static volatile sig_atomic_t g_stop = 0;
+static volatile sig_atomic_t g_report = 0;
+
+static needle_t g_needle;
+static pattern_t *g_patterns = NULL;
+static size_t g_pattern_count = 0;
+static int g_use_patterns = 0;
+static int g_check_every_line = 0;
+static ac_automaton_t g_ac;
+static long long g_start_time = 0;
+static long long g_end_time = 0;
+
+// ASCII 大写转小写, 和 tr '[:upper:]' '[:lower:]' 一样只管单字节
+static unsigned char g_fold[256];
+
+static stats_t g_stats;
+static out_buf_t g_out = { -1, NULL, 0, 0 };
+
+void show_help(void)
+{
+    printf("日志过滤与统计工具\n");
+    printf("用法: %s [选项] <日志文件>...\n", g_program);
+    printf("\n");
+    printf("gzip 压缩的日志直接读取, 不落盘解压. 给出多个文件 (比如轮转出来的 app.log.2.gz app.log.1.gz app.log) 时\n");
+    printf("并行处理, 统计合在一起, 过滤结果按时间归并输出\n");
+    printf("\n");
+    printf("选项:\n");
+    printf("  -k <关键字>        按关键字过滤日志, 可以给多次, 匹配任意一个即可\n");
+    printf("  -K <文件>          从文件读入关键字, 每行一个\n");
+    printf("  -r <正则>          按扩展正则表达式过滤, 可以给多次; 正则里必需的字面串先用来预筛\n");
+    printf("  -s <日期>          开始日期 (格式: YYYY-MM-DD 或 YYYY-MM-DD HH:MM:SS)\n");
+    printf("  -e <日期>          结束日期 (格式: YYYY-MM-DD 或 YYYY-MM-DD HH:MM:SS)\n");
+    printf("  -o <文件>          输出到文件\n");
+    printf("  -c                 区分大小写搜索\n");
+    printf("  -S                 仅显示统计信息\n");
+    printf("  -v                 详细输出\n");
+    printf("  -t <线程数>        扫描线程数, 默认为 CPU 数\n");
+    printf("  -m <个数>          最多精确统计的不同 IP 个数, 超过后前10个为估计值, 0 表示不限制 (默认 %d)\n", IP_TRACK_LIMIT);
+    printf("  -f                 处理完现有内容后继续跟踪日志的新增行, 能跟上轮转和截断; Ctrl-C 结束, SIGUSR1 打印当前统计\n");
+    printf("  -C <文件>          检查点文件: 从上次处理到的位置继续, 统计接着累计, 结束时写回; -o 改为追加\n");
+    printf("  -I                 使用并维护稀疏时间索引 <日志文件>.idx, -s/-e 只扫描时间窗口所在的块\n");
+    printf("  -h                 显示帮助信息\n");
+    printf("  --bench <文件> [关键字]\n");
+    printf("                     关键字查找基准测试, 和 grep -F / grep -F -i 对比, 以及多线程扫描的扩展性\n");
+    printf("\n");
+    printf("示例:\n");
+    printf("  %s -k \"ERROR\" /var/log/app.log\n", g_program);
+    printf("  %s -s \"2024-01-01\" -e \"2024-01-31\" /var/log/app.log\n", g_program);
+    printf("  %s -k \"ERROR\" -s \"2024-01-01 10:00:00\" -o filtered.log /var/log/app.log\n", g_program);
+    printf("  %s -S /var/log/app.log\n", g_program);
+    printf("  %s -k \"ERROR\" /var/log/app.log.*.gz /var/log/app.log\n", g_program);
+    printf("  %s -k \"ERROR\" -k \"FATAL\" -r \"took [0-9]{4,}ms\" -S /var/log/app.log\n", g_program);
+}
+
+int write_all(int fd, const char *data, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = write(fd, data, len);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int out_flush(out_buf_t *out)
+{
+    int ret = 0;
+
+    if (out->len > 0)
+    {
+        ret = write_all(out->fd, out->data, out->len);
+        out->len = 0;
+    }
+    return ret;
+}
+
+// 内存模式下放不下就把缓冲区加倍
+int out_grow(out_buf_t *out, size_t need)
+{
+    size_t cap = out->cap ? out->cap : 4096;
+
+    while (cap < out->len + need)
+    {
+        cap *= 2;
+    }
+    char *data = realloc(out->data, cap);
+    if (data == NULL)
+    {
+        return -1;
+    }
+    out->data = data;
+    out->cap = cap;
+    return 0;
+}
+
+// 追加一行并补上换行符, 超过 OUT_FLUSH_SIZE 就写出去
+int out_append_line(out_buf_t *out, const char *line, size_t len)
+{
+    if (out->len + len + 1 > out->cap && out->fd < 0)
+    {
+        if (out_grow(out, len + 1) != 0)
+        {
+            return -1;
+        }
+    }
+    else if (out->len + len + 1 > out->cap)
+    {
+        if (out_flush(out) != 0)
+        {
+            return -1;
+        }
+        if (len + 1 > out->cap)
+        {
+            // 特别长的行直接写, 不进缓冲区
+            if (write_all(out->fd, line, len) != 0 || write_all(out->fd, "\n", 1) != 0)
+            {
+                return -1;
+            }
+            return 0;
+        }
+    }
+    memcpy(out->data + out->len, line, len);
+    out->data[out->len + len] = '\n';
+    out->len += len + 1;
+    return 0;
+}
+
+// 记下一行 [begin, end), 紧跟在上一段后面 (中间只隔一个换行符) 时直接接上
+int range_list_add(range_list_t *list, size_t begin, size_t end)
+{
+    if (list->count > 0 && list->items[list->count - 1].end + 1 == begin)
+    {
+        list->items[list->count - 1].end = end;
+        return 0;
+    }
+    if (list->count == list->cap)
+    {
+        size_t cap = list->cap ? list->cap * 2 : 256;
+        scan_range_t *items = realloc(list->items, cap * sizeof(scan_range_t));
+        if (items == NULL)
+        {
+            return -1;
+        }
+        list->items = items;
+        list->cap = cap;
+    }
+    list->items[list->count].begin = begin;
+    list->items[list->count].end = end;
+    list->count++;
+    return 0;
+}
+
+// 把 runs 指向的内容写到 fd, 每段带上后面的换行符, 文件末尾没有换行符的话补一个. 一次 writev 最多 IOV_MAX 段
+int write_runs(int fd, const char *map, size_t size, const range_list_t *runs)
+{
+    struct iovec iov[IOV_MAX];
+    size_t i = 0;
+
+    while (i < runs->count)
+    {
+        int n = 0;
+        size_t bytes = 0;
+        while (i < runs->count && n < IOV_MAX - 1)
+        {
+            const scan_range_t *run = &runs->items[i++];
+            size_t len = run->end - run->begin + (run->end < size);
+            iov[n].iov_base = (void *)(map + run->begin);
+            iov[n++].iov_len = len;
+            bytes += len;
+            if (run->end == size)
+            {
+                iov[n].iov_base = "\n";
+                iov[n++].iov_len = 1;
+                bytes++;
+            }
+        }
+
+        int first = 0;
+        while (bytes > 0)
+        {
+            ssize_t written = writev(fd, iov + first, n - first);
+            if (written < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                return -1;
+            }
+            bytes -= written;
+            // 没写完就跳过已经写出去的部分接着写
+            while (first < n && (size_t)written >= iov[first].iov_len)
+            {
+                written -= iov[first++].iov_len;
+            }
+            if (first < n)
+            {
+                iov[first].iov_base = (char *)iov[first].iov_base + written;
+                iov[first].iov_len -= written;
+            }
+        }
+    }
+    return 0;
+}
+
+static inline int is_digit(int c)
+{
+    return c >= '0' && c <= '9';
+}
+
+// 公历日期到 1970-01-01 的天数, 对任意年份成立
+long long days_from_civil(long long y, unsigned m, unsigned d)
+{
+    y -= m <= 2;
+    long long era = (y >= 0 ? y : y - 399) / 400;
+    unsigned yoe = (unsigned)(y - era * 400);
+    unsigned doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+    unsigned doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + (long long)doe - 719468;
+}
+
+static inline int two_digits(const char *s)
+{
+    return (s[0] - '0') * 10 + (s[1] - '0');
+}
+
+// 校验 "YYYY-MM-DD HH:MM:SS" 各字段的范围, 把从纪元开始的秒数 (1970 年以前为负) 写进 *seconds.
+// 不存在的时间 (2024-02-30, 24:00:00) 返回 -1. 起止日期和日志时间用同一套换算, 只做比较, 所以不需要考虑时区
+int time_to_seconds(const char *ts, long long *seconds)
+{
+    static const unsigned char days_in_month[12] = { 31, 29, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 };
+    int year = two_digits(ts) * 100 + two_digits(ts + 2);
+    int month = two_digits(ts + 5);
+    int day = two_digits(ts + 8);
+    int hour = two_digits(ts + 11);
+    int minute = two_digits(ts + 14);
+    int second = two_digits(ts + 17);
+
+    if (month < 1 || month > 12 || day < 1 || day > days_in_month[month - 1] || hour > 23 || minute > 59 || second > 59)
+    {
+        return -1;
+    }
+    if (month == 2 && day == 29 && !(year % 4 == 0 && (year % 100 != 0 || year % 400 == 0)))
+    {
+        return -1;
+    }
+    *seconds = days_from_civil(year, month, day) * 86400 + hour * 3600 + minute * 60 + second;
+    return 0;
+}
+
+// "dd:dd:dd" 这样的定长片段: 'd' 位置必须是数字, 其他位置原样比较
+static inline int match_layout(const char *s, const char *layout, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+    {
+        if (layout[i] == 'd' ? !is_digit(s[i]) : s[i] != layout[i])
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// 从行首取时间戳, 支持三种格式, 结果规范化成 "YYYY-MM-DD HH:MM:SS" 写进 out (不带 '\0'):
+//   2024-01-01 10:00:00 / 2024-01-01T10:00:00
+//   2024/01/01 10:00:00
+//   [2024-01-01 10:00:00]
+int extract_timestamp(const char *line, size_t len, char *out)
+{
+    if (len >= TIME_LEN && is_digit(line[0]))
+    {
+        char sep = line[4];
+        if ((sep != '-' && sep != '/') || line[7] != sep || !match_layout(line + 11, "dd:dd:dd", 8)
+            || !match_layout(line, "dddd", 4) || !match_layout(line + 5, "dd", 2) || !match_layout(line + 8, "dd", 2))
+        {
+            return 0;
+        }
+        if (line[10] != ' ' && (line[10] != 'T' || sep != '-'))
+        {
+            return 0;
+        }
+        memcpy(out, line, TIME_LEN);
+        out[4] = out[7] = '-';
+        out[10] = ' ';
+        return 1;
+    }
+    if (len >= TIME_LEN + 2 && line[0] == '[' && line[TIME_LEN + 1] == ']'
+        && match_layout(line + 1, "dddd-dd-dd dd:dd:dd", TIME_LEN))
+    {
+        memcpy(out, line + 1, TIME_LEN);
+        return 1;
+    }
+    return 0;
+}
+
+// -s/-e 的参数: YYYY-MM-DD 或 YYYY/MM/DD, 后面可以跟 " HH:MM[:SS]" 或 "THH:MM[:SS]"
+int parse_date_arg(const char *arg, long long *seconds)
+{
+    char ts[TIME_LEN + 1] = "0000-00-00 00:00:00";
+    size_t len;
+
+    while (*arg == ' ' || *arg == '\t')
+    {
+        arg++;
+    }
+    len = strlen(arg);
+    while (len > 0 && (arg[len - 1] == ' ' || arg[len - 1] == '\t'))
+    {
+        len--;
+    }
+
+    if (len < 10 || !match_layout(arg, "dddd", 4) || (arg[4] != '-' && arg[4] != '/') || arg[7] != arg[4]
+        || !match_layout(arg + 5, "dd", 2) || !match_layout(arg + 8, "dd", 2))
+    {
+        return -1;
+    }
+    memcpy(ts, arg, 10);
+    ts[4] = ts[7] = '-';
+    if (len > 10)
+    {
+        if ((arg[10] != ' ' && arg[10] != 'T') || (len != 16 && len != 19)
+            || !match_layout(arg + 11, len == 16 ? "dd:dd" : "dd:dd:dd", len - 11))
+        {
+            return -1;
+        }
+        memcpy(ts + 11, arg + 11, len - 11);
+    }
+
+    return time_to_seconds(ts, seconds);
+}
+
+int init_needle(needle_t *needle, const char *keyword, int fold)
+{
+    size_t len = strlen(keyword);
+
+    memset(needle, 0, sizeof(*needle));
+    needle->folded = malloc(len + 1);
+    if (needle->folded == NULL)
+    {
+        return -1;
+    }
+    for (size_t i = 0; i <= len; i++)
+    {
+        needle->folded[i] = fold ? g_fold[(unsigned char)keyword[i]] : keyword[i];
+    }
+    needle->text = keyword;
+    needle->len = len;
+    needle->fold = fold;
+    // read 出来的行里不会有换行符, 带换行符的关键字哪一行都匹配不上
+    needle->impossible = memchr(keyword, '\n', len) != NULL;
+
+    unsigned char first = needle->folded[0];
+    unsigned char last = needle->folded[len - 1];
+    needle->first_or = fold && first >= 'a' && first <= 'z' ? 0x20 : 0;
+    needle->last_or = fold && last >= 'a' && last <= 'z' ? 0x20 : 0;
+    needle->first_value = first;
+    needle->last_value = last;
+    return 0;
+}
+
+static inline int verify_needle(const needle_t *needle, const char *s)
+{
+    if (!needle->fold)
+    {
+        return memcmp(s, needle->text, needle->len) == 0;
+    }
+    for (size_t i = 0; i < needle->len; i++)
+    {
+        if (g_fold[(unsigned char)s[i]] != (unsigned char)needle->folded[i])
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// 查找核: 在 [p, end) 里找关键字第一次出现的位置, 没有返回 NULL.
+// 顺带把它前面 (没有命中时是整段) 的换行符个数加到 *newlines 上, 总行数就不用再扫一遍
+const char *find_keyword_scalar(const needle_t *needle, const char *p, const char *end, unsigned long *newlines)
+{
+    unsigned long count = 0;
+    const char *hit = NULL;
+
+    for (; end - p >= (ptrdiff_t)needle->len; p++)
+    {
+        if (((unsigned char)*p | needle->first_or) == needle->first_value && verify_needle(needle, p))
+        {
+            hit = p;
+            break;
+        }
+        count += *p == '\n';
+    }
+    if (hit == NULL)
+    {
+        for (; p < end; p++)
+        {
+            count += *p == '\n';
+        }
+    }
+    *newlines += count;
+    return hit;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// 每次看 16 个起点: 首字节和末字节都对上的位置才逐个验证, 绝大多数块一次比较就跳过
+__attribute__((target("sse2,popcnt")))
+const char *find_keyword_sse2(const needle_t *needle, const char *p, const char *end, unsigned long *newlines)
+{
+    const __m128i first_or = _mm_set1_epi8(needle->first_or);
+    const __m128i first_value = _mm_set1_epi8(needle->first_value);
+    const __m128i last_or = _mm_set1_epi8(needle->last_or);
+    const __m128i last_value = _mm_set1_epi8(needle->last_value);
+    const __m128i nl = _mm_set1_epi8('\n');
+    size_t last = needle->len - 1;
+    unsigned long count = 0;
+
+    while (end - p >= (ptrdiff_t)(last + 16))
+    {
+        __m128i head = _mm_loadu_si128((const __m128i *)p);
+        __m128i tail = _mm_loadu_si128((const __m128i *)(p + last));
+        unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(_mm_or_si128(head, first_or), first_value),
+                                                        _mm_cmpeq_epi8(_mm_or_si128(tail, last_or), last_value)));
+        unsigned lines = _mm_movemask_epi8(_mm_cmpeq_epi8(head, nl));
+        while (mask != 0)
+        {
+            unsigned bit = __builtin_ctz(mask);
+            if (verify_needle(needle, p + bit))
+            {
+                *newlines += count + __builtin_popcount(lines & ((1u << bit) - 1));
+                return p + bit;
+            }
+            mask &= mask - 1;
+        }
+        count += __builtin_popcount(lines);
+        p += 16;
+    }
+    *newlines += count;
+    return find_keyword_scalar(needle, p, end, newlines);
+}
+
+__attribute__((target("avx2,popcnt")))
+const char *find_keyword_avx2(const needle_t *needle, const char *p, const char *end, unsigned long *newlines)
+{
+    const __m256i first_or = _mm256_set1_epi8(needle->first_or);
+    const __m256i first_value = _mm256_set1_epi8(needle->first_value);
+    const __m256i last_or = _mm256_set1_epi8(needle->last_or);
+    const __m256i last_value = _mm256_set1_epi8(needle->last_value);
+    const __m256i nl = _mm256_set1_epi8('\n');
+    size_t last = needle->len - 1;
+    unsigned long count = 0;
+
+    while (end - p >= (ptrdiff_t)(last + 32))
+    {
+        __m256i head = _mm256_loadu_si256((const __m256i *)p);
+        __m256i tail = _mm256_loadu_si256((const __m256i *)(p + last));
+        unsigned mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(_mm256_or_si256(head, first_or), first_value),
+                                                              _mm256_cmpeq_epi8(_mm256_or_si256(tail, last_or), last_value)));
+        unsigned lines = _mm256_movemask_epi8(_mm256_cmpeq_epi8(head, nl));
+        while (mask != 0)
+        {
+            unsigned bit = __builtin_ctz(mask);
+            if (verify_needle(needle, p + bit))
+            {
+                *newlines += count + __builtin_popcount(lines & ((1u << bit) - 1));
+                return p + bit;
+            }
+            mask &= mask - 1;
+        }
+        count += __builtin_popcount(lines);
+        p += 32;
+    }
+    *newlines += count;
+    return find_keyword_scalar(needle, p, end, newlines);
+}
+#endif
+
+static find_keyword_t g_find_keyword = find_keyword_scalar;
+
+void init_search(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt"))
+    {
+        g_find_keyword = find_keyword_avx2;
+    }
+    else if (__builtin_cpu_supports("popcnt"))
+    {
+        g_find_keyword = find_keyword_sse2;
+    }
+#endif
+}
+
+// 正则里每个匹配都必须包含的最长字面串 (写到 out, 返回长度), 用来在自动机里预筛. 只做保守的分析:
+// 最外层有 | 时放弃; 括号、方括号和 . 把字面串断开; 后面跟 ? * {0 {,n} 的字符可以不出现, 跟 + 和 {1.. 的至少出现一次.
+// { 后面不是 1-9 (包括 {,n} 和不构成区间的 {) 一律当作可以不出现, 宁可少筛也不能漏行
+size_t required_literal(const char *re, char *out)
+{
+    char run[PATTERN_MAX];
+    size_t run_len = 0;
+    size_t best = 0;
+    const char *p = re;
+
+    while (*p != '\0')
+    {
+        int literal = -1;
+        int quantified = 0;
+
+        if (*p == '|')
+        {
+            return 0;
+        }
+        if (*p == '(' || *p == '[')
+        {
+            // 括号里可能有 |, 方括号里的字符都不是必需的, 整个跳过
+            int depth = 0;
+            do
+            {
+                if (*p == '\\' && p[1] != '\0')
+                {
+                    p++;
+                }
+                else if (*p == '[')
+                {
+                    p += p[1] == '^' ? 2 : 1;
+                    p += *p == ']' ? 1 : 0;
+                    while (*p != '\0' && *p != ']')
+                    {
+                        p++;
+                    }
+                }
+                else if (*p == '(')
+                {
+                    depth++;
+                }
+                else if (*p == ')')
+                {
+                    depth--;
+                }
+                if (*p != '\0')
+                {
+                    p++;
+                }
+            } while (*p != '\0' && depth > 0);
+        }
+        else if (*p == '\\' && p[1] != '\0')
+        {
+            // \. \* 这类是字面字符, \w \b \< 之类是 GNU 的扩展, 当作断开
+            if (!((p[1] >= 'a' && p[1] <= 'z') || (p[1] >= 'A' && p[1] <= 'Z') || is_digit(p[1])))
+            {
+                literal = (unsigned char)p[1];
+            }
+            p += 2;
+        }
+        else if (*p == '.' || *p == '^' || *p == '$')
+        {
+            p++;
+        }
+        else if (*p == '*' || *p == '+' || *p == '?' || *p == '{')
+        {
+            // 量词跟在断开的地方后面, 没有字面字符可以去掉
+            p++;
+            continue;
+        }
+        else
+        {
+            literal = (unsigned char)*p++;
+        }
+
+        if (*p == '*' || *p == '?' || (*p == '{' && !(p[1] >= '1' && p[1] <= '9')))
+        {
+            quantified = 1;
+        }
+        else if (*p == '+' || *p == '{')
+        {
+            quantified = 2;
+        }
+        if (literal >= 0 && quantified != 1 && run_len < PATTERN_MAX)
+        {
+            run[run_len++] = literal;
+        }
+        // 断开、可选或者可以重复的字符之后, 这一段字面串就结束了
+        if (literal < 0 || quantified != 0 || *p == '\0' || *p == '|')
+        {
+            if (run_len > best)
+            {
+                best = run_len;
+                memcpy(out, run, run_len);
+            }
+            run_len = 0;
+        }
+        while (quantified != 0 && *p != '\0' && (*p == '*' || *p == '+' || *p == '?' || *p == '{'))
+        {
+            if (*p == '{')
+            {
+                while (*p != '\0' && *p != '}')
+                {
+                    p++;
+                }
+            }
+            if (*p != '\0')
+            {
+                p++;
+            }
+        }
+    }
+    if (run_len > best)
+    {
+        best = run_len;
+        memcpy(out, run, run_len);
+    }
+    return best;
+}
+
+// 把若干字面串编译成 Aho-Corasick 自动机. 只区分在模式里出现过的字节, 其余字节归为第 0 类,
+// 转移表是 状态数 x 字节类数 的稠密 DFA, 几十个模式也只有几十 KB, 能留在 L1/L2 里.
+// 有输出的状态编号排在前面, 查找时一次比较就知道有没有匹配
+int ac_build(ac_automaton_t *ac, const char *const *literals, const size_t *lens, const uint32_t *ids, size_t count, int fold)
+{
+    uint32_t class_of[256];
+    size_t total = 1;
+
+    memset(ac, 0, sizeof(*ac));
+    memset(class_of, 0, sizeof(class_of));
+    ac->class_count = 1;
+    for (size_t i = 0; i < count; i++)
+    {
+        total += lens[i];
+        for (size_t j = 0; j < lens[i]; j++)
+        {
+            unsigned char c = fold ? g_fold[(unsigned char)literals[i][j]] : (unsigned char)literals[i][j];
+            if (class_of[c] == 0)
+            {
+                class_of[c] = ac->class_count++;
+            }
+        }
+    }
+    for (int c = 0; c < 256; c++)
+    {
+        ac->byte_class[c] = class_of[fold ? g_fold[c] : c];
+    }
+
+    uint32_t classes = ac->class_count;
+    uint32_t *next = malloc(total * classes * sizeof(uint32_t));
+    uint32_t *fail = calloc(total, sizeof(uint32_t));
+    uint32_t *order = malloc(total * sizeof(uint32_t));
+    uint32_t *renumber = malloc(total * sizeof(uint32_t));
+    uint32_t *own = malloc(total * sizeof(uint32_t)); // 每个状态自己的模式链表头, 链在 own_next 上
+    uint32_t *own_next = malloc((count + 1) * sizeof(uint32_t));
+    uint8_t *accept = calloc(total, 1);
+    int ret = -1;
+
+    if (next == NULL || fail == NULL || order == NULL || renumber == NULL || own == NULL || own_next == NULL || accept == NULL)
+    {
+        goto done;
+    }
+    memset(next, 0xff, total * classes * sizeof(uint32_t));
+    memset(own, 0xff, total * sizeof(uint32_t));
+
+    // 建字典树, 状态 0 是根
+    uint32_t states = 1;
+    for (size_t i = 0; i < count; i++)
+    {
+        uint32_t state = 0;
+        for (size_t j = 0; j < lens[i]; j++)
+        {
+            uint32_t *slot = &next[state * classes + ac->byte_class[(unsigned char)literals[i][j]]];
+            if (*slot == UINT32_MAX)
+            {
+                *slot = states++;
+            }
+            state = *slot;
+        }
+        own_next[i] = own[state];
+        own[state] = i;
+        accept[state] = 1;
+    }
+
+    // 按层次遍历补全失败转移, 同时把缺的边都填上, 变成 DFA
+    size_t head = 0, tail = 0;
+    for (uint32_t c = 0; c < classes; c++)
+    {
+        uint32_t *slot = &next[c];
+        if (*slot == UINT32_MAX)
+        {
+            *slot = 0;
+        }
+        else
+        {
+            fail[*slot] = 0;
+            order[tail++] = *slot;
+        }
+    }
+    while (head < tail)
+    {
+        uint32_t state = order[head++];
+        accept[state] |= accept[fail[state]];
+        for (uint32_t c = 0; c < classes; c++)
+        {
+            uint32_t *slot = &next[state * classes + c];
+            if (*slot == UINT32_MAX)
+            {
+                *slot = next[fail[state] * classes + c];
+            }
+            else
+            {
+                fail[*slot] = next[fail[state] * classes + c];
+                order[tail++] = *slot;
+            }
+        }
+    }
+
+    // 重新编号: 有输出的状态在前. 每个状态的输出是它自己的模式加上失败链上所有状态的模式
+    uint32_t accepting = 0;
+    size_t outputs = 0;
+    for (uint32_t s = 0; s < states; s++)
+    {
+        if (accept[s])
+        {
+            renumber[s] = accepting++;
+            for (uint32_t t = s;; t = fail[t])
+            {
+                for (uint32_t i = own[t]; i != UINT32_MAX; i = own_next[i])
+                {
+                    outputs++;
+                }
+                if (t == 0)
+                {
+                    break;
+                }
+            }
+        }
+    }
+    uint32_t other = accepting;
+    for (uint32_t s = 0; s < states; s++)
+    {
+        if (!accept[s])
+        {
+            renumber[s] = other++;
+        }
+    }
+
+    ac->next = malloc((size_t)states * classes * sizeof(uint32_t));
+    ac->out_start = malloc((accepting + 1) * sizeof(uint32_t));
+    ac->out_ids = malloc((outputs + 1) * sizeof(uint32_t));
+    if (ac->next == NULL || ac->out_start == NULL || ac->out_ids == NULL)
+    {
+        goto done;
+    }
+    for (uint32_t s = 0; s < states; s++)
+    {
+        for (uint32_t c = 0; c < classes; c++)
+        {
+            ac->next[renumber[s] * classes + c] = renumber[next[s * classes + c]] * classes;
+        }
+    }
+    size_t n = 0;
+    for (uint32_t s = 0; s < states; s++)
+    {
+        if (!accept[s])
+        {
+            continue;
+        }
+        ac->out_start[renumber[s]] = n;
+        for (uint32_t t = s;; t = fail[t])
+        {
+            for (uint32_t i = own[t]; i != UINT32_MAX; i = own_next[i])
+            {
+                ac->out_ids[n++] = ids[i];
+            }
+            if (t == 0)
+            {
+                break;
+            }
+        }
+    }
+    ac->out_start[accepting] = n;
+    ac->root = renumber[0] * classes;
+    ac->accept_limit = accepting * classes;
+    ac->state_count = states;
+
+    // 预筛表: 开头几个字节相同的字面串分在同一组, 分组越少误报越多. 比最短字面串还靠后的字节不参与筛选
+    size_t prefix = AC_PREFIX;
+    for (size_t i = 0; i < count; i++)
+    {
+        prefix = lens[i] < prefix ? lens[i] : prefix;
+        ac->max_len = lens[i] > ac->max_len ? lens[i] : ac->max_len;
+    }
+    for (size_t k = prefix; k < AC_PREFIX; k++)
+    {
+        memset(ac->prefix_lo[k], 0xff, 16);
+        memset(ac->prefix_hi[k], 0xff, 16);
+    }
+    for (size_t i = 0; i < count; i++)
+    {
+        const unsigned char *s = (const unsigned char *)literals[i];
+        uint8_t bucket = 1 << ((ac->byte_class[s[0]] * 31 + (lens[i] > 1 ? ac->byte_class[s[1]] : 0)) & 7);
+        for (size_t k = 0; k < prefix; k++)
+        {
+            for (int c = 0; c < 256; c++)
+            {
+                if (ac->byte_class[c] == ac->byte_class[s[k]])
+                {
+                    ac->prefix_lo[k][c & 0x0f] |= bucket;
+                    ac->prefix_hi[k][c >> 4] |= bucket;
+                }
+            }
+        }
+    }
+    ret = 0;
+
+done:
+    free(next);
+    free(fail);
+    free(order);
+    free(renumber);
+    free(own);
+    free(own_next);
+    free(accept);
+    return ret;
+}
+
+void ac_free(ac_automaton_t *ac)
+{
+    free(ac->next);
+    free(ac->out_start);
+    free(ac->out_ids);
+    memset(ac, 0, sizeof(*ac));
+}
+
+// 从根状态开始在 [p, end) 里找第一个匹配, 返回匹配的最后一个字节之后的位置, 没有返回 NULL
+const char *ac_find_scalar(const ac_automaton_t *ac, const char *p, const char *end)
+{
+    const uint32_t *next = ac->next;
+    const uint8_t *byte_class = ac->byte_class;
+    uint32_t limit = ac->accept_limit;
+    uint32_t state = ac->root;
+
+    while (p < end)
+    {
+        state = next[state + byte_class[(unsigned char)*p++]];
+        if (state < limit)
+        {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// 自动机每个字节都要等上一次查表的结果, 一个字节好几个周期. 这里先用 pshufb 一次看 32 个位置的前 3 个字节
+// 是否可能是某个字面串的开头 (Hyperscan 的 Teddy), 只在候选位置上从根状态走最多 max_len 步确认
+__attribute__((target("avx2")))
+const char *ac_find_avx2(const ac_automaton_t *ac, const char *p, const char *end)
+{
+    const __m256i low_nibble = _mm256_set1_epi8(0x0f);
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i lo[AC_PREFIX], hi[AC_PREFIX];
+
+    if (ac->accept_limit == 0)
+    {
+        return NULL;
+    }
+    for (int k = 0; k < AC_PREFIX; k++)
+    {
+        lo[k] = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)ac->prefix_lo[k]));
+        hi[k] = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)ac->prefix_hi[k]));
+    }
+
+    while (end - p >= 32 + AC_PREFIX - 1)
+    {
+        __m256i groups = _mm256_set1_epi8(-1);
+        for (int k = 0; k < AC_PREFIX; k++)
+        {
+            __m256i block = _mm256_loadu_si256((const __m256i *)(p + k));
+            __m256i l = _mm256_shuffle_epi8(lo[k], _mm256_and_si256(block, low_nibble));
+            __m256i h = _mm256_shuffle_epi8(hi[k], _mm256_and_si256(_mm256_srli_epi16(block, 4), low_nibble));
+            groups = _mm256_and_si256(groups, _mm256_and_si256(l, h));
+        }
+        uint32_t mask = ~(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(groups, zero));
+        while (mask != 0)
+        {
+            const char *s = p + __builtin_ctz(mask);
+            const char *stop = (size_t)(end - s) > ac->max_len ? s + ac->max_len : end;
+            uint32_t state = ac->root;
+            while (s < stop)
+            {
+                state = ac->next[state + ac->byte_class[(unsigned char)*s++]];
+                if (state < ac->accept_limit)
+                {
+                    return s;
+                }
+            }
+            mask &= mask - 1;
+        }
+        p += 32;
+    }
+    // 剩下不到一组的字节: 之前的候选位置都确认过了, 从根状态接着找就不会漏
+    return ac_find_scalar(ac, p, end);
+}
+#endif
+
+static ac_find_t g_ac_find = ac_find_scalar;
+
+// 读入 -K 的模式文件, 每行一个字面串, 空行跳过
+static int load_pattern_file(const char *path, pattern_t **patterns, size_t *count, size_t *cap)
+{
+    FILE *fp = fopen(path, "r");
+    char *line = NULL;
+    size_t line_cap = 0;
+    ssize_t len;
+
+    if (fp == NULL)
+    {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    while ((len = getline(&line, &line_cap, fp)) >= 0)
+    {
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+        {
+            line[--len] = '\0';
+        }
+        if (len == 0)
+        {
+            continue;
+        }
+        if (*count == *cap)
+        {
+            size_t bigger = *cap ? *cap * 2 : 64;
+            pattern_t *grown = realloc(*patterns, bigger * sizeof(pattern_t));
+            if (grown == NULL)
+            {
+                break;
+            }
+            *patterns = grown;
+            *cap = bigger;
+        }
+        pattern_t *pattern = &(*patterns)[(*count)++];
+        memset(pattern, 0, sizeof(*pattern));
+        pattern->kind = PATTERN_LITERAL;
+        pattern->owned = strdup(line);
+        pattern->text = pattern->owned;
+        if (pattern->owned == NULL)
+        {
+            (*count)--;
+            break;
+        }
+    }
+    int failed = ferror(fp) || !feof(fp);
+    if (failed)
+    {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno ? errno : ENOMEM));
+    }
+    free(line);
+    fclose(fp);
+    return failed ? -1 : 0;
+}
+
+// 展开 -K, 编译 -r, 把所有字面串 (包括正则的必需字面串) 编进一个自动机.
+// 只有一个字面串时还走原来的 SIMD 查找 (g_keyword). 失败时打印原因并返回 -1
+int init_patterns(void)
+{
+    pattern_t *patterns = NULL;
+    size_t count = 0, cap = 0;
+
+    for (int i = 0; i < g_pattern_arg_count; i++)
+    {
+        const pattern_t *arg = &g_pattern_args[i];
+        if (arg->kind == PATTERN_FILE)
+        {
+            if (load_pattern_file(arg->text, &patterns, &count, &cap) != 0)
+            {
+                free(patterns);
+                return -1;
+            }
+            continue;
+        }
+        if (count == cap)
+        {
+            size_t bigger = cap ? cap * 2 : 64;
+            pattern_t *grown = realloc(patterns, bigger * sizeof(pattern_t));
+            if (grown == NULL)
+            {
+                perror("malloc");
+                free(patterns);
+                return -1;
+            }
+            patterns = grown;
+            cap = bigger;
+        }
+        patterns[count++] = *arg;
+    }
+    g_patterns = patterns;
+    g_pattern_count = count;
+    if (count == 1 && patterns[0].kind == PATTERN_LITERAL)
+    {
+        g_keyword = patterns[0].text;
+        return 0;
+    }
+    if (g_pattern_arg_count == 0)
+    {
+        return 0;
+    }
+
+    const char **literals = malloc((count + 1) * sizeof(char *));
+    size_t *lens = malloc((count + 1) * sizeof(size_t));
+    uint32_t *ids = malloc((count + 1) * sizeof(uint32_t));
+    char (*required)[PATTERN_MAX] = malloc((count + 1) * PATTERN_MAX);
+    size_t literal_count = 0;
+    int ret = 0;
+
+    if (literals == NULL || lens == NULL || ids == NULL || required == NULL)
+    {
+        perror("malloc");
+        ret = -1;
+    }
+    for (size_t i = 0; ret == 0 && i < count; i++)
+    {
+        pattern_t *pattern = &patterns[i];
+        const char *literal = pattern->text;
+        size_t len = strlen(literal);
+        if (pattern->kind == PATTERN_REGEX)
+        {
+            int err = regcomp(&pattern->regex, pattern->text, REG_EXTENDED | REG_NOSUB | (g_case_sensitive ? 0 : REG_ICASE));
+            if (err != 0)
+            {
+                char message[256];
+                regerror(err, &pattern->regex, message, sizeof(message));
+                fprintf(stderr, "错误: 正则表达式 '%s' 无效: %s\n", pattern->text, message);
+                ret = -1;
+                break;
+            }
+            pattern->compiled = 1;
+            literal = required[i];
+            len = required_literal(pattern->text, required[i]);
+        }
+        // 空串 (以及没有必需字面串的正则) 要逐行检查; 含换行符的字面串不可能出现在一行里
+        if (len == 0 || (pattern->kind == PATTERN_LITERAL && memchr(literal, '\n', len) != NULL))
+        {
+            g_check_every_line |= len == 0;
+            continue;
+        }
+        pattern->in_automaton = 1;
+        literals[literal_count] = literal;
+        lens[literal_count] = len;
+        ids[literal_count++] = i;
+    }
+    if (ret == 0 && ac_build(&g_ac, literals, lens, ids, literal_count, !g_case_sensitive) != 0)
+    {
+        perror("malloc");
+        ret = -1;
+    }
+    g_use_patterns = ret == 0;
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        g_ac_find = ac_find_avx2;
+    }
+#endif
+    if (g_verbose && ret == 0)
+    {
+        printf("%zu 个模式, 自动机 %u 个状态 x %u 个字节类 (%.1f KB)%s\n", count, g_ac.state_count, g_ac.class_count,
+               g_ac.state_count * g_ac.class_count * 4 / 1024.0, g_check_every_line ? ", 有模式需要逐行检查" : "");
+    }
+    free(literals);
+    free(lens);
+    free(ids);
+    free(required);
+    return ret;
+}
+
+void free_patterns(void)
+{
+    for (size_t i = 0; i < g_pattern_count; i++)
+    {
+        if (g_patterns[i].compiled)
+        {
+            regfree(&g_patterns[i].regex);
+        }
+        free(g_patterns[i].owned);
+    }
+    free(g_patterns);
+    ac_free(&g_ac);
+}
+
+// FNV-1a, IP 计数表和索引的文件指纹共用
+static inline uint64_t hash_bytes(const void *data, size_t len)
+{
+    const unsigned char *p = data;
+    uint64_t h = 1469598103934665603ULL;
+
+    for (size_t i = 0; i < len; i++)
+    {
+        h = (h ^ p[i]) * 1099511628211ULL;
+    }
+    return h ^ (h >> 29);
+}
+
+// IP 键的哈希: 乘法散列取高位再折一下, 相邻的地址也能散开
+static inline size_t hash_ip(uint64_t key)
+{
+    uint64_t h = (key ^ (key >> 29)) * 0x9e3779b97f4a7c15ULL;
+    return (size_t)(h ^ (h >> 32));
+}
+
+// 把 grep -o 取出的串还原出来, 返回长度
+size_t format_ip(uint64_t key, char *out)
+{
+    char *p = out;
+
+    for (int part = 0; part < 4; part++)
+    {
+        unsigned digits, value;
+        if (key & IP_KEY_RAW)
+        {
+            unsigned field = (key >> (12 * part)) & 0xfff;
+            digits = field >> 10;
+            value = field & 0x3ff;
+        }
+        else
+        {
+            value = (key >> (24 - 8 * part)) & 0xff;
+            digits = value >= 100 ? 3 : value >= 10 ? 2 : 1;
+        }
+        for (int d = digits - 1; d >= 0; d--)
+        {
+            p[d] = '0' + value % 10;
+            value /= 10;
+        }
+        p += digits;
+        if (part < 3)
+        {
+            *p++ = '.';
+        }
+    }
+    *p = '\0';
+    return p - out;
+}
+
+int ip_table_grow(ip_table_t *table)
+{
+    size_t cap = table->slots ? (table->mask + 1) * 2 : IP_TABLE_INIT;
+    ip_entry_t *slots = calloc(cap, sizeof(ip_entry_t));
+
+    if (slots == NULL)
+    {
+        return -1;
+    }
+    if (table->slots != NULL)
+    {
+        for (size_t i = 0; i <= table->mask; i++)
+        {
+            ip_entry_t *entry = &table->slots[i];
+            if (entry->count == 0)
+            {
+                continue;
+            }
+            size_t pos = hash_ip(entry->key) & (cap - 1);
+            while (slots[pos].count != 0)
+            {
+                pos = (pos + 1) & (cap - 1);
+            }
+            slots[pos] = *entry;
+        }
+        free(table->slots);
+    }
+    table->slots = slots;
+    table->mask = cap - 1;
+    return 0;
+}
+
+// 近似模式的最小堆按 count 排序, 堆里存槽位下标, 槽位里记着自己在堆里的位置
+static void ip_heap_sift_down(ip_table_t *table, size_t i)
+{
+    size_t n = table->count;
+    uint32_t *heap = table->heap;
+
+    for (;;)
+    {
+        size_t smallest = i;
+        size_t left = 2 * i + 1;
+        size_t right = left + 1;
+        if (left < n && table->slots[heap[left]].count < table->slots[heap[smallest]].count)
+        {
+            smallest = left;
+        }
+        if (right < n && table->slots[heap[right]].count < table->slots[heap[smallest]].count)
+        {
+            smallest = right;
+        }
+        if (smallest == i)
+        {
+            return;
+        }
+        uint32_t tmp = heap[i];
+        heap[i] = heap[smallest];
+        heap[smallest] = tmp;
+        table->slots[heap[i]].heap_pos = i;
+        table->slots[heap[smallest]].heap_pos = smallest;
+        i = smallest;
+    }
+}
+
+// 不同 IP 的个数达到上限: 以后只跟踪这么多个, 新 IP 替换掉次数最少的那个 (Space-Saving)
+static int ip_table_start_approximate(ip_table_t *table)
+{
+    table->heap = malloc(table->count * sizeof(uint32_t));
+    if (table->heap == NULL)
+    {
+        return -1;
+    }
+    size_t n = 0;
+    for (size_t i = 0; i <= table->mask; i++)
+    {
+        if (table->slots[i].count != 0)
+        {
+            table->slots[i].heap_pos = n;
+            table->heap[n++] = i;
+        }
+    }
+    for (size_t i = n / 2; i-- > 0;)
+    {
+        ip_heap_sift_down(table, i);
+    }
+    table->approximate = 1;
+    return 0;
+}
+
+// 线性探测表的删除: 把后面探测链上的项往前挪, 不留墓碑. 只在近似模式下用, 挪动时同步堆里的下标
+static void ip_table_remove(ip_table_t *table, size_t hole)
+{
+    for (size_t i = (hole + 1) & table->mask; table->slots[i].count != 0; i = (i + 1) & table->mask)
+    {
+        size_t home = hash_ip(table->slots[i].key) & table->mask;
+        if (((i - home) & table->mask) >= ((i - hole) & table->mask))
+        {
+            table->slots[hole] = table->slots[i];
+            table->heap[table->slots[hole].heap_pos] = hole;
+            hole = i;
+        }
+    }
+    table->slots[hole].count = 0;
+}
+
+// 给 key 加上 count 次. error 是这些次数里可能多算的部分, 合并近似表的时候才不为 0
+void ip_table_add(ip_table_t *table, uint64_t key, uint64_t count, uint64_t error)
+{
+    if (table->slots == NULL && ip_table_grow(table) != 0)
+    {
+        return;
+    }
+
+    size_t pos = hash_ip(key) & table->mask;
+    while (table->slots[pos].count != 0)
+    {
+        ip_entry_t *entry = &table->slots[pos];
+        if (entry->key == key)
+        {
+            entry->count += count;
+            entry->error += error;
+            if (table->approximate)
+            {
+                ip_heap_sift_down(table, entry->heap_pos);
+            }
+            return;
+        }
+        pos = (pos + 1) & table->mask;
+    }
+
+    if (!table->approximate && g_ip_limit > 0 && table->count >= g_ip_limit && ip_table_start_approximate(table) != 0)
+    {
+        return;
+    }
+    if (table->approximate)
+    {
+        // 新 IP 接替堆顶: 继承它的次数作为误差上限, 真实次数在 [count - error, count] 之间
+        ip_entry_t *victim = &table->slots[table->heap[0]];
+        uint64_t floor = victim->count;
+        ip_table_remove(table, table->heap[0]);
+        pos = hash_ip(key) & table->mask;
+        while (table->slots[pos].count != 0)
+        {
+            pos = (pos + 1) & table->mask;
+        }
+        table->slots[pos].key = key;
+        table->slots[pos].count = floor + count;
+        table->slots[pos].error = floor + error;
+        table->slots[pos].heap_pos = 0;
+        table->heap[0] = pos;
+        ip_heap_sift_down(table, 0);
+        return;
+    }
+
+    if (table->count >= table->mask)
+    {
+        // 扩容失败, 表已经满了
+        return;
+    }
+    ip_entry_t *entry = &table->slots[pos];
+    entry->key = key;
+    entry->count = count;
+    entry->error = error;
+    table->count++;
+    // 装载因子不超过 1/2
+    if (table->count * 2 > table->mask + 1)
+    {
+        ip_table_grow(table);
+    }
+}
+
+void ip_table_free(ip_table_t *table)
+{
+    free(table->slots);
+    free(table->heap);
+    memset(table, 0, sizeof(*table));
+}
+
+void free_counts(counts_t *counts)
+{
+    ip_table_free(&counts->ips);
+    free(counts->hits);
+    counts->hits = NULL;
+}
+
+// 和 grep -o '[0-9]\{1,3\}\.[0-9]\{1,3\}\.[0-9]\{1,3\}\.[0-9]\{1,3\}' 取出同样的串:
+// 从左往右找最左最长的匹配, 匹配之后从它的结尾继续找. 匹配的同时算出键, 不再拷贝字符串
+void count_ips(ip_table_t *table, const char *line, size_t len)
+{
+    size_t i = 0;
+
+    while (i < len)
+    {
+        if (!is_digit(line[i]))
+        {
+            i++;
+            continue;
+        }
+
+        size_t pos = i;
+        uint32_t ip = 0;
+        uint64_t raw = 0;
+        int canonical = 1;
+        int part;
+        for (part = 0; part < 4; part++)
+        {
+            unsigned n = 0;
+            unsigned value = 0;
+            while (n < 3 && pos + n < len && is_digit(line[pos + n]))
+            {
+                value = value * 10 + (line[pos + n] - '0');
+                n++;
+            }
+            if (n == 0)
+            {
+                break;
+            }
+            canonical &= value <= 255 && (n == 1 || line[pos] != '0');
+            ip = ip << 8 | (value & 0xff);
+            raw |= (uint64_t)(n << 10 | value) << (12 * part);
+            pos += n;
+            if (part < 3)
+            {
+                if (pos >= len || line[pos] != '.')
+                {
+                    break;
+                }
+                pos++;
+            }
+        }
+        if (part == 4)
+        {
+            ip_table_add(table, canonical ? ip : IP_KEY_RAW | raw, 1, 0);
+            i = pos;
+        }
+        else
+        {
+            i++;
+        }
+    }
+}
+
+// 六个级别名的首字母各不相同, 按首字母 (折成小写后) 查级别下标加 1, 0 表示不是任何级别的开头
+static unsigned char g_level_start[256];
+
+void init_levels(void)
+{
+    for (int i = 0; i < LEVEL_COUNT; i++)
+    {
+        g_level_start[(unsigned char)g_fold[(unsigned char)g_level_names[i][0]]] = i + 1;
+        g_level_start[(unsigned char)g_level_names[i][0]] = i + 1;
+    }
+}
+
+// 一趟扫完整行, 和原来的 grep -i 一样按行计数: 一行里出现多次只算一次, WARN 也会命中 WARNING
+void count_levels(unsigned long *levels, const char *line, size_t len)
+{
+    unsigned seen = 0;
+
+    for (size_t i = 0; i < len; i++)
+    {
+        int level = g_level_start[(unsigned char)line[i]];
+        if (level == 0)
+        {
+            continue;
+        }
+        const char *name = g_level_names[level - 1];
+        size_t j = 1;
+        while (name[j] != '\0' && i + j < len && (g_fold[(unsigned char)line[i + j]] ^ 0x20) == (unsigned char)name[j])
+        {
+            j++;
+        }
+        if (name[j] == '\0')
+        {
+            seen |= 1u << (level - 1);
+        }
+    }
+    while (seen != 0)
+    {
+        levels[__builtin_ctz(seen)]++;
+        seen &= seen - 1;
+    }
+}
+
+void collect_stats(const scan_ctx_t *ctx, const char *line, size_t len, const char *time, int has_time)
+{
+    line_stats_t *lines = ctx->lines;
+
+    if (lines->filtered_lines++ == 0 && has_time)
+    {
+        memcpy(lines->first_time, time, TIME_LEN);
+    }
+    if (has_time)
+    {
+        memcpy(lines->last_time, time, TIME_LEN);
+    }
+    else
+    {
+        lines->last_time[0] = '\0';
+    }
+
+    count_levels(ctx->counts->levels, line, len);
+    count_ips(&ctx->counts->ips, line, len);
+}
+
+// next 紧接在 into 后面
+void merge_line_stats(line_stats_t *into, const line_stats_t *next)
+{
+    into->total_lines += next->total_lines;
+    if (next->filtered_lines == 0)
+    {
+        return;
+    }
+    if (into->filtered_lines == 0)
+    {
+        memcpy(into->first_time, next->first_time, sizeof(into->first_time));
+    }
+    memcpy(into->last_time, next->last_time, sizeof(into->last_time));
+    into->filtered_lines += next->filtered_lines;
+}
+
+// from 合并之后不再使用, 命中计数的数组可以直接拿过来
+void merge_counts(counts_t *into, counts_t *from)
+{
+    for (int i = 0; i < LEVEL_COUNT; i++)
+    {
+        into->levels[i] += from->levels[i];
+    }
+    if (into->hits == NULL)
+    {
+        into->hits = from->hits;
+        from->hits = NULL;
+    }
+    for (size_t i = 0; from->hits != NULL && i < g_pattern_count; i++)
+    {
+        into->hits[i] += from->hits[i];
+    }
+    for (size_t i = 0; from->ips.slots != NULL && i <= from->ips.mask; i++)
+    {
+        const ip_entry_t *entry = &from->ips.slots[i];
+        if (entry->count != 0)
+        {
+            ip_table_add(&into->ips, entry->key, entry->count, entry->error);
+        }
+    }
+    // 任何一个线程转成了近似统计, 合起来也只能是近似的
+    if (from->ips.approximate && !into->ips.approximate && into->ips.count > 0)
+    {
+        ip_table_start_approximate(&into->ips);
+    }
+}
+
+// 处理一行 (不含换行符, 关键字已经匹配过). 通过了日期过滤返回 1, 被过滤掉返回 0, 写过滤结果失败返回 -1
+int process_line(const scan_ctx_t *ctx, const char *line, size_t len)
+{
+    char time[TIME_LEN];
+    int has_time;
+
+    has_time = extract_timestamp(line, len, time);
+    // 没有时间戳, 或者时间戳本身不合法的行不参与日期过滤
+    if (has_time && (g_start_date != NULL || g_end_date != NULL))
+    {
+        long long seconds;
+        if (time_to_seconds(time, &seconds) == 0
+            && ((g_start_date != NULL && seconds < g_start_time) || (g_end_date != NULL && seconds > g_end_time)))
+        {
+            return 0;
+        }
+    }
+
+    collect_stats(ctx, line, len, time, has_time);
+    if (ctx->runs != NULL && range_list_add(ctx->runs, line - ctx->base, line + len - ctx->base) != 0)
+    {
+        return -1;
+    }
+    if (ctx->runs == NULL && ctx->out != NULL && out_append_line(ctx->out, line, len) != 0)
+    {
+        return -1;
+    }
+    return 1;
+}
+
+// 正则只在这一行里匹配, 不用拷出来补 '\0'
+static inline int regex_matches(const pattern_t *pattern, const char *line, size_t len)
+{
+    regmatch_t match[1];
+
+    match[0].rm_so = 0;
+    match[0].rm_eo = len;
+    return regexec(&pattern->regex, line, 1, match, REG_STARTEND) == 0;
+}
+
+static inline unsigned long count_newlines(const char *p, const char *end)
+{
+    unsigned long n = 0;
+
+    while (p < end && (p = memchr(p, '\n', end - p)) != NULL)
+    {
+        n++;
+        p++;
+    }
+    return n;
+}
+
+// 多模式时一行匹配了哪些模式, 编号写进 ids, 返回个数. 自动机从 line + skip 走到行尾 (skip 之前不会有匹配开始),
+// 正则只在必需字面串出现时才真正匹配. stamps[id] == stamp 表示这一行已经看过这个模式
+static size_t match_patterns(const char *line, size_t len, size_t skip, uint32_t *ids, uint32_t *stamps, uint32_t stamp)
+{
+    const ac_automaton_t *ac = &g_ac;
+    uint32_t state = ac->root;
+    size_t n = 0;
+
+    for (size_t i = skip; i < len; i++)
+    {
+        state = ac->next[state + ac->byte_class[(unsigned char)line[i]]];
+        if (state >= ac->accept_limit)
+        {
+            continue;
+        }
+        uint32_t s = state / ac->class_count;
+        for (uint32_t k = ac->out_start[s]; k < ac->out_start[s + 1]; k++)
+        {
+            uint32_t id = ac->out_ids[k];
+            if (stamps[id] != stamp)
+            {
+                stamps[id] = stamp;
+                ids[n++] = id;
+            }
+        }
+    }
+
+    size_t matched = 0;
+    for (size_t k = 0; k < n; k++)
+    {
+        pattern_t *pattern = &g_patterns[ids[k]];
+        if (pattern->kind == PATTERN_LITERAL || regex_matches(pattern, line, len))
+        {
+            ids[matched++] = ids[k];
+        }
+    }
+    for (size_t id = 0; g_check_every_line && id < g_pattern_count; id++)
+    {
+        pattern_t *pattern = &g_patterns[id];
+        if (!pattern->in_automaton && pattern->compiled && regex_matches(pattern, line, len))
+        {
+            ids[matched++] = id;
+        }
+    }
+    return matched;
+}
+
+// 多模式版的 scan_block: 自动机在整块上找任意一个字面串, 找到之后再扩到行边界, 逐个确认这一行匹配了哪些模式.
+// 有模式需要逐行检查时每一行都要看
+int scan_block_patterns(const scan_ctx_t *ctx, const char *buf, size_t len)
+{
+    const char *p = buf;
+    const char *end = buf + len;
+    uint32_t *ids = malloc((g_pattern_count + 1) * sizeof(uint32_t));
+    uint32_t *stamps = calloc(g_pattern_count + 1, sizeof(uint32_t));
+    uint32_t stamp = 0;
+    int ret = 0;
+
+    if (ids == NULL || stamps == NULL || (ctx->counts->hits == NULL && (ctx->counts->hits = calloc(g_pattern_count + 1, sizeof(unsigned long))) == NULL))
+    {
+        free(ids);
+        free(stamps);
+        return -1;
+    }
+
+    while (p < end)
+    {
+        const char *start = p;
+        size_t skip = 0;
+        if (!g_check_every_line)
+        {
+            const char *hit = g_ac_find(&g_ac, p, end);
+            if (hit == NULL)
+            {
+                ctx->lines->total_lines += count_newlines(p, end);
+                break;
+            }
+            start = memrchr(p, '\n', hit - p);
+            start = start != NULL ? start + 1 : p;
+            ctx->lines->total_lines += count_newlines(p, start);
+            // 这是块里第一个匹配, 行里的匹配都在它之后结束, 开头不会早于 hit - max_len
+            skip = (size_t)(hit - start) > g_ac.max_len ? hit - start - g_ac.max_len : 0;
+        }
+        const char *line_end = memchr(start, '\n', end - start);
+        if (line_end == NULL)
+        {
+            line_end = end;
+        }
+        else
+        {
+            ctx->lines->total_lines++;
+        }
+
+        size_t matched = match_patterns(start, line_end - start, skip, ids, stamps, ++stamp);
+        int accepted = matched > 0 ? process_line(ctx, start, line_end - start) : 0;
+        if (accepted < 0)
+        {
+            ret = -1;
+            break;
+        }
+        for (size_t k = 0; accepted && k < matched; k++)
+        {
+            ctx->counts->hits[ids[k]]++;
+        }
+        p = line_end + 1;
+    }
+    // 和 scan_block 一样, 末尾没有换行符的那一行在这里补上
+    if (ret == 0 && len > 0 && end[-1] != '\n')
+    {
+        ctx->lines->total_lines++;
+    }
+    free(ids);
+    free(stamps);
+    return ret;
+}
+
+// 处理 [buf, buf + len) 里的若干整行, 只有文件末尾那一行可以没有换行符.
+// 有关键字时在整块上直接找, 命中之后才向两边扩到行边界, 不含关键字的行不会被单独切出来
+int scan_block(const scan_ctx_t *ctx, const char *buf, size_t len)
+{
+    const char *p = buf;
+    const char *end = buf + len;
+
+    if (g_use_patterns)
+    {
+        return scan_block_patterns(ctx, buf, len);
+    }
+
+    if (g_keyword == NULL || g_needle.impossible)
+    {
+        while (p < end)
+        {
+            const char *newline = memchr(p, '\n', end - p);
+            const char *line_end = newline != NULL ? newline : end;
+            ctx->lines->total_lines++;
+            if (g_keyword == NULL && process_line(ctx, p, line_end - p) < 0)
+            {
+                return -1;
+            }
+            p = line_end + 1;
+        }
+        return 0;
+    }
+
+    while (p < end)
+    {
+        const char *hit = g_find_keyword(&g_needle, p, end, &ctx->lines->total_lines);
+        if (hit == NULL)
+        {
+            break;
+        }
+        const char *start = memrchr(p, '\n', hit - p);
+        start = start != NULL ? start + 1 : p;
+        const char *line_end = memchr(hit + g_needle.len, '\n', end - hit - g_needle.len);
+        if (line_end == NULL)
+        {
+            line_end = end;
+        }
+        else
+        {
+            ctx->lines->total_lines++;
+        }
+        if (process_line(ctx, start, line_end - start) < 0)
+        {
+            return -1;
+        }
+        p = line_end + 1;
+    }
+    // 查找核只数换行符, 末尾没有换行符的那一行在这里补上
+    if (len > 0 && end[-1] != '\n')
+    {
+        ctx->lines->total_lines++;
+    }
+    return 0;
+}
+
+// 不能映射的输入从当前位置按大块读到文件末尾, 每块处理到最后一个换行符为止, 剩下的半行挪到下一块开头.
+// partial 不为 NULL 时末尾没有换行符的半行不处理, 它的长度存在 *partial 里
+int scan_file(const scan_ctx_t *ctx, int fd, size_t *partial)
+{
+    size_t cap = READ_BLOCK;
+    size_t have = 0;
+    char *buf = malloc(cap);
+
+    if (buf == NULL)
+    {
+        return -1;
+    }
+
+    for (;;)
+    {
+        if (have == cap)
+        {
+            char *bigger = realloc(buf, cap * 2);
+            if (bigger == NULL)
+            {
+                free(buf);
+                return -1;
+            }
+            buf = bigger;
+            cap *= 2;
+        }
+
+        ssize_t n = read(fd, buf + have, cap - have);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            free(buf);
+            return -1;
+        }
+        if (n == 0)
+        {
+            break;
+        }
+
+        size_t scan_from = have;
+        have += n;
+        const char *newline = memrchr(buf + scan_from, '\n', have - scan_from);
+        if (newline == NULL)
+        {
+            continue;
+        }
+        size_t used = newline + 1 - buf;
+        if (scan_block(ctx, buf, used) != 0)
+        {
+            free(buf);
+            return -1;
+        }
+        have -= used;
+        memmove(buf, buf + used, have);
+    }
+
+    int ret = 0;
+    if (partial != NULL)
+    {
+        *partial = have;
+    }
+    else
+    {
+        ret = scan_block(ctx, buf, have);
+    }
+    free(buf);
+    return ret;
+}
+
+// 在 cursor 后面切出下一块: 至少 SCAN_CHUNK 字节, 延伸到换行符为止, 不跨过当前这一段的结尾. 持锁调用
+static int next_chunk(scan_job_t *job, scan_slot_t *slot)
+{
+    while (job->range_index < job->range_count && job->cursor >= job->ranges[job->range_index].end)
+    {
+        if (++job->range_index < job->range_count)
+        {
+            job->cursor = job->ranges[job->range_index].begin;
+        }
+    }
+    if (job->range_index >= job->range_count)
+    {
+        return 0;
+    }
+
+    size_t begin = job->cursor;
+    size_t limit = job->ranges[job->range_index].end;
+    size_t end = limit;
+    if (limit - begin > SCAN_CHUNK)
+    {
+        const char *newline = memchr(job->map + begin + SCAN_CHUNK - 1, '\n', limit - begin - SCAN_CHUNK + 1);
+        if (newline != NULL)
+        {
+            end = newline + 1 - job->map;
+        }
+    }
+    slot->begin = job->map + begin;
+    slot->end = job->map + end;
+    job->cursor = end;
+    return 1;
+}
+
+void *scan_worker(void *arg)
+{
+    scan_worker_t *worker = arg;
+    scan_job_t *job = worker->job;
+
+    pthread_mutex_lock(&job->lock);
+    while (job->chunk_count < 0)
+    {
+        // 写出去之前槽位不能复用, 这里同时起到限制在途块数的作用
+        scan_slot_t *slot = &job->slots[job->next_chunk % job->slot_count];
+        if (slot->state != SLOT_FREE)
+        {
+            pthread_cond_wait(&job->cond, &job->lock);
+            continue;
+        }
+        if (!next_chunk(job, slot))
+        {
+            job->chunk_count = job->next_chunk;
+            pthread_cond_broadcast(&job->cond);
+            break;
+        }
+        slot->index = job->next_chunk++;
+        slot->state = SLOT_BUSY;
+        pthread_mutex_unlock(&job->lock);
+
+        scan_ctx_t ctx = { &slot->lines, &worker->counts, NULL, job->want_output ? &slot->runs : NULL, job->map };
+        memset(&slot->lines, 0, sizeof(slot->lines));
+        slot->runs.count = 0;
+#ifdef MADV_POPULATE_READ
+        // 一次把这一块的页表建好, 比扫描时一页一页缺页快, 多个线程还能同时建
+        uintptr_t page = (uintptr_t)slot->begin & ~job->page_mask;
+        madvise((void *)page, slot->end - (const char *)page, MADV_POPULATE_READ);
+#endif
+        slot->failed = scan_block(&ctx, slot->begin, slot->end - slot->begin) != 0;
+
+        pthread_mutex_lock(&job->lock);
+        slot->state = SLOT_DONE;
+        pthread_cond_broadcast(&job->cond);
+    }
+    pthread_mutex_unlock(&job->lock);
+    return NULL;
+}
+
+// 映射好的文件里按顺序排好的若干段, 切成以换行符结尾的块交给线程池. 当前线程按块的顺序合并行数、首末时间
+// 和过滤结果所在的位置 (runs 为 NULL 表示不输出), 线程各自的计数最后再加起来.
+// 返回 0, 内存不够时设置 errno 并返回 -1
+int scan_mapped(const char *map, const scan_range_t *ranges, int range_count, int threads, stats_t *stats, range_list_t *runs)
+{
+    scan_job_t job;
+    scan_worker_t workers[MAX_THREADS];
+    pthread_t tids[MAX_THREADS];
+    int started = 0;
+    int failed = 0;
+    int saved_errno = 0;
+    int create_error = 0;
+
+    memset(&job, 0, sizeof(job));
+    job.map = map;
+    job.ranges = ranges;
+    job.range_count = range_count;
+    job.cursor = range_count > 0 ? ranges[0].begin : 0;
+    job.want_output = runs != NULL;
+    job.page_mask = sysconf(_SC_PAGESIZE) - 1;
+    job.chunk_count = -1;
+    threads = threads < 1 ? 1 : threads > MAX_THREADS ? MAX_THREADS : threads;
+    job.slot_count = threads * SLOTS_PER_THREAD;
+    job.slots = calloc(job.slot_count, sizeof(scan_slot_t));
+    if (job.slots == NULL)
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+    pthread_mutex_init(&job.lock, NULL);
+    pthread_cond_init(&job.cond, NULL);
+
+    memset(workers, 0, sizeof(workers));
+    for (int t = 0; t < threads; t++)
+    {
+        workers[started].job = &job;
+        create_error = pthread_create(&tids[started], NULL, scan_worker, &workers[started]);
+        if (create_error == 0)
+        {
+            started++;
+        }
+    }
+    if (started == 0)
+    {
+        saved_errno = create_error;
+        failed = 1;
+        job.chunk_count = 0;
+    }
+
+    for (long index = 0;; index++)
+    {
+        pthread_mutex_lock(&job.lock);
+        scan_slot_t *slot = &job.slots[index % job.slot_count];
+        while (!(job.chunk_count >= 0 && index >= job.chunk_count) && !(slot->state == SLOT_DONE && slot->index == index))
+        {
+            pthread_cond_wait(&job.cond, &job.lock);
+        }
+        int finished = job.chunk_count >= 0 && index >= job.chunk_count;
+        pthread_mutex_unlock(&job.lock);
+        if (finished)
+        {
+            break;
+        }
+
+        for (size_t i = 0; !slot->failed && runs != NULL && i < slot->runs.count; i++)
+        {
+            slot->failed = range_list_add(runs, slot->runs.items[i].begin, slot->runs.items[i].end) != 0;
+        }
+        if (slot->failed && !failed)
+        {
+            saved_errno = ENOMEM;
+            failed = 1;
+        }
+        merge_line_stats(&stats->lines, &slot->lines);
+
+        pthread_mutex_lock(&job.lock);
+        slot->state = SLOT_FREE;
+        pthread_cond_broadcast(&job.cond);
+        pthread_mutex_unlock(&job.lock);
+    }
+
+    for (int t = 0; t < started; t++)
+    {
+        pthread_join(tids[t], NULL);
+        merge_counts(&stats->counts, &workers[t].counts);
+        free_counts(&workers[t].counts);
+    }
+    for (int i = 0; i < job.slot_count; i++)
+    {
+        free(job.slots[i].runs.items);
+    }
+    free(job.slots);
+    pthread_mutex_destroy(&job.lock);
+    pthread_cond_destroy(&job.cond);
+    if (failed)
+    {
+        errno = saved_errno;
+        return -1;
+    }
+    return 0;
+}
+
+static int read_full(int fd, void *buf, size_t len, off_t offset)
+{
+    char *p = buf;
+
+    while (len > 0)
+    {
+        ssize_t n = pread(fd, p, len, offset);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            return -1;
+        }
+        p += n;
+        len -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+void index_fingerprint(const char *map, size_t end, uint64_t *head, uint64_t *tail)
+{
+    size_t n = end < INDEX_HASH_BYTES ? end : INDEX_HASH_BYTES;
+
+    *head = hash_bytes(map, n);
+    *tail = hash_bytes(map + end - n, n);
+}
+
+void reset_index(time_index_t *index)
+{
+    free(index->entries);
+    memset(index, 0, sizeof(*index));
+    memcpy(index->header.magic, g_index_magic, sizeof(g_index_magic));
+    index->header.block_size = INDEX_BLOCK;
+}
+
+// 读入索引文件, 并确认它描述的还是现在这个日志文件. 不存在、格式不对或者已经过期时返回 -1, index 为空
+int load_index(const char *path, time_index_t *index, const char *map, size_t size)
+{
+    struct stat st;
+    index_header_t *header = &index->header;
+    int fd = open(path, O_RDONLY);
+
+    reset_index(index);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(*header) || read_full(fd, header, sizeof(*header), 0) != 0
+        || memcmp(header->magic, g_index_magic, sizeof(g_index_magic)) != 0 || header->block_size != INDEX_BLOCK
+        || (size_t)st.st_size != sizeof(*header) + header->count * sizeof(index_entry_t) || header->indexed_end > size)
+    {
+        close(fd);
+        reset_index(index);
+        return -1;
+    }
+
+    uint64_t head, tail;
+    index_fingerprint(map, header->indexed_end, &head, &tail);
+    index->cap = header->count;
+    index->entries = malloc(index->cap * sizeof(index_entry_t) + 1);
+    if (head != header->head_hash || tail != header->tail_hash || index->entries == NULL
+        || read_full(fd, index->entries, header->count * sizeof(index_entry_t), sizeof(*header)) != 0)
+    {
+        close(fd);
+        reset_index(index);
+        return -1;
+    }
+    close(fd);
+    return 0;
+}
+
+// 一块 [begin, end) 的索引项. 时间戳的判断和 process_line 一致
+void index_block(const char *map, size_t begin, size_t end, index_entry_t *entry)
+{
+    const char *p = map + begin;
+    const char *stop = map + end;
+    char time[TIME_LEN];
+
+    entry->offset = begin;
+    entry->lines = 0;
+    entry->undated = 0;
+    entry->min_time = INT64_MAX;
+    entry->max_time = INT64_MIN;
+    while (p < stop)
+    {
+        const char *newline = memchr(p, '\n', stop - p);
+        const char *line_end = newline != NULL ? newline : stop;
+        long long seconds;
+
+        entry->lines++;
+        if (extract_timestamp(p, line_end - p, time) && time_to_seconds(time, &seconds) == 0)
+        {
+            entry->min_time = seconds < entry->min_time ? seconds : entry->min_time;
+            entry->max_time = seconds > entry->max_time ? seconds : entry->max_time;
+        }
+        else
+        {
+            entry->undated++;
+        }
+        p = line_end + 1;
+    }
+}
+
+// 从 indexed_end 开始给新增的完整块建索引, 文件末尾不够一块的部分留到下次. 返回新建的块数, 内存不够返回 -1
+long extend_index(time_index_t *index, const char *map, size_t size)
+{
+    index_header_t *header = &index->header;
+    size_t begin = header->indexed_end;
+    long added = 0;
+
+    while (size - begin > INDEX_BLOCK)
+    {
+        const char *newline = memchr(map + begin + INDEX_BLOCK - 1, '\n', size - begin - INDEX_BLOCK + 1);
+        if (newline == NULL)
+        {
+            break;
+        }
+        if (header->count == index->cap)
+        {
+            size_t cap = index->cap ? index->cap * 2 : 256;
+            index_entry_t *entries = realloc(index->entries, cap * sizeof(index_entry_t));
+            if (entries == NULL)
+            {
+                return -1;
+            }
+            index->entries = entries;
+            index->cap = cap;
+        }
+        size_t end = newline + 1 - map;
+        index_block(map, begin, end, &index->entries[header->count++]);
+        begin = end;
+        added++;
+    }
+    header->indexed_end = begin;
+    index_fingerprint(map, begin, &header->head_hash, &header->tail_hash);
+    return added;
+}
+
+// 先写临时文件再改名, 并发的查询不会读到写了一半的索引
+int save_index(const char *path, const time_index_t *index)
+{
+    size_t tmp_len = strlen(path) + 32;
+    char *tmp = malloc(tmp_len);
+    int fd = -1;
+
+    if (tmp == NULL)
+    {
+        return -1;
+    }
+    snprintf(tmp, tmp_len, "%s.%ld", path, (long)getpid());
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || write_all(fd, (const char *)&index->header, sizeof(index->header)) != 0
+        || write_all(fd, (const char *)index->entries, index->header.count * sizeof(index_entry_t)) != 0
+        || close(fd) != 0 || rename(tmp, path) != 0)
+    {
+        int saved_errno = errno;
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        unlink(tmp);
+        free(tmp);
+        errno = saved_errno;
+        return -1;
+    }
+    free(tmp);
+    return 0;
+}
+
+// 一块里的每一行都会被日期过滤掉: 没有不带时间戳的行, 而且时间范围整个落在窗口外面
+static inline int block_outside_window(const index_entry_t *entry)
+{
+    return entry->undated == 0
+           && ((g_start_date != NULL && entry->max_time < g_start_time) || (g_end_date != NULL && entry->min_time > g_end_time));
+}
+
+// 各块按文件顺序时间不减, 而且都没有不带时间戳的行, 这时窗口内的块是连续的一段, 可以二分查找
+int index_is_sorted(const time_index_t *index)
+{
+    for (uint64_t i = 0; i < index->header.count; i++)
+    {
+        const index_entry_t *entry = &index->entries[i];
+        if (entry->undated != 0 || (i > 0 && entry->min_time < entry[-1].max_time))
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void add_range(scan_range_t *ranges, int *count, size_t begin, size_t end)
+{
+    if (begin >= end)
+    {
+        return;
+    }
+    if (*count > 0 && ranges[*count - 1].end == begin)
+    {
+        ranges[*count - 1].end = end;
+        return;
+    }
+    ranges[*count].begin = begin;
+    ranges[*count].end = end;
+    (*count)++;
+}
+
+// -I: 读入并补全 <日志文件>.idx, 算出需要扫描的几段. 跳过的块一定全被日期过滤掉, 只把它们的行数记进总行数.
+// 时间有序时二分查找窗口; 乱序的日志逐块比较时间范围, 乱序的块自然落在窗口里被扫描.
+// 返回 NULL 表示用不了索引, 扫描整个文件
+scan_range_t *plan_with_index(const char *map, size_t size, int *range_count, unsigned long *skipped_lines)
+{
+    time_index_t index;
+    size_t path_len = strlen(g_log_file) + 5;
+    char *path = malloc(path_len);
+    scan_range_t *ranges = NULL;
+
+    memset(&index, 0, sizeof(index));
+    if (path == NULL)
+    {
+        return NULL;
+    }
+    snprintf(path, path_len, "%s.idx", g_log_file);
+
+    int loaded = load_index(path, &index, map, size) == 0;
+    uint64_t old_count = index.header.count;
+    long added = extend_index(&index, map, size);
+    if (added < 0)
+    {
+        free(index.entries);
+        free(path);
+        return NULL;
+    }
+    if ((added > 0 || !loaded) && save_index(path, &index) != 0)
+    {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+    }
+
+    uint64_t count = index.header.count;
+    uint64_t lo = 0;
+    uint64_t hi = count;
+    int sorted = index_is_sorted(&index);
+    ranges = malloc((count + 1) * sizeof(scan_range_t));
+    *range_count = 0;
+    if (ranges == NULL)
+    {
+        free(index.entries);
+        free(path);
+        return NULL;
+    }
+
+    if (g_start_date == NULL && g_end_date == NULL)
+    {
+        add_range(ranges, range_count, 0, size);
+    }
+    else if (sorted)
+    {
+        // lo: 第一个最大时间 >= 开始时间的块; hi: 第一个最小时间 > 结束时间的块
+        if (g_start_date != NULL)
+        {
+            uint64_t left = 0, right = count;
+            while (left < right)
+            {
+                uint64_t mid = left + (right - left) / 2;
+                if (index.entries[mid].max_time < g_start_time)
+                {
+                    left = mid + 1;
+                }
+                else
+                {
+                    right = mid;
+                }
+            }
+            lo = left;
+        }
+        if (g_end_date != NULL)
+        {
+            uint64_t left = lo, right = count;
+            while (left < right)
+            {
+                uint64_t mid = left + (right - left) / 2;
+                if (index.entries[mid].min_time <= g_end_time)
+                {
+                    left = mid + 1;
+                }
+                else
+                {
+                    right = mid;
+                }
+            }
+            hi = left;
+        }
+        for (uint64_t i = 0; i < count; i++)
+        {
+            *skipped_lines += i < lo || i >= hi ? index.entries[i].lines : 0;
+        }
+        if (lo < hi)
+        {
+            add_range(ranges, range_count, index.entries[lo].offset, hi < count ? index.entries[hi].offset : index.header.indexed_end);
+        }
+        add_range(ranges, range_count, index.header.indexed_end, size);
+    }
+    else
+    {
+        for (uint64_t i = 0; i < count; i++)
+        {
+            const index_entry_t *entry = &index.entries[i];
+            size_t end = i + 1 < count ? index.entries[i + 1].offset : index.header.indexed_end;
+            if (block_outside_window(entry))
+            {
+                *skipped_lines += entry->lines;
+            }
+            else
+            {
+                add_range(ranges, range_count, entry->offset, end);
+            }
+        }
+        add_range(ranges, range_count, index.header.indexed_end, size);
+    }
+
+    if (g_verbose)
+    {
+        size_t scanned = 0;
+        for (int i = 0; i < *range_count; i++)
+        {
+            scanned += ranges[i].end - ranges[i].begin;
+        }
+        printf("索引 %s: %llu 块 (%s), 本次新建 %llu 块, 扫描 %.1f MB / %.1f MB\n", path, (unsigned long long)count,
+               sorted ? "时间有序" : "时间乱序", (unsigned long long)(count - old_count), scanned / 1e6, size / 1e6);
+    }
+    free(index.entries);
+    free(path);
+    return ranges;
+}
+
+// 过滤条件的指纹: 所有模式、大小写、日期窗口和 -m 都一样, 累计的统计才能接着加
+uint64_t filter_params_hash(void)
+{
+    char params[512];
+    int n = snprintf(params, sizeof(params), "%d|%d|%lld|%d|%lld|%zu|", g_case_sensitive, g_start_date != NULL,
+                     g_start_time, g_end_date != NULL, g_end_time, g_ip_limit);
+    uint64_t hash = hash_bytes(params, n);
+
+    for (size_t i = 0; i < g_pattern_count; i++)
+    {
+        hash = (hash ^ hash_bytes(g_patterns[i].text, strlen(g_patterns[i].text) + 1)) * 0x9e3779b97f4a7c15ULL + g_patterns[i].kind;
+    }
+    return hash;
+}
+
+// 文件开头 min(offset, INDEX_HASH_BYTES) 字节的指纹
+int file_head_hash(int fd, size_t offset, uint64_t *hash)
+{
+    char head[INDEX_HASH_BYTES];
+    size_t n = offset < INDEX_HASH_BYTES ? offset : INDEX_HASH_BYTES;
+
+    if (read_full(fd, head, n, 0) != 0)
+    {
+        return -1;
+    }
+    *hash = hash_bytes(head, n);
+    return 0;
+}
+
+// -C: 读入检查点, 把累计的统计放进 stats, 并算出这次从哪里开始. 日志被轮转或者截断时从头开始, 统计照样接着累计.
+// 检查点不存在、格式不对或者过滤条件变了时返回 -1, stats 保持为空
+int load_checkpoint(const char *path, int log_fd, const struct stat *log_st, stats_t *stats, size_t *offset)
+{
+    checkpoint_header_t header;
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+
+    *offset = 0;
+    if (fd < 0)
+    {
+        return -1;
+    }
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(header) || read_full(fd, &header, sizeof(header), 0) != 0
+        || memcmp(header.magic, g_checkpoint_magic, sizeof(g_checkpoint_magic)) != 0
+        || (size_t)st.st_size != sizeof(header) + header.ip_count * sizeof(checkpoint_ip_t) + header.hit_count * sizeof(uint64_t)
+        || header.params_hash != filter_params_hash() || header.hit_count != (g_use_patterns ? g_pattern_count : 0))
+    {
+        if (g_verbose)
+        {
+            printf("检查点 %s 无效或过滤条件已改变, 从头开始统计\n", path);
+        }
+        close(fd);
+        return -1;
+    }
+
+    checkpoint_ip_t *ips = malloc(header.ip_count * sizeof(checkpoint_ip_t) + 1);
+    uint64_t *hits = calloc(header.hit_count + 1, sizeof(uint64_t));
+    if (ips == NULL || hits == NULL || read_full(fd, ips, header.ip_count * sizeof(checkpoint_ip_t), sizeof(header)) != 0
+        || read_full(fd, hits, header.hit_count * sizeof(uint64_t), sizeof(header) + header.ip_count * sizeof(checkpoint_ip_t)) != 0
+        || (header.hit_count > 0 && (stats->counts.hits = calloc(header.hit_count, sizeof(unsigned long))) == NULL))
+    {
+        free(ips);
+        free(hits);
+        close(fd);
+        return -1;
+    }
+    close(fd);
+    for (uint64_t i = 0; i < header.hit_count; i++)
+    {
+        stats->counts.hits[i] = hits[i];
+    }
+    free(hits);
+
+    stats->lines = header.lines;
+    memcpy(stats->counts.levels, header.levels, sizeof(header.levels));
+    for (uint64_t i = 0; i < header.ip_count; i++)
+    {
+        ip_table_add(&stats->counts.ips, ips[i].key, ips[i].count, ips[i].error);
+    }
+    if (header.approximate && !stats->counts.ips.approximate && stats->counts.ips.count > 0)
+    {
+        ip_table_start_approximate(&stats->counts.ips);
+    }
+    free(ips);
+
+    uint64_t head;
+    if (header.dev != (uint64_t)log_st->st_dev || header.ino != (uint64_t)log_st->st_ino
+        || header.offset > (uint64_t)log_st->st_size || file_head_hash(log_fd, header.offset, &head) != 0
+        || head != header.head_hash)
+    {
+        if (g_verbose)
+        {
+            printf("日志在上次处理之后被轮转或截断, 从头处理\n");
+        }
+        return 0;
+    }
+    *offset = header.offset;
+    if (g_verbose)
+    {
+        printf("从检查点继续: 已处理 %llu 字节, 本次新增 %llu 字节\n", (unsigned long long)header.offset,
+               (unsigned long long)(log_st->st_size - header.offset));
+    }
+    return 0;
+}
+
+// 和 save_index 一样先写临时文件再改名, 中途被杀掉也不会留下写了一半的检查点
+int save_checkpoint(const char *path, int log_fd, const stats_t *stats, size_t offset)
+{
+    checkpoint_header_t header;
+    struct stat log_st;
+    const ip_table_t *table = &stats->counts.ips;
+    checkpoint_ip_t *ips = malloc(table->count * sizeof(checkpoint_ip_t) + 1);
+    uint64_t *hits = calloc(g_pattern_count + 1, sizeof(uint64_t));
+    size_t tmp_len = strlen(path) + 32;
+    char *tmp = malloc(tmp_len);
+    int fd = -1;
+
+    memset(&header, 0, sizeof(header));
+    if (ips == NULL || hits == NULL || tmp == NULL || fstat(log_fd, &log_st) != 0
+        || file_head_hash(log_fd, offset, &header.head_hash) != 0)
+    {
+        free(ips);
+        free(hits);
+        free(tmp);
+        return -1;
+    }
+    memcpy(header.magic, g_checkpoint_magic, sizeof(g_checkpoint_magic));
+    header.params_hash = filter_params_hash();
+    header.dev = log_st.st_dev;
+    header.ino = log_st.st_ino;
+    header.offset = offset;
+    header.lines = stats->lines;
+    memcpy(header.levels, stats->counts.levels, sizeof(header.levels));
+    header.approximate = table->approximate;
+    for (size_t i = 0; table->slots != NULL && i <= table->mask; i++)
+    {
+        const ip_entry_t *entry = &table->slots[i];
+        if (entry->count != 0)
+        {
+            checkpoint_ip_t *ip = &ips[header.ip_count++];
+            ip->key = entry->key;
+            ip->count = entry->count;
+            ip->error = entry->error;
+        }
+    }
+    header.hit_count = g_use_patterns ? g_pattern_count : 0;
+    for (size_t i = 0; stats->counts.hits != NULL && i < header.hit_count; i++)
+    {
+        hits[i] = stats->counts.hits[i];
+    }
+
+    snprintf(tmp, tmp_len, "%s.%ld", path, (long)getpid());
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || write_all(fd, (const char *)&header, sizeof(header)) != 0
+        || write_all(fd, (const char *)ips, header.ip_count * sizeof(checkpoint_ip_t)) != 0
+        || write_all(fd, (const char *)hits, header.hit_count * sizeof(uint64_t)) != 0 || close(fd) != 0
+        || rename(tmp, path) != 0)
+    {
+        int saved_errno = errno;
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        unlink(tmp);
+        free(ips);
+        free(hits);
+        free(tmp);
+        errno = saved_errno;
+        return -1;
+    }
+    free(ips);
+    free(hits);
+    free(tmp);
+    return 0;
+}
+
+// sort -nr 的次序: 次数从多到少, 次数相同时按字符串倒序. b 的字符串已经格式化在 b_text 里
+static int ip_before(const ip_entry_t *a, const ip_entry_t *b, const char *b_text)
+{
+    char text[24];
+
+    if (a->count != b->count)
+    {
+        return a->count > b->count;
+    }
+    format_ip(a->key, text);
+    return strcmp(text, b_text) > 0;
+}
+
+// 一趟选出前 TOP_IPS 个, 不用把整张表排序
+void print_top_ips(const ip_table_t *table)
+{
+    const ip_entry_t *top[TOP_IPS];
+    char text[TOP_IPS][24];
+    size_t n = 0;
+
+    for (size_t i = 0; table->slots != NULL && i <= table->mask; i++)
+    {
+        const ip_entry_t *entry = &table->slots[i];
+        if (entry->count == 0 || (n == TOP_IPS && !ip_before(entry, top[n - 1], text[n - 1])))
+        {
+            continue;
+        }
+        size_t j = n < TOP_IPS ? n++ : TOP_IPS - 1;
+        while (j > 0 && ip_before(entry, top[j - 1], text[j - 1]))
+        {
+            top[j] = top[j - 1];
+            memcpy(text[j], text[j - 1], sizeof(text[j]));
+            j--;
+        }
+        top[j] = entry;
+        format_ip(entry->key, text[j]);
+    }
+
+    if (table->approximate)
+    {
+        uint64_t error = 0;
+        for (size_t i = 0; i < n; i++)
+        {
+            error = top[i]->error > error ? top[i]->error : error;
+        }
+        printf("(不同 IP 超过 %zu 个, 以下为 Space-Saving 估计值, 每个最多多算 %llu 次)\n", g_ip_limit,
+               (unsigned long long)error);
+    }
+    for (size_t i = 0; i < n; i++)
+    {
+        printf("%s: %llu\n", text[i], (unsigned long long)top[i]->count);
+    }
+}
+
+void print_stats(const stats_t *stats)
+{
+    printf("=== 日志统计信息 ===\n");
+    printf("日志文件:");
+    for (int i = 0; i < g_input_count; i++)
+    {
+        printf(" %s", g_inputs[i]);
+    }
+    printf("\n");
+    printf("总行数: %lu\n", stats->lines.total_lines);
+    printf("过滤后行数: %lu\n", stats->lines.filtered_lines);
+    if (g_keyword != NULL)
+    {
+        printf("关键字: %s\n", g_keyword);
+    }
+    if (g_use_patterns)
+    {
+        printf("模式数: %zu\n", g_pattern_count);
+    }
+    if (g_start_date != NULL)
+    {
+        printf("开始日期: %s\n", g_start_date);
+    }
+    if (g_end_date != NULL)
+    {
+        printf("结束日期: %s\n", g_end_date);
+    }
+    if (stats->lines.filtered_lines == 0)
+    {
+        return;
+    }
+
+    printf("\n=== 日志级别统计 ===\n");
+    for (int i = 0; i < LEVEL_COUNT; i++)
+    {
+        if (stats->counts.levels[i] > 0)
+        {
+            printf("%s: %lu\n", g_level_names[i], stats->counts.levels[i]);
+        }
+    }
+
+    printf("\n=== 时间范围 ===\n");
+    if (stats->lines.first_time[0] != '\0')
+    {
+        printf("最早时间: %s\n", stats->lines.first_time);
+    }
+    if (stats->lines.last_time[0] != '\0')
+    {
+        printf("最晚时间: %s\n", stats->lines.last_time);
+    }
+
+    printf("\n=== 前10个最常见的IP地址 ===\n");
+    print_top_ips(&stats->counts.ips);
+
+    if (g_use_patterns)
+    {
+        printf("\n=== 模式命中统计 ===\n");
+        for (size_t i = 0; i < g_pattern_count; i++)
+        {
+            printf("%s%s: %lu\n", g_patterns[i].kind == PATTERN_REGEX ? "正则 " : "", g_patterns[i].text,
+                   stats->counts.hits != NULL ? stats->counts.hits[i] : 0);
+        }
+    }
+}
+
+double now_seconds(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// 和 scan_block 一样整块查找、扩到行边界, 只数匹配的行, 不做过滤和统计
+unsigned long count_matching_lines(find_keyword_t find, const needle_t *needle, const char *buf, size_t len)
+{
+    const char *p = buf;
+    const char *end = buf + len;
+    unsigned long newlines = 0;
+    unsigned long matches = 0;
+
+    while (p < end)
+    {
+        const char *hit = find(needle, p, end, &newlines);
+        if (hit == NULL)
+        {
+            break;
+        }
+        const char *line_end = memchr(hit + needle->len, '\n', end - hit - needle->len);
+        matches++;
+        if (line_end == NULL)
+        {
+            break;
+        }
+        p = line_end + 1;
+    }
+    return matches;
+}
+
+// 跑一次 grep, 从管道读回 -c 的结果, 返回耗时 (秒), 失败返回 -1
+double run_grep(char *const argv[], unsigned long *count)
+{
+    posix_spawn_file_actions_t actions;
+    int pipe_fd[2];
+    char out[64];
+    size_t out_len = 0;
+    pid_t pid;
+    int status;
+
+    if (pipe(pipe_fd) != 0)
+    {
+        return -1;
+    }
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, pipe_fd[1], STDOUT_FILENO);
+    posix_spawn_file_actions_addclose(&actions, pipe_fd[0]);
+    posix_spawn_file_actions_addclose(&actions, pipe_fd[1]);
+
+    double start = now_seconds();
+    int err = posix_spawnp(&pid, argv[0], &actions, NULL, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    close(pipe_fd[1]);
+    if (err != 0)
+    {
+        close(pipe_fd[0]);
+        return -1;
+    }
+    for (;;)
+    {
+        ssize_t n = read(pipe_fd[0], out + out_len, sizeof(out) - 1 - out_len);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            break;
+        }
+        out_len += n;
+    }
+    close(pipe_fd[0]);
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+    {
+    }
+    double elapsed = now_seconds() - start;
+
+    // grep 没找到时退出码是 1, 只有 2 才是出错
+    if (!WIFEXITED(status) || WEXITSTATUS(status) > 1)
+    {
+        return -1;
+    }
+    out[out_len] = '\0';
+    *count = strtoul(out, NULL, 10);
+    return elapsed;
+}
+
+// 同一份映射用 1, 2, 4 ... 个线程完整扫描一遍 (统计, 不输出过滤结果), 看吞吐量随线程数怎么变.
+// 至少测到 4 个线程, CPU 不够时能看出超额订阅的开销
+void run_scaling_benchmark(const char *buf, size_t len, const char *keyword)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int max_threads = cpus > 4 ? (int)cpus : 4;
+    double mb = len / 1e6;
+
+    max_threads = max_threads > MAX_THREADS ? MAX_THREADS : max_threads;
+    for (int with_keyword = 0; with_keyword <= 1; with_keyword++)
+    {
+        if (with_keyword)
+        {
+            if (init_needle(&g_needle, keyword, 1) != 0)
+            {
+                perror("malloc");
+                return;
+            }
+            g_keyword = keyword;
+            printf("\n=== 多线程扫描 -k \"%s\" -S, %ld 个 CPU ===\n", keyword, cpus);
+        }
+        else
+        {
+            printf("\n=== 多线程扫描 -S (统计全部行), %ld 个 CPU ===\n", cpus);
+        }
+
+        double base = 0;
+        for (int threads = 1; threads <= max_threads; threads = threads * 2 > max_threads && threads < max_threads ? max_threads : threads * 2)
+        {
+            double best = 1e30;
+            int failed = 0;
+            for (int round = 0; round < BENCH_ROUNDS && !failed; round++)
+            {
+                stats_t stats;
+                memset(&stats, 0, sizeof(stats));
+                double start = now_seconds();
+                scan_range_t whole = { 0, len };
+                failed = scan_mapped(buf, &whole, 1, threads, &stats, NULL) != 0;
+                double elapsed = now_seconds() - start;
+                best = elapsed < best ? elapsed : best;
+                free_counts(&stats.counts);
+            }
+            if (failed)
+            {
+                perror("scan");
+                break;
+            }
+            if (threads == 1)
+            {
+                base = best;
+            }
+            printf("  %2d 线程  %9.1f MB/s  加速比 %.2f\n", threads, mb / best, base / best);
+        }
+
+        if (with_keyword)
+        {
+            free(g_needle.folded);
+            memset(&g_needle, 0, sizeof(g_needle));
+            g_keyword = NULL;
+        }
+    }
+}
+
+// --bench: 文件整个映射进内存, 分别用各个查找核和 grep -F / grep -F -i 数匹配的行
+int run_search_benchmark(const char *path, const char *keyword)
+{
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0 || fstat(fd, &st) != 0)
+    {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        return 1;
+    }
+    if (st.st_size == 0 || keyword[0] == '\0')
+    {
+        fprintf(stderr, "%s: 文件和关键字都不能为空\n", path);
+        close(fd);
+        return 1;
+    }
+    size_t len = st.st_size;
+    const char *buf = mmap(NULL, len, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    close(fd);
+    if (buf == MAP_FAILED)
+    {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return 1;
+    }
+
+    struct
+    {
+        const char *name;
+        find_keyword_t find;
+        int supported;
+    } kernels[] = {
+        { "scalar", find_keyword_scalar, 1 },
+#if defined(__x86_64__) || defined(__i386__)
+        { "sse2", find_keyword_sse2, __builtin_cpu_supports("popcnt") },
+        { "avx2", find_keyword_avx2, __builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt") },
+#endif
+    };
+    double mb = len / 1e6;
+
+    for (int fold = 0; fold <= 1; fold++)
+    {
+        needle_t needle;
+        unsigned long expected = 0;
+
+        if (init_needle(&needle, keyword, fold) != 0)
+        {
+            perror("malloc");
+            break;
+        }
+        printf("\n=== 关键字 \"%s\", %s, %.1f MB ===\n", keyword, fold ? "不区分大小写" : "区分大小写", mb);
+        for (size_t k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++)
+        {
+            if (!kernels[k].supported)
+            {
+                continue;
+            }
+            double best = 1e30;
+            unsigned long matches = 0;
+            for (int round = 0; round < BENCH_ROUNDS; round++)
+            {
+                double start = now_seconds();
+                matches = count_matching_lines(kernels[k].find, &needle, buf, len);
+                double elapsed = now_seconds() - start;
+                best = elapsed < best ? elapsed : best;
+            }
+            if (k == 0)
+            {
+                expected = matches;
+            }
+            printf("  %-12s %9.1f MB/s  %lu 行%s\n", kernels[k].name, mb / best, matches,
+                   matches == expected ? "" : "  (结果不一致!)");
+        }
+
+        char *grep_argv[8];
+        int argc = 0;
+        grep_argv[argc++] = "grep";
+        grep_argv[argc++] = "-c";
+        grep_argv[argc++] = "-F";
+        if (fold)
+        {
+            grep_argv[argc++] = "-i";
+        }
+        grep_argv[argc++] = "--";
+        grep_argv[argc++] = (char *)keyword;
+        grep_argv[argc++] = (char *)path;
+        grep_argv[argc] = NULL;
+        const char *grep_name = fold ? "grep -F -i" : "grep -F";
+        double best = 1e30;
+        unsigned long matches = 0;
+        for (int round = 0; round < BENCH_ROUNDS; round++)
+        {
+            double elapsed = run_grep(grep_argv, &matches);
+            if (elapsed < 0)
+            {
+                best = -1;
+                break;
+            }
+            best = elapsed < best ? elapsed : best;
+        }
+        if (best < 0)
+        {
+            printf("  %-12s 无法运行\n", grep_name);
+        }
+        else
+        {
+            printf("  %-12s %9.1f MB/s  %lu 行%s\n", grep_name, mb / best, matches,
+                   matches == expected ? "" : "  (结果不一致!)");
+        }
+        free(needle.folded);
+    }
+
+    run_scaling_benchmark(buf, len, keyword);
+    munmap((void *)buf, len);
+    return 0;
+}
+
+static void on_follow_signal(int sig)
+{
+    if (sig == SIGUSR1)
+    {
+        g_report = 1;
+    }
+    else
+    {
+        g_stop = 1;
+    }
+}
+
+// 从 *offset 读到文件末尾, 处理新写入的完整行. finish 为真时末尾的半行也处理 (日志已经被轮转走, 不会再写完了)
+int follow_read(const scan_ctx_t *ctx, int fd, size_t *offset, int finish)
+{
+    size_t partial = 0;
+
+    if (lseek(fd, *offset, SEEK_SET) < 0 || scan_file(ctx, fd, finish ? NULL : &partial) != 0)
+    {
+        return -1;
+    }
+    off_t end = lseek(fd, 0, SEEK_CUR);
+    if (end < 0 || (ctx->out != NULL && out_flush(ctx->out) != 0))
+    {
+        return -1;
+    }
+    *offset = end - partial;
+    return 0;
+}
+
+// 监视日志所在的目录, 日志被改名或者删除之后还能看到同名的新文件出现
+int watch_log_dir(int inotify_fd)
+{
+    const char *slash = strrchr(g_log_file, '/');
+    size_t len = slash == NULL ? 1 : slash == g_log_file ? 1 : (size_t)(slash - g_log_file);
+    char *dir = malloc(len + 1);
+
+    if (dir == NULL)
+    {
+        return -1;
+    }
+    memcpy(dir, slash == NULL ? "." : g_log_file, len);
+    dir[len] = '\0';
+    int wd = inotify_add_watch(inotify_fd, dir, IN_CREATE | IN_MOVED_TO);
+    free(dir);
+    return wd;
+}
+
+// -f: 等日志增长, 只处理新写入的完整行, 统计接着累计. 路径指向了新文件 (轮转) 时先把旧文件读完再换过去,
+// 文件变短 (截断) 时从头开始. 收到 SIGINT/SIGTERM 时打印累计的统计后返回, 失败返回 -1
+int follow_log(int fd, size_t offset, int out_fd)
+{
+    struct sigaction action;
+    sigset_t blocked, orig_mask;
+    scan_ctx_t ctx = { &g_stats.lines, &g_stats.counts, out_fd >= 0 ? &g_out : NULL, NULL, NULL };
+    double last_save = now_seconds();
+    int dirty = 0;
+    int ret = 0;
+
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = on_follow_signal;
+    sigemptyset(&blocked);
+    sigaddset(&blocked, SIGINT);
+    sigaddset(&blocked, SIGTERM);
+    sigaddset(&blocked, SIGUSR1);
+    // 信号只在 ppoll 等待时放进来, 不会漏掉, 也不会打断一半的处理
+    sigprocmask(SIG_BLOCK, &blocked, &orig_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    sigaction(SIGUSR1, &action, NULL);
+
+    g_out.fd = out_fd;
+    g_out.len = 0;
+    if (g_out.cap < OUT_FLUSH_SIZE && out_grow(&g_out, OUT_FLUSH_SIZE) != 0)
+    {
+        return -1;
+    }
+
+    // 没有 inotify (比如达到了监视数上限) 时只靠定时检查
+    int inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    int file_wd = -1;
+    if (inotify_fd >= 0)
+    {
+        file_wd = inotify_add_watch(inotify_fd, g_log_file, IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF);
+        watch_log_dir(inotify_fd);
+    }
+    else if (g_verbose)
+    {
+        printf("inotify 不可用, 每 %d 秒检查一次日志\n", FOLLOW_POLL_SECONDS);
+    }
+    fflush(stdout);
+
+    while (!g_stop)
+    {
+        struct stat fd_st, path_st;
+
+        if (fstat(fd, &fd_st) != 0)
+        {
+            ret = -1;
+            break;
+        }
+        if ((size_t)fd_st.st_size < offset)
+        {
+            if (g_verbose)
+            {
+                printf("日志被截断, 从头处理\n");
+                fflush(stdout);
+            }
+            offset = 0;
+        }
+        size_t before = offset;
+        if (follow_read(&ctx, fd, &offset, 0) != 0)
+        {
+            ret = -1;
+            break;
+        }
+        dirty |= offset != before;
+
+        // 路径指向了另一个文件: 旧文件读完 (包括最后的半行) 之后换过去, 新文件从头处理
+        if (stat(g_log_file, &path_st) == 0 && (path_st.st_dev != fd_st.st_dev || path_st.st_ino != fd_st.st_ino))
+        {
+            int new_fd = open(g_log_file, O_RDONLY);
+            if (new_fd >= 0)
+            {
+                if (follow_read(&ctx, fd, &offset, 1) != 0)
+                {
+                    close(new_fd);
+                    ret = -1;
+                    break;
+                }
+                close(fd);
+                fd = new_fd;
+                offset = 0;
+                dirty = 1;
+                if (inotify_fd >= 0)
+                {
+                    inotify_rm_watch(inotify_fd, file_wd);
+                    file_wd = inotify_add_watch(inotify_fd, g_log_file, IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF);
+                }
+                if (g_verbose)
+                {
+                    printf("日志已轮转, 开始跟踪新文件\n");
+                    fflush(stdout);
+                }
+                continue;
+            }
+        }
+
+        if (g_report)
+        {
+            g_report = 0;
+            printf("\n");
+            print_stats(&g_stats);
+            fflush(stdout);
+        }
+        if (dirty && g_checkpoint_file != NULL && now_seconds() - last_save >= CHECKPOINT_INTERVAL)
+        {
+            if (save_checkpoint(g_checkpoint_file, fd, &g_stats, offset) != 0)
+            {
+                fprintf(stderr, "%s: %s\n", g_checkpoint_file, strerror(errno));
+            }
+            last_save = now_seconds();
+            dirty = 0;
+        }
+
+        struct pollfd pfd = { inotify_fd, POLLIN, 0 };
+        struct timespec timeout = { FOLLOW_POLL_SECONDS, 0 };
+        if (ppoll(&pfd, inotify_fd >= 0 ? 1 : 0, &timeout, &orig_mask) > 0)
+        {
+            // 事件本身不用细看, 每次都重新检查一遍文件
+            char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+            while (read(inotify_fd, events, sizeof(events)) > 0)
+            {
+            }
+        }
+    }
+
+    if (inotify_fd >= 0)
+    {
+        close(inotify_fd);
+    }
+    if (ret == 0)
+    {
+        printf("\n");
+        print_stats(&g_stats);
+    }
+    if (g_checkpoint_file != NULL && save_checkpoint(g_checkpoint_file, fd, &g_stats, offset) != 0)
+    {
+        fprintf(stderr, "%s: %s\n", g_checkpoint_file, strerror(errno));
+        ret = -1;
+    }
+    close(fd);
+    sigprocmask(SIG_SETMASK, &orig_mask, NULL);
+    return ret;
+}
+
+// 开头是 gzip 的魔数
+int is_gzip(int fd)
+{
+    unsigned char magic[2];
+
+    return pread(fd, magic, sizeof(magic), 0) == sizeof(magic) && magic[0] == 0x1f && magic[1] == 0x8b;
+}
+
+// 解压线程: 按顺序把解出来的数据填进 GZ_SLOTS 个块里, 扫描线程用完一块才能再填.
+// 几个 gzip 成员首尾相接 (cat a.gz b.gz) 时接着往下解
+void *gz_worker(void *arg)
+{
+    gz_pipe_t *pipe = arg;
+    unsigned char in[GZ_INPUT_SIZE];
+    z_stream zs;
+    int eof = 0;
+    int in_member = 0;
+    int finished = 0;
+
+    memset(&zs, 0, sizeof(zs));
+    if (inflateInit2(&zs, 15 + 32) != Z_OK)
+    {
+        pipe->error = ENOMEM;
+        finished = 1;
+    }
+
+    for (long index = 0; !finished; index++)
+    {
+        gz_block_t *block = &pipe->blocks[index % GZ_SLOTS];
+
+        pthread_mutex_lock(&pipe->lock);
+        while (block->full && !pipe->cancel)
+        {
+            pthread_cond_wait(&pipe->cond, &pipe->lock);
+        }
+        finished = pipe->cancel;
+        pthread_mutex_unlock(&pipe->lock);
+
+        block->len = 0;
+        while (!finished && block->len < READ_BLOCK)
+        {
+            if (zs.avail_in == 0 && !eof)
+            {
+                ssize_t n = read(pipe->fd, in, sizeof(in));
+                if (n < 0 && errno == EINTR)
+                {
+                    continue;
+                }
+                if (n < 0)
+                {
+                    pipe->error = errno;
+                    finished = 1;
+                    break;
+                }
+                eof = n == 0;
+                zs.next_in = in;
+                zs.avail_in = n;
+            }
+            if (zs.avail_in == 0 && eof)
+            {
+                // 文件结束在一个成员的中间, 说明被截断了
+                pipe->error = in_member ? -1 : 0;
+                finished = 1;
+                break;
+            }
+
+            zs.next_out = (unsigned char *)block->data + block->len;
+            zs.avail_out = READ_BLOCK - block->len;
+            int ret = inflate(&zs, Z_NO_FLUSH);
+            block->len = READ_BLOCK - zs.avail_out;
+            in_member = ret != Z_STREAM_END;
+            if (ret == Z_STREAM_END)
+            {
+                inflateReset(&zs);
+            }
+            else if (ret != Z_OK && ret != Z_BUF_ERROR)
+            {
+                pipe->error = -1;
+                finished = 1;
+            }
+        }
+
+        pthread_mutex_lock(&pipe->lock);
+        block->full = 1;
+        block->last = finished;
+        pthread_cond_broadcast(&pipe->cond);
+        pthread_mutex_unlock(&pipe->lock);
+    }
+
+    inflateEnd(&zs);
+    return NULL;
+}
+
+// 把 [data, data + len) 追加到 carry 后面
+static int carry_append(out_buf_t *carry, const char *data, size_t len)
+{
+    if (len == 0)
+    {
+        return 0;
+    }
+    if (carry->len + len > carry->cap && out_grow(carry, len) != 0)
+    {
+        return -1;
+    }
+    memcpy(carry->data + carry->len, data, len);
+    carry->len += len;
+    return 0;
+}
+
+// 解压和扫描分在两个线程上. 每块里完整的行直接在块里扫描, 跨块的那一行拼到 carry 里再扫.
+// 返回 0; 失败返回 -1, errno 为 0 表示压缩数据损坏或不完整
+int scan_gzip(const scan_ctx_t *ctx, int fd)
+{
+    gz_pipe_t pipe;
+    pthread_t tid;
+    out_buf_t carry = { -1, NULL, 0, 0 };
+    int failed = 0;
+
+    memset(&pipe, 0, sizeof(pipe));
+    pipe.fd = fd;
+    for (int i = 0; i < GZ_SLOTS; i++)
+    {
+        pipe.blocks[i].data = malloc(READ_BLOCK);
+        failed |= pipe.blocks[i].data == NULL;
+    }
+    pthread_mutex_init(&pipe.lock, NULL);
+    pthread_cond_init(&pipe.cond, NULL);
+    int create_error = failed ? ENOMEM : pthread_create(&tid, NULL, gz_worker, &pipe);
+    if (create_error != 0)
+    {
+        for (int i = 0; i < GZ_SLOTS; i++)
+        {
+            free(pipe.blocks[i].data);
+        }
+        pthread_mutex_destroy(&pipe.lock);
+        pthread_cond_destroy(&pipe.cond);
+        errno = create_error;
+        return -1;
+    }
+
+    for (long index = 0; !failed; index++)
+    {
+        gz_block_t *block = &pipe.blocks[index % GZ_SLOTS];
+
+        pthread_mutex_lock(&pipe.lock);
+        while (!block->full)
+        {
+            pthread_cond_wait(&pipe.cond, &pipe.lock);
+        }
+        pthread_mutex_unlock(&pipe.lock);
+
+        const char *p = block->data;
+        const char *end = block->data + block->len;
+        if (carry.len > 0)
+        {
+            const char *newline = memchr(p, '\n', end - p);
+            const char *stop = newline != NULL ? newline + 1 : end;
+            failed = carry_append(&carry, p, stop - p) != 0
+                     || (newline != NULL && scan_block(ctx, carry.data, carry.len) != 0);
+            carry.len = newline != NULL ? 0 : carry.len;
+            p = stop;
+        }
+        const char *last = p < end ? memrchr(p, '\n', end - p) : NULL;
+        if (!failed && last != NULL)
+        {
+            failed = scan_block(ctx, p, last + 1 - p) != 0;
+            p = last + 1;
+        }
+        if (!failed)
+        {
+            failed = carry_append(&carry, p, end - p) != 0;
+        }
+
+        pthread_mutex_lock(&pipe.lock);
+        block->full = 0;
+        int done = block->last;
+        pipe.cancel = failed;
+        pthread_cond_broadcast(&pipe.cond);
+        pthread_mutex_unlock(&pipe.lock);
+        if (done)
+        {
+            break;
+        }
+    }
+    pthread_join(tid, NULL);
+
+    // 最后一行没有换行符
+    if (!failed && carry.len > 0)
+    {
+        failed = scan_block(ctx, carry.data, carry.len) != 0;
+    }
+    for (int i = 0; i < GZ_SLOTS; i++)
+    {
+        free(pipe.blocks[i].data);
+    }
+    free(carry.data);
+    pthread_mutex_destroy(&pipe.lock);
+    pthread_cond_destroy(&pipe.cond);
+    if (failed)
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+    if (pipe.error != 0)
+    {
+        errno = pipe.error > 0 ? pipe.error : 0;
+        return -1;
+    }
+    return 0;
+}
+
+// 打开并检查日志文件, 出错时打印和原脚本一样的提示并返回 -1
+int open_log(const char *path, struct stat *st)
+{
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0 && errno != EACCES)
+    {
+        fprintf(stderr, "错误: 日志文件 '%s' 不存在\n", path);
+        return -1;
+    }
+    if (fd >= 0 && (fstat(fd, st) != 0 || !S_ISREG(st->st_mode)))
+    {
+        fprintf(stderr, "错误: 日志文件 '%s' 不存在\n", path);
+        close(fd);
+        return -1;
+    }
+    if (fd < 0)
+    {
+        fprintf(stderr, "错误: 日志文件 '%s' 无法读取\n", path);
+        return -1;
+    }
+    return fd;
+}
+
+void *input_worker(void *arg)
+{
+    input_job_t *job = arg;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&job->lock);
+        int i = job->next++;
+        pthread_mutex_unlock(&job->lock);
+        if (i >= job->count)
+        {
+            break;
+        }
+
+        input_t *input = &job->inputs[i];
+        scan_ctx_t ctx = { &input->stats.lines, &input->stats.counts, g_stats_only ? NULL : &input->out, NULL, NULL };
+        int fd = open(input->path, O_RDONLY);
+        int ret = fd < 0 ? -1 : is_gzip(fd) ? scan_gzip(&ctx, fd) : scan_file(&ctx, fd, NULL);
+        if (ret == 0 && !g_stats_only)
+        {
+            ret = out_flush(&input->out);
+        }
+        input->error = ret != 0 ? (errno != 0 ? errno : -1) : 0;
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+    }
+    return NULL;
+}
+
+// 按第一行过滤结果的时间排序, 没有时间的排在前面, 时间相同时保持命令行上的顺序
+static int compare_inputs(const void *a, const void *b)
+{
+    const input_t *x = a;
+    const input_t *y = b;
+    int diff = strcmp(x->stats.lines.first_time, y->stats.lines.first_time);
+
+    return diff != 0 ? diff : x->order - y->order;
+}
+
+// 过滤结果先写进一个已经 unlink 的临时文件, 内存里只留一个 OUT_FLUSH_SIZE 的缓冲区
+int spool_open(void)
+{
+    const char *dir = getenv("TMPDIR");
+    char path[PATH_MAX];
+
+    if (dir == NULL || dir[0] == '\0')
+    {
+        dir = "/tmp";
+    }
+    if (snprintf(path, sizeof(path), "%s/log_filter.XXXXXX", dir) >= (int)sizeof(path))
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    int fd = mkstemp(path);
+    if (fd >= 0)
+    {
+        unlink(path);
+    }
+    return fd;
+}
+
+// 保证 cursor->p 开头有一整行, 或者文件已经读完 (p == end): 缓冲区里找不到换行符就把剩下的挪到开头再读一块,
+// 一行比缓冲区还长时才把缓冲区加倍
+static int merge_cursor_fill(merge_cursor_t *cursor)
+{
+    for (;;)
+    {
+        size_t left = cursor->end - cursor->p;
+        if (left > 0 && memchr(cursor->p, '\n', left) != NULL)
+        {
+            return 0;
+        }
+        if (cursor->data == NULL || left == cursor->cap)
+        {
+            size_t cap = cursor->cap ? cursor->cap * 2 : MERGE_BLOCK;
+            char *data = malloc(cap);
+            if (data == NULL)
+            {
+                return -1;
+            }
+            memcpy(data, cursor->p, left);
+            free(cursor->data);
+            cursor->data = data;
+            cursor->cap = cap;
+        }
+        else
+        {
+            memmove(cursor->data, cursor->p, left);
+        }
+        cursor->p = cursor->data;
+        cursor->end = cursor->data + left;
+
+        ssize_t n = read(cursor->fd, cursor->data + left, cursor->cap - left);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n < 0)
+        {
+            return -1;
+        }
+        if (n == 0)
+        {
+            // 过滤结果每行都补了换行符, 读完时缓冲区里不会剩半行
+            cursor->end = cursor->p;
+            return 0;
+        }
+        cursor->end += n;
+    }
+}
+
+// 只剩这一个输入有行: 缓冲区里的和文件里剩下的原样拷到 fd
+static int merge_cursor_drain(merge_cursor_t *cursor, int fd)
+{
+    if (write_all(fd, cursor->p, cursor->end - cursor->p) != 0)
+    {
+        return -1;
+    }
+    for (;;)
+    {
+        ssize_t n = read(cursor->fd, cursor->data, cursor->cap);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            return n < 0 ? -1 : 0;
+        }
+        if (write_all(fd, cursor->data, n) != 0)
+        {
+            return -1;
+        }
+    }
+}
+
+// 读出 cursor 当前这一行的时间. 没有合法时间戳的行 (比如异常堆栈) 沿用上一行的, 归并时跟着上一行走
+static void merge_cursor_key(merge_cursor_t *cursor)
+{
+    char time[TIME_LEN];
+    long long seconds;
+
+    if (cursor->p >= cursor->end)
+    {
+        return;
+    }
+    const char *newline = memchr(cursor->p, '\n', cursor->end - cursor->p);
+    if (extract_timestamp(cursor->p, newline - cursor->p, time) && time_to_seconds(time, &seconds) == 0)
+    {
+        cursor->key = seconds;
+    }
+}
+
+// 各个文件的过滤结果 (临时文件) 按时间归并写到 fd. 时间相同的行按 inputs 的顺序, 只剩一个文件有行时直接整段拷.
+// 每个输入只占一块 MERGE_BLOCK 的读缓冲区, 内存和过滤结果有多少无关
+int merge_outputs(const input_t *inputs, int count, int fd)
+{
+    merge_cursor_t *cursors = calloc(count, sizeof(merge_cursor_t));
+    out_buf_t out = { fd, malloc(OUT_FLUSH_SIZE), 0, OUT_FLUSH_SIZE };
+    int ret = 0;
+
+    if (cursors == NULL || out.data == NULL)
+    {
+        free(cursors);
+        free(out.data);
+        return -1;
+    }
+    for (int i = 0; ret == 0 && i < count; i++)
+    {
+        cursors[i].fd = inputs[i].out.fd;
+        cursors[i].key = LLONG_MIN;
+        if (lseek(cursors[i].fd, 0, SEEK_SET) < 0 || merge_cursor_fill(&cursors[i]) != 0)
+        {
+            ret = -1;
+        }
+        merge_cursor_key(&cursors[i]);
+    }
+
+    while (ret == 0)
+    {
+        int best = -1;
+        int active = 0;
+        for (int i = 0; i < count; i++)
+        {
+            if (cursors[i].p < cursors[i].end)
+            {
+                active++;
+                best = best < 0 || cursors[i].key < cursors[best].key ? i : best;
+            }
+        }
+        if (active <= 1)
+        {
+            if (out_flush(&out) != 0 || (best >= 0 && merge_cursor_drain(&cursors[best], fd) != 0))
+            {
+                ret = -1;
+            }
+            break;
+        }
+
+        merge_cursor_t *cursor = &cursors[best];
+        const char *newline = memchr(cursor->p, '\n', cursor->end - cursor->p);
+        if (out_append_line(&out, cursor->p, newline - cursor->p) != 0)
+        {
+            ret = -1;
+            break;
+        }
+        cursor->p = newline + 1;
+        if (merge_cursor_fill(cursor) != 0)
+        {
+            ret = -1;
+            break;
+        }
+        merge_cursor_key(cursor);
+    }
+    for (int i = 0; i < count; i++)
+    {
+        free(cursors[i].data);
+    }
+    free(cursors);
+    free(out.data);
+    return ret;
+}
+
+// 多个文件或者 gzip 压缩的日志: 每个文件一个线程, 压缩的文件再配一个解压线程, 解出来的数据只在内存里.
+// 统计要先打印, 所以过滤结果各自写进临时文件, 统计打印完之后按时间归并输出. 只有一个输入而且 -o 指向
+// 别的文件时不用等, 扫描时直接写过去
+int filter_inputs(void)
+{
+    input_job_t job;
+    pthread_t tids[MAX_THREADS];
+    struct stat out_st;
+    int started = 0;
+    int create_error = 0;
+    int exit_code = 0;
+    int output_is_input = 0;
+    int direct = 0;
+    int direct_fd = -1;
+
+    if (g_follow || g_checkpoint_file != NULL || g_use_index)
+    {
+        fprintf(stderr, "错误: -f、-C 和 -I 只支持单个未压缩的日志文件\n");
+        return 1;
+    }
+
+    memset(&job, 0, sizeof(job));
+    job.count = g_input_count;
+    job.inputs = calloc(job.count, sizeof(input_t));
+    if (job.inputs == NULL)
+    {
+        perror("malloc");
+        return 1;
+    }
+    int have_out_st = g_output_file != NULL && stat(g_output_file, &out_st) == 0;
+    for (int i = 0; i < job.count; i++)
+    {
+        struct stat st;
+        int fd = open_log(g_inputs[i], &st);
+        if (fd < 0)
+        {
+            free(job.inputs);
+            return 1;
+        }
+        close(fd);
+        output_is_input |= have_out_st && st.st_dev == out_st.st_dev && st.st_ino == out_st.st_ino;
+        job.inputs[i].path = g_inputs[i];
+        job.inputs[i].order = i;
+        job.inputs[i].out.fd = -1;
+    }
+
+    // -o 是输入之一时不能提前截断, 和多个输入一样先写临时文件
+    if (!g_stats_only && job.count == 1 && g_output_file != NULL && !output_is_input)
+    {
+        direct_fd = open(g_output_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (direct_fd < 0)
+        {
+            fprintf(stderr, "%s: %s\n", g_output_file, strerror(errno));
+            free(job.inputs);
+            return 1;
+        }
+        direct = 1;
+    }
+    for (int i = 0; !g_stats_only && i < job.count; i++)
+    {
+        out_buf_t *out = &job.inputs[i].out;
+        out->fd = direct ? direct_fd : spool_open();
+        out->data = malloc(OUT_FLUSH_SIZE);
+        out->cap = OUT_FLUSH_SIZE;
+        if (out->fd < 0 || out->data == NULL)
+        {
+            perror(out->fd < 0 ? "mkstemp" : "malloc");
+            exit_code = 1;
+            break;
+        }
+    }
+
+    pthread_mutex_init(&job.lock, NULL);
+    int threads = g_threads < job.count ? g_threads : job.count;
+    threads = threads > MAX_THREADS ? MAX_THREADS : threads;
+    for (int t = 0; exit_code == 0 && t < threads; t++)
+    {
+        create_error = pthread_create(&tids[started], NULL, input_worker, &job);
+        started += create_error == 0;
+    }
+    if (exit_code == 0 && started == 0)
+    {
+        fprintf(stderr, "pthread_create: %s\n", strerror(create_error));
+        exit_code = 1;
+    }
+    for (int t = 0; t < started; t++)
+    {
+        pthread_join(tids[t], NULL);
+    }
+    pthread_mutex_destroy(&job.lock);
+
+    for (int i = 0; exit_code == 0 && i < job.count; i++)
+    {
+        input_t *input = &job.inputs[i];
+        if (input->error != 0)
+        {
+            fprintf(stderr, "%s: %s\n", input->path, input->error > 0 ? strerror(input->error) : "压缩数据损坏或不完整");
+            exit_code = 1;
+        }
+    }
+
+    if (exit_code == 0)
+    {
+        qsort(job.inputs, job.count, sizeof(input_t), compare_inputs);
+        for (int i = 0; i < job.count; i++)
+        {
+            merge_line_stats(&g_stats.lines, &job.inputs[i].stats.lines);
+            merge_counts(&g_stats.counts, &job.inputs[i].stats.counts);
+        }
+        print_stats(&g_stats);
+    }
+    if (exit_code == 0 && !g_stats_only)
+    {
+        printf("\n=== 过滤结果 ===\n");
+        int out_fd = direct_fd;
+        if (out_fd < 0 && g_output_file != NULL)
+        {
+            out_fd = open(g_output_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        }
+        else if (out_fd < 0)
+        {
+            printf("\n");
+            fflush(stdout);
+            out_fd = STDOUT_FILENO;
+        }
+        direct_fd = -1;
+        if (out_fd < 0 || (!direct && merge_outputs(job.inputs, job.count, out_fd) != 0)
+            || (out_fd != STDOUT_FILENO && close(out_fd) != 0))
+        {
+            fprintf(stderr, "%s: %s\n", g_output_file != NULL ? g_output_file : "write", strerror(errno));
+            exit_code = 1;
+        }
+        if (g_output_file != NULL)
+        {
+            printf("结果已保存到: %s\n", g_output_file);
+        }
+    }
+    if (exit_code == 0 && g_verbose)
+    {
+        printf("处理完成!\n");
+    }
+
+    if (direct_fd >= 0)
+    {
+        close(direct_fd);
+    }
+    for (int i = 0; i < job.count; i++)
+    {
+        if (!direct && job.inputs[i].out.fd >= 0)
+        {
+            close(job.inputs[i].out.fd);
+        }
+        free(job.inputs[i].out.data);
+        free_counts(&job.inputs[i].stats.counts);
+    }
+    free(job.inputs);
+    free_counts(&g_stats.counts);
+    if (fflush(stdout) != 0)
+    {
+        exit_code = 1;
+    }
+    return exit_code;
+}
+
+int parse_args(int argc, char *argv[])
+{
+    g_inputs = calloc(argc, sizeof(char *));
+    g_pattern_args = calloc(argc, sizeof(pattern_t));
+    if (g_inputs == NULL || g_pattern_args == NULL)
+    {
+        perror("malloc");
+        return -1;
+    }
+    for (int i = 1; i < argc; i++)
+    {
+        const char *arg = argv[i];
+        if (arg[0] != '-')
+        {
+            g_inputs[g_input_count++] = arg;
+            g_log_file = g_inputs[0];
+            continue;
+        }
+
+        const char **value = NULL;
+        if (strcmp(arg, "-k") == 0 || strcmp(arg, "-K") == 0 || strcmp(arg, "-r") == 0)
+        {
+            if (i + 1 >= argc || argv[i + 1][0] == '\0')
+            {
+                fprintf(stderr, "错误: %s 需要参数\n", arg);
+                return -1;
+            }
+            pattern_t *pattern = &g_pattern_args[g_pattern_arg_count++];
+            pattern->text = argv[++i];
+            pattern->kind = arg[1] == 'k' ? PATTERN_LITERAL : arg[1] == 'K' ? PATTERN_FILE : PATTERN_REGEX;
+        }
+        else if (strcmp(arg, "-s") == 0)
+        {
+            value = &g_start_date;
+        }
+        else if (strcmp(arg, "-e") == 0)
+        {
+            value = &g_end_date;
+        }
+        else if (strcmp(arg, "-o") == 0)
+        {
+            value = &g_output_file;
+        }
+        else if (strcmp(arg, "-c") == 0)
+        {
+            g_case_sensitive = 1;
+        }
+        else if (strcmp(arg, "-S") == 0)
+        {
+            g_stats_only = 1;
+        }
+        else if (strcmp(arg, "-v") == 0)
+        {
+            g_verbose = 1;
+        }
+        else if (strcmp(arg, "-I") == 0)
+        {
+            g_use_index = 1;
+        }
+        else if (strcmp(arg, "-f") == 0)
+        {
+            g_follow = 1;
+        }
+        else if (strcmp(arg, "-C") == 0)
+        {
+            value = &g_checkpoint_file;
+        }
+        else if (strcmp(arg, "-t") == 0)
+        {
+            if (i + 1 >= argc || (g_threads = atoi(argv[i + 1])) <= 0)
+            {
+                fprintf(stderr, "错误: -t 需要一个正整数\n");
+                return -1;
+            }
+            i++;
+        }
+        else if (strcmp(arg, "-m") == 0)
+        {
+            char *end = NULL;
+            if (i + 1 < argc && is_digit(argv[i + 1][0]))
+            {
+                g_ip_limit = strtoul(argv[i + 1], &end, 10);
+            }
+            if (end == NULL || *end != '\0')
+            {
+                fprintf(stderr, "错误: -m 需要一个非负整数\n");
+                return -1;
+            }
+            i++;
+        }
+        else if (strcmp(arg, "-h") == 0)
+        {
+            show_help();
+            exit(0);
+        }
+        else
+        {
+            fprintf(stderr, "错误: 未知选项 %s\n", arg);
+            show_help();
+            return -1;
+        }
+
+        if (value != NULL)
+        {
+            if (i + 1 >= argc || argv[i + 1][0] == '\0')
+            {
+                fprintf(stderr, "错误: %s 需要参数\n", arg);
+                return -1;
+            }
+            *value = argv[++i];
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    struct stat st;
+    range_list_t runs = { NULL, 0, 0 };
+    int out_fd = -1;
+    int exit_code = 0;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    g_program = argv[0];
+    g_threads = cpus > 0 ? (int)cpus : 1;
+    for (int c = 0; c < 256; c++)
+    {
+        g_fold[c] = (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+    }
+    init_levels();
+    init_search();
+
+    if (argc > 1 && strcmp(argv[1], "--bench") == 0)
+    {
+        if (argc < 3)
+        {
+            fprintf(stderr, "用法: %s --bench <日志文件> [关键字]\n", g_program);
+            return 1;
+        }
+        return run_search_benchmark(argv[2], argc > 3 ? argv[3] : "ERROR");
+    }
+
+    if (parse_args(argc, argv) != 0)
+    {
+        return 1;
+    }
+    if (g_log_file == NULL)
+    {
+        fprintf(stderr, "错误: 请指定日志文件\n");
+        show_help();
+        return 1;
+    }
+
+    int fd = open_log(g_log_file, &st);
+    if (fd < 0)
+    {
+        return 1;
+    }
+
+    if (g_verbose)
+    {
+        printf("开始过滤日志...\n");
+    }
+    if (init_patterns() != 0)
+    {
+        close(fd);
+        return 1;
+    }
+    if (g_keyword != NULL && init_needle(&g_needle, g_keyword, !g_case_sensitive) != 0)
+    {
+        perror("malloc");
+        close(fd);
+        return 1;
+    }
+
+    if (g_start_date != NULL && parse_date_arg(g_start_date, &g_start_time) != 0)
+    {
+        fprintf(stderr, "错误: 开始日期格式无效\n");
+        close(fd);
+        return 1;
+    }
+    if (g_end_date != NULL && parse_date_arg(g_end_date, &g_end_time) != 0)
+    {
+        fprintf(stderr, "错误: 结束日期格式无效\n");
+        close(fd);
+        return 1;
+    }
+
+    // 多个文件或者 gzip 压缩的日志走另一条路
+    if (g_input_count > 1 || is_gzip(fd))
+    {
+        close(fd);
+        exit_code = filter_inputs();
+        free(g_needle.folded);
+        free_patterns();
+        free(g_pattern_args);
+        free(g_inputs);
+        return exit_code;
+    }
+
+    // -f 和 -C 只处理完整的行, 末尾没写完的半行留到下次; -C 从检查点记着的位置继续, 统计接着累计
+    int incremental = g_follow || g_checkpoint_file != NULL;
+    size_t offset = 0;
+    if (g_checkpoint_file != NULL)
+    {
+        load_checkpoint(g_checkpoint_file, fd, &st, &g_stats, &offset);
+    }
+
+    // 过滤结果要等统计信息打印完再输出. -o 的目标不是日志文件本身时现在就打开, 尽早报错; -C 时追加到后面
+    int same_file = 0;
+    if (!g_stats_only && g_output_file != NULL)
+    {
+        struct stat out_st;
+        same_file = stat(g_output_file, &out_st) == 0 && out_st.st_dev == st.st_dev && out_st.st_ino == st.st_ino;
+        if (same_file && incremental)
+        {
+            fprintf(stderr, "错误: -f 和 -C 不能把结果写回日志文件本身\n");
+            close(fd);
+            return 1;
+        }
+        if (!same_file)
+        {
+            int mode = g_checkpoint_file != NULL ? O_APPEND : O_TRUNC;
+            out_fd = open(g_output_file, O_WRONLY | O_CREAT | mode, 0644);
+            if (out_fd < 0)
+            {
+                fprintf(stderr, "%s: %s\n", g_output_file, strerror(errno));
+                close(fd);
+                return 1;
+            }
+        }
+    }
+
+    // 普通文件映射进来多线程扫描, 过滤结果只记位置, 最后直接从映射里写出去.
+    // 映射失败 (比如 32 位下文件太大) 才退回按块读, 过滤结果拷在内存里
+    size_t scan_end = st.st_size;
+    void *map = st.st_size > 0 ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    if (map != MAP_FAILED)
+    {
+        if (incremental)
+        {
+            const char *newline = memrchr((const char *)map + offset, '\n', st.st_size - offset);
+            scan_end = newline != NULL ? (size_t)(newline + 1 - (const char *)map) : offset;
+        }
+        scan_range_t whole = { offset, scan_end };
+        scan_range_t *ranges = &whole;
+        int range_count = 1;
+
+        madvise(map, st.st_size, MADV_SEQUENTIAL);
+        // 索引跳过的块要把行数记进总行数, 只有从头开始时才能用
+        if (g_use_index && offset == 0)
+        {
+            ranges = plan_with_index(map, st.st_size, &range_count, &g_stats.lines.total_lines);
+            if (ranges == NULL)
+            {
+                ranges = &whole;
+                range_count = 1;
+            }
+            // 索引总是扫到文件末尾, 末尾的半行要去掉
+            while (range_count > 0 && ranges[range_count - 1].begin >= scan_end)
+            {
+                range_count--;
+            }
+            if (range_count > 0 && ranges[range_count - 1].end > scan_end)
+            {
+                ranges[range_count - 1].end = scan_end;
+            }
+        }
+        if (scan_mapped(map, ranges, range_count, g_threads, &g_stats, g_stats_only ? NULL : &runs) != 0)
+        {
+            fprintf(stderr, "%s: %s\n", g_log_file, strerror(errno));
+            exit_code = 1;
+        }
+        if (ranges != &whole)
+        {
+            free(ranges);
+        }
+        // 要覆盖日志文件本身时先把结果拷出来, 截断之后映射就不能再读了
+        for (size_t i = 0; exit_code == 0 && same_file && i < runs.count; i++)
+        {
+            const scan_range_t *run = &runs.items[i];
+            if (out_append_line(&g_out, (const char *)map + run->begin, run->end - run->begin) != 0)
+            {
+                perror("malloc");
+                exit_code = 1;
+            }
+        }
+    }
+    else
+    {
+        scan_ctx_t ctx = { &g_stats.lines, &g_stats.counts, g_stats_only ? NULL : &g_out, NULL, NULL };
+        size_t partial = 0;
+        off_t end;
+        if (lseek(fd, offset, SEEK_SET) < 0 || scan_file(&ctx, fd, incremental ? &partial : NULL) != 0
+            || (end = lseek(fd, 0, SEEK_CUR)) < 0)
+        {
+            fprintf(stderr, "%s: %s\n", g_log_file, strerror(errno));
+            exit_code = 1;
+        }
+        else
+        {
+            scan_end = end - partial;
+        }
+    }
+
+    if (exit_code == 0)
+    {
+        print_stats(&g_stats);
+        if (!g_stats_only)
+        {
+            printf("\n=== 过滤结果 ===\n");
+            if (g_output_file == NULL)
+            {
+                printf("\n");
+                fflush(stdout);
+                out_fd = STDOUT_FILENO;
+            }
+            else if (same_file)
+            {
+                out_fd = open(g_output_file, O_WRONLY | O_TRUNC);
+            }
+
+            int ret = -1;
+            if (out_fd >= 0 && map != MAP_FAILED && !same_file)
+            {
+                ret = write_runs(out_fd, map, st.st_size, &runs);
+            }
+            else if (out_fd >= 0)
+            {
+                ret = write_all(out_fd, g_out.data, g_out.len);
+            }
+            if (ret != 0)
+            {
+                fprintf(stderr, "%s: %s\n", g_output_file != NULL ? g_output_file : "write", strerror(errno));
+                exit_code = 1;
+            }
+            if (g_output_file != NULL)
+            {
+                printf("结果已保存到: %s\n", g_output_file);
+            }
+        }
+        if (exit_code == 0 && g_checkpoint_file != NULL && save_checkpoint(g_checkpoint_file, fd, &g_stats, scan_end) != 0)
+        {
+            fprintf(stderr, "%s: %s\n", g_checkpoint_file, strerror(errno));
+            exit_code = 1;
+        }
+    }
+    if (map != MAP_FAILED)
+    {
+        munmap(map, st.st_size);
+    }
+
+    // follow_log 接管 fd, 结束时关掉
+    if (exit_code == 0 && g_follow)
+    {
+        fflush(stdout);
+        if (follow_log(fd, scan_end, g_stats_only ? -1 : out_fd) != 0)
+        {
+            fprintf(stderr, "%s: %s\n", g_log_file, strerror(errno));
+            exit_code = 1;
+        }
+    }
+    else
+    {
+        close(fd);
+    }
+    if (exit_code == 0 && g_verbose)
+    {
+        printf("处理完成!\n");
+    }
+    if (out_fd == STDOUT_FILENO)
+    {
+        out_fd = -1;
+    }
+
+    if (out_fd >= 0 && close(out_fd) != 0)
+    {
+        fprintf(stderr, "%s: %s\n", g_output_file, strerror(errno));
+        exit_code = 1;
+    }
+    free(runs.items);
+    free(g_out.data);
+    free(g_needle.folded);
+    free_patterns();
+    free(g_pattern_args);
+    free(g_inputs);
+    free_counts(&g_stats.counts);
+    if (fflush(stdout) != 0)
+    {
+        exit_code = 1;
+    }
+    return exit_code;
+}
@@ -1,59 +1,1420 @@
+#define _GNU_SOURCE
 #include<stdio.h>
 #include<stdlib.h>
+#include<stdint.h>
+#include<string.h>
+#include<errno.h>
+#include<fcntl.h>
+#include<unistd.h>
+#include<time.h>
+#include<pthread.h>
+#include<sys/stat.h>
+#include<sys/mman.h>
+#include<sys/sendfile.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include<immintrin.h>
+#endif
+#ifndef NO_IO_URING
+#include<sys/syscall.h>
+#include<linux/io_uring.h>
+#endif
 
-#define BUFFER_SIZE 1024
+// 回退路径使用的缓冲区: 128 KB, 按页对齐
+#define BUFFER_SIZE (128 * 1024)
+#define BUFFER_ALIGN 4096
+
+// 每次零拷贝系统调用最多搬运的字节数
+#define CHUNK_SIZE (1 << 30)
+
+// 流式模式 (-S) 的块大小: 从 128 KB 开始, 读满一块就翻倍, 最大 8 MB
+#define STREAM_MIN_CHUNK (128 * 1024)
+#define STREAM_MAX_CHUNK (8 * 1024 * 1024)
+
+// 预读模式 (-p K): 每个槽位预读文件开头的字节数, 以及兜底线程池的线程数上限
+#define PREFETCH_BUF_SIZE (64 * 1024)
+#define PREFETCH_MAX_THREADS 8
+
+// 行处理模式 (-n -b -s -A) 的输出缓冲区
+#define LINE_OUT_SIZE (256 * 1024)
+// 不需要改动的连续字节超过这个长度就不再拷进输出缓冲区
+#define LINE_DIRECT_SIZE (16 * 1024)
+// 行号缓冲区: 最多 20 位数字 + '\t', LINE_NUM_LAST 是个位所在下标
+#define LINE_NUM_SIZE 24
+#define LINE_NUM_LAST (LINE_NUM_SIZE - 2)
+
+typedef enum {
+    OUT_OTHER,      // 终端等: 只能走 read/write
+    OUT_REGULAR,    // 普通文件: copy_file_range
+    OUT_SOCKET,     // socket: sendfile
+    OUT_PIPE        // 管道: splice
+} output_kind_t;
+
+// 双缓冲流: 读线程填一块, 主线程写另一块
+typedef struct {
+    int fd;
+    int direct;
+    int drop_cache;
+    char* buf[2];
+    size_t len[2];
+    int full[2];
+    size_t chunk;
+    size_t max_chunk;
+    off_t start_offset;
+    off_t offset;
+    int read_errno;
+    int stop;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+} stream_t;
+
+typedef enum {
+    SLOT_EMPTY,
+    SLOT_OPENING,
+    SLOT_READING,
+    SLOT_READY
+} slot_state_t;
+
+// 预读槽位: 第 i 个参数放在 slots[i % K]
+typedef struct {
+    const char* name;
+    int is_stdin;
+    int fd;
+    int open_errno;
+    int read_errno;
+    char* buf;
+    size_t len;
+    slot_state_t state;
+} prefetch_slot_t;
+
+typedef struct {
+    char** files;
+    int nfiles;
+    int depth;
+    prefetch_slot_t* slots;
+
+    // 线程池兜底路径使用
+    int next_claim;
+    int next_emit;
+    int stop;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+} prefetch_t;
+
+#ifndef NO_IO_URING
+typedef struct {
+    int fd;
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_sqe* sqes;
+    struct io_uring_cqe* cqes;
+    void* sq_ring;
+    void* cq_ring;
+    size_t sq_ring_size;
+    size_t cq_ring_size;
+    size_t sqes_size;
+    unsigned to_submit;
+} uring_t;
+#endif
+
+// 行处理状态跨块、跨文件保持, 和 GNU cat 一样行号连续
+typedef struct {
+    char num[LINE_NUM_SIZE];
+    char* num_start;
+    int at_line_start;
+    int blank_run;
+    char* out;
+    size_t out_len;
+} line_state_t;
+
+static output_kind_t g_output_kind = OUT_OTHER;
+static char* g_buffer = NULL;
+static unsigned long long g_copied = 0;
+
+static int g_stream_mode = 0;
+static int g_direct_io = 0;
+static int g_print_stats = 0;
+static int g_prefetch_depth = 0;
+
+static int g_number_lines = 0;
+static int g_number_nonblank = 0;
+static int g_squeeze_blank = 0;
+static int g_show_all = 0;
+static int g_line_mode = 0;
+static line_state_t g_line = { .at_line_start = 1 };
 
 void print_usage(const char* program_name){
-    printf("Usage: %s [file1] [file2] ...\n", program_name);
+    printf("Usage: %s [-nbsA] [-S] [-D] [-P] [-p K] [file1] [file2] ...\n", program_name);
     printf("       %s  (read from stdin)\n", program_name);
+    printf("  -n    number all output lines\n");
+    printf("  -b    number nonempty output lines, overrides -n\n");
+    printf("  -s    suppress repeated empty output lines\n");
+    printf("  -A    show nonprinting characters with ^ and M- notation, TAB as ^I, $ at line end\n");
+    printf("  -S    streaming mode: adaptive double buffer, sequential readahead,\n");
+    printf("        drop consumed pages from the page cache\n");
+    printf("  -D    read files with O_DIRECT (implies -S)\n");
+    printf("  -P    print throughput and page-cache impact to stderr\n");
+    printf("  -p K  open and read the next K files ahead (io_uring, or a thread\n");
+    printf("        pool without it); output keeps argument order\n");
+}
+
+double now_seconds(void){
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// 用 mincore 统计文件当前在 page cache 中的页数, 非普通文件返回 -1
+long resident_pages(int fd){
+    struct stat st;
+    long page = sysconf(_SC_PAGESIZE);
+
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)){
+        return -1;
+    }
+    if (st.st_size == 0){
+        return 0;
+    }
+
+    size_t pages = (st.st_size + page - 1) / page;
+    void* map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED){
+        return -1;
+    }
+    unsigned char* vec = malloc(pages);
+    long count = -1;
+    if (vec != NULL && mincore(map, st.st_size, vec) == 0){
+        count = 0;
+        for (size_t i = 0; i < pages; i++){
+            count += vec[i] & 1;
+        }
+    }
+    free(vec);
+    munmap(map, st.st_size);
+    return count;
+}
+
+output_kind_t detect_output_kind(int fd){
+    struct stat st;
+
+    if (fstat(fd, &st) == -1){
+        return OUT_OTHER;
+    }
+    if (S_ISREG(st.st_mode)){
+        // O_APPEND 的输出 copy_file_range 不支持
+        int flags = fcntl(fd, F_GETFL);
+        return (flags != -1 && (flags & O_APPEND)) ? OUT_OTHER : OUT_REGULAR;
+    }
+    if (S_ISSOCK(st.st_mode)){
+        return OUT_SOCKET;
+    }
+    if (S_ISFIFO(st.st_mode)){
+        return OUT_PIPE;
+    }
+    return OUT_OTHER;
+}
+
+int write_all(int fd, const char* buf, size_t len){
+    while (len > 0){
+        ssize_t n = write(fd, buf, len);
+        if (n < 0){
+            if (errno == EINTR){
+                continue;
+            }
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// ---- 行处理: 向量化扫描换行/控制字符, 整段拷贝, 只对特殊字节单独处理 ----
+// 每次扫描 64 字节, 返回位图: 第 i 位为 1 表示 p[i] 是需要处理的字节.
+// 不足 64 字节的尾巴走标量版本.
+
+static inline uint64_t mask_newline_scalar(const char* p, size_t n){
+    uint64_t mask = 0;
+
+    for (size_t i = 0; i < n; i++){
+        mask |= (uint64_t)(p[i] == '\n') << i;
+    }
+    return mask;
+}
+
+// 需要转义的字节: < 0x20 或 >= 0x7f (包括 '\n' 和 '\t')
+static inline uint64_t mask_special_scalar(const char* p, size_t n){
+    uint64_t mask = 0;
+
+    for (size_t i = 0; i < n; i++){
+        unsigned char c = p[i];
+        mask |= (uint64_t)(c < 0x20 || c >= 0x7f) << i;
+    }
+    return mask;
+}
+
+uint64_t scan_newline_scalar(const char* p, size_t n){
+    return mask_newline_scalar(p, n < 64 ? n : 64);
+}
+
+uint64_t scan_special_scalar(const char* p, size_t n){
+    return mask_special_scalar(p, n < 64 ? n : 64);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+uint64_t scan_newline_sse2(const char* p, size_t n){
+    if (n < 64){
+        return mask_newline_scalar(p, n);
+    }
+
+    const __m128i nl = _mm_set1_epi8('\n');
+    uint64_t mask = 0;
+    for (int i = 0; i < 4; i++){
+        __m128i v = _mm_loadu_si128((const __m128i*)(p + 16 * i));
+        mask |= (uint64_t)(unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v, nl)) << (16 * i);
+    }
+    return mask;
+}
+
+// x 加上 0x60 后, 可打印范围 [0x20, 0x7e] 恰好落在有符号的 [-128, -34],
+// 一次有符号比较就能挑出所有特殊字节
+__attribute__((target("sse2")))
+uint64_t scan_special_sse2(const char* p, size_t n){
+    if (n < 64){
+        return mask_special_scalar(p, n);
+    }
+
+    const __m128i bias = _mm_set1_epi8(0x60);
+    const __m128i limit = _mm_set1_epi8(-34);
+    uint64_t mask = 0;
+    for (int i = 0; i < 4; i++){
+        __m128i v = _mm_add_epi8(_mm_loadu_si128((const __m128i*)(p + 16 * i)), bias);
+        mask |= (uint64_t)(unsigned)_mm_movemask_epi8(_mm_cmpgt_epi8(v, limit)) << (16 * i);
+    }
+    return mask;
+}
+
+__attribute__((target("avx2")))
+uint64_t scan_newline_avx2(const char* p, size_t n){
+    if (n < 64){
+        return mask_newline_scalar(p, n);
+    }
+
+    const __m256i nl = _mm256_set1_epi8('\n');
+    __m256i lo = _mm256_loadu_si256((const __m256i*)p);
+    __m256i hi = _mm256_loadu_si256((const __m256i*)(p + 32));
+    return (uint64_t)(unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, nl)) |
+           (uint64_t)(unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, nl)) << 32;
+}
+
+__attribute__((target("avx2")))
+uint64_t scan_special_avx2(const char* p, size_t n){
+    if (n < 64){
+        return mask_special_scalar(p, n);
+    }
+
+    const __m256i bias = _mm256_set1_epi8(0x60);
+    const __m256i limit = _mm256_set1_epi8(-34);
+    __m256i lo = _mm256_add_epi8(_mm256_loadu_si256((const __m256i*)p), bias);
+    __m256i hi = _mm256_add_epi8(_mm256_loadu_si256((const __m256i*)(p + 32)), bias);
+    return (uint64_t)(unsigned)_mm256_movemask_epi8(_mm256_cmpgt_epi8(lo, limit)) |
+           (uint64_t)(unsigned)_mm256_movemask_epi8(_mm256_cmpgt_epi8(hi, limit)) << 32;
+}
+#endif
+
+static uint64_t (*g_scan_newline)(const char*, size_t) = scan_newline_scalar;
+static uint64_t (*g_scan_special)(const char*, size_t) = scan_special_scalar;
+
+void init_line_scanner(void){
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")){
+        g_scan_newline = scan_newline_avx2;
+        g_scan_special = scan_special_avx2;
+    }else if (__builtin_cpu_supports("sse2")){
+        g_scan_newline = scan_newline_sse2;
+        g_scan_special = scan_special_sse2;
+    }
+#endif
+}
+
+int line_flush(void){
+    int ret = write_all(STDOUT_FILENO, g_line.out, g_line.out_len);
+    g_line.out_len = 0;
+    return ret;
+}
+
+// 保证输出缓冲区还有 need 字节空间
+static inline int line_reserve(size_t need){
+    if (g_line.out_len + need > LINE_OUT_SIZE){
+        return line_flush();
+    }
+    return 0;
+}
+
+static inline int line_append(const char* p, size_t len){
+    if (len >= LINE_DIRECT_SIZE){
+        // 大段原样输出直接从输入缓冲区写出去, 省一次 memcpy
+        if (line_flush() != 0){
+            return -1;
+        }
+        return write_all(STDOUT_FILENO, p, len);
+    }
+    if (line_reserve(len) != 0){
+        return -1;
+    }
+    memcpy(g_line.out + g_line.out_len, p, len);
+    g_line.out_len += len;
+    return 0;
+}
+
+// 行号直接以 ASCII 形式保存在 "     N\t" 里原地 +1, 格式和 GNU cat 的
+// "%6llu\t" 一致, 避免每行做除法或 printf
+void line_number_init(void){
+    memset(g_line.num, ' ', sizeof(g_line.num));
+    g_line.num[LINE_NUM_LAST] = '0';
+    g_line.num[LINE_NUM_LAST + 1] = '\t';
+    g_line.num_start = &g_line.num[LINE_NUM_LAST - 5];
+}
+
+static inline void line_put_number(void){
+    char* d = &g_line.num[LINE_NUM_LAST];
+
+    while (*d == '9'){
+        *d-- = '0';
+    }
+    *d = *d == ' ' ? '1' : *d + 1;
+    if (d < g_line.num_start){
+        g_line.num_start = d;
+    }
+
+    size_t len = &g_line.num[LINE_NUM_LAST + 2] - g_line.num_start;
+    memcpy(g_line.out + g_line.out_len, g_line.num_start, len);
+    g_line.out_len += len;
+}
+
+static inline void line_put_escaped(unsigned char c){
+    char* out = g_line.out + g_line.out_len;
+
+    if (c >= 0x80){
+        *out++ = 'M';
+        *out++ = '-';
+        c &= 0x7f;
+    }
+    if (c < 0x20){
+        *out++ = '^';
+        *out++ = c + 64;
+    }else if (c == 0x7f){
+        *out++ = '^';
+        *out++ = '?';
+    }else {
+        *out++ = c;
+    }
+    g_line.out_len = out - g_line.out;
+}
+
+// 只有 -s 时不必逐行处理: 一个 '\n' 前面两个字节也都是换行 (连续第二个
+// 以上的空行) 才需要丢掉, 用位运算一次算出整块里要丢的位置.
+// at_line_start / blank_run 作为跨块的进位.
+int squeeze_block(const char* p, size_t len){
+    const char* end = p + len;
+    const char* span = p;
+    uint64_t carry_nl = g_line.at_line_start;
+    uint64_t carry_blank = g_line.at_line_start && g_line.blank_run > 0;
+
+    for (const char* base = p; base < end; base += 64){
+        size_t n = end - base < 64 ? (size_t)(end - base) : 64;
+        uint64_t nl = g_scan_newline(base, n);
+        uint64_t line_start = nl << 1 | carry_nl;
+        uint64_t after_blank = (nl & line_start) << 1 | carry_blank;
+        uint64_t drop = nl & after_blank;
+
+        carry_nl = nl >> (n - 1) & 1;
+        carry_blank = (nl & line_start) >> (n - 1) & 1;
+
+        while (drop != 0){
+            const char* q = base + __builtin_ctzll(drop);
+            drop &= drop - 1;
+            if (q > span && line_append(span, q - span) != 0){
+                return -1;
+            }
+            span = q + 1;
+        }
+    }
+
+    if (end > span && line_append(span, end - span) != 0){
+        return -1;
+    }
+    g_line.at_line_start = (int)carry_nl;
+    g_line.blank_run = (int)carry_blank;
+    return 0;
+}
+
+// 输入里不需要改动的字节先记在 [span, p) 里, 只有要插入行号/转义或
+// 丢掉空行时才把这一段整体拷出去, 所以 -s 基本是大段 memcpy
+int transform_block(const char* p, size_t len){
+    const char* end = p + len;
+    const char* span = p;
+    uint64_t (*scan)(const char*, size_t) = g_show_all ? g_scan_special : g_scan_newline;
+    int number_all = g_number_lines && !g_number_nonblank;
+    int number_any = g_number_lines || g_number_nonblank;
+
+#define FLUSH_SPAN(upto)                                                  \
+    do {                                                                  \
+        if ((upto) > span && line_append(span, (upto) - span) != 0){      \
+            return -1;                                                    \
+        }                                                                 \
+        if (line_reserve(LINE_NUM_SIZE + 8) != 0){                        \
+            return -1;                                                    \
+        }                                                                 \
+    } while (0)
+
+// 非空行的行首: 需要编号时在这里插入行号
+#define START_LINE(at)                                                    \
+    do {                                                                  \
+        g_line.blank_run = 0;                                             \
+        g_line.at_line_start = 0;                                         \
+        if (number_any){                                                  \
+            FLUSH_SPAN(at);                                               \
+            line_put_number();                                            \
+            span = (at);                                                  \
+        }                                                                 \
+    } while (0)
+
+    if (g_line.at_line_start && p < end && *p != '\n'){
+        START_LINE(p);
+    }
+
+    for (const char* base = p; base < end; base += 64){
+        uint64_t mask = scan(base, end - base);
+
+        while (mask != 0){
+            const char* q = base + __builtin_ctzll(mask);
+            mask &= mask - 1;
+
+            if (*q != '\n'){
+                FLUSH_SPAN(q);
+                line_put_escaped(*q);
+                span = q + 1;
+                continue;
+            }
+
+            if (g_line.at_line_start){
+                // 空行
+                if (g_squeeze_blank && g_line.blank_run > 0){
+                    FLUSH_SPAN(q);
+                    span = q + 1;
+                }else {
+                    g_line.blank_run++;
+                    if (number_all || g_show_all){
+                        FLUSH_SPAN(q);
+                        if (number_all){
+                            line_put_number();
+                        }
+                        if (g_show_all){
+                            g_line.out[g_line.out_len++] = '$';
+                        }
+                        span = q;
+                    }
+                }
+            }else {
+                if (g_show_all){
+                    FLUSH_SPAN(q);
+                    g_line.out[g_line.out_len++] = '$';
+                    span = q;
+                }
+                g_line.at_line_start = 1;
+            }
+
+            // 下一行如果不是空行, 行首在这里就处理掉; 空行留给它自己的 '\n'
+            if (q + 1 < end && q[1] != '\n'){
+                START_LINE(q + 1);
+            }
+        }
+    }
+
+    FLUSH_SPAN(end);
+#undef START_LINE
+#undef FLUSH_SPAN
+    return 0;
+}
+
+// 所有输出都经过这里: 行处理模式下先变换, 每个输入块结束时刷一次
+int output_block(const char* buf, size_t len){
+    if (!g_line_mode){
+        return write_all(STDOUT_FILENO, buf, len);
+    }
+    int only_squeeze = !g_number_lines && !g_number_nonblank && !g_show_all;
+    if ((only_squeeze ? squeeze_block(buf, len) : transform_block(buf, len)) != 0){
+        return -1;
+    }
+    return line_flush();
+}
+
+// 零拷贝快速路径.
+// 返回 1 表示已拷贝到 EOF, 0 表示该路径不可用 (调用方回退到 read/write,
+// 文件偏移停在已拷贝的位置), -1 表示真正的 I/O 错误.
+int copy_fast(int in_fd){
+    for (;;){
+        ssize_t n;
+
+        switch (g_output_kind){
+        case OUT_REGULAR:
+            n = copy_file_range(in_fd, NULL, STDOUT_FILENO, NULL, CHUNK_SIZE, 0);
+            break;
+        case OUT_SOCKET:
+            n = sendfile(STDOUT_FILENO, in_fd, NULL, CHUNK_SIZE);
+            break;
+        case OUT_PIPE:
+            n = splice(in_fd, NULL, STDOUT_FILENO, NULL, CHUNK_SIZE, SPLICE_F_MOVE);
+            break;
+        default:
+            return 0;
+        }
+
+        if (n > 0){
+            g_copied += n;
+            continue;
+        }
+        if (n == 0){
+            return 1;
+        }
+        if (errno == EINTR){
+            continue;
+        }
+        if (errno == EINVAL || errno == EXDEV || errno == ENOSYS ||
+            errno == EBADF || errno == EOPNOTSUPP || errno == ESPIPE){
+            return 0;
+        }
+        return -1;
+    }
+}
+
+int copy_buffered(int in_fd){
+    ssize_t n;
+
+    while ((n = read(in_fd, g_buffer, BUFFER_SIZE)) != 0){
+        if (n < 0){
+            if (errno == EINTR){
+                continue;
+            }
+            return -1;
+        }
+        if (output_block(g_buffer, n) != 0){
+            return -1;
+        }
+        g_copied += n;
+    }
+    return 0;
+}
+
+// 读满一块 (除非 EOF), O_DIRECT 下保证偏移始终按块对齐
+ssize_t read_chunk(stream_t* s, char* buf, size_t want){
+    size_t got = 0;
+
+    while (got < want){
+        ssize_t n = read(s->fd, buf + got, want - got);
+        if (n == 0){
+            break;
+        }
+        if (n < 0){
+            if (errno == EINTR){
+                continue;
+            }
+            if (errno == EINVAL && s->direct){
+                // 文件系统不接受这次直接 I/O, 退回 page cache 路径继续读
+                int flags = fcntl(s->fd, F_GETFL);
+                fcntl(s->fd, F_SETFL, flags & ~O_DIRECT);
+                s->direct = 0;
+                continue;
+            }
+            return -1;
+        }
+        got += n;
+    }
+    return got;
+}
+
+void* stream_reader(void* arg){
+    stream_t* s = arg;
+
+    for (int i = 0; ; i ^= 1){
+        pthread_mutex_lock(&s->mutex);
+        while (s->full[i] && !s->stop){
+            pthread_cond_wait(&s->cond, &s->mutex);
+        }
+        int stop = s->stop;
+        size_t want = s->chunk;
+        pthread_mutex_unlock(&s->mutex);
+        if (stop){
+            return NULL;
+        }
+
+        ssize_t n = read_chunk(s, s->buf[i], want);
+        int err = n < 0 ? errno : 0;
+
+        if (s->drop_cache){
+            // 已经读进用户缓冲区的页不再需要, 及时从 page cache 中丢掉.
+            // 预读中的页会被内核跳过, 所以窗口多回退一块, EOF 时再整体清一次
+            off_t from = s->offset - (off_t)want;
+            if (n <= 0){
+                from = s->start_offset;
+            }
+            if (from < s->start_offset){
+                from = s->start_offset;
+            }
+            posix_fadvise(s->fd, from, n > 0 ? s->offset + n - from : 0, POSIX_FADV_DONTNEED);
+        }
+
+        pthread_mutex_lock(&s->mutex);
+        s->len[i] = n > 0 ? (size_t)n : 0;
+        s->full[i] = 1;
+        s->read_errno = err;
+        if (n > 0){
+            s->offset += n;
+            if ((size_t)n == want && s->chunk < s->max_chunk){
+                s->chunk *= 2;
+            }
+        }
+        pthread_cond_broadcast(&s->cond);
+        pthread_mutex_unlock(&s->mutex);
+
+        if (n <= 0){
+            return NULL;
+        }
+    }
+}
+
+size_t stream_max_chunk(int fd){
+    struct stat st;
+    size_t max = STREAM_MAX_CHUNK;
+
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)){
+        max = STREAM_MIN_CHUNK;
+        while (max < STREAM_MAX_CHUNK && (off_t)max < st.st_size){
+            max *= 2;
+        }
+    }
+    return max;
+}
+
+int copy_stream(int in_fd, int direct){
+    stream_t s;
+    pthread_t reader;
+    int ret = 0;
+
+    memset(&s, 0, sizeof(s));
+    s.fd = in_fd;
+    s.direct = direct;
+    s.max_chunk = stream_max_chunk(in_fd);
+    s.chunk = STREAM_MIN_CHUNK < s.max_chunk ? STREAM_MIN_CHUNK : s.max_chunk;
+    s.offset = lseek(in_fd, 0, SEEK_CUR);
+    if (s.offset < 0){
+        s.offset = 0;
+    }
+    s.start_offset = s.offset;
+
+    // 已经大部分在缓存里的热文件不主动丢页, 只处理冷文件
+    long resident = resident_pages(in_fd);
+    if (resident >= 0 && !direct){
+        struct stat st;
+        long page = sysconf(_SC_PAGESIZE);
+        fstat(in_fd, &st);
+        s.drop_cache = resident * page * 2 < st.st_size;
+    }
+    posix_fadvise(in_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    for (int i = 0; i < 2; i++){
+        if (posix_memalign((void**)&s.buf[i], BUFFER_ALIGN, s.max_chunk) != 0){
+            free(s.buf[0]);
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+    pthread_mutex_init(&s.mutex, NULL);
+    pthread_cond_init(&s.cond, NULL);
+
+    if (pthread_create(&reader, NULL, stream_reader, &s) != 0){
+        ret = copy_buffered(in_fd);
+    }else {
+        for (int i = 0; ; i ^= 1){
+            pthread_mutex_lock(&s.mutex);
+            while (!s.full[i]){
+                pthread_cond_wait(&s.cond, &s.mutex);
+            }
+            size_t len = s.len[i];
+            int err = s.read_errno;
+            pthread_mutex_unlock(&s.mutex);
+
+            if (len == 0){
+                if (err != 0){
+                    errno = err;
+                    ret = -1;
+                }
+                break;
+            }
+            if (output_block(s.buf[i], len) != 0){
+                ret = -1;
+                break;
+            }
+            g_copied += len;
+
+            pthread_mutex_lock(&s.mutex);
+            s.full[i] = 0;
+            pthread_cond_broadcast(&s.cond);
+            pthread_mutex_unlock(&s.mutex);
+        }
+
+        int saved = errno;
+        pthread_mutex_lock(&s.mutex);
+        s.stop = 1;
+        pthread_cond_broadcast(&s.cond);
+        pthread_mutex_unlock(&s.mutex);
+        pthread_join(reader, NULL);
+        errno = saved;
+    }
+
+    pthread_cond_destroy(&s.cond);
+    pthread_mutex_destroy(&s.mutex);
+    free(s.buf[0]);
+    free(s.buf[1]);
+    return ret;
+}
+
+int copy_fd(int in_fd, int direct){
+    if (g_stream_mode){
+        return copy_stream(in_fd, direct);
+    }
+
+    // 行处理需要看到每个字节, 不能走零拷贝
+    int ret = g_line_mode ? 0 : copy_fast(in_fd);
+
+    if (ret != 0){
+        return ret < 0 ? -1 : 0;
+    }
+    return copy_buffered(in_fd);
+}
+
+void print_stats(const char* name, double seconds, long before, long after){
+    double mb = g_copied / (1024.0 * 1024.0);
+
+    fprintf(stderr, "%s: %llu bytes in %.3f s, %.1f MB/s",
+            name, g_copied, seconds, seconds > 0 ? mb / seconds : 0.0);
+    if (before >= 0 && after >= 0){
+        fprintf(stderr, ", page cache %ld -> %ld pages (%+ld)", before, after, after - before);
+    }
+    fprintf(stderr, "\n");
+}
+
+int cat_fd(int fd, const char* name, int direct){
+    long before = -1;
+    double start = 0;
+    int ret;
+
+    if (g_print_stats){
+        before = resident_pages(fd);
+        start = now_seconds();
+    }
+    g_copied = 0;
+
+    ret = copy_fd(fd, direct);
+    if (ret != 0){
+        perror(name);
+    }
+
+    if (g_print_stats){
+        print_stats(name, now_seconds() - start, before, resident_pages(fd));
+    }
+    return ret != 0;
 }
 
 int cat_file(const char* filename){
-    FILE* file;
-    char buffer[BUFFER_SIZE];
-    size_t bytes_read;
+    int fd = -1;
+    int direct = 0;
 
-    file = fopen(filename, "r");
-    if (file == NULL){
+    if (g_direct_io){
+        fd = open(filename, O_RDONLY | O_DIRECT);
+        direct = fd != -1;
+    }
+    if (fd == -1){
+        fd = open(filename, O_RDONLY);
+    }
+    if (fd == -1){
         perror(filename);
         return 1;
     }
 
-    while((bytes_read = fread(buffer, 1, BUFFER_SIZE, file)) > 0){
-        fwrite(buffer, 1, bytes_read, stdout);
-    }
+    int ret = cat_fd(fd, filename, direct);
+    close(fd);
+    return ret;
+}
 
-    if (ferror(file)){
-        perror(filename);
-        fclose(file);
+int cat_stdin() {
+    return cat_fd(STDIN_FILENO, "stdin", 0);
+}
+
+// 输出一个已经预读好的槽位: 先写预读到的开头, 再从预读结束的位置接着常规拷贝到 EOF.
+// 预读没读满不代表到了文件末尾 (比如读的时候文件还在增长), 所以总要接着读
+int emit_slot(prefetch_slot_t* slot){
+    if (slot->is_stdin){
+        return cat_stdin();
+    }
+    if (slot->fd < 0){
+        errno = slot->open_errno;
+        perror(slot->name);
         return 1;
     }
 
-    fclose(file);
+    double start = g_print_stats ? now_seconds() : 0;
+    int ret = 0;
+    g_copied = 0;
+
+    if (slot->read_errno != 0){
+        errno = slot->read_errno;
+        perror(slot->name);
+        ret = 1;
+    }else {
+        if (slot->len > 0){
+            if (output_block(slot->buf, slot->len) != 0){
+                perror(slot->name);
+                ret = 1;
+            }
+            g_copied += slot->len;
+        }
+        if (ret == 0){
+            if (slot->len > 0){
+                lseek(slot->fd, slot->len, SEEK_SET);
+            }
+            if (copy_fd(slot->fd, 0) != 0){
+                perror(slot->name);
+                ret = 1;
+            }
+        }
+    }
+
+    if (g_print_stats){
+        print_stats(slot->name, now_seconds() - start, -1, -1);
+    }
+    close(slot->fd);
+    slot->fd = -1;
+    return ret;
+}
+
+// 只预读普通文件: 管道、FIFO、设备预读掉的数据收不回来, 它们直接走常规拷贝
+int fd_is_regular(int fd){
+    struct stat st;
+
+    return fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+}
+
+void prefetch_open_read(prefetch_slot_t* slot){
+    slot->fd = open(slot->name, O_RDONLY);
+    if (slot->fd < 0){
+        slot->open_errno = errno;
+        return;
+    }
+    if (!fd_is_regular(slot->fd)){
+        return;
+    }
+
+    ssize_t n;
+    do {
+        n = pread(slot->fd, slot->buf, PREFETCH_BUF_SIZE, 0);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0){
+        slot->read_errno = errno;
+    }else {
+        slot->len = n;
+    }
+}
+
+void prefetch_reset_slot(prefetch_t* pf, int index){
+    prefetch_slot_t* slot = &pf->slots[index % pf->depth];
+    const char* name = pf->files[index];
+
+    slot->name = name;
+    slot->is_stdin = name[0] == '-' && name[1] == '\0';
+    slot->fd = -1;
+    slot->open_errno = 0;
+    slot->read_errno = 0;
+    slot->len = 0;
+    slot->state = slot->is_stdin ? SLOT_READY : SLOT_OPENING;
+}
+
+void* prefetch_worker(void* arg){
+    prefetch_t* pf = arg;
+
+    pthread_mutex_lock(&pf->mutex);
+    for (;;){
+        while (!pf->stop && (pf->next_claim >= pf->nfiles ||
+                             pf->next_claim >= pf->next_emit + pf->depth)){
+            pthread_cond_wait(&pf->cond, &pf->mutex);
+        }
+        if (pf->stop){
+            break;
+        }
+        int index = pf->next_claim++;
+        prefetch_slot_t* slot = &pf->slots[index % pf->depth];
+        prefetch_reset_slot(pf, index);
+        pthread_mutex_unlock(&pf->mutex);
+
+        if (!slot->is_stdin){
+            prefetch_open_read(slot);
+        }
+
+        pthread_mutex_lock(&pf->mutex);
+        slot->state = SLOT_READY;
+        pthread_cond_broadcast(&pf->cond);
+    }
+    pthread_mutex_unlock(&pf->mutex);
+    return NULL;
+}
+
+int prefetch_run_threads(prefetch_t* pf){
+    int nthreads = pf->depth < PREFETCH_MAX_THREADS ? pf->depth : PREFETCH_MAX_THREADS;
+    pthread_t threads[PREFETCH_MAX_THREADS];
+    int started = 0;
+    int exit_code = 0;
+
+    pthread_mutex_init(&pf->mutex, NULL);
+    pthread_cond_init(&pf->cond, NULL);
+    for (; started < nthreads; started++){
+        if (pthread_create(&threads[started], NULL, prefetch_worker, pf) != 0){
+            break;
+        }
+    }
+
+    for (int i = 0; i < pf->nfiles; i++){
+        prefetch_slot_t* slot = &pf->slots[i % pf->depth];
+
+        if (started == 0){
+            // 一个线程都起不来: 在当前线程里顺序处理
+            prefetch_reset_slot(pf, i);
+            if (!slot->is_stdin){
+                prefetch_open_read(slot);
+            }
+        }else {
+            pthread_mutex_lock(&pf->mutex);
+            while (pf->next_claim <= i || slot->state != SLOT_READY){
+                pthread_cond_wait(&pf->cond, &pf->mutex);
+            }
+            pthread_mutex_unlock(&pf->mutex);
+        }
+
+        if (emit_slot(slot) != 0){
+            exit_code = 1;
+        }
+
+        pthread_mutex_lock(&pf->mutex);
+        slot->state = SLOT_EMPTY;
+        pf->next_emit = i + 1;
+        pthread_cond_broadcast(&pf->cond);
+        pthread_mutex_unlock(&pf->mutex);
+    }
+
+    pthread_mutex_lock(&pf->mutex);
+    pf->stop = 1;
+    pthread_cond_broadcast(&pf->cond);
+    pthread_mutex_unlock(&pf->mutex);
+    for (int i = 0; i < started; i++){
+        pthread_join(threads[i], NULL);
+    }
+    pthread_cond_destroy(&pf->cond);
+    pthread_mutex_destroy(&pf->mutex);
+    return exit_code;
+}
+
+#ifndef NO_IO_URING
+// 没有 liburing, 直接用系统调用搭一个最小的 ring
+int uring_init(uring_t* ring, unsigned entries){
+    struct io_uring_params params;
+
+    memset(ring, 0, sizeof(*ring));
+    memset(&params, 0, sizeof(params));
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0){
+        return -1;
+    }
+
+    // 确认内核支持 OPENAT 和 READ
+    size_t probe_size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe* probe = calloc(1, probe_size);
+    int supported = probe != NULL &&
+        syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PROBE, probe, 256) == 0 &&
+        probe->last_op >= IORING_OP_READ &&
+        (probe->ops[IORING_OP_OPENAT].flags & IO_URING_OP_SUPPORTED) &&
+        (probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED);
+    free(probe);
+    if (!supported){
+        close(ring->fd);
+        return -1;
+    }
+
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP){
+        if (ring->cq_ring_size > ring->sq_ring_size){
+            ring->sq_ring_size = ring->cq_ring_size;
+        }
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED){
+        close(ring->fd);
+        return -1;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP){
+        ring->cq_ring = ring->sq_ring;
+    }else {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED){
+            munmap(ring->sq_ring, ring->sq_ring_size);
+            close(ring->fd);
+            return -1;
+        }
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED){
+        if (ring->cq_ring != ring->sq_ring){
+            munmap(ring->cq_ring, ring->cq_ring_size);
+        }
+        munmap(ring->sq_ring, ring->sq_ring_size);
+        close(ring->fd);
+        return -1;
+    }
+
+    char* sq = ring->sq_ring;
+    char* cq = ring->cq_ring;
+    ring->sq_head = (unsigned*)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned*)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned*)(sq + params.sq_off.array);
+    ring->cq_head = (unsigned*)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned*)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
     return 0;
 }
 
-int cat_stdin() {
-    char buffer[BUFFER_SIZE];
-    size_t bytes_read;
+void uring_destroy(uring_t* ring){
+    munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring != ring->sq_ring){
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+}
+
+struct io_uring_sqe* uring_get_sqe(uring_t* ring){
+    unsigned tail = *ring->sq_tail;
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe* sqe = &ring->sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->to_submit++;
+    return sqe;
+}
+
+int uring_enter(uring_t* ring, unsigned min_complete){
+    unsigned flags = min_complete > 0 ? IORING_ENTER_GETEVENTS : 0;
+
+    for (;;){
+        int n = syscall(__NR_io_uring_enter, ring->fd, ring->to_submit, min_complete, flags, NULL, 0);
+        if (n >= 0){
+            ring->to_submit -= n < (int)ring->to_submit ? n : (int)ring->to_submit;
+            return 0;
+        }
+        if (errno != EINTR){
+            return -1;
+        }
+    }
+}
+
+void uring_queue_open(uring_t* ring, prefetch_t* pf, int index){
+    struct io_uring_sqe* sqe = uring_get_sqe(ring);
+
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (unsigned long)pf->files[index];
+    sqe->open_flags = O_RDONLY;
+    sqe->user_data = index;
+}
+
+void uring_queue_read(uring_t* ring, prefetch_slot_t* slot, int index){
+    struct io_uring_sqe* sqe = uring_get_sqe(ring);
 
-    while((bytes_read = fread(buffer, 1, BUFFER_SIZE, stdin)) > 0){
-        fwrite(buffer, 1, bytes_read, stdout);
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = slot->fd;
+    sqe->addr = (unsigned long)slot->buf;
+    sqe->len = PREFETCH_BUF_SIZE;
+    sqe->off = 0;
+    sqe->user_data = index;
+}
+
+void uring_reap(uring_t* ring, prefetch_t* pf){
+    unsigned head = *ring->cq_head;
+    unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+    for (; head != tail; head++){
+        struct io_uring_cqe* cqe = &ring->cqes[head & *ring->cq_mask];
+        int index = (int)cqe->user_data;
+        prefetch_slot_t* slot = &pf->slots[index % pf->depth];
+
+        if (slot->state == SLOT_OPENING){
+            if (cqe->res < 0){
+                slot->open_errno = -cqe->res;
+                slot->state = SLOT_READY;
+            }else if (fd_is_regular(cqe->res)){
+                slot->fd = cqe->res;
+                slot->state = SLOT_READING;
+                uring_queue_read(ring, slot, index);
+            }else {
+                slot->fd = cqe->res;
+                slot->state = SLOT_READY;
+            }
+        }else if (slot->state == SLOT_READING){
+            if (cqe->res < 0){
+                slot->read_errno = -cqe->res;
+            }else {
+                slot->len = cqe->res;
+            }
+            slot->state = SLOT_READY;
+        }
     }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+}
 
-    if (ferror(stdin)){
-        perror("stdin");
-        return 1;
+// *emitted 返回已经输出完的文件数; io_uring_enter 出错时停在出错的那个文件, 剩下的交给调用方
+int prefetch_run_uring(prefetch_t* pf, uring_t* ring, int* emitted){
+    int next_submit = 0;
+    int exit_code = 0;
+
+    for (int i = 0; i < pf->nfiles; i++){
+        prefetch_slot_t* slot = &pf->slots[i % pf->depth];
+
+        *emitted = i;
+        while (next_submit < pf->nfiles && next_submit < i + pf->depth){
+            prefetch_reset_slot(pf, next_submit);
+            if (!pf->slots[next_submit % pf->depth].is_stdin){
+                uring_queue_open(ring, pf, next_submit);
+            }
+            next_submit++;
+        }
+
+        while (slot->state != SLOT_READY){
+            if (uring_enter(ring, 1) != 0){
+                perror("io_uring_enter");
+                return exit_code;
+            }
+            uring_reap(ring, pf);
+        }
+        // 把 reap 时排进来的 READ 顺手提交, 输出期间内核继续干活
+        if (ring->to_submit > 0 && uring_enter(ring, 0) != 0){
+            perror("io_uring_enter");
+            return exit_code;
+        }
+
+        if (emit_slot(slot) != 0){
+            exit_code = 1;
+        }
+        slot->state = SLOT_EMPTY;
     }
+    *emitted = pf->nfiles;
+    return exit_code;
+}
+#endif
 
+int prefetch_alloc_slots(prefetch_t* pf){
+    pf->slots = calloc(pf->depth, sizeof(prefetch_slot_t));
+    if (pf->slots == NULL){
+        perror("calloc");
+        return -1;
+    }
+    for (int i = 0; i < pf->depth; i++){
+        pf->slots[i].fd = -1;
+        if (posix_memalign((void**)&pf->slots[i].buf, BUFFER_ALIGN, PREFETCH_BUF_SIZE) != 0){
+            for (int j = 0; j < i; j++){
+                free(pf->slots[j].buf);
+            }
+            free(pf->slots);
+            pf->slots = NULL;
+            perror("posix_memalign");
+            return -1;
+        }
+    }
     return 0;
 }
 
+void prefetch_close_slots(prefetch_t* pf){
+    for (int i = 0; i < pf->depth; i++){
+        if (pf->slots[i].fd >= 0){
+            close(pf->slots[i].fd);
+            pf->slots[i].fd = -1;
+        }
+    }
+}
+
+void prefetch_free_slots(prefetch_t* pf){
+    prefetch_close_slots(pf);
+    for (int i = 0; i < pf->depth; i++){
+        free(pf->slots[i].buf);
+    }
+    free(pf->slots);
+    pf->slots = NULL;
+}
+
+int cat_prefetch(char** files, int nfiles, int depth){
+    prefetch_t pf;
+    int exit_code;
+
+    memset(&pf, 0, sizeof(pf));
+    pf.files = files;
+    pf.nfiles = nfiles;
+    pf.depth = depth;
+    if (prefetch_alloc_slots(&pf) != 0){
+        return 1;
+    }
+
+#ifndef NO_IO_URING
+    uring_t ring;
+    // 每个槽位最多同时挂一个 OPENAT 或 READ
+    if (uring_init(&ring, depth) == 0){
+        int emitted = 0;
+
+        exit_code = prefetch_run_uring(&pf, &ring, &emitted);
+        uring_destroy(&ring);
+        if (emitted < nfiles){
+            // ring 中途坏了: 还没输出的文件改用线程池预读.
+            // 关掉 ring 不保证内核里挂着的 READ 已经结束, 旧缓冲区可能还会被写, 所以不复用也不释放
+            fprintf(stderr, "mini_cat: io_uring 出错, 剩下的 %d 个文件改用线程预读\n", nfiles - emitted);
+            prefetch_close_slots(&pf);
+            memset(&pf, 0, sizeof(pf));
+            pf.files = files + emitted;
+            pf.nfiles = nfiles - emitted;
+            pf.depth = depth;
+            if (prefetch_alloc_slots(&pf) != 0){
+                return 1;
+            }
+            exit_code |= prefetch_run_threads(&pf);
+        }
+    }else {
+        exit_code = prefetch_run_threads(&pf);
+    }
+#else
+    exit_code = prefetch_run_threads(&pf);
+#endif
+
+    prefetch_free_slots(&pf);
+    return exit_code < 0 ? 1 : exit_code;
+}
+
 int main(int argc, char* argv[]) {
     int exit_code = 0;
 
+    if (posix_memalign((void**)&g_buffer, BUFFER_ALIGN, BUFFER_SIZE) != 0){
+        perror("posix_memalign");
+        return 1;
+    }
+    g_output_kind = detect_output_kind(STDOUT_FILENO);
+
+    // 选项可以出现在任意位置, "--" 之后全部当作文件名
+    int nfiles = 0;
+    int end_of_options = 0;
+    for (int i = 1; i < argc; i++){
+        if (end_of_options || argv[i][0] != '-' || argv[i][1] == '\0'){
+            argv[++nfiles] = argv[i];
+            continue;
+        }
+        if (strcmp(argv[i], "--") == 0){
+            end_of_options = 1;
+            continue;
+        }
+        for (int j = 1; argv[i][j] != '\0'; j++){
+            switch (argv[i][j]){
+            case 'n':
+                g_number_lines = 1;
+                break;
+            case 'b':
+                g_number_nonblank = 1;
+                break;
+            case 's':
+                g_squeeze_blank = 1;
+                break;
+            case 'A':
+                g_show_all = 1;
+                break;
+            case 'S':
+                g_stream_mode = 1;
+                break;
+            case 'D':
+                g_stream_mode = 1;
+                g_direct_io = 1;
+                break;
+            case 'P':
+                g_print_stats = 1;
+                break;
+            case 'p': {
+                // 参数可以紧跟 (-p16) 也可以是下一个 argv
+                const char* value = argv[i][j + 1] != '\0' ? &argv[i][j + 1] : argv[++i];
+                if (value == NULL || (g_prefetch_depth = atoi(value)) <= 0){
+                    fprintf(stderr, "%s: -p needs a positive number\n", argv[0]);
+                    free(g_buffer);
+                    return 1;
+                }
+                j = strlen(argv[i]) - 1;
+                break;
+            }
+            case 'h':
+                print_usage(argv[0]);
+                free(g_buffer);
+                return 0;
+            default:
+                fprintf(stderr, "%s: unknown option -%c\n", argv[0], argv[i][j]);
+                print_usage(argv[0]);
+                free(g_buffer);
+                return 1;
+            }
+        }
+    }
+    argc = nfiles + 1;
+
+    g_line_mode = g_number_lines || g_number_nonblank || g_squeeze_blank || g_show_all;
+    if (g_line_mode){
+        g_line.out = malloc(LINE_OUT_SIZE);
+        if (g_line.out == NULL){
+            perror("malloc");
+            free(g_buffer);
+            return 1;
+        }
+        init_line_scanner();
+        line_number_init();
+    }
+
     if (argc == 1){
-        return cat_stdin();
+        exit_code = cat_stdin();
+        free(g_line.out);
+        free(g_buffer);
+        return exit_code;
+    }
+
+    if (g_prefetch_depth > 0 && !g_direct_io){
+        exit_code = cat_prefetch(argv + 1, nfiles, g_prefetch_depth);
+        free(g_line.out);
+        free(g_buffer);
+        return exit_code;
     }
 
     for (int i = 1; i < argc; i++){
@@ -67,5 +1428,8 @@ int main(int argc, char* argv[]) {
             }
         }
     }
+
+    free(g_line.out);
+    free(g_buffer);
     return exit_code;
-}
\ No newline at end of file
+}
@@ -1,125 +1,2086 @@
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <dirent.h>
+#include <pthread.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
 #include <pwd.h>
 #include <grp.h>
 #include <time.h>
 #include <unistd.h>
 
-void print_permissions(mode_t mode)
+// getdents64 每批读取的缓冲区大小
+#define DIRENT_BUF_SIZE (1024 * 1024)
+
+// -l 输出用到的字段, 只向内核要这些
+#define DETAIL_MASK (STATX_TYPE | STATX_MODE | STATX_NLINK | STATX_UID | STATX_GID | STATX_SIZE | STATX_MTIME)
+
+// -R 最多的工作线程数
+#define MAX_THREADS 256
+
+// 直接写 stdout 的缓冲区攒到这么大才 write 一次
+#define OUT_FLUSH_SIZE (1024 * 1024)
+
+// uid/gid 名字缓存的初始槽位数 (2 的幂)
+#define NAME_CACHE_INIT 64
+
+// 基数排序每趟处理的位数
+#define RADIX_BITS 11
+#define RADIX_SIZE (1 << RADIX_BITS)
+#define RADIX_PASSES ((64 + RADIX_BITS - 1) / RADIX_BITS)
+
+struct linux_dirent64
+{
+    ino64_t d_ino;
+    off64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+typedef struct
+{
+    mode_t mode;
+    nlink_t nlink;
+    uid_t uid;
+    gid_t gid;
+    off_t size;
+    time_t mtime;
+    long mtime_nsec;
+} file_info_t;
+
+// 一个目录的全部条目, 按列存放 (每个条目 57 字节加名字):
+// 名字连续放在 names 里, 其他字段是平行数组, 排序只重排 order
+typedef struct
+{
+    char *names;
+    size_t names_len;
+    size_t names_cap;
+    uint32_t *name_off;
+    int64_t *size;
+    int64_t *mtime;
+    uint32_t *mtime_nsec;
+    uint32_t *mode;
+    uint32_t *nlink;
+    uint32_t *uid;
+    uint32_t *gid;
+    unsigned char *type;
+    uint32_t *order;
+    uint32_t *scratch;
+    uint64_t *keys;
+    size_t count;
+    size_t cap;
+} entry_arena_t;
+
+typedef enum
+{
+    SORT_NAME,
+    SORT_SIZE,
+    SORT_TIME,
+    SORT_NONE
+} sort_key_t;
+
+// 可增长的输出缓冲区, 每个目录一份. fd >= 0 时攒满 OUT_FLUSH_SIZE 就写出去
+typedef struct
+{
+    char *data;
+    size_t len;
+    size_t cap;
+    int fd;
+} out_buf_t;
+
+// uid/gid -> 名字的开放寻址哈希表, 整个进程共用, 查不到的也缓存成 "unknown"
+typedef struct
+{
+    unsigned int *ids;
+    const char **names;
+    size_t cap;
+    size_t count;
+    pthread_mutex_t mutex;
+} name_cache_t;
+
+// 递归遍历里的一个目录. 子目录 fd 由父目录所在线程用 openat 打开,
+// fd 为 -1 时按路径打开 (fd 配额用完时)
+typedef struct dir_node
+{
+    char *path;
+    int fd;
+    out_buf_t out;
+    out_buf_t err;
+    struct dir_node **children;
+    int nchildren;
+    int children_cap;
+    int done;
+} dir_node_t;
+
+// 工作窃取队列: 所有者在 bottom 端压入/弹出, 其他线程从 top 端偷
+typedef struct
+{
+    dir_node_t **tasks;
+    int top;
+    int bottom;
+    int capacity;
+    pthread_mutex_t mutex;
+} work_deque_t;
+
+typedef struct walker walker_t;
+
+typedef struct
+{
+    walker_t *walker;
+    int id;
+    char *dirent_buf;
+    entry_arena_t arena;
+} worker_t;
+
+struct walker
+{
+    int nthreads;
+    work_deque_t deques[MAX_THREADS];
+    worker_t workers[MAX_THREADS];
+
+    // queued: 队列里等待的目录数, pending: 还没处理完的目录数
+    int queued;
+    int pending;
+    pthread_mutex_t idle_mutex;
+    pthread_cond_t idle_cond;
+
+    pthread_mutex_t done_mutex;
+    pthread_cond_t done_cond;
+};
+
+// du 索引文件: 头 + 按先序排列的定长目录记录 + 名字池, 整个文件直接 mmap 使用
+typedef struct
+{
+    char magic[8];
+    uint64_t count;
+    uint64_t pool_size;
+} du_header_t;
+
+typedef struct
+{
+    uint64_t dev;
+    uint64_t ino;
+    int64_t mtime;
+    uint32_t mtime_nsec;
+    uint32_t nchildren;   // 直接子目录数, 子目录记录紧跟在后面
+    uint64_t file_bytes;  // 目录自身加上直接包含的非目录条目
+    uint64_t total_bytes; // 整棵子树
+    uint32_t name_off;
+    uint32_t subtree;     // 以它为根的记录数 (含自身), 跳过整棵子树用
+} du_record_t;
+
+typedef struct
+{
+    // 上一次的索引, 没有时 old_count 为 0
+    const du_record_t *old;
+    const char *old_pool;
+    size_t old_count;
+    size_t old_pool_size;
+    void *old_map;
+    size_t old_map_size;
+
+    // 这一次生成的索引
+    du_record_t *records;
+    size_t count;
+    size_t cap;
+    char *pool;
+    size_t pool_len;
+    size_t pool_cap;
+
+    char *dirent_buf;
+    char *path;
+    size_t path_len;
+    size_t path_cap;
+    size_t rescanned;
+    size_t reused;
+} du_ctx_t;
+
+typedef struct
+{
+    int show_all;
+    int show_details;
+    int recursive;
+    int threads;
+    sort_key_t sort_key;
+    int reverse;
+    int columns;
+    int width;
+    int disk_usage;
+    const char *index_path;
+    int verbose;
+} ls_options_t;
+
+static ls_options_t g_opts = { 0, 0, 0, 0, SORT_NAME, 0, 0, 80, 0, NULL, 0 };
+static int g_have_statx = 1;
+
+// 预先打开的子目录 fd 配额, 超出后改为按路径打开
+static long g_fd_budget = 0;
+static long g_open_fds = 0;
+
+static name_cache_t g_user_cache = { NULL, NULL, 0, 0, PTHREAD_MUTEX_INITIALIZER };
+static name_cache_t g_group_cache = { NULL, NULL, 0, 0, PTHREAD_MUTEX_INITIALIZER };
+
+// 每个线程记住上一次的结果: 同一目录里的文件大多属于同一个用户/组,
+// 修改时间也常常落在同一分钟
+static __thread unsigned int t_last_uid = (unsigned int)-1;
+static __thread const char *t_last_user = NULL;
+static __thread unsigned int t_last_gid = (unsigned int)-1;
+static __thread const char *t_last_group = NULL;
+static __thread time_t t_last_minute = -1;
+static __thread char t_last_time[16];
+static __thread size_t t_last_time_len = 0;
+
+int write_all(int fd, const char *data, size_t len);
+
+int buf_flush(out_buf_t *buf)
+{
+    int ret = 0;
+
+    if (buf->fd >= 0 && buf->len > 0)
+    {
+        ret = write_all(buf->fd, buf->data, buf->len);
+        buf->len = 0;
+    }
+    return ret;
+}
+
+int buf_reserve(out_buf_t *buf, size_t need)
+{
+    if (buf->len + need <= buf->cap)
+    {
+        return 0;
+    }
+    if (buf->fd >= 0 && buf->len + need > OUT_FLUSH_SIZE)
+    {
+        buf_flush(buf);
+        if (need <= buf->cap)
+        {
+            return 0;
+        }
+    }
+
+    size_t cap = buf->cap ? buf->cap : 4096;
+    while (cap < buf->len + need)
+    {
+        cap *= 2;
+    }
+    char *data = realloc(buf->data, cap);
+    if (data == NULL)
+    {
+        return -1;
+    }
+    buf->data = data;
+    buf->cap = cap;
+    return 0;
+}
+
+static inline void buf_append(out_buf_t *buf, const char *data, size_t len)
+{
+    if (buf_reserve(buf, len) == 0)
+    {
+        memcpy(buf->data + buf->len, data, len);
+        buf->len += len;
+    }
+}
+
+static inline void buf_puts(out_buf_t *buf, const char *str)
+{
+    buf_append(buf, str, strlen(str));
+}
+
+void buf_printf(out_buf_t *buf, const char *format, ...)
+{
+    va_list args;
+
+    va_start(args, format);
+    int n = vsnprintf(NULL, 0, format, args);
+    va_end(args);
+    if (n < 0 || buf_reserve(buf, n + 1) != 0)
+    {
+        return;
+    }
+
+    va_start(args, format);
+    vsnprintf(buf->data + buf->len, n + 1, format, args);
+    va_end(args);
+    buf->len += n;
+}
+
+void buf_free(out_buf_t *buf)
+{
+    buf_flush(buf);
+    free(buf->data);
+    buf->data = NULL;
+    buf->len = buf->cap = 0;
+}
+
+int write_all(int fd, const char *data, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = write(fd, data, len);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// 权限串直接写进 dst (10 个字符), 不再每位一次 printf
+static inline void format_permissions(char *dst, mode_t mode)
+{
+    dst[0] = (S_ISDIR(mode)) ? 'd' : '-';
+    dst[1] = (mode & S_IRUSR) ? 'r' : '-';
+    dst[2] = (mode & S_IWUSR) ? 'w' : '-';
+    dst[3] = (mode & S_IXUSR) ? 'x' : '-';
+    dst[4] = (mode & S_IRGRP) ? 'r' : '-';
+    dst[5] = (mode & S_IWGRP) ? 'w' : '-';
+    dst[6] = (mode & S_IXGRP) ? 'x' : '-';
+    dst[7] = (mode & S_IROTH) ? 'r' : '-';
+    dst[8] = (mode & S_IWOTH) ? 'w' : '-';
+    dst[9] = (mode & S_IXOTH) ? 'x' : '-';
+}
+
+// 等价于 printf(" %*ld", width, value), 返回写入的字节数
+static inline size_t format_number(char *dst, long value, int width)
+{
+    char digits[24];
+    int n = 0;
+    int negative = value < 0;
+    unsigned long v = negative ? -(unsigned long)value : (unsigned long)value;
+    size_t len = 0;
+
+    do
+    {
+        digits[n++] = '0' + v % 10;
+        v /= 10;
+    } while (v != 0);
+    if (negative)
+    {
+        digits[n++] = '-';
+    }
+
+    dst[len++] = ' ';
+    for (int i = n; i < width; i++)
+    {
+        dst[len++] = ' ';
+    }
+    while (n > 0)
+    {
+        dst[len++] = digits[--n];
+    }
+    return len;
+}
+
+// 查表; 没有就在锁外调 getpwuid_r/getgrgid_r, 再插回表里
+const char *name_cache_lookup(name_cache_t *cache, unsigned int id, int is_group)
+{
+    const char *name = NULL;
+
+    pthread_mutex_lock(&cache->mutex);
+    if (cache->cap > 0)
+    {
+        for (size_t i = (id * 2654435761u) & (cache->cap - 1); cache->names[i] != NULL; i = (i + 1) & (cache->cap - 1))
+        {
+            if (cache->ids[i] == id)
+            {
+                name = cache->names[i];
+                break;
+            }
+        }
+    }
+    pthread_mutex_unlock(&cache->mutex);
+    if (name != NULL)
+    {
+        return name;
+    }
+
+    char storage[4096];
+    const char *found = NULL;
+    if (is_group)
+    {
+        struct group grp, *result = NULL;
+        getgrgid_r(id, &grp, storage, sizeof(storage), &result);
+        found = result ? result->gr_name : NULL;
+    }
+    else
+    {
+        struct passwd pwd, *result = NULL;
+        getpwuid_r(id, &pwd, storage, sizeof(storage), &result);
+        found = result ? result->pw_name : NULL;
+    }
+    char *copy = strdup(found ? found : "unknown");
+    if (copy == NULL)
+    {
+        return "unknown";
+    }
+
+    pthread_mutex_lock(&cache->mutex);
+    if ((cache->count + 1) * 2 > cache->cap)
+    {
+        size_t cap = cache->cap ? cache->cap * 2 : NAME_CACHE_INIT;
+        unsigned int *ids = calloc(cap, sizeof(unsigned int));
+        const char **names = calloc(cap, sizeof(char *));
+        if (ids == NULL || names == NULL)
+        {
+            free(ids);
+            free(names);
+            pthread_mutex_unlock(&cache->mutex);
+            return copy;
+        }
+        for (size_t i = 0; i < cache->cap; i++)
+        {
+            if (cache->names[i] != NULL)
+            {
+                size_t j = (cache->ids[i] * 2654435761u) & (cap - 1);
+                while (names[j] != NULL)
+                {
+                    j = (j + 1) & (cap - 1);
+                }
+                ids[j] = cache->ids[i];
+                names[j] = cache->names[i];
+            }
+        }
+        free(cache->ids);
+        free(cache->names);
+        cache->ids = ids;
+        cache->names = names;
+        cache->cap = cap;
+    }
+    size_t i = (id * 2654435761u) & (cache->cap - 1);
+    while (cache->names[i] != NULL && cache->ids[i] != id)
+    {
+        i = (i + 1) & (cache->cap - 1);
+    }
+    if (cache->names[i] == NULL)
+    {
+        cache->ids[i] = id;
+        cache->names[i] = copy;
+        cache->count++;
+        name = copy;
+    }
+    else
+    {
+        // 另一个线程抢先插入了
+        name = cache->names[i];
+        free(copy);
+    }
+    pthread_mutex_unlock(&cache->mutex);
+    return name;
+}
+
+static inline const char *user_name(uid_t uid)
+{
+    if (t_last_user == NULL || t_last_uid != uid)
+    {
+        t_last_user = name_cache_lookup(&g_user_cache, uid, 0);
+        t_last_uid = uid;
+    }
+    return t_last_user;
+}
+
+static inline const char *group_name(gid_t gid)
+{
+    if (t_last_group == NULL || t_last_gid != gid)
+    {
+        t_last_group = name_cache_lookup(&g_group_cache, gid, 1);
+        t_last_gid = gid;
+    }
+    return t_last_group;
+}
+
+// "%b %d %H:%M" 的结果在同一分钟内不变, 只有换了分钟才调 localtime_r
+static inline size_t format_mtime(char *dst, time_t mtime)
+{
+    time_t minute = mtime >= 0 ? mtime / 60 : (mtime - 59) / 60;
+
+    if (minute != t_last_minute)
+    {
+        struct tm time_info;
+        localtime_r(&mtime, &time_info);
+        t_last_time_len = strftime(t_last_time, sizeof(t_last_time), "%b %d %H:%M", &time_info);
+        t_last_minute = minute;
+    }
+    dst[0] = ' ';
+    memcpy(dst + 1, t_last_time, t_last_time_len);
+    return t_last_time_len + 1;
+}
+
+// 相对目录 fd 取文件信息, 内核不用再从头解析路径.
+// flags 为 0 时和 stat() 一样跟随符号链接
+int fetch_file_info(int dir_fd, const char *name, int flags, unsigned int mask, file_info_t *info)
+{
+    if (g_have_statx)
+    {
+        struct statx stx;
+
+        if (statx(dir_fd, name, flags | AT_STATX_SYNC_AS_STAT, mask, &stx) == 0)
+        {
+            info->mode = stx.stx_mode;
+            info->nlink = stx.stx_nlink;
+            info->uid = stx.stx_uid;
+            info->gid = stx.stx_gid;
+            info->size = stx.stx_size;
+            info->mtime = stx.stx_mtime.tv_sec;
+            info->mtime_nsec = stx.stx_mtime.tv_nsec;
+            return 0;
+        }
+        if (errno != ENOSYS)
+        {
+            return -1;
+        }
+        g_have_statx = 0;
+    }
+
+    struct stat file_stat;
+    if (fstatat(dir_fd, name, &file_stat, flags) == -1)
+    {
+        return -1;
+    }
+    info->mode = file_stat.st_mode;
+    info->nlink = file_stat.st_nlink;
+    info->uid = file_stat.st_uid;
+    info->gid = file_stat.st_gid;
+    info->size = file_stat.st_size;
+    info->mtime = file_stat.st_mtime;
+    info->mtime_nsec = file_stat.st_mtim.tv_nsec;
+    return 0;
+}
+
+// 条目的 stat 失败时只报错不显示, 但 -R 仍可能按 d_type 进入它
+#define ENTRY_NOSTAT 0x80
+
+void arena_free(entry_arena_t *arena)
+{
+    free(arena->names);
+    free(arena->name_off);
+    free(arena->size);
+    free(arena->mtime);
+    free(arena->mtime_nsec);
+    free(arena->mode);
+    free(arena->nlink);
+    free(arena->uid);
+    free(arena->gid);
+    free(arena->type);
+    free(arena->order);
+    free(arena->scratch);
+    free(arena->keys);
+    memset(arena, 0, sizeof(*arena));
+}
+
+static int grow_array(void **array, size_t elem_size, size_t cap)
+{
+    void *grown = realloc(*array, elem_size * cap);
+    if (grown == NULL)
+    {
+        return -1;
+    }
+    *array = grown;
+    return 0;
+}
+
+// 追加一个条目, info 为 NULL 表示 stat 失败
+int arena_add(entry_arena_t *arena, const char *name, unsigned char d_type, const file_info_t *info)
+{
+    size_t len = strlen(name) + 1;
+
+    if (arena->count == arena->cap)
+    {
+        size_t cap = arena->cap ? arena->cap * 2 : 1024;
+        if (cap > UINT32_MAX ||
+            grow_array((void **)&arena->name_off, sizeof(uint32_t), cap) != 0 ||
+            grow_array((void **)&arena->size, sizeof(int64_t), cap) != 0 ||
+            grow_array((void **)&arena->mtime, sizeof(int64_t), cap) != 0 ||
+            grow_array((void **)&arena->mtime_nsec, sizeof(uint32_t), cap) != 0 ||
+            grow_array((void **)&arena->mode, sizeof(uint32_t), cap) != 0 ||
+            grow_array((void **)&arena->nlink, sizeof(uint32_t), cap) != 0 ||
+            grow_array((void **)&arena->uid, sizeof(uint32_t), cap) != 0 ||
+            grow_array((void **)&arena->gid, sizeof(uint32_t), cap) != 0 ||
+            grow_array((void **)&arena->type, sizeof(unsigned char), cap) != 0 ||
+            grow_array((void **)&arena->order, sizeof(uint32_t), cap) != 0 ||
+            grow_array((void **)&arena->scratch, sizeof(uint32_t), cap) != 0 ||
+            grow_array((void **)&arena->keys, sizeof(uint64_t), cap) != 0)
+        {
+            return -1;
+        }
+        arena->cap = cap;
+    }
+    if (arena->names_len + len > arena->names_cap)
+    {
+        size_t cap = arena->names_cap ? arena->names_cap : 16384;
+        while (cap < arena->names_len + len)
+        {
+            cap *= 2;
+        }
+        if (cap > UINT32_MAX || grow_array((void **)&arena->names, 1, cap) != 0)
+        {
+            return -1;
+        }
+        arena->names_cap = cap;
+    }
+
+    size_t i = arena->count++;
+    arena->name_off[i] = arena->names_len;
+    memcpy(arena->names + arena->names_len, name, len);
+    arena->names_len += len;
+    arena->type[i] = d_type;
+    if (info == NULL)
+    {
+        arena->type[i] |= ENTRY_NOSTAT;
+        arena->size[i] = arena->mtime[i] = 0;
+        arena->mtime_nsec[i] = arena->mode[i] = arena->nlink[i] = arena->uid[i] = arena->gid[i] = 0;
+        return 0;
+    }
+    arena->size[i] = info->size;
+    arena->mtime[i] = info->mtime;
+    arena->mtime_nsec[i] = info->mtime_nsec;
+    arena->mode[i] = info->mode;
+    arena->nlink[i] = info->nlink;
+    arena->uid[i] = info->uid;
+    arena->gid[i] = info->gid;
+    return 0;
+}
+
+// 名字在字符串池里按插入顺序紧挨着存放, 长度由相邻偏移算出
+static inline size_t entry_name_len(const entry_arena_t *arena, size_t i)
+{
+    size_t end = i + 1 < arena->count ? arena->name_off[i + 1] : arena->names_len;
+    return end - arena->name_off[i] - 1;
+}
+
+static int compare_names(const void *a, const void *b, void *arg)
+{
+    const entry_arena_t *arena = arg;
+    return strcmp(arena->names + arena->name_off[*(const uint32_t *)a],
+                  arena->names + arena->name_off[*(const uint32_t *)b]);
+}
+
+typedef enum
+{
+    KEY_U64,
+    KEY_I64,
+    KEY_U32
+} key_kind_t;
+
+// 统一映射成无符号 64 位再比较: 有符号数翻转符号位, 降序就取反
+static inline uint64_t radix_key(const void *keys, key_kind_t kind, int descending, uint32_t i)
+{
+    uint64_t key;
+
+    if (kind == KEY_U64)
+    {
+        key = ((const uint64_t *)keys)[i];
+    }
+    else if (kind == KEY_I64)
+    {
+        key = (uint64_t)((const int64_t *)keys)[i] ^ (1ULL << 63);
+    }
+    else
+    {
+        key = ((const uint32_t *)keys)[i];
+    }
+    return descending ? ~key : key;
+}
+
+// 按 keys[order[k]] 给 order 做 LSD 基数排序, 稳定, 所以键相同的条目保持原来的顺序.
+// 先一遍统计所有趟的直方图, 整趟都落在同一个桶里的 (高位全相同) 直接跳过
+void radix_sort(uint32_t *order, uint32_t *scratch, size_t n, const void *keys, key_kind_t kind, int descending)
+{
+    static __thread uint32_t hist[RADIX_PASSES][RADIX_SIZE];
+    uint32_t *src = order;
+    uint32_t *dst = scratch;
+
+    memset(hist, 0, sizeof(hist));
+    for (size_t k = 0; k < n; k++)
+    {
+        uint64_t key = radix_key(keys, kind, descending, order[k]);
+        for (int pass = 0; pass < RADIX_PASSES; pass++)
+        {
+            hist[pass][(key >> (pass * RADIX_BITS)) & (RADIX_SIZE - 1)]++;
+        }
+    }
+
+    for (int pass = 0; pass < RADIX_PASSES; pass++)
+    {
+        int shift = pass * RADIX_BITS;
+        uint32_t *count = hist[pass];
+        if (count[(radix_key(keys, kind, descending, order[0]) >> shift) & (RADIX_SIZE - 1)] == n)
+        {
+            continue;
+        }
+
+        uint32_t sum = 0;
+        for (int b = 0; b < RADIX_SIZE; b++)
+        {
+            uint32_t c = count[b];
+            count[b] = sum;
+            sum += c;
+        }
+        for (size_t k = 0; k < n; k++)
+        {
+            uint32_t idx = src[k];
+            dst[count[(radix_key(keys, kind, descending, idx) >> shift) & (RADIX_SIZE - 1)]++] = idx;
+        }
+        uint32_t *tmp = src;
+        src = dst;
+        dst = tmp;
+    }
+
+    if (src != order)
+    {
+        memcpy(order, src, n * sizeof(uint32_t));
+    }
+}
+
+// 名字从第 depth 字节起的 8 个字节按大端拼成整数 (不足补 0),
+// 整数的大小关系和 strcmp 对这一段的结果一致
+static inline uint64_t name_chunk(const entry_arena_t *arena, uint32_t i, size_t depth)
+{
+    const unsigned char *name = (const unsigned char *)arena->names + arena->name_off[i];
+    size_t len = entry_name_len(arena, i);
+    uint64_t key = 0;
+
+    for (size_t b = depth; b < depth + 8; b++)
+    {
+        key = (key << 8) | (b < len ? name[b] : 0);
+    }
+    return key;
+}
+
+// 按名字排序: 每次取 8 个字节做基数排序, 前缀相同的一段再往后取 8 个字节,
+// 剩下的小段交给 qsort_r
+void sort_names(entry_arena_t *arena, uint32_t *order, uint32_t *scratch, size_t n, size_t depth)
+{
+    if (n < 64)
+    {
+        qsort_r(order, n, sizeof(uint32_t), compare_names, arena);
+        return;
+    }
+
+    for (size_t k = 0; k < n; k++)
+    {
+        arena->keys[order[k]] = name_chunk(arena, order[k], depth);
+    }
+    radix_sort(order, scratch, n, arena->keys, KEY_U64, 0);
+
+    size_t start = 0;
+    for (size_t k = 1; k <= n; k++)
+    {
+        if (k == n || arena->keys[order[k]] != arena->keys[order[start]])
+        {
+            // 最后一个字节为 0 说明名字已经结束, 不用再往后比
+            if (k - start > 1 && (arena->keys[order[start]] & 0xff) != 0)
+            {
+                sort_names(arena, order + start, scratch + start, k - start, depth + 8);
+            }
+            start = k;
+        }
+    }
+}
+
+// 只排 order 排列: 先按名字, 再按数值键做稳定排序, -r 整体倒过来
+void sort_entries(entry_arena_t *arena)
+{
+    size_t n = arena->count;
+
+    for (size_t i = 0; i < n; i++)
+    {
+        arena->order[i] = i;
+    }
+    if (g_opts.sort_key == SORT_NONE || n < 2)
+    {
+        return;
+    }
+
+    sort_names(arena, arena->order, arena->scratch, n, 0);
+    if (g_opts.sort_key == SORT_SIZE)
+    {
+        radix_sort(arena->order, arena->scratch, n, arena->size, KEY_I64, 1);
+    }
+    else if (g_opts.sort_key == SORT_TIME)
+    {
+        radix_sort(arena->order, arena->scratch, n, arena->mtime_nsec, KEY_U32, 1);
+        radix_sort(arena->order, arena->scratch, n, arena->mtime, KEY_I64, 1);
+    }
+
+    if (g_opts.reverse)
+    {
+        for (size_t i = 0, j = n - 1; i < j; i++, j--)
+        {
+            uint32_t tmp = arena->order[i];
+            arena->order[i] = arena->order[j];
+            arena->order[j] = tmp;
+        }
+    }
+}
+
+// 显示详细信息 (类似 ls -l), 一行手工拼好再整体追加
+void print_long_entry(out_buf_t *out, const entry_arena_t *arena, size_t i)
+{
+    const char *user = user_name(arena->uid[i]);
+    const char *group = group_name(arena->gid[i]);
+    size_t user_len = strlen(user);
+    size_t group_len = strlen(group);
+    size_t name_len = entry_name_len(arena, i);
+    if (buf_reserve(out, 96 + user_len + group_len + name_len) != 0)
+    {
+        return;
+    }
+
+    char *line = out->data + out->len;
+    char *p = line;
+    format_permissions(p, arena->mode[i]);
+    p += 10;
+    p += format_number(p, (long)arena->nlink[i], 2);
+
+    // 用户名和组名
+    *p++ = ' ';
+    memcpy(p, user, user_len);
+    p += user_len;
+    *p++ = ' ';
+    memcpy(p, group, group_len);
+    p += group_len;
+
+    // 文件大小
+    p += format_number(p, (long)arena->size[i], 8);
+
+    // 修改时间
+    p += format_mtime(p, arena->mtime[i]);
+
+    // 文件名
+    *p++ = ' ';
+    memcpy(p, arena->names + arena->name_off[i], name_len);
+    p += name_len;
+
+    // 如果是目录，添加 / 标识
+    if (S_ISDIR(arena->mode[i]))
+    {
+        *p++ = '/';
+    }
+    *p++ = '\n';
+    out->len += p - line;
+}
+
+static inline size_t entry_width(const entry_arena_t *arena, size_t i)
+{
+    return entry_name_len(arena, i) + (S_ISDIR(arena->mode[i]) ? 1 : 0);
+}
+
+// -C: 和 ls 一样竖着排, 从最多的列数往下试, 取第一个放得进终端宽度的
+void print_columns(out_buf_t *out, entry_arena_t *arena)
+{
+    // 排序已经做完, scratch 用来存要显示的条目
+    uint32_t *shown = arena->scratch;
+    size_t n = 0;
+    for (size_t k = 0; k < arena->count; k++)
+    {
+        if (!(arena->type[arena->order[k]] & ENTRY_NOSTAT))
+        {
+            shown[n++] = arena->order[k];
+        }
+    }
+    if (n == 0)
+    {
+        return;
+    }
+
+    size_t width = g_opts.width;
+    size_t max_cols = width / 3 > 0 ? width / 3 : 1;
+    if (max_cols > n)
+    {
+        max_cols = n;
+    }
+    size_t *col_width = malloc(max_cols * sizeof(size_t));
+    if (col_width == NULL)
+    {
+        return;
+    }
+
+    size_t rows = n;
+    size_t cols = 1;
+    for (size_t try_cols = max_cols; try_cols > 1; try_cols--)
+    {
+        size_t try_rows = (n + try_cols - 1) / try_cols;
+        size_t used = (n + try_rows - 1) / try_rows;
+        size_t total = 2 * (used - 1);
+        for (size_t c = 0; c < used && total <= width; c++)
+        {
+            size_t widest = 0;
+            for (size_t k = c * try_rows; k < n && k < (c + 1) * try_rows; k++)
+            {
+                size_t w = entry_width(arena, shown[k]);
+                if (w > widest)
+                {
+                    widest = w;
+                }
+            }
+            col_width[c] = widest;
+            total += widest;
+        }
+        if (total <= width)
+        {
+            rows = try_rows;
+            cols = used;
+            break;
+        }
+    }
+    if (cols == 1)
+    {
+        col_width[0] = 0;
+    }
+
+    for (size_t r = 0; r < rows; r++)
+    {
+        for (size_t c = 0; c < cols; c++)
+        {
+            size_t k = c * rows + r;
+            if (k >= n)
+            {
+                break;
+            }
+            uint32_t i = shown[k];
+            size_t name_len = entry_name_len(arena, i);
+            int is_dir = S_ISDIR(arena->mode[i]);
+            int last = c + 1 == cols || k + rows >= n;
+            size_t pad = last ? 0 : col_width[c] + 2 - name_len - is_dir;
+            if (buf_reserve(out, name_len + 1 + pad + 1) != 0)
+            {
+                break;
+            }
+            memcpy(out->data + out->len, arena->names + arena->name_off[i], name_len);
+            out->len += name_len;
+            if (is_dir)
+            {
+                out->data[out->len++] = '/';
+            }
+            memset(out->data + out->len, ' ', pad);
+            out->len += pad;
+        }
+        buf_append(out, "\n", 1);
+    }
+    free(col_width);
+}
+
+dir_node_t *node_create(const char *parent, const char *name, int fd)
+{
+    dir_node_t *node = calloc(1, sizeof(dir_node_t));
+    if (node == NULL)
+    {
+        return NULL;
+    }
+
+    if (parent == NULL)
+    {
+        node->path = strdup(name);
+    }
+    else
+    {
+        size_t plen = strlen(parent);
+        int slash = plen > 0 && parent[plen - 1] != '/';
+        node->path = malloc(plen + slash + strlen(name) + 1);
+        if (node->path != NULL)
+        {
+            sprintf(node->path, slash ? "%s/%s" : "%s%s", parent, name);
+        }
+    }
+    if (node->path == NULL)
+    {
+        free(node);
+        return NULL;
+    }
+    node->fd = fd;
+    node->out.fd = -1;
+    node->err.fd = -1;
+    return node;
+}
+
+void node_destroy(dir_node_t *node)
+{
+    if (node->fd >= 0)
+    {
+        close(node->fd);
+        __atomic_sub_fetch(&g_open_fds, 1, __ATOMIC_RELAXED);
+    }
+    buf_free(&node->out);
+    buf_free(&node->err);
+    free(node->children);
+    free(node->path);
+    free(node);
+}
+
+// -R: 记录一个需要递归进入的子目录. 不跟随符号链接, 和 ls -R 一致
+void add_child(dir_node_t *node, int dir_fd, const char *name, unsigned char d_type)
+{
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+    {
+        return;
+    }
+    if (d_type == DT_UNKNOWN)
+    {
+        file_info_t info;
+        if (fetch_file_info(dir_fd, name, AT_SYMLINK_NOFOLLOW, STATX_TYPE, &info) == -1 || !S_ISDIR(info.mode))
+        {
+            return;
+        }
+    }
+    else if (d_type != DT_DIR)
+    {
+        return;
+    }
+
+    if (node->nchildren == node->children_cap)
+    {
+        int cap = node->children_cap ? node->children_cap * 2 : 8;
+        dir_node_t **children = realloc(node->children, cap * sizeof(dir_node_t *));
+        if (children == NULL)
+        {
+            return;
+        }
+        node->children = children;
+        node->children_cap = cap;
+    }
+
+    int fd = -1;
+    if (__atomic_add_fetch(&g_open_fds, 1, __ATOMIC_RELAXED) <= g_fd_budget)
+    {
+        fd = openat(dir_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    }
+    if (fd == -1)
+    {
+        __atomic_sub_fetch(&g_open_fds, 1, __ATOMIC_RELAXED);
+    }
+
+    dir_node_t *child = node_create(node->path, name, fd);
+    if (child == NULL)
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+            __atomic_sub_fetch(&g_open_fds, 1, __ATOMIC_RELAXED);
+        }
+        return;
+    }
+    node->children[node->nchildren++] = child;
+}
+
+// 先把整个目录收进 arena, 排好序再统一格式化; -R 的子目录也按排好的顺序进入
+void list_directory(dir_node_t *node, char *dirent_buf, entry_arena_t *arena)
+{
+    int dir_fd = node->fd;
+    if (dir_fd == -1)
+    {
+        dir_fd = open(node->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (dir_fd == -1)
+        {
+            buf_printf(&node->err, "opendir: %s\n", strerror(errno));
+            return;
+        }
+    }
+
+    buf_printf(&node->out, "Directory: %s\n", node->path);
+    if (g_opts.show_details)
+    {
+        buf_printf(&node->out, "total files in directory:\n");
+    }
+
+    // -l 要全部字段; 只按大小/时间排序时要这几个; 否则 d_type 不够用时才 stat
+    unsigned int mask = 0;
+    if (g_opts.show_details)
+    {
+        mask = DETAIL_MASK;
+    }
+    else if (g_opts.sort_key == SORT_SIZE || g_opts.sort_key == SORT_TIME)
+    {
+        mask = STATX_TYPE | STATX_SIZE | STATX_MTIME;
+    }
+
+    arena->count = 0;
+    arena->names_len = 0;
+
+    // 一次 getdents64 取回一大批目录项
+    for (;;)
+    {
+        long nread = syscall(SYS_getdents64, dir_fd, dirent_buf, DIRENT_BUF_SIZE);
+        if (nread == -1)
+        {
+            buf_printf(&node->err, "getdents64: %s\n", strerror(errno));
+            break;
+        }
+        if (nread == 0)
+        {
+            break;
+        }
+
+        for (long pos = 0; pos < nread;)
+        {
+            struct linux_dirent64 *entry = (struct linux_dirent64 *)(dirent_buf + pos);
+            pos += entry->d_reclen;
+
+            // 跳过隐藏文件（除非使用 -a 选项）
+            if (!g_opts.show_all && entry->d_name[0] == '.')
+            {
+                continue;
+            }
+
+            file_info_t info;
+            int stat_ok = 1;
+            if (mask != 0 || entry->d_type == DT_LNK || entry->d_type == DT_UNKNOWN)
+            {
+                // 简单显示只需要知道是不是目录: 符号链接和 DT_UNKNOWN 才去问内核
+                stat_ok = fetch_file_info(dir_fd, entry->d_name, 0, mask ? mask : STATX_TYPE, &info) == 0;
+                if (!stat_ok)
+                {
+                    buf_printf(&node->err, "stat: %s\n", strerror(errno));
+                }
+            }
+            else
+            {
+                memset(&info, 0, sizeof(info));
+                info.mode = entry->d_type == DT_DIR ? S_IFDIR : 0;
+            }
+
+            if (arena_add(arena, entry->d_name, entry->d_type, stat_ok ? &info : NULL) != 0)
+            {
+                buf_printf(&node->err, "%s: %s\n", node->path, strerror(ENOMEM));
+                break;
+            }
+        }
+    }
+
+    sort_entries(arena);
+
+    if (g_opts.show_details)
+    {
+        for (size_t k = 0; k < arena->count; k++)
+        {
+            uint32_t i = arena->order[k];
+            if (!(arena->type[i] & ENTRY_NOSTAT))
+            {
+                print_long_entry(&node->out, arena, i);
+            }
+        }
+    }
+    else if (g_opts.columns)
+    {
+        print_columns(&node->out, arena);
+    }
+    else
+    {
+        for (size_t k = 0; k < arena->count; k++)
+        {
+            uint32_t i = arena->order[k];
+            if (!(arena->type[i] & ENTRY_NOSTAT))
+            {
+                buf_append(&node->out, arena->names + arena->name_off[i], entry_name_len(arena, i));
+                if (S_ISDIR(arena->mode[i]))
+                {
+                    buf_append(&node->out, "/", 1);
+                }
+                buf_append(&node->out, "  ", 2);
+            }
+        }
+        buf_printf(&node->out, "\n");
+    }
+
+    if (g_opts.recursive)
+    {
+        for (size_t k = 0; k < arena->count; k++)
+        {
+            uint32_t i = arena->order[k];
+            add_child(node, dir_fd, arena->names + arena->name_off[i], arena->type[i] & ~ENTRY_NOSTAT);
+        }
+    }
+
+    if (node->fd == -1)
+    {
+        close(dir_fd);
+    }
+}
+
+int deque_init(work_deque_t *dq)
+{
+    dq->capacity = 64;
+    dq->top = dq->bottom = 0;
+    dq->tasks = malloc(dq->capacity * sizeof(dir_node_t *));
+    if (dq->tasks == NULL)
+    {
+        return -1;
+    }
+    pthread_mutex_init(&dq->mutex, NULL);
+    return 0;
+}
+
+void deque_destroy(work_deque_t *dq)
+{
+    pthread_mutex_destroy(&dq->mutex);
+    free(dq->tasks);
+}
+
+int deque_push(work_deque_t *dq, dir_node_t *node)
+{
+    pthread_mutex_lock(&dq->mutex);
+    if (dq->top == dq->bottom)
+    {
+        dq->top = dq->bottom = 0;
+    }
+    if (dq->bottom == dq->capacity)
+    {
+        dir_node_t **tasks = realloc(dq->tasks, dq->capacity * 2 * sizeof(dir_node_t *));
+        if (tasks == NULL)
+        {
+            pthread_mutex_unlock(&dq->mutex);
+            return -1;
+        }
+        dq->tasks = tasks;
+        dq->capacity *= 2;
+    }
+    dq->tasks[dq->bottom++] = node;
+    pthread_mutex_unlock(&dq->mutex);
+    return 0;
+}
+
+dir_node_t *deque_pop(work_deque_t *dq)
+{
+    dir_node_t *node = NULL;
+
+    pthread_mutex_lock(&dq->mutex);
+    if (dq->bottom > dq->top)
+    {
+        node = dq->tasks[--dq->bottom];
+    }
+    pthread_mutex_unlock(&dq->mutex);
+    return node;
+}
+
+dir_node_t *deque_steal(work_deque_t *dq)
+{
+    dir_node_t *node = NULL;
+
+    pthread_mutex_lock(&dq->mutex);
+    if (dq->bottom > dq->top)
+    {
+        node = dq->tasks[dq->top++];
+    }
+    pthread_mutex_unlock(&dq->mutex);
+    return node;
+}
+
+// 先取自己队列的 bottom (深度优先, 局部性好), 没有再轮流去别人队列的 top 偷
+dir_node_t *walker_next_task(walker_t *walker, int id)
+{
+    dir_node_t *node = deque_pop(&walker->deques[id]);
+
+    for (int i = 1; node == NULL && i < walker->nthreads; i++)
+    {
+        node = deque_steal(&walker->deques[(id + i) % walker->nthreads]);
+    }
+    return node;
+}
+
+void *walker_thread(void *arg)
+{
+    worker_t *self = arg;
+    walker_t *walker = self->walker;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&walker->idle_mutex);
+        while (walker->queued == 0 && walker->pending > 0)
+        {
+            pthread_cond_wait(&walker->idle_cond, &walker->idle_mutex);
+        }
+        if (walker->pending == 0)
+        {
+            pthread_mutex_unlock(&walker->idle_mutex);
+            break;
+        }
+        pthread_mutex_unlock(&walker->idle_mutex);
+
+        dir_node_t *node = walker_next_task(walker, self->id);
+        if (node == NULL)
+        {
+            // 被别的线程抢先偷走了, 回去重新等
+            continue;
+        }
+        pthread_mutex_lock(&walker->idle_mutex);
+        walker->queued--;
+        pthread_mutex_unlock(&walker->idle_mutex);
+
+        list_directory(node, self->dirent_buf, &self->arena);
+
+        // 子目录倒序压入, 自己弹出时正好按目录顺序处理
+        int pushed = 0;
+        for (int i = node->nchildren - 1; i >= 0; i--)
+        {
+            if (deque_push(&walker->deques[self->id], node->children[i]) == 0)
+            {
+                pushed++;
+            }
+            else
+            {
+                // 入队失败: 标记完成并报错, 打印线程不会卡住
+                buf_printf(&node->children[i]->err, "%s: %s\n", node->children[i]->path, strerror(ENOMEM));
+                pthread_mutex_lock(&walker->done_mutex);
+                node->children[i]->done = 1;
+                pthread_mutex_unlock(&walker->done_mutex);
+            }
+        }
+
+        pthread_mutex_lock(&walker->idle_mutex);
+        walker->queued += pushed;
+        walker->pending += pushed - 1;
+        pthread_cond_broadcast(&walker->idle_cond);
+        pthread_mutex_unlock(&walker->idle_mutex);
+
+        pthread_mutex_lock(&walker->done_mutex);
+        node->done = 1;
+        pthread_cond_broadcast(&walker->done_cond);
+        pthread_mutex_unlock(&walker->done_mutex);
+    }
+    return NULL;
+}
+
+// 按先序输出: 主线程等每个目录完成后立刻打印并释放, 输出顺序与线程调度无关
+void print_tree(walker_t *walker, dir_node_t *root)
+{
+    size_t cap = 1024, top = 0;
+    dir_node_t **stack = malloc(cap * sizeof(dir_node_t *));
+    out_buf_t out = { NULL, 0, 0, STDOUT_FILENO };
+    int first = 1;
+
+    if (stack == NULL)
+    {
+        return;
+    }
+    stack[top++] = root;
+
+    while (top > 0)
+    {
+        dir_node_t *node = stack[--top];
+
+        pthread_mutex_lock(&walker->done_mutex);
+        while (!node->done)
+        {
+            pthread_cond_wait(&walker->done_cond, &walker->done_mutex);
+        }
+        pthread_mutex_unlock(&walker->done_mutex);
+
+        // 小目录的输出攒进同一个缓冲区, 攒满 OUT_FLUSH_SIZE 才 write 一次
+        if (!first && node->out.len > 0)
+        {
+            buf_append(&out, "\n", 1);
+        }
+        first = 0;
+        if (node->out.len >= OUT_FLUSH_SIZE)
+        {
+            buf_flush(&out);
+            write_all(STDOUT_FILENO, node->out.data, node->out.len);
+        }
+        else
+        {
+            buf_append(&out, node->out.data, node->out.len);
+        }
+        if (node->err.len > 0)
+        {
+            buf_flush(&out);
+            write_all(STDERR_FILENO, node->err.data, node->err.len);
+        }
+
+        if (top + node->nchildren > cap)
+        {
+            while (top + node->nchildren > cap)
+            {
+                cap *= 2;
+            }
+            dir_node_t **grown = realloc(stack, cap * sizeof(dir_node_t *));
+            if (grown == NULL)
+            {
+                break;
+            }
+            stack = grown;
+        }
+        for (int i = node->nchildren - 1; i >= 0; i--)
+        {
+            stack[top++] = node->children[i];
+        }
+        node_destroy(node);
+    }
+    buf_free(&out);
+    free(stack);
+}
+
+// 递归遍历: 目录 fd 在工作窃取队列之间流转, 子目录用 openat 相对父目录打开
+void mini_ls_recursive(dir_node_t *root)
+{
+    walker_t *walker = calloc(1, sizeof(walker_t));
+    pthread_t threads[MAX_THREADS];
+    int started = 0;
+
+    if (walker == NULL)
+    {
+        perror("calloc");
+        node_destroy(root);
+        return;
+    }
+    // nthreads 在线程启动前定下, 之后不再改: 没起来的线程的队列一直是空的, 偷不到东西而已
+    walker->nthreads = g_opts.threads;
+    for (int i = 0; i < walker->nthreads; i++)
+    {
+        if (deque_init(&walker->deques[i]) != 0)
+        {
+            perror("malloc");
+            for (int j = 0; j < i; j++)
+            {
+                deque_destroy(&walker->deques[j]);
+            }
+            free(walker);
+            node_destroy(root);
+            return;
+        }
+    }
+    pthread_mutex_init(&walker->idle_mutex, NULL);
+    pthread_cond_init(&walker->idle_cond, NULL);
+    pthread_mutex_init(&walker->done_mutex, NULL);
+    pthread_cond_init(&walker->done_cond, NULL);
+
+    deque_push(&walker->deques[0], root);
+    walker->queued = 1;
+    walker->pending = 1;
+
+    for (int i = 0; i < walker->nthreads; i++)
+    {
+        worker_t *worker = &walker->workers[i];
+        worker->walker = walker;
+        worker->id = i;
+        worker->dirent_buf = malloc(DIRENT_BUF_SIZE);
+        if (worker->dirent_buf == NULL || pthread_create(&threads[i], NULL, walker_thread, worker) != 0)
+        {
+            free(worker->dirent_buf);
+            break;
+        }
+        started++;
+    }
+
+    if (started == 0)
+    {
+        // 一个线程都起不来就在当前线程里跑
+        worker_t *worker = &walker->workers[0];
+        worker->dirent_buf = malloc(DIRENT_BUF_SIZE);
+        if (worker->dirent_buf != NULL)
+        {
+            // 没有别的线程在跑, 这里改 nthreads 是安全的
+            walker->nthreads = 1;
+            walker_thread(worker);
+        }
+    }
+
+    print_tree(walker, root);
+
+    for (int i = 0; i < started; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+    for (int i = 0; i < MAX_THREADS; i++)
+    {
+        free(walker->workers[i].dirent_buf);
+        arena_free(&walker->workers[i].arena);
+    }
+    for (int i = 0; i < g_opts.threads; i++)
+    {
+        deque_destroy(&walker->deques[i]);
+    }
+    pthread_cond_destroy(&walker->done_cond);
+    pthread_mutex_destroy(&walker->done_mutex);
+    pthread_cond_destroy(&walker->idle_cond);
+    pthread_mutex_destroy(&walker->idle_mutex);
+    free(walker);
+}
+
+// -R 会同时打开很多目录 fd: 把软限制提到硬限制, 留一半给预打开的子目录
+void setup_fd_budget(void)
 {
-    printf((S_ISDIR(mode)) ? "d" : "-");
-    printf((mode & S_IRUSR) ? "r" : "-");
-    printf((mode & S_IWUSR) ? "w" : "-");
-    printf((mode & S_IXUSR) ? "x" : "-");
-    printf((mode & S_IRGRP) ? "r" : "-");
-    printf((mode & S_IWGRP) ? "w" : "-");
-    printf((mode & S_IXGRP) ? "x" : "-");
-    printf((mode & S_IROTH) ? "r" : "-");
-    printf((mode & S_IWOTH) ? "w" : "-");
-    printf((mode & S_IXOTH) ? "x" : "-");
+    struct rlimit limit;
+
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0)
+    {
+        if (limit.rlim_cur < limit.rlim_max)
+        {
+            limit.rlim_cur = limit.rlim_max;
+            setrlimit(RLIMIT_NOFILE, &limit);
+            getrlimit(RLIMIT_NOFILE, &limit);
+        }
+        g_fd_budget = limit.rlim_cur == RLIM_INFINITY ? 1 << 20 : (long)limit.rlim_cur / 2;
+    }
 }
 
-void print_file_info(const char *filename, const char *path, int show_details)
+void mini_ls(const char *path)
 {
-    struct stat file_stat;
-    char full_path[1024];
+    int dir_fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd == -1)
+    {
+        perror("opendir");
+        return;
+    }
 
-    // 构建完整路径
-    if (strcmp(path, ".") == 0)
+    dir_node_t *root = node_create(NULL, path, dir_fd);
+    if (root == NULL)
     {
-        strcpy(full_path, filename);
+        perror("malloc");
+        close(dir_fd);
+        return;
     }
-    else
+    g_open_fds++;
+
+    if (g_opts.recursive)
+    {
+        setup_fd_budget();
+        mini_ls_recursive(root);
+        return;
+    }
+
+    char *dirent_buf = malloc(DIRENT_BUF_SIZE);
+    if (dirent_buf == NULL)
+    {
+        perror("malloc");
+        node_destroy(root);
+        return;
+    }
+    // 单目录模式不需要排队等别人, 输出缓冲区满了就直接写出去
+    entry_arena_t arena;
+    memset(&arena, 0, sizeof(arena));
+    root->out.fd = STDOUT_FILENO;
+    list_directory(root, dirent_buf, &arena);
+    buf_flush(&root->out);
+    write_all(STDERR_FILENO, root->err.data, root->err.len);
+    arena_free(&arena);
+    free(dirent_buf);
+    node_destroy(root);
+}
+
+// ---------------- du 模式 ----------------
+// 目录的 mtime 只在增删改名条目时变化. 上次索引里 inode 和 mtime 都没变的目录
+// 直接复用它的文件总量和子目录列表, 只对子目录做一次 fstatat 看要不要往下走;
+// 变了的目录才重新 getdents64 并 stat 每个条目.
+// 注意: 文件原地变大不会改目录 mtime, 这种变化要等所在目录有增删才会被发现.
+
+#define DU_MAGIC "MLSDU01"
+
+static int du_same_mtime(const du_record_t *rec, const struct stat *st)
+{
+    return rec->mtime == (int64_t)st->st_mtim.tv_sec && rec->mtime_nsec == (uint32_t)st->st_mtim.tv_nsec;
+}
+
+static const char *du_old_name(const du_ctx_t *ctx, size_t o)
+{
+    return ctx->old_pool + ctx->old[o].name_off;
+}
+
+// 索引文件可能损坏或被截断, 用到的每条旧记录都先检查一遍
+static int du_old_valid(const du_ctx_t *ctx, size_t o)
+{
+    return o < ctx->old_count && ctx->old[o].subtree >= 1 &&
+           ctx->old[o].subtree <= ctx->old_count - o && ctx->old[o].name_off < ctx->old_pool_size;
+}
+
+void du_load_index(du_ctx_t *ctx, const char *index_path)
+{
+    int fd = open(index_path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
     {
-        snprintf(full_path, sizeof(full_path), "%s/%s", path, filename);
+        if (errno != ENOENT)
+        {
+            fprintf(stderr, "%s: %s\n", index_path, strerror(errno));
+        }
+        return;
     }
 
-    if (stat(full_path, &file_stat) == -1)
+    struct stat st;
+    void *map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size < sizeof(du_header_t))
+    {
+        fprintf(stderr, "%s: 索引格式不对, 重新统计\n", index_path);
+        close(fd);
+        return;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
     {
-        perror("stat");
+        fprintf(stderr, "%s: 索引无法读取, 重新统计\n", index_path);
         return;
     }
 
-    if (show_details)
+    const du_header_t *header = map;
+    size_t size = st.st_size;
+    if (memcmp(header->magic, DU_MAGIC, sizeof(header->magic)) != 0 ||
+        header->count > (size - sizeof(du_header_t)) / sizeof(du_record_t) ||
+        header->pool_size != size - sizeof(du_header_t) - header->count * sizeof(du_record_t) ||
+        header->pool_size == 0 || ((const char *)map)[size - 1] != '\0')
     {
-        // 显示详细信息 (类似 ls -l)
-        print_permissions(file_stat.st_mode);
-        printf(" %2ld", file_stat.st_nlink);
+        fprintf(stderr, "%s: 索引格式不对, 重新统计\n", index_path);
+        munmap(map, size);
+        return;
+    }
 
-        // 用户名和组名
-        struct passwd *pwd = getpwuid(file_stat.st_uid);
-        struct group *grp = getgrgid(file_stat.st_gid);
-        printf(" %s %s", pwd ? pwd->pw_name : "unknown", grp ? grp->gr_name : "unknown");
+    ctx->old_map = map;
+    ctx->old_map_size = size;
+    ctx->old = (const du_record_t *)(header + 1);
+    ctx->old_count = header->count;
+    ctx->old_pool = (const char *)(ctx->old + ctx->old_count);
+    ctx->old_pool_size = header->pool_size;
+}
+
+// 先写临时文件再 rename, 中途失败也不会留下半个索引
+int du_save_index(du_ctx_t *ctx, const char *index_path)
+{
+    size_t len = strlen(index_path);
+    char *tmp_path = malloc(len + 16);
+    if (tmp_path == NULL)
+    {
+        return -1;
+    }
+    snprintf(tmp_path, len + 16, "%s.tmp.%d", index_path, (int)getpid());
 
-        // 文件大小
-        printf(" %8ld", file_stat.st_size);
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1)
+    {
+        perror(tmp_path);
+        free(tmp_path);
+        return -1;
+    }
 
-        // 修改时间
-        char time_str[64];
-        struct tm *time_info = localtime(&file_stat.st_mtime);
-        strftime(time_str, sizeof(time_str), "%b %d %H:%M", time_info);
-        printf(" %s", time_str);
+    du_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, DU_MAGIC, sizeof(header.magic));
+    header.count = ctx->count;
+    header.pool_size = ctx->pool_len;
+    int ret = 0;
+    if (write_all(fd, (const char *)&header, sizeof(header)) != 0 ||
+        write_all(fd, (const char *)ctx->records, ctx->count * sizeof(du_record_t)) != 0 ||
+        write_all(fd, ctx->pool, ctx->pool_len) != 0)
+    {
+        perror(tmp_path);
+        ret = -1;
+    }
+    if (close(fd) != 0 && ret == 0)
+    {
+        perror(tmp_path);
+        ret = -1;
+    }
+    if (ret == 0 && rename(tmp_path, index_path) != 0)
+    {
+        perror(index_path);
+        ret = -1;
+    }
+    if (ret != 0)
+    {
+        unlink(tmp_path);
+    }
+    free(tmp_path);
+    return ret;
+}
 
-        // 文件名
-        printf(" %s", filename);
+static long du_new_record(du_ctx_t *ctx, const char *name, const struct stat *st)
+{
+    size_t len = strlen(name) + 1;
 
-        // 如果是目录，添加 / 标识
-        if (S_ISDIR(file_stat.st_mode))
+    if (ctx->count == ctx->cap)
+    {
+        size_t cap = ctx->cap ? ctx->cap * 2 : 1024;
+        if (cap > UINT32_MAX || grow_array((void **)&ctx->records, sizeof(du_record_t), cap) != 0)
         {
-            printf("/");
+            return -1;
         }
-        printf("\n");
+        ctx->cap = cap;
     }
-    else
+    if (ctx->pool_len + len > ctx->pool_cap)
     {
-        // 简单显示文件名
-        printf("%s", filename);
-        if (S_ISDIR(file_stat.st_mode))
+        size_t cap = ctx->pool_cap ? ctx->pool_cap : 65536;
+        while (cap < ctx->pool_len + len)
+        {
+            cap *= 2;
+        }
+        if (cap > UINT32_MAX || grow_array((void **)&ctx->pool, 1, cap) != 0)
         {
-            printf("/");
+            return -1;
         }
-        printf("  ");
+        ctx->pool_cap = cap;
     }
+
+    du_record_t *rec = &ctx->records[ctx->count];
+    memset(rec, 0, sizeof(*rec));
+    rec->dev = st->st_dev;
+    rec->ino = st->st_ino;
+    rec->mtime = st->st_mtim.tv_sec;
+    rec->mtime_nsec = st->st_mtim.tv_nsec;
+    rec->name_off = ctx->pool_len;
+    rec->subtree = 1;
+    memcpy(ctx->pool + ctx->pool_len, name, len);
+    ctx->pool_len += len;
+    return ctx->count++;
 }
 
-void mini_ls(const char *path, int show_all, int show_details)
+// 当前路径只在报错和输出时用, 按层压入弹出
+static size_t du_path_push(du_ctx_t *ctx, const char *name)
 {
-    DIR *dir;
-    struct dirent *entry;
+    size_t saved = ctx->path_len;
+    size_t len = strlen(name);
 
-    dir = opendir(path);
-    if (dir == NULL)
+    if (ctx->path_len + len + 2 > ctx->path_cap)
+    {
+        size_t cap = ctx->path_cap ? ctx->path_cap : 4096;
+        while (cap < ctx->path_len + len + 2)
+        {
+            cap *= 2;
+        }
+        if (grow_array((void **)&ctx->path, 1, cap) != 0)
+        {
+            return saved;
+        }
+        ctx->path_cap = cap;
+    }
+    if (ctx->path_len > 0 && ctx->path[ctx->path_len - 1] != '/')
+    {
+        ctx->path[ctx->path_len++] = '/';
+    }
+    memcpy(ctx->path + ctx->path_len, name, len + 1);
+    ctx->path_len += len;
+    return saved;
+}
+
+static void du_path_pop(du_ctx_t *ctx, size_t saved)
+{
+    ctx->path_len = saved;
+    ctx->path[saved] = '\0';
+}
+
+static int compare_old_names(const void *a, const void *b, void *arg)
+{
+    const du_ctx_t *ctx = arg;
+    return strcmp(du_old_name(ctx, *(const uint32_t *)a), du_old_name(ctx, *(const uint32_t *)b));
+}
+
+long du_scan(du_ctx_t *ctx, int dir_fd, const char *name, const struct stat *st, long old);
+
+// 进入一个子目录, 结果累加到父记录 r 上. st 为 NULL 时自己 stat
+static void du_visit_child(du_ctx_t *ctx, long r, int dir_fd, const char *name, const struct stat *st, long old)
+{
+    struct stat child_st;
+
+    if (st == NULL)
+    {
+        if (fstatat(dir_fd, name, &child_st, AT_SYMLINK_NOFOLLOW) == -1)
+        {
+            if (errno != ENOENT)
+            {
+                size_t saved = du_path_push(ctx, name);
+                fprintf(stderr, "stat: %s: %s\n", ctx->path, strerror(errno));
+                du_path_pop(ctx, saved);
+            }
+            return;
+        }
+        st = &child_st;
+    }
+    if (!S_ISDIR(st->st_mode))
     {
-        perror("opendir");
         return;
     }
 
-    printf("Directory: %s\n", path);
-    if (show_details)
+    size_t saved = du_path_push(ctx, name);
+    int fd = openat(dir_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd == -1)
+    {
+        fprintf(stderr, "opendir: %s: %s\n", ctx->path, strerror(errno));
+    }
+    long child = du_scan(ctx, fd, name, st, old);
+    if (fd != -1)
+    {
+        close(fd);
+    }
+    du_path_pop(ctx, saved);
+
+    if (child >= 0)
+    {
+        ctx->records[r].total_bytes += ctx->records[child].total_bytes;
+        ctx->records[r].nchildren++;
+    }
+}
+
+// 统计一个目录 (dir_fd 为 -1 表示打不开, 只记它自身). old 是上次索引里
+// 同名的记录, 没有时为 -1. 返回新记录的下标
+long du_scan(du_ctx_t *ctx, int dir_fd, const char *name, const struct stat *st, long old)
+{
+    if (old >= 0 && (!du_old_valid(ctx, old) || ctx->old[old].dev != (uint64_t)st->st_dev ||
+                     ctx->old[old].ino != (uint64_t)st->st_ino))
+    {
+        old = -1;
+    }
+
+    long r = du_new_record(ctx, name, st);
+    if (r < 0)
+    {
+        fprintf(stderr, "%s: %s\n", ctx->path, strerror(ENOMEM));
+        return -1;
+    }
+    if (dir_fd == -1)
     {
-        printf("total files in directory:\n");
+        ctx->records[r].file_bytes = ctx->records[r].total_bytes = (uint64_t)st->st_blocks * 512;
+        return r;
     }
 
-    while ((entry = readdir(dir)) != NULL)
+    if (old >= 0 && du_same_mtime(&ctx->old[old], st))
     {
-        // 跳过隐藏文件（除非使用 -a 选项）
-        if (!show_all && entry->d_name[0] == '.')
+        // 目录没变: 文件总量照抄, 只沿着上次记下的子目录往下看
+        ctx->reused++;
+        ctx->records[r].file_bytes = ctx->records[r].total_bytes = ctx->old[old].file_bytes;
+        size_t c = old + 1;
+        for (uint32_t k = 0; k < ctx->old[old].nchildren && du_old_valid(ctx, c); k++)
         {
-            continue;
+            du_visit_child(ctx, r, dir_fd, du_old_name(ctx, c), NULL, c);
+            c += ctx->old[c].subtree;
+        }
+        ctx->records[r].subtree = ctx->count - r;
+        return r;
+    }
+
+    // 目录变了 (或者是新目录): 重新列一遍, 旧的子目录记录按名字找回来
+    ctx->rescanned++;
+    uint64_t file_bytes = (uint64_t)st->st_blocks * 512;
+    uint32_t *old_children = NULL;
+    uint32_t old_nchildren = 0;
+    if (old >= 0 && ctx->old[old].nchildren > 0)
+    {
+        old_children = malloc(ctx->old[old].nchildren * sizeof(uint32_t));
+        size_t c = old + 1;
+        for (uint32_t k = 0; old_children != NULL && k < ctx->old[old].nchildren && du_old_valid(ctx, c); k++)
+        {
+            old_children[old_nchildren++] = c;
+            c += ctx->old[c].subtree;
+        }
+        qsort_r(old_children, old_nchildren, sizeof(uint32_t), compare_old_names, ctx);
+    }
+
+    // dirent_buf 全局只有一份, 先把子目录收集起来, 列完再递归
+    char *names = NULL;
+    size_t names_len = 0, names_cap = 0;
+    struct stat *stats = NULL;
+    size_t nsub = 0, sub_cap = 0;
+    for (;;)
+    {
+        long nread = syscall(SYS_getdents64, dir_fd, ctx->dirent_buf, DIRENT_BUF_SIZE);
+        if (nread == -1)
+        {
+            fprintf(stderr, "getdents64: %s: %s\n", ctx->path, strerror(errno));
+            break;
+        }
+        if (nread == 0)
+        {
+            break;
+        }
+
+        for (long pos = 0; pos < nread;)
+        {
+            struct linux_dirent64 *entry = (struct linux_dirent64 *)(ctx->dirent_buf + pos);
+            pos += entry->d_reclen;
+            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+            {
+                continue;
+            }
+
+            struct stat entry_st;
+            if (fstatat(dir_fd, entry->d_name, &entry_st, AT_SYMLINK_NOFOLLOW) == -1)
+            {
+                if (errno != ENOENT)
+                {
+                    fprintf(stderr, "stat: %s/%s: %s\n", ctx->path, entry->d_name, strerror(errno));
+                }
+                continue;
+            }
+            if (!S_ISDIR(entry_st.st_mode))
+            {
+                file_bytes += (uint64_t)entry_st.st_blocks * 512;
+                continue;
+            }
+
+            size_t len = strlen(entry->d_name) + 1;
+            if (nsub == sub_cap)
+            {
+                sub_cap = sub_cap ? sub_cap * 2 : 16;
+                if (grow_array((void **)&stats, sizeof(struct stat), sub_cap) != 0)
+                {
+                    break;
+                }
+            }
+            if (names_len + len > names_cap)
+            {
+                names_cap = names_cap ? names_cap * 2 : 4096;
+                while (names_cap < names_len + len)
+                {
+                    names_cap *= 2;
+                }
+                if (grow_array((void **)&names, 1, names_cap) != 0)
+                {
+                    break;
+                }
+            }
+            memcpy(names + names_len, entry->d_name, len);
+            names_len += len;
+            stats[nsub++] = entry_st;
+        }
+    }
+    ctx->records[r].file_bytes = ctx->records[r].total_bytes = file_bytes;
+
+    const char *child_name = names;
+    for (size_t k = 0; k < nsub; k++)
+    {
+        long child_old = -1;
+        if (old_nchildren > 0)
+        {
+            // 二分查找同名的旧记录
+            size_t lo = 0, hi = old_nchildren;
+            while (lo < hi)
+            {
+                size_t mid = (lo + hi) / 2;
+                int cmp = strcmp(du_old_name(ctx, old_children[mid]), child_name);
+                if (cmp == 0)
+                {
+                    child_old = old_children[mid];
+                    break;
+                }
+                if (cmp < 0)
+                {
+                    lo = mid + 1;
+                }
+                else
+                {
+                    hi = mid;
+                }
+            }
         }
+        du_visit_child(ctx, r, dir_fd, child_name, &stats[k], child_old);
+        child_name += strlen(child_name) + 1;
+    }
+
+    free(names);
+    free(stats);
+    free(old_children);
+    ctx->records[r].subtree = ctx->count - r;
+    return r;
+}
+
+static int compare_totals(const void *a, const void *b, void *arg)
+{
+    const du_ctx_t *ctx = arg;
+    const du_record_t *x = &ctx->records[*(const uint32_t *)a];
+    const du_record_t *y = &ctx->records[*(const uint32_t *)b];
+    if (x->total_bytes != y->total_bytes)
+    {
+        return x->total_bytes < y->total_bytes ? 1 : -1;
+    }
+    return strcmp(ctx->pool + x->name_off, ctx->pool + y->name_off);
+}
+
+// 输出每个直接子目录的总量 (大的在前), 最后一行是整个目录
+void print_du(du_ctx_t *ctx, const char *path)
+{
+    const du_record_t *root = &ctx->records[0];
+    uint32_t *children = malloc((root->nchildren + 1) * sizeof(uint32_t));
+    if (children == NULL)
+    {
+        perror("malloc");
+        return;
+    }
+
+    size_t c = 1;
+    for (uint32_t k = 0; k < root->nchildren; k++)
+    {
+        children[k] = c;
+        c += ctx->records[c].subtree;
+    }
+    qsort_r(children, root->nchildren, sizeof(uint32_t), compare_totals, ctx);
+
+    int slash = path[0] != '\0' && path[strlen(path) - 1] != '/';
+    for (uint32_t k = 0; k < root->nchildren; k++)
+    {
+        const du_record_t *rec = &ctx->records[children[k]];
+        printf("%12llu  %s%s%s/\n", (unsigned long long)rec->total_bytes, path, slash ? "/" : "",
+               ctx->pool + rec->name_off);
+    }
+    printf("%12llu  %s\n", (unsigned long long)root->total_bytes, path);
+    free(children);
+}
+
+void mini_ls_du(const char *path)
+{
+    du_ctx_t ctx;
+    struct stat st;
 
-        print_file_info(entry->d_name, path, show_details);
+    memset(&ctx, 0, sizeof(ctx));
+    int dir_fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd == -1 || fstat(dir_fd, &st) == -1)
+    {
+        perror("opendir");
+        if (dir_fd != -1)
+        {
+            close(dir_fd);
+        }
+        return;
+    }
+    ctx.dirent_buf = malloc(DIRENT_BUF_SIZE);
+    if (ctx.dirent_buf == NULL)
+    {
+        perror("malloc");
+        close(dir_fd);
+        return;
+    }
+    if (g_opts.index_path != NULL)
+    {
+        du_load_index(&ctx, g_opts.index_path);
     }
 
-    if (!show_details)
+    du_path_push(&ctx, path);
+    long root = du_scan(&ctx, dir_fd, path, &st, ctx.old_count > 0 ? 0 : -1);
+    close(dir_fd);
+
+    if (root == 0)
     {
-        printf("\n");
+        print_du(&ctx, path);
+        if (g_opts.index_path != NULL)
+        {
+            du_save_index(&ctx, g_opts.index_path);
+        }
+        if (g_opts.verbose)
+        {
+            fprintf(stderr, "directories: %zu, rescanned: %zu, reused: %zu\n", ctx.count, ctx.rescanned,
+                    ctx.reused);
+        }
     }
 
-    closedir(dir);
+    if (ctx.old_map != NULL)
+    {
+        munmap(ctx.old_map, ctx.old_map_size);
+    }
+    free(ctx.records);
+    free(ctx.pool);
+    free(ctx.path);
+    free(ctx.dirent_buf);
 }
 
 void print_usage(const char *program_name)
@@ -128,6 +2089,16 @@ void print_usage(const char *program_name)
     printf("Options:\n");
     printf("  -a    显示所有文件（包括隐藏文件）\n");
     printf("  -l    显示详细信息\n");
+    printf("  -S    按文件大小排序 (大的在前)\n");
+    printf("  -t    按修改时间排序 (新的在前)\n");
+    printf("  -r    逆序排列\n");
+    printf("  -U    不排序, 按目录中的存储顺序列出\n");
+    printf("  -C    按终端宽度分列显示\n");
+    printf("  -R    递归列出子目录\n");
+    printf("  -j N  -R 使用 N 个工作线程 (默认为 CPU 数)\n");
+    printf("  -D    统计每个子目录占用的空间 (类似 du -d1)\n");
+    printf("  -I F  -D 的索引文件: 下次只重新统计 inode 或 mtime 变了的目录\n");
+    printf("  -v    -D 结束时在标准错误输出重新统计/复用的目录数\n");
     printf("  -h    显示帮助信息\n");
     printf("\n");
     printf("Examples:\n");
@@ -135,12 +2106,13 @@ void print_usage(const char *program_name)
     printf("  %s /tmp      # 列出 /tmp 目录\n", program_name);
     printf("  %s -l        # 详细列出当前目录\n", program_name);
     printf("  %s -a -l .   # 详细列出当前目录的所有文件\n", program_name);
+    printf("  %s -lSr /var # 按大小从小到大详细列出 /var\n", program_name);
+    printf("  %s -R -j 16 /data  # 用 16 个线程递归列出 /data\n", program_name);
+    printf("  %s -D -I ~/.data.du /data  # 增量统计 /data 下的空间占用\n", program_name);
 }
 
 int main(int argc, char *argv[])
 {
-    int show_all = 0;
-    int show_details = 0;
     const char *directory = ".";
 
     // 解析命令行参数
@@ -153,10 +2125,59 @@ int main(int argc, char *argv[])
                 switch (argv[i][j])
                 {
                 case 'a':
-                    show_all = 1;
+                    g_opts.show_all = 1;
                     break;
                 case 'l':
-                    show_details = 1;
+                    g_opts.show_details = 1;
+                    break;
+                case 'R':
+                    g_opts.recursive = 1;
+                    break;
+                case 'S':
+                    g_opts.sort_key = SORT_SIZE;
+                    break;
+                case 't':
+                    g_opts.sort_key = SORT_TIME;
+                    break;
+                case 'r':
+                    g_opts.reverse = 1;
+                    break;
+                case 'U':
+                    g_opts.sort_key = SORT_NONE;
+                    break;
+                case 'C':
+                    g_opts.columns = 1;
+                    break;
+                case 'j':
+                {
+                    // 参数可以紧跟 (-j16) 也可以是下一个参数
+                    const char *value = argv[i][j + 1] != '\0' ? &argv[i][j + 1] : argv[++i];
+                    if (value == NULL || (g_opts.threads = atoi(value)) <= 0)
+                    {
+                        fprintf(stderr, "Option -j needs a positive number\n");
+                        return 1;
+                    }
+                    j = strlen(argv[i]) - 1;
+                    break;
+                }
+                case 'D':
+                    g_opts.disk_usage = 1;
+                    break;
+                case 'I':
+                {
+                    const char *value = argv[i][j + 1] != '\0' ? &argv[i][j + 1] : argv[++i];
+                    if (value == NULL)
+                    {
+                        fprintf(stderr, "Option -I needs an index file\n");
+                        return 1;
+                    }
+                    g_opts.index_path = value;
+                    g_opts.disk_usage = 1;
+                    j = strlen(argv[i]) - 1;
+                    break;
+                }
+                case 'v':
+                    g_opts.verbose = 1;
                     break;
                 case 'h':
                     print_usage(argv[0]);
@@ -174,7 +2195,38 @@ int main(int argc, char *argv[])
         }
     }
 
-    mini_ls(directory, show_all, show_details);
+    if (g_opts.threads == 0)
+    {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        g_opts.threads = cpus > 0 ? (int)cpus : 1;
+    }
+    if (g_opts.threads > MAX_THREADS)
+    {
+        g_opts.threads = MAX_THREADS;
+    }
+
+    if (g_opts.columns)
+    {
+        // 终端宽度: 先问终端, 再看 COLUMNS, 都没有就按 80 列
+        struct winsize ws;
+        const char *env = getenv("COLUMNS");
+        if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0)
+        {
+            g_opts.width = ws.ws_col;
+        }
+        else if (env != NULL && atoi(env) > 0)
+        {
+            g_opts.width = atoi(env);
+        }
+    }
+
+    if (g_opts.disk_usage)
+    {
+        mini_ls_du(directory);
+        return 0;
+    }
+
+    mini_ls(directory);
 
     return 0;
-}
\ No newline at end of file
+}
@@ -1,167 +1,3648 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
 #include <string.h>
-#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include "str_parser_pow5.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
-double parseNumber(const char **expr)
+// 变量个数和变量名长度上限
+#define MAX_VARS 32
+#define MAX_VAR_NAME 32
+
+// 求值栈的深度上限, 编译时超出就报错, 求值时不用再检查
+#define STACK_LIMIT 256
+
+// 语法树的高度上限, 编译是递归的, 防止栈溢出
+#define MAX_TREE_DEPTH 10000
+
+// 公共子表达式的临时槽位数. JIT 把它们放在栈顶下面的 red zone (128 字节) 里
+#define MAX_TEMPS 16
+
+// 批量求值时每条指令处理的行数, 和线程数上限
+#define BATCH_BLOCK 2048
+#define MAX_BATCH_THREADS 64
+
+typedef enum
+{
+    EVAL_OK = 0,
+    EVAL_EMPTY,
+    EVAL_SYNTAX,
+    EVAL_TRAILING,
+    EVAL_DIV_ZERO,
+    EVAL_UNKNOWN_VAR,
+    EVAL_TOO_DEEP,
+    EVAL_NO_MEMORY
+} EvalStatus;
+
+typedef enum
+{
+    NODE_NUM,
+    NODE_VAR,
+    NODE_NEG,
+    NODE_ADD,
+    NODE_SUB,
+    NODE_MUL,
+    NODE_DIV
+} NodeType;
+
+// 语法树节点放在一个数组里, 子节点用下标引用
+typedef struct
+{
+    NodeType type;
+    int left;
+    int right;
+    int var;
+    int depth;
+    int temp; // 被多处引用的子表达式算一次存进这个临时槽位, -1 表示不存
+    double value;
+} Node;
+
+typedef struct
+{
+    Node *nodes;
+    int count;
+    int capacity;
+    int root;
+    char varNames[MAX_VARS][MAX_VAR_NAME];
+    int varCount;
+} Ast;
+
+// 解析范围是 [pos, end), 输入不需要以 '\0' 结尾
+typedef struct
+{
+    const char *pos;
+    const char *end;
+    Ast *ast;
+    int depth;
+    EvalStatus status;
+    const char *errorPos;
+} Parser;
+
+typedef enum
+{
+    OP_CONST,
+    OP_LOAD,
+    OP_NEG,
+    OP_ADD,
+    OP_SUB,
+    OP_MUL,
+    OP_DIV,
+    OP_STORE, // 栈顶复制到临时槽位 arg, 不出栈
+    OP_TEMP   // 临时槽位 arg 入栈
+} OpCode;
+
+typedef struct
+{
+    int op;
+    int arg;
+} Instr;
+
+// JIT 生成的函数, 返回 EvalStatus
+typedef int (*JitFunction)(const double *vars, double *out);
+
+// 编译好的表达式: 后缀形式的字节码, 常量单独放一张表.
+// 先清零再使用; 重复编译时沿用已经分配的缓冲区, 用完调 freeProgram
+typedef struct
+{
+    Ast ast;
+    Instr *code;
+    int length;
+    int codeCapacity;
+    double *consts;
+    int constCount;
+    int constCapacity;
+    int maxStack;
+    int tempCount;
+
+    // 优化时重建语法树用的缓冲区, 和 ast.nodes 轮换使用
+    Node *spareNodes;
+    int spareCapacity;
+    int *scratch;
+    int scratchCapacity;
+
+    // 求值次数到阈值后生成的机器码, jitState: 0 还没编译, 1 已编译, -1 编译不了
+    JitFunction jit;
+    void *jitCode;
+    size_t jitSize;
+    unsigned long calls;
+    int jitState;
+} Program;
+
+const char *evalStatusMessage(EvalStatus status)
+{
+    switch (status)
+    {
+    case EVAL_OK:
+        return "OK";
+    case EVAL_EMPTY:
+        return "Invalid expression";
+    case EVAL_SYNTAX:
+        return "Syntax error";
+    case EVAL_TRAILING:
+        return "not complete expression";
+    case EVAL_DIV_ZERO:
+        return "Division by zero";
+    case EVAL_UNKNOWN_VAR:
+        return "Unknown variable";
+    case EVAL_TOO_DEEP:
+        return "Expression too deep";
+    case EVAL_NO_MEMORY:
+        return "Out of memory";
+    }
+    return "Unknown error";
+}
+
+// 只认 ASCII, 不受 locale 影响, 也省掉 ctype 的查表函数调用
+static inline int isDigit(int c)
+{
+    return (unsigned)(c - '0') < 10;
+}
+
+static inline int isSpace(int c)
+{
+    return c == ' ' || (unsigned)(c - '\t') < 5;
+}
+
+static inline int isIdentStart(int c)
+{
+    return (unsigned)((c | 0x20) - 'a') < 26 || c == '_';
+}
+
+static inline int isIdentChar(int c)
+{
+    return isIdentStart(c) || isDigit(c);
+}
+
+static inline int peekChar(const Parser *p)
+{
+    return p->pos < p->end ? (unsigned char)*p->pos : '\0';
+}
+
+// 十进制数字串先化成 w * 10^q (w 最多 19 位有效数字), 再分三档:
+//   1. Clinger 快速路径: w 和 10^|q| 都能精确表示成 double, 一次乘或除就是正确舍入的结果
+//   2. Eisel-Lemire: w 乘上 5^q 的 128 位近似值, 截出 53 位尾数再舍入
+//   3. 近似值不够判断舍入 (极少数), 或者截断了有效数字后 w 和 w+1 结果不同时交给 strtod
+static const double g_exactPow10[] = { 1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+                                       1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+
+// 小端序下 8 个字节是否都是 ASCII 数字
+static inline int isEightDigits(uint64_t v)
+{
+    return ((v & 0xF0F0F0F0F0F0F0F0ULL) | (((v + 0x0606060606060606ULL) & 0xF0F0F0F0F0F0F0F0ULL) >> 4)) ==
+           0x3333333333333333ULL;
+}
+
+// 一次换算 8 个数字: 相邻两位合并成 0..99, 再两组两组合并
+static inline uint32_t parseEightDigits(uint64_t v)
+{
+    v -= 0x3030303030303030ULL;
+    v = v * 10 + (v >> 8);
+    v = ((v & 0x000000FF000000FFULL) * 0x000F424000000064ULL +
+         ((v >> 16) & 0x000000FF000000FFULL) * 0x0000271000000001ULL) >> 32;
+    return (uint32_t)v;
+}
+
+// 超过 19 位时 w 会回绕, 由调用者重新截取
+static inline const char *parseDigits(const char *p, const char *end, uint64_t *w)
+{
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    while (end - p >= 8)
+    {
+        uint64_t chunk;
+        memcpy(&chunk, p, sizeof(chunk));
+        if (!isEightDigits(chunk))
+        {
+            break;
+        }
+        *w = *w * 100000000 + parseEightDigits(chunk);
+        p += 8;
+    }
+#endif
+    while (p < end && isDigit((unsigned char)*p))
+    {
+        *w = *w * 10 + (*p - '0');
+        p++;
+    }
+    return p;
+}
+
+// w * 10^q 正确舍入后的 double 位模式; 判断不了时返回 -1
+static int64_t eiselLemire(int64_t q, uint64_t w)
+{
+    if (w == 0 || q < POW5_MIN_EXPONENT)
+    {
+        return 0;
+    }
+    if (q > POW5_MAX_EXPONENT)
+    {
+        return 0x7FF0000000000000LL;
+    }
+
+    int lz = __builtin_clzll(w);
+    w <<= lz;
+
+    // 高 64 位里尾数以下的 9 位全是 1 时, 低位的进位可能影响舍入, 再乘一次低半部分
+    const uint64_t *pow5 = &g_pow5Table[2 * (q - POW5_MIN_EXPONENT)];
+    unsigned __int128 first = (unsigned __int128)w * pow5[0];
+    uint64_t high = (uint64_t)(first >> 64);
+    uint64_t low = (uint64_t)first;
+    if ((high & 0x1FF) == 0x1FF)
+    {
+        uint64_t secondHigh = (uint64_t)(((unsigned __int128)w * pow5[1]) >> 64);
+        low += secondHigh;
+        if (secondHigh > low)
+        {
+            high++;
+        }
+        if (low == 0xFFFFFFFFFFFFFFFFULL && (q < -27 || q > 55))
+        {
+            return -1;
+        }
+    }
+
+    int upperBit = (int)(high >> 63);
+    int shift = upperBit + 9;
+    uint64_t mantissa = high >> shift;
+    // floor(log2(10^q)) + 63, 加上 double 的指数偏移
+    int32_t power2 = (int32_t)((((152170 + 65536) * q) >> 16) + 63) + upperBit - lz + 1023;
+
+    if (power2 <= 0)
+    {
+        // 非规格化数: 多移掉的位数等于指数不足的部分
+        if (-power2 + 1 >= 64)
+        {
+            return 0;
+        }
+        mantissa >>= -power2 + 1;
+        mantissa += mantissa & 1;
+        mantissa >>= 1;
+        power2 = mantissa < (1ULL << 52) ? 0 : 1;
+        return (int64_t)(((uint64_t)power2 << 52) | (mantissa & ((1ULL << 52) - 1)));
+    }
+
+    // 只有这个范围的 q 可能正好落在两个 double 中间, 这时按偶数舍入
+    if (low <= 1 && q >= -4 && q <= 23 && (mantissa & 3) == 1 && (mantissa << shift) == high)
+    {
+        mantissa &= ~1ULL;
+    }
+    mantissa += mantissa & 1;
+    mantissa >>= 1;
+    if (mantissa >= (2ULL << 52))
+    {
+        mantissa = 1ULL << 52;
+        power2++;
+    }
+    mantissa &= ~(1ULL << 52);
+    if (power2 >= 0x7FF)
+    {
+        return 0x7FF0000000000000LL;
+    }
+    return (int64_t)(((uint64_t)power2 << 52) | mantissa);
+}
+
+// 表达式不一定以 '\0' 结尾, strtod 要用一份拷贝
+static double fallbackStrtod(const char *start, size_t len)
+{
+    char local[128];
+    char *copy = len < sizeof(local) ? local : malloc(len + 1);
+    if (copy == NULL)
+    {
+        return NAN;
+    }
+    memcpy(copy, start, len);
+    copy[len] = '\0';
+    double value = strtod(copy, NULL);
+    if (copy != local)
+    {
+        free(copy);
+    }
+    return value;
+}
+
+// 解析 digits [. digits] [(e|E) [+-] digits], 符号由调用者处理.
+// 'e' 后面没有数字时不算进来; 一个数字都没有时 *expr 不动
+double parseNumber(const char **expr, const char *end)
+{
+    const char *start = *expr;
+    const char *p = start;
+    uint64_t w = 0;
+
+    p = parseDigits(p, end, &w);
+    const char *intEnd = p;
+    const char *fracStart = p;
+    const char *fracEnd = p;
+    if (p < end && *p == '.')
+    {
+        fracStart = ++p;
+        p = parseDigits(p, end, &w);
+        fracEnd = p;
+    }
+    size_t digitCount = (size_t)(intEnd - start) + (size_t)(fracEnd - fracStart);
+    if (digitCount == 0)
+    {
+        return 0;
+    }
+
+    int64_t expNumber = 0;
+    if (p < end && (*p == 'e' || *p == 'E'))
+    {
+        const char *e = p + 1;
+        int negative = 0;
+        if (e < end && (*e == '+' || *e == '-'))
+        {
+            negative = *e == '-';
+            e++;
+        }
+        if (e < end && isDigit((unsigned char)*e))
+        {
+            // 再大的指数结果也只是 0 或 inf, 封顶防止溢出
+            while (e < end && isDigit((unsigned char)*e))
+            {
+                if (expNumber < 0x10000000)
+                {
+                    expNumber = expNumber * 10 + (*e - '0');
+                }
+                e++;
+            }
+            if (negative)
+            {
+                expNumber = -expNumber;
+            }
+            p = e;
+        }
+    }
+    *expr = p;
+    int64_t exponent = expNumber - (fracEnd - fracStart);
+
+    // 有效数字 (不算前导零) 超过 19 位: 只留前 19 位, 后面的位只可能影响舍入
+    int truncated = 0;
+    if (digitCount > 19)
+    {
+        for (const char *s = start; s < fracEnd && (*s == '0' || *s == '.'); s++)
+        {
+            digitCount -= *s == '0';
+        }
+        if (digitCount > 19)
+        {
+            truncated = 1;
+            w = 0;
+            const char *s = start;
+            while (w < 1000000000000000000ULL && s < intEnd)
+            {
+                w = w * 10 + (*s++ - '0');
+            }
+            if (w >= 1000000000000000000ULL)
+            {
+                exponent = (intEnd - s) + expNumber;
+            }
+            else
+            {
+                s = fracStart;
+                while (w < 1000000000000000000ULL && s < fracEnd)
+                {
+                    w = w * 10 + (*s++ - '0');
+                }
+                exponent = (fracStart - s) + expNumber;
+            }
+        }
+    }
+
+    if (!truncated && exponent >= -22 && exponent <= 22 && w <= (1ULL << 53))
+    {
+        double value = (double)w;
+        return exponent < 0 ? value / g_exactPow10[-exponent] : value * g_exactPow10[exponent];
+    }
+
+    int64_t bits = eiselLemire(exponent, w);
+    if (truncated && bits >= 0 && eiselLemire(exponent, w + 1) != bits)
+    {
+        bits = -1;
+    }
+    if (bits < 0)
+    {
+        return fallbackStrtod(start, (size_t)(p - start));
+    }
+    double value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+void skipWhitespace(Parser *p)
+{
+    while (p->pos < p->end && isSpace((unsigned char)*p->pos))
+    {
+        p->pos++;
+    }
+}
+
+static void parseFail(Parser *p, EvalStatus status)
+{
+    if (p->status == EVAL_OK)
+    {
+        p->status = status;
+        p->errorPos = p->pos;
+    }
+}
+
+static int addNode(Parser *p, NodeType type, int left, int right)
+{
+    Ast *ast = p->ast;
+
+    if (ast->count == ast->capacity)
+    {
+        int capacity = ast->capacity ? ast->capacity * 2 : 32;
+        Node *nodes = realloc(ast->nodes, capacity * sizeof(Node));
+        if (nodes == NULL)
+        {
+            parseFail(p, EVAL_NO_MEMORY);
+            return -1;
+        }
+        ast->nodes = nodes;
+        ast->capacity = capacity;
+    }
+
+    Node *node = &ast->nodes[ast->count];
+    memset(node, 0, sizeof(Node));
+    node->type = type;
+    node->left = left;
+    node->right = right;
+    node->depth = 1;
+    node->temp = -1;
+    if (left >= 0 && ast->nodes[left].depth >= node->depth)
+    {
+        node->depth = ast->nodes[left].depth + 1;
+    }
+    if (right >= 0 && ast->nodes[right].depth >= node->depth)
+    {
+        node->depth = ast->nodes[right].depth + 1;
+    }
+    if (node->depth > MAX_TREE_DEPTH)
+    {
+        parseFail(p, EVAL_TOO_DEEP);
+        return -1;
+    }
+    return ast->count++;
+}
+
+// 变量按第一次出现的顺序编号
+static int internVariable(Parser *p, const char *name, size_t len)
+{
+    Ast *ast = p->ast;
+
+    for (int i = 0; i < ast->varCount; i++)
+    {
+        if (strncmp(ast->varNames[i], name, len) == 0 && ast->varNames[i][len] == '\0')
+        {
+            return i;
+        }
+    }
+    if (ast->varCount == MAX_VARS || len >= MAX_VAR_NAME)
+    {
+        parseFail(p, EVAL_SYNTAX);
+        return -1;
+    }
+    memcpy(ast->varNames[ast->varCount], name, len);
+    ast->varNames[ast->varCount][len] = '\0';
+    return ast->varCount++;
+}
+
+int parseExpression(Parser *p);
+
+int parseFactor(Parser *p)
+{
+    skipWhitespace(p);
+    int result = -1;
+    int c = peekChar(p);
+
+    // 括号和一元运算符的嵌套层数也要限制, 解析本身是递归的
+    if (++p->depth > MAX_TREE_DEPTH)
+    {
+        parseFail(p, EVAL_TOO_DEEP);
+        return -1;
+    }
+
+    if (c == '(')
+    {
+        p->pos++;
+        result = parseExpression(p);
+        skipWhitespace(p);
+        if (peekChar(p) != ')')
+        {
+            parseFail(p, EVAL_SYNTAX);
+            return -1;
+        }
+        p->pos++;
+    }
+    else if (c == '-')
+    {
+        p->pos++;
+        int operand = parseFactor(p);
+        if (operand < 0)
+        {
+            return -1;
+        }
+        result = addNode(p, NODE_NEG, operand, -1);
+    }
+    else if (c == '+')
+    {
+        p->pos++;
+        result = parseFactor(p);
+    }
+    else if (isDigit(c) || c == '.')
+    {
+        const char *start = p->pos;
+        double value = parseNumber(&p->pos, p->end);
+        if (p->pos == start)
+        {
+            parseFail(p, EVAL_SYNTAX);
+            return -1;
+        }
+        result = addNode(p, NODE_NUM, -1, -1);
+        if (result >= 0)
+        {
+            p->ast->nodes[result].value = value;
+        }
+    }
+    else if (isIdentStart(c))
+    {
+        const char *start = p->pos;
+        while (p->pos < p->end && isIdentChar((unsigned char)*p->pos))
+        {
+            p->pos++;
+        }
+        int var = internVariable(p, start, p->pos - start);
+        if (var < 0)
+        {
+            return -1;
+        }
+        result = addNode(p, NODE_VAR, -1, -1);
+        if (result >= 0)
+        {
+            p->ast->nodes[result].var = var;
+        }
+    }
+    else
+    {
+        parseFail(p, EVAL_SYNTAX);
+        return -1;
+    }
+
+    skipWhitespace(p);
+    p->depth--;
+    return result;
+}
+
+int parseTerm(Parser *p)
+{
+    int result = parseFactor(p);
+
+    while (result >= 0 && (peekChar(p) == '*' || peekChar(p) == '/'))
+    {
+        char operator = *p->pos;
+        p->pos++;
+        int operand = parseFactor(p);
+        if (operand < 0)
+        {
+            return -1;
+        }
+        result = addNode(p, operator == '*' ? NODE_MUL : NODE_DIV, result, operand);
+    }
+
+    return result;
+}
+
+int parseExpression(Parser *p)
+{
+    int result = parseTerm(p);
+
+    while (result >= 0 && (peekChar(p) == '+' || peekChar(p) == '-'))
+    {
+        char operator = *p->pos;
+        p->pos++;
+        int operand = parseTerm(p);
+        if (operand < 0)
+        {
+            return -1;
+        }
+        result = addNode(p, operator == '+' ? NODE_ADD : NODE_SUB, result, operand);
+    }
+
+    return result;
+}
+
+void freeAst(Ast *ast)
+{
+    free(ast->nodes);
+    memset(ast, 0, sizeof(Ast));
+}
+
+// 把 [src, src + len) 解析成语法树, 沿用 ast 里已有的节点数组.
+// 出错时 errorPos 指向出错的位置
+EvalStatus parseAst(const char *src, size_t len, Ast *ast, const char **errorPos)
+{
+    Parser p;
+
+    ast->count = 0;
+    ast->varCount = 0;
+    ast->root = -1;
+    p.pos = src;
+    p.end = src + len;
+    p.ast = ast;
+    p.depth = 0;
+    p.status = EVAL_OK;
+    p.errorPos = NULL;
+
+    skipWhitespace(&p);
+    if (p.pos == p.end)
+    {
+        p.status = EVAL_EMPTY;
+        p.errorPos = p.pos;
+    }
+    else
+    {
+        ast->root = parseExpression(&p);
+        skipWhitespace(&p);
+        if (p.status == EVAL_OK && p.pos != p.end)
+        {
+            parseFail(&p, EVAL_TRAILING);
+        }
+    }
+
+    if (errorPos != NULL)
+    {
+        *errorPos = p.errorPos;
+    }
+    return p.status;
+}
+
+// ---------------- 优化 ----------------
+// 按节点下标顺序 (子节点总在父节点前面) 重建一遍语法树:
+//   1. 常量折叠: 两边都是常量的运算直接算出来, 除数为 0 的保留到求值时报错
+//   2. 代数化简: 只做 IEEE 754 下结果逐位不变的, x*1, 1*x, x/1, x-0, x+(-0), -0+x, --x,
+//      以及除以 2 的整数次幂改成乘倒数. x+0 不化简 (-0 + 0 = +0), 也不做结合律变换
+//   3. hash-consing: 结构相同的子树合并成同一个节点, 变成 DAG; 被引用多次的运算节点
+//      分配临时槽位, 编译时只算一次
+
+// 优化开关, 基准测试里关掉做对比
+static int g_optimize = 1;
+
+typedef struct
+{
+    Node *nodes;
+    int count;
+    int *table;
+    unsigned mask;
+} Optimizer;
+
+static uint64_t doubleBits(double value)
+{
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return bits;
+}
+
+static unsigned hashNode(const Node *node)
+{
+    uint64_t h = (uint64_t)node->type * 0x9E3779B97F4A7C15ULL;
+    h ^= ((uint64_t)(uint32_t)node->left << 32 | (uint32_t)node->right) * 0xC2B2AE3D27D4EB4FULL;
+    h ^= (node->type == NODE_NUM ? doubleBits(node->value) : (uint64_t)node->var) * 0x165667B19E3779F9ULL;
+    return (unsigned)(h ^ h >> 29);
+}
+
+static int sameNode(const Node *a, const Node *b)
+{
+    if (a->type != b->type)
+    {
+        return 0;
+    }
+    if (a->type == NODE_NUM)
+    {
+        return doubleBits(a->value) == doubleBits(b->value);
+    }
+    return a->var == b->var && a->left == b->left && a->right == b->right;
+}
+
+// 已经有相同的节点就返回它, 否则追加一个
+static int internNode(Optimizer *o, NodeType type, int left, int right, int var, double value)
+{
+    Node node;
+
+    memset(&node, 0, sizeof(node));
+    node.type = type;
+    node.left = left;
+    node.right = right;
+    node.var = var;
+    node.value = value;
+    node.temp = -1;
+
+    unsigned slot = hashNode(&node) & o->mask;
+    while (o->table[slot] >= 0)
+    {
+        if (sameNode(&o->nodes[o->table[slot]], &node))
+        {
+            return o->table[slot];
+        }
+        slot = (slot + 1) & o->mask;
+    }
+
+    node.depth = 1;
+    if (left >= 0 && o->nodes[left].depth >= node.depth)
+    {
+        node.depth = o->nodes[left].depth + 1;
+    }
+    if (right >= 0 && o->nodes[right].depth >= node.depth)
+    {
+        node.depth = o->nodes[right].depth + 1;
+    }
+    o->nodes[o->count] = node;
+    o->table[slot] = o->count;
+    return o->count++;
+}
+
+static int isConst(const Optimizer *o, int index, double value)
+{
+    return o->nodes[index].type == NODE_NUM && doubleBits(o->nodes[index].value) == doubleBits(value);
+}
+
+// 2 的整数次幂 (规格化数), 它的倒数也能精确表示
+static int isPowerOfTwo(double value)
+{
+    uint64_t bits = doubleBits(value);
+    unsigned exponent = (unsigned)(bits >> 52) & 0x7FF;
+    return (bits & ((1ULL << 52) - 1)) == 0 && exponent != 0 && exponent != 0x7FF;
+}
+
+static int optimizeNode(Optimizer *o, const Node *node, int left, int right)
+{
+    switch (node->type)
+    {
+    case NODE_NUM:
+        return internNode(o, NODE_NUM, -1, -1, 0, node->value);
+    case NODE_VAR:
+        return internNode(o, NODE_VAR, -1, -1, node->var, 0);
+    case NODE_NEG:
+        if (o->nodes[left].type == NODE_NUM)
+        {
+            return internNode(o, NODE_NUM, -1, -1, 0, -o->nodes[left].value);
+        }
+        if (o->nodes[left].type == NODE_NEG)
+        {
+            return o->nodes[left].left;
+        }
+        return internNode(o, NODE_NEG, left, -1, 0, 0);
+    default:
+        break;
+    }
+
+    const Node *l = &o->nodes[left];
+    const Node *r = &o->nodes[right];
+    if (l->type == NODE_NUM && r->type == NODE_NUM && !(node->type == NODE_DIV && r->value == 0))
+    {
+        double value = node->type == NODE_ADD   ? l->value + r->value
+                       : node->type == NODE_SUB ? l->value - r->value
+                       : node->type == NODE_MUL ? l->value * r->value
+                                                : l->value / r->value;
+        return internNode(o, NODE_NUM, -1, -1, 0, value);
+    }
+    switch (node->type)
+    {
+    case NODE_ADD:
+        if (isConst(o, right, -0.0))
+        {
+            return left;
+        }
+        if (isConst(o, left, -0.0))
+        {
+            return right;
+        }
+        break;
+    case NODE_SUB:
+        if (isConst(o, right, 0.0))
+        {
+            return left;
+        }
+        break;
+    case NODE_MUL:
+        if (isConst(o, right, 1.0))
+        {
+            return left;
+        }
+        if (isConst(o, left, 1.0))
+        {
+            return right;
+        }
+        break;
+    case NODE_DIV:
+        if (isConst(o, right, 1.0))
+        {
+            return left;
+        }
+        if (r->type == NODE_NUM && isPowerOfTwo(r->value))
+        {
+            int reciprocal = internNode(o, NODE_NUM, -1, -1, 0, 1 / r->value);
+            return internNode(o, NODE_MUL, left, reciprocal, 0, 0);
+        }
+        break;
+    default:
+        break;
+    }
+    return internNode(o, node->type, left, right, 0, 0);
+}
+
+static EvalStatus optimizeAst(Program *prog)
+{
+    Ast *ast = &prog->ast;
+    int count = ast->count;
+
+    // 每个原节点最多变成两个新节点 (除以 2 的幂多一个常量)
+    if (prog->spareCapacity < 2 * count)
+    {
+        Node *nodes = realloc(prog->spareNodes, 2 * (size_t)count * sizeof(Node));
+        if (nodes == NULL)
+        {
+            return EVAL_NO_MEMORY;
+        }
+        prog->spareNodes = nodes;
+        prog->spareCapacity = 2 * count;
+    }
+    unsigned tableSize = 16;
+    while (tableSize < 4 * (unsigned)count)
+    {
+        tableSize *= 2;
+    }
+    // remap 和引用计数共用前 2 * count 个, 后面是哈希表
+    int need = 2 * count + (int)tableSize;
+    if (prog->scratchCapacity < need)
+    {
+        int *scratch = realloc(prog->scratch, (size_t)need * sizeof(int));
+        if (scratch == NULL)
+        {
+            return EVAL_NO_MEMORY;
+        }
+        prog->scratch = scratch;
+        prog->scratchCapacity = need;
+    }
+
+    Optimizer o;
+    int *remap = prog->scratch;
+    o.nodes = prog->spareNodes;
+    o.count = 0;
+    o.table = prog->scratch + 2 * count;
+    o.mask = tableSize - 1;
+    memset(o.table, 0xFF, tableSize * sizeof(int));
+    for (int i = 0; i < count; i++)
+    {
+        const Node *node = &ast->nodes[i];
+        remap[i] = optimizeNode(&o, node, node->left >= 0 ? remap[node->left] : -1,
+                                node->right >= 0 ? remap[node->right] : -1);
+    }
+    int root = remap[ast->root];
+
+    // 从根往下数每个节点被几个 (活着的) 父节点引用
+    int *refs = prog->scratch;
+    memset(refs, 0, (size_t)o.count * sizeof(int));
+    refs[root] = 1;
+    for (int i = root; i >= 0; i--)
+    {
+        if (refs[i] > 0 && o.nodes[i].left >= 0)
+        {
+            refs[o.nodes[i].left]++;
+            if (o.nodes[i].right >= 0)
+            {
+                refs[o.nodes[i].right]++;
+            }
+        }
+    }
+    prog->tempCount = 0;
+    for (int i = 0; i <= root && prog->tempCount < MAX_TEMPS; i++)
+    {
+        if (refs[i] > 1 && o.nodes[i].left >= 0)
+        {
+            o.nodes[i].temp = prog->tempCount++;
+        }
+    }
+
+    Node *old = ast->nodes;
+    int oldCapacity = ast->capacity;
+    ast->nodes = o.nodes;
+    ast->capacity = prog->spareCapacity;
+    prog->spareNodes = old;
+    prog->spareCapacity = oldCapacity;
+    ast->count = o.count;
+    ast->root = root;
+    return EVAL_OK;
+}
+
+typedef struct
+{
+    Program *prog;
+    int depth;
+    EvalStatus status;
+    unsigned char tempReady[MAX_TEMPS];
+} Compiler;
+
+static void emit(Compiler *c, int op, int arg)
+{
+    Program *prog = c->prog;
+
+    if (prog->length == prog->codeCapacity)
+    {
+        int capacity = prog->codeCapacity ? prog->codeCapacity * 2 : 32;
+        Instr *code = realloc(prog->code, capacity * sizeof(Instr));
+        if (code == NULL)
+        {
+            c->status = EVAL_NO_MEMORY;
+            return;
+        }
+        prog->code = code;
+        prog->codeCapacity = capacity;
+    }
+    prog->code[prog->length].op = op;
+    prog->code[prog->length].arg = arg;
+    prog->length++;
+
+    // 记录求值栈的最大深度
+    if (op == OP_CONST || op == OP_LOAD || op == OP_TEMP)
+    {
+        c->depth++;
+        if (c->depth > prog->maxStack)
+        {
+            prog->maxStack = c->depth;
+        }
+    }
+    else if (op != OP_NEG && op != OP_STORE)
+    {
+        c->depth--;
+    }
+}
+
+static int addConst(Compiler *c, double value)
+{
+    Program *prog = c->prog;
+
+    if (prog->constCount == prog->constCapacity)
+    {
+        int capacity = prog->constCapacity ? prog->constCapacity * 2 : 16;
+        double *consts = realloc(prog->consts, capacity * sizeof(double));
+        if (consts == NULL)
+        {
+            c->status = EVAL_NO_MEMORY;
+            return 0;
+        }
+        prog->consts = consts;
+        prog->constCapacity = capacity;
+    }
+    prog->consts[prog->constCount] = value;
+    return prog->constCount++;
+}
+
+// 后序遍历生成字节码. 带临时槽位的节点第一次遇到时算出来存一份, 以后直接取
+static void compileNode(Compiler *c, int index)
+{
+    const Node *node = &c->prog->ast.nodes[index];
+
+    if (node->temp >= 0 && c->tempReady[node->temp])
+    {
+        emit(c, OP_TEMP, node->temp);
+        return;
+    }
+    switch (node->type)
+    {
+    case NODE_NUM:
+        emit(c, OP_CONST, addConst(c, node->value));
+        break;
+    case NODE_VAR:
+        emit(c, OP_LOAD, node->var);
+        break;
+    case NODE_NEG:
+        compileNode(c, node->left);
+        emit(c, OP_NEG, 0);
+        break;
+    default:
+        compileNode(c, node->left);
+        compileNode(c, node->right);
+        emit(c, node->type == NODE_ADD ? OP_ADD : node->type == NODE_SUB ? OP_SUB
+                                              : node->type == NODE_MUL   ? OP_MUL
+                                                                         : OP_DIV,
+             0);
+        break;
+    }
+    if (node->temp >= 0)
+    {
+        emit(c, OP_STORE, node->temp);
+        c->tempReady[node->temp] = 1;
+    }
+}
+
+void releaseJit(Program *prog);
+
+void freeProgram(Program *prog)
+{
+    releaseJit(prog);
+    freeAst(&prog->ast);
+    free(prog->code);
+    free(prog->consts);
+    free(prog->spareNodes);
+    free(prog->scratch);
+    memset(prog, 0, sizeof(Program));
+}
+
+static EvalStatus compileProgram(const char *src, size_t len, Program *prog, const char **errorPos, int optimize)
+{
+    releaseJit(prog);
+    prog->length = 0;
+    prog->constCount = 0;
+    prog->maxStack = 0;
+    prog->tempCount = 0;
+    EvalStatus status = parseAst(src, len, &prog->ast, errorPos);
+    if (status != EVAL_OK)
+    {
+        return status;
+    }
+
+    Compiler c;
+    memset(&c, 0, sizeof(c));
+    c.prog = prog;
+    if (optimize)
+    {
+        c.status = optimizeAst(prog);
+    }
+    if (c.status == EVAL_OK)
+    {
+        compileNode(&c, prog->ast.root);
+    }
+    if (c.status == EVAL_OK && prog->maxStack > STACK_LIMIT)
+    {
+        c.status = EVAL_TOO_DEEP;
+    }
+    if (c.status != EVAL_OK && errorPos != NULL)
+    {
+        *errorPos = src;
+    }
+    return c.status;
+}
+
+// 编译一次, 之后用 evaluateProgram 反复求值. 语法树留在 prog 里
+EvalStatus compileExpression(const char *src, size_t len, Program *prog, const char **errorPos)
+{
+    return compileProgram(src, len, prog, errorPos, g_optimize);
+}
+
+// 变量名 -> evaluateProgram 里 vars 数组的下标, 表达式里没有这个变量时返回 -1
+int findVariable(const Program *prog, const char *name)
+{
+    for (int i = 0; i < prog->ast.varCount; i++)
+    {
+        if (strcmp(prog->ast.varNames[i], name) == 0)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// 求值循环里没有解析也没有内存分配; 除数为 0 时返回 EVAL_DIV_ZERO
+EvalStatus evaluateProgram(const Program *prog, const double *vars, double *result)
+{
+    double stack[STACK_LIMIT];
+    double temps[MAX_TEMPS];
+    int sp = 0;
+    const Instr *ip = prog->code;
+    const Instr *end = ip + prog->length;
+
+    for (; ip < end; ip++)
+    {
+        switch (ip->op)
+        {
+        case OP_CONST:
+            stack[sp++] = prog->consts[ip->arg];
+            break;
+        case OP_LOAD:
+            stack[sp++] = vars[ip->arg];
+            break;
+        case OP_NEG:
+            stack[sp - 1] = -stack[sp - 1];
+            break;
+        case OP_ADD:
+            sp--;
+            stack[sp - 1] += stack[sp];
+            break;
+        case OP_SUB:
+            sp--;
+            stack[sp - 1] -= stack[sp];
+            break;
+        case OP_MUL:
+            sp--;
+            stack[sp - 1] *= stack[sp];
+            break;
+        case OP_DIV:
+            sp--;
+            if (stack[sp] == 0)
+            {
+                return EVAL_DIV_ZERO;
+            }
+            stack[sp - 1] /= stack[sp];
+            break;
+        case OP_STORE:
+            temps[ip->arg] = stack[sp - 1];
+            break;
+        case OP_TEMP:
+            stack[sp++] = temps[ip->arg];
+            break;
+        }
+    }
+
+    *result = stack[0];
+    return EVAL_OK;
+}
+
+// 每次都重新解析的求值用的编译缓冲区, 每个线程一份, 反复使用
+static __thread Program g_workspace;
+
+// 对 [src, src + len) 解析并求值一次, 表达式里不能有变量, 输入不需要以 '\0' 结尾
+EvalStatus evaluateText(const char *src, size_t len, double *result, const char **errorPos)
+{
+    // 只求值一次, 优化省下的时间抵不上优化本身
+    EvalStatus status = compileProgram(src, len, &g_workspace, errorPos, 0);
+    if (status != EVAL_OK)
+    {
+        return status;
+    }
+    if (g_workspace.ast.varCount > 0)
+    {
+        if (errorPos != NULL)
+        {
+            *errorPos = src;
+        }
+        return EVAL_UNKNOWN_VAR;
+    }
+    return evaluateProgram(&g_workspace, NULL, result);
+}
+
+// 线程退出前释放它的编译缓冲区
+void releaseWorkspace(void)
+{
+    freeProgram(&g_workspace);
+}
+
+// ---------------- 表达式缓存 ----------------
+// 输入里同一个表达式会反复出现. 按表达式原文缓存: 不含变量的存求值结果 (包括出错的状态),
+// 要按变量求值的存编译好的程序. 按哈希值分成 CACHE_SHARDS 个分片, 每片一把锁.
+// 每片是一张线性探测的哈希表, 项里直接放表达式原文 (短的话), 命中时只碰一两条缓存行.
+// 装满 3/4 后用 CLOCK 算法淘汰: 命中时置引用位, 指针扫过时有引用位的清掉再给一次机会
+
+#define CACHE_SHARDS 16
+
+// CLOCK 指针每次跨过的槽位数. 奇数, 所以一圈下来每个槽位都走到; 如果一格一格地走, 指针前面是一整片
+// 没淘汰过的满槽位, 线性探测会连成几千个槽位长的一串, 查找和删除都要走完它
+#define CACHE_HAND_STRIDE 0x9E3779B1U
+
+// 不超过这个长度的表达式原文直接存在项里, 更长的另外分配
+#define CACHE_INLINE_KEY 80
+
+// 缓存里的程序带引用计数: 缓存自己持有一个, 每个取用者持有一个,
+// 淘汰时缓存放掉自己的那个, 最后一个放手的负责释放
+typedef struct
+{
+    Program prog; // 必须是第一个成员, 对外只给 Program 指针
+    int refs;
+} SharedProgram;
+
+// 128 字节, 两条缓存行
+typedef struct
+{
+    uint64_t hash;
+    double value;
+    SharedProgram *prog; // 第一次按程序取用时才编译
+    uint32_t keyLen;
+    int errorOffset; // errorPos 相对表达式开头的偏移, -1 表示 NULL
+    unsigned char used;
+    unsigned char referenced;
+    unsigned char status; // 当作常量表达式求值的结果, 即 evaluateText 的返回值
+    union
+    {
+        char inlineKey[CACHE_INLINE_KEY];
+        char *key;
+    };
+} __attribute__((aligned(64))) CacheEntry;
+
+typedef struct
+{
+    pthread_mutex_t lock;
+    CacheEntry *entries;
+    unsigned mask; // 槽位数 - 1
+    unsigned count;
+    unsigned limit; // 项数上限, 槽位数的 3/4
+    unsigned hand;
+    unsigned version; // 每插入或删除一项加一: 没变过的话, 上次探测到的空槽位仍然是插入的位置
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+} __attribute__((aligned(64))) CacheShard;
+
+typedef struct
+{
+    CacheShard shards[CACHE_SHARDS];
+    unsigned long bypassed; // 调用方因为命中率低没有走缓存的次数, 只用来统计
+} ExprCache;
+
+typedef struct
+{
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+    unsigned long entries;
+    unsigned long bypassed;
+} CacheStats;
+
+// 每次处理 8 字节的乘法哈希, 高位分片, 低位选槽位
+static uint64_t hashText(const char *text, size_t len)
+{
+    uint64_t h = 0x9E3779B97F4A7C15ULL ^ (len * 0xC2B2AE3D27D4EB4FULL);
+    size_t i = 0;
+
+    for (; i + 8 <= len; i += 8)
+    {
+        uint64_t chunk;
+        memcpy(&chunk, text + i, sizeof(chunk));
+        h = (h ^ chunk) * 0x100000001B3ULL;
+        h ^= h >> 29;
+    }
+    if (i < len)
+    {
+        uint64_t chunk = 0;
+        memcpy(&chunk, text + i, len - i);
+        h = (h ^ chunk) * 0x100000001B3ULL;
+    }
+    h ^= h >> 32;
+    h *= 0xD6E8FEB86659FD93ULL;
+    h ^= h >> 32;
+    return h;
+}
+
+static void dropProgram(SharedProgram *shared)
+{
+    if (shared != NULL && __atomic_sub_fetch(&shared->refs, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+        freeProgram(&shared->prog);
+        free(shared);
+    }
+}
+
+static const char *entryKey(const CacheEntry *entry)
+{
+    return entry->keyLen <= CACHE_INLINE_KEY ? entry->inlineKey : entry->key;
+}
+
+static void clearEntry(CacheEntry *entry)
+{
+    if (entry->keyLen > CACHE_INLINE_KEY)
+    {
+        free(entry->key);
+    }
+    dropProgram(entry->prog);
+    memset(entry, 0, sizeof(CacheEntry));
+}
+
+void freeExprCache(ExprCache *cache)
+{
+    if (cache == NULL)
+    {
+        return;
+    }
+    for (int s = 0; s < CACHE_SHARDS; s++)
+    {
+        CacheShard *shard = &cache->shards[s];
+        for (unsigned i = 0; shard->entries != NULL && i <= shard->mask; i++)
+        {
+            if (shard->entries[i].used)
+            {
+                clearEntry(&shard->entries[i]);
+            }
+        }
+        free(shard->entries);
+        pthread_mutex_destroy(&shard->lock);
+    }
+    free(cache);
+}
+
+// 至少能放 capacity 项 (按 2 的幂向上取整), 平均分给各分片; 内存不足时返回 NULL
+ExprCache *createExprCache(size_t capacity)
+{
+    ExprCache *cache = aligned_alloc(64, sizeof(ExprCache));
+    if (cache == NULL)
+    {
+        return NULL;
+    }
+    memset(cache, 0, sizeof(ExprCache));
+    unsigned slots = 16;
+    while ((size_t)slots / 4 * 3 * CACHE_SHARDS < capacity && slots < (1U << 24))
+    {
+        slots *= 2;
+    }
+    for (int s = 0; s < CACHE_SHARDS; s++)
+    {
+        CacheShard *shard = &cache->shards[s];
+        pthread_mutex_init(&shard->lock, NULL);
+        shard->mask = slots - 1;
+        shard->limit = slots / 4 * 3;
+        shard->entries = aligned_alloc(64, slots * sizeof(CacheEntry));
+        if (shard->entries == NULL)
+        {
+            freeExprCache(cache);
+            return NULL;
+        }
+        memset(shard->entries, 0, slots * sizeof(CacheEntry));
+    }
+    return cache;
+}
+
+static CacheShard *cacheShard(ExprCache *cache, uint64_t hash)
+{
+    return &cache->shards[hash >> 60 & (CACHE_SHARDS - 1)];
+}
+
+// 找到时返回那一项, 否则返回探测到的空槽位. 持锁调用
+static CacheEntry *cacheFind(CacheShard *shard, uint64_t hash, const char *src, size_t len)
+{
+    for (unsigned i = (unsigned)hash & shard->mask;; i = (i + 1) & shard->mask)
+    {
+        CacheEntry *entry = &shard->entries[i];
+        if (!entry->used ||
+            (entry->hash == hash && entry->keyLen == len && memcmp(entryKey(entry), src, len) == 0))
+        {
+            return entry;
+        }
+    }
+}
+
+// 删掉一项, 后面探测链上的项往回挪, 保证查找时不会提前遇到空位. 持锁调用
+static void cacheRemove(CacheShard *shard, unsigned index)
+{
+    shard->version++;
+    clearEntry(&shard->entries[index]);
+    for (unsigned next = (index + 1) & shard->mask; shard->entries[next].used; next = (next + 1) & shard->mask)
+    {
+        unsigned home = (unsigned)shard->entries[next].hash & shard->mask;
+        // home 不在 (index, next] 之间时, 这一项可以挪到 index
+        if (((next - home) & shard->mask) >= ((next - index) & shard->mask))
+        {
+            shard->entries[index] = shard->entries[next];
+            memset(&shard->entries[next], 0, sizeof(CacheEntry));
+            index = next;
+        }
+    }
+    shard->count--;
+}
+
+// 超过上限就按 CLOCK 淘汰, 直到回到上限. 持锁调用
+static void cacheMakeRoom(CacheShard *shard)
+{
+    while (shard->count > shard->limit)
+    {
+        CacheEntry *entry = &shard->entries[shard->hand];
+        if (entry->used && entry->referenced)
+        {
+            entry->referenced = 0;
+        }
+        else if (entry->used)
+        {
+            cacheRemove(shard, shard->hand);
+            shard->evictions++;
+            // 挪过来的项还没检查过, 指针先不动
+            continue;
+        }
+        shard->hand = (shard->hand + CACHE_HAND_STRIDE) & shard->mask;
+    }
+}
+
+// 插入新项. slot 和 version 是未命中时探测到的空槽位和当时的版本, 表没变过就直接用, 不再探测一遍;
+// 别的线程已经先插入了同一个表达式就用已有的. 不淘汰, 调用方填好这一项后再 cacheMakeRoom.
+// 持锁调用, 内存不足时返回 NULL
+static CacheEntry *cacheInsert(CacheShard *shard, unsigned slot, unsigned version, uint64_t hash, const char *src,
+                               size_t len)
+{
+    CacheEntry *entry = version == shard->version ? &shard->entries[slot] : cacheFind(shard, hash, src, len);
+    if (entry->used)
+    {
+        return entry;
+    }
+    char *key = NULL;
+    if (len > CACHE_INLINE_KEY)
+    {
+        key = malloc(len);
+        if (key == NULL)
+        {
+            return NULL;
+        }
+        memcpy(key, src, len);
+    }
+    entry->hash = hash;
+    entry->keyLen = (uint32_t)len;
+    entry->used = 1;
+    if (key != NULL)
+    {
+        entry->key = key;
+    }
+    else
+    {
+        memcpy(entry->inlineKey, src, len);
+    }
+    shard->count++;
+    shard->version++;
+    return entry;
+}
+
+// 和 cacheEvaluate 相同, *hit 返回这次是不是命中
+static EvalStatus cacheEvaluateHit(ExprCache *cache, const char *src, size_t len, double *result,
+                                   const char **errorPos, int *hit)
+{
+    uint64_t hash = hashText(src, len);
+    CacheShard *shard = cacheShard(cache, hash);
+
+    pthread_mutex_lock(&shard->lock);
+    CacheEntry *entry = cacheFind(shard, hash, src, len);
+    if (entry->used)
+    {
+        EvalStatus status = (EvalStatus)entry->status;
+        int errorOffset = entry->errorOffset;
+        if (status == EVAL_OK)
+        {
+            *result = entry->value;
+        }
+        if (!entry->referenced)
+        {
+            entry->referenced = 1;
+        }
+        shard->hits++;
+        pthread_mutex_unlock(&shard->lock);
+        if (errorPos != NULL)
+        {
+            *errorPos = errorOffset >= 0 ? src + errorOffset : NULL;
+        }
+        *hit = 1;
+        return status;
+    }
+    *hit = 0;
+    // 记下探测到的空槽位, 插入时不用再探测
+    unsigned slot = (unsigned)(entry - shard->entries);
+    unsigned version = shard->version;
+    shard->misses++;
+    pthread_mutex_unlock(&shard->lock);
+
+    // 解析求值不占着锁
+    const char *position = NULL;
+    double value = 0;
+    EvalStatus status = evaluateText(src, len, &value, &position);
+    if (status == EVAL_OK)
+    {
+        *result = value;
+    }
+    if (errorPos != NULL)
+    {
+        *errorPos = position;
+    }
+    if (status == EVAL_NO_MEMORY)
+    {
+        return status;
+    }
+
+    pthread_mutex_lock(&shard->lock);
+    entry = cacheInsert(shard, slot, version, hash, src, len);
+    if (entry != NULL && entry->prog == NULL)
+    {
+        entry->status = (unsigned char)status;
+        entry->errorOffset = position != NULL ? (int)(position - src) : -1;
+        entry->value = value;
+    }
+    cacheMakeRoom(shard);
+    pthread_mutex_unlock(&shard->lock);
+    return status;
+}
+
+// 和 evaluateText 相同, 结果 (包括出错状态和出错位置) 按表达式原文缓存
+EvalStatus cacheEvaluate(ExprCache *cache, const char *src, size_t len, double *result, const char **errorPos)
+{
+    int hit;
+
+    return cacheEvaluateHit(cache, src, len, result, errorPos, &hit);
+}
+
+// 取一个编译 (并优化) 好的程序, 多个线程可以同时用它求值; 用完调 cacheReleaseProgram.
+// 编译出错时返回 NULL, 出错状态和位置和 compileExpression 相同
+Program *cacheAcquireProgram(ExprCache *cache, const char *src, size_t len, EvalStatus *status,
+                             const char **errorPos)
+{
+    uint64_t hash = hashText(src, len);
+    CacheShard *shard = cacheShard(cache, hash);
+
+    pthread_mutex_lock(&shard->lock);
+    CacheEntry *entry = cacheFind(shard, hash, src, len);
+    unsigned slot = (unsigned)(entry - shard->entries);
+    unsigned version = shard->version;
+    if (entry->used)
+    {
+        entry->referenced = 1;
+        shard->hits++;
+        if (entry->prog != NULL)
+        {
+            SharedProgram *shared = entry->prog;
+            __atomic_add_fetch(&shared->refs, 1, __ATOMIC_RELAXED);
+            pthread_mutex_unlock(&shard->lock);
+            *status = EVAL_OK;
+            return &shared->prog;
+        }
+        // 只缓存了常量求值的结果: 解析就出错的直接返回, 否则编译一份挂上去
+        if (entry->status != EVAL_OK && entry->status != EVAL_DIV_ZERO && entry->status != EVAL_UNKNOWN_VAR)
+        {
+            *status = (EvalStatus)entry->status;
+            if (errorPos != NULL)
+            {
+                *errorPos = entry->errorOffset >= 0 ? src + entry->errorOffset : NULL;
+            }
+            pthread_mutex_unlock(&shard->lock);
+            return NULL;
+        }
+    }
+    else
+    {
+        shard->misses++;
+    }
+    pthread_mutex_unlock(&shard->lock);
+
+    SharedProgram *shared = calloc(1, sizeof(SharedProgram));
+    if (shared == NULL)
+    {
+        *status = EVAL_NO_MEMORY;
+        return NULL;
+    }
+    shared->refs = 1;
+    const char *position = NULL;
+    *status = compileExpression(src, len, &shared->prog, &position);
+    if (errorPos != NULL)
+    {
+        *errorPos = position;
+    }
+    if (*status != EVAL_OK)
+    {
+        dropProgram(shared);
+        return NULL;
+    }
+
+    // 同时也是常量表达式的求值结果
+    double value = 0;
+    EvalStatus constStatus = EVAL_UNKNOWN_VAR;
+    if (shared->prog.ast.varCount == 0)
+    {
+        constStatus = evaluateProgram(&shared->prog, NULL, &value);
+    }
+
+    pthread_mutex_lock(&shard->lock);
+    entry = cacheInsert(shard, slot, version, hash, src, len);
+    if (entry != NULL)
+    {
+        if (entry->prog == NULL)
+        {
+            entry->prog = shared;
+            entry->status = (unsigned char)constStatus;
+            entry->errorOffset = constStatus == EVAL_UNKNOWN_VAR ? 0 : -1;
+            entry->value = value;
+            __atomic_add_fetch(&shared->refs, 1, __ATOMIC_RELAXED);
+        }
+        else
+        {
+            // 别的线程先编译好了, 用它的
+            SharedProgram *existing = entry->prog;
+            __atomic_add_fetch(&existing->refs, 1, __ATOMIC_RELAXED);
+            pthread_mutex_unlock(&shard->lock);
+            dropProgram(shared);
+            return &existing->prog;
+        }
+    }
+    cacheMakeRoom(shard);
+    pthread_mutex_unlock(&shard->lock);
+    return &shared->prog;
+}
+
+void cacheReleaseProgram(Program *prog)
+{
+    dropProgram((SharedProgram *)prog);
+}
+
+void cacheStats(ExprCache *cache, CacheStats *stats)
+{
+    memset(stats, 0, sizeof(CacheStats));
+    for (int s = 0; s < CACHE_SHARDS; s++)
+    {
+        CacheShard *shard = &cache->shards[s];
+        pthread_mutex_lock(&shard->lock);
+        stats->hits += shard->hits;
+        stats->misses += shard->misses;
+        stats->evictions += shard->evictions;
+        stats->entries += shard->count;
+        pthread_mutex_unlock(&shard->lock);
+    }
+    stats->bypassed = __atomic_load_n(&cache->bypassed, __ATOMIC_RELAXED);
+}
+
+// 进程共用的缓存, evaluateExpression 用; 第一次用时创建
+#define DEFAULT_CACHE_CAPACITY 4096
+
+static ExprCache *g_defaultCache;
+static pthread_once_t g_defaultCacheOnce = PTHREAD_ONCE_INIT;
+
+static void createDefaultCache(void)
+{
+    g_defaultCache = createExprCache(DEFAULT_CACHE_CAPACITY);
+}
+
+// 解析并求值一次, 表达式里不能有变量. 结果按原文缓存在进程共用的缓存里
+EvalStatus evaluateExpression(const char *expression, double *result, const char **errorPos)
+{
+    pthread_once(&g_defaultCacheOnce, createDefaultCache);
+    if (g_defaultCache == NULL)
+    {
+        return evaluateText(expression, strlen(expression), result, errorPos);
+    }
+    return cacheEvaluate(g_defaultCache, expression, strlen(expression), result, errorPos);
+}
+
+void printError(EvalStatus status, const char *errorPos)
+{
+    if (status == EVAL_TRAILING)
+    {
+        printf("Error: %s, remain %s\n", evalStatusMessage(status), errorPos);
+    }
+    else if (status == EVAL_SYNTAX && errorPos != NULL && *errorPos == '\0')
+    {
+        printf("Error: %s at end of expression\n", evalStatusMessage(status));
+    }
+    else if (status == EVAL_SYNTAX && errorPos != NULL)
+    {
+        printf("Error: %s near '%.10s'\n", evalStatusMessage(status), errorPos);
+    }
+    else
+    {
+        printf("Error: %s\n", evalStatusMessage(status));
+    }
+}
+
+void testExpression(const char *expression)
+{
+    double result;
+    const char *errorPos;
+
+    printf("Expression: %s\n", expression);
+    EvalStatus status = evaluateExpression(expression, &result, &errorPos);
+    if (status != EVAL_OK)
+    {
+        printError(status, errorPos);
+        return;
+    }
+    printf("Result: %.2f\n", result);
+}
+
+// 单个数字: parseNumber 和 strtod 的结果要逐位一致
+void testNumber(const char *text)
+{
+    const char *pos = text;
+    double value = parseNumber(&pos, text + strlen(text));
+    double expected = strtod(text, NULL);
+    printf("Number: %-40s %.17g (%s)\n", text, value,
+           memcmp(&value, &expected, sizeof(double)) == 0 ? "same as strtod" : "DIFFERENT from strtod");
+}
+
+// 编译一次, 用不同的变量值求值几次
+void testProgram(const char *expression, const char *varName, const double *values, int count)
+{
+    Program prog;
+    const char *errorPos;
+
+    memset(&prog, 0, sizeof(prog));
+    printf("Program: %s\n", expression);
+    EvalStatus status = compileExpression(expression, strlen(expression), &prog, &errorPos);
+    if (status != EVAL_OK)
+    {
+        printError(status, errorPos);
+        freeProgram(&prog);
+        return;
+    }
+    printf("  %d instructions, %d variables, stack %d\n", prog.length, prog.ast.varCount, prog.maxStack);
+
+    int var = findVariable(&prog, varName);
+    for (int i = 0; i < count; i++)
+    {
+        double vars[MAX_VARS] = { 0 };
+        double result;
+        if (var >= 0)
+        {
+            vars[var] = values[i];
+        }
+        status = evaluateProgram(&prog, vars, &result);
+        if (status != EVAL_OK)
+        {
+            printf("  %s = %g: ", varName, values[i]);
+            printError(status, NULL);
+        }
+        else
+        {
+            printf("  %s = %g: %.4f\n", varName, values[i], result);
+        }
+    }
+    freeProgram(&prog);
+}
+
+// ---------------- 按列批量求值 ----------------
+// 每条指令一次处理 BATCH_BLOCK 行, 每个栈位置对应一块缓冲区;
+// LOAD 直接指向输入列, 不复制. 除数为 0 的行记在掩码里, 结果置为 NaN
+
+typedef void (*BlockOp)(int op, double *dst, const double *a, const double *b, size_t n, unsigned char *divZero);
+
+static void blockOpScalar(int op, double *dst, const double *a, const double *b, size_t n, unsigned char *divZero)
+{
+    switch (op)
+    {
+    case OP_NEG:
+        for (size_t i = 0; i < n; i++)
+        {
+            dst[i] = -a[i];
+        }
+        break;
+    case OP_ADD:
+        for (size_t i = 0; i < n; i++)
+        {
+            dst[i] = a[i] + b[i];
+        }
+        break;
+    case OP_SUB:
+        for (size_t i = 0; i < n; i++)
+        {
+            dst[i] = a[i] - b[i];
+        }
+        break;
+    case OP_MUL:
+        for (size_t i = 0; i < n; i++)
+        {
+            dst[i] = a[i] * b[i];
+        }
+        break;
+    case OP_DIV:
+        for (size_t i = 0; i < n; i++)
+        {
+            divZero[i] |= b[i] == 0;
+            dst[i] = a[i] / b[i];
+        }
+        break;
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2"))) static void blockOpAvx2(int op, double *dst, const double *a, const double *b, size_t n,
+                                                          unsigned char *divZero)
+{
+    size_t i = 0;
+
+    switch (op)
+    {
+    case OP_NEG:
+    {
+        const __m256d sign = _mm256_set1_pd(-0.0);
+        for (; i + 4 <= n; i += 4)
+        {
+            _mm256_storeu_pd(dst + i, _mm256_xor_pd(_mm256_loadu_pd(a + i), sign));
+        }
+        break;
+    }
+    case OP_ADD:
+        for (; i + 4 <= n; i += 4)
+        {
+            _mm256_storeu_pd(dst + i, _mm256_add_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i)));
+        }
+        break;
+    case OP_SUB:
+        for (; i + 4 <= n; i += 4)
+        {
+            _mm256_storeu_pd(dst + i, _mm256_sub_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i)));
+        }
+        break;
+    case OP_MUL:
+        for (; i + 4 <= n; i += 4)
+        {
+            _mm256_storeu_pd(dst + i, _mm256_mul_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i)));
+        }
+        break;
+    case OP_DIV:
+    {
+        const __m256d zero = _mm256_setzero_pd();
+        for (; i + 4 <= n; i += 4)
+        {
+            __m256d divisor = _mm256_loadu_pd(b + i);
+            int mask = _mm256_movemask_pd(_mm256_cmp_pd(divisor, zero, _CMP_EQ_OQ));
+            if (mask != 0)
+            {
+                // 少见的情况, 逐位记下来
+                for (int lane = 0; lane < 4; lane++)
+                {
+                    divZero[i + lane] |= (mask >> lane) & 1;
+                }
+            }
+            _mm256_storeu_pd(dst + i, _mm256_div_pd(_mm256_loadu_pd(a + i), divisor));
+        }
+        break;
+    }
+    }
+
+    // 剩下不足 4 行的尾巴
+    if (i < n)
+    {
+        blockOpScalar(op, dst + i, a + i, b ? b + i : NULL, n - i, divZero ? divZero + i : NULL);
+    }
+}
+#endif
+
+static BlockOp g_blockOp = NULL;
+
+// 按 CPU 选择批量求值的内核; forceScalar 用于对比测试
+void initBatchKernel(int forceScalar)
+{
+    g_blockOp = blockOpScalar;
+#if defined(__x86_64__) || defined(__i386__)
+    if (!forceScalar && __builtin_cpu_supports("avx2"))
+    {
+        g_blockOp = blockOpAvx2;
+    }
+#else
+    (void)forceScalar;
+#endif
+}
+
+typedef struct
+{
+    const Program *prog;
+    const double *const *columns;
+    double *out;
+    unsigned char *errors;
+    size_t begin;
+    size_t end;
+    long errorRows;
+    EvalStatus status;
+} BatchTask;
+
+static void *batchWorker(void *arg)
+{
+    BatchTask *task = arg;
+    const Program *prog = task->prog;
+    const double *stack[STACK_LIMIT];
+    unsigned char divZero[BATCH_BLOCK];
+    // 栈上每层一块, 后面跟着每个临时槽位一块
+    int blocks = prog->maxStack + prog->tempCount;
+    double *workspace = aligned_alloc(64, (size_t)(blocks > 0 ? blocks : 1) * BATCH_BLOCK * sizeof(double));
+    double *temps = workspace + (size_t)prog->maxStack * BATCH_BLOCK;
+
+    if (workspace == NULL)
+    {
+        task->status = EVAL_NO_MEMORY;
+        return NULL;
+    }
+
+    for (size_t row = task->begin; row < task->end; row += BATCH_BLOCK)
+    {
+        size_t n = task->end - row < BATCH_BLOCK ? task->end - row : BATCH_BLOCK;
+        int sp = 0;
+
+        memset(divZero, 0, n);
+        for (int pc = 0; pc < prog->length; pc++)
+        {
+            const Instr *ip = &prog->code[pc];
+            double *buffer;
+
+            switch (ip->op)
+            {
+            case OP_CONST:
+                buffer = workspace + (size_t)sp * BATCH_BLOCK;
+                for (size_t i = 0; i < n; i++)
+                {
+                    buffer[i] = prog->consts[ip->arg];
+                }
+                stack[sp++] = buffer;
+                break;
+            case OP_LOAD:
+                stack[sp++] = task->columns[ip->arg] + row;
+                break;
+            case OP_NEG:
+                buffer = workspace + (size_t)(sp - 1) * BATCH_BLOCK;
+                g_blockOp(OP_NEG, buffer, stack[sp - 1], NULL, n, NULL);
+                stack[sp - 1] = buffer;
+                break;
+            case OP_STORE:
+                buffer = temps + (size_t)ip->arg * BATCH_BLOCK;
+                memcpy(buffer, stack[sp - 1], n * sizeof(double));
+                stack[sp - 1] = buffer;
+                break;
+            case OP_TEMP:
+                stack[sp++] = temps + (size_t)ip->arg * BATCH_BLOCK;
+                break;
+            default:
+                sp--;
+                buffer = workspace + (size_t)(sp - 1) * BATCH_BLOCK;
+                g_blockOp(ip->op, buffer, stack[sp - 1], stack[sp], n, divZero);
+                stack[sp - 1] = buffer;
+                break;
+            }
+        }
+
+        memcpy(task->out + row, stack[0], n * sizeof(double));
+        for (size_t i = 0; i < n; i++)
+        {
+            if (divZero[i])
+            {
+                task->out[row + i] = NAN;
+                task->errorRows++;
+            }
+        }
+        if (task->errors != NULL)
+        {
+            memcpy(task->errors + row, divZero, n);
+        }
+    }
+
+    free(workspace);
+    return NULL;
+}
+
+// 对 rows 行求值: columns[i] 是第 i 个变量 (findVariable 的编号) 的整列数据.
+// errors 可以为 NULL, 否则除数为 0 的行置 1. 返回出错的行数, 内存不足时返回 -1.
+// threads > 1 时按行区间切给多个线程
+long evaluateBatch(const Program *prog, const double *const *columns, size_t rows, double *out, unsigned char *errors,
+                   int threads)
+{
+    BatchTask tasks[MAX_BATCH_THREADS];
+    pthread_t tids[MAX_BATCH_THREADS];
+    int started[MAX_BATCH_THREADS] = { 0 };
+    long errorRows = 0;
+
+    if (g_blockOp == NULL)
+    {
+        initBatchKernel(0);
+    }
+    if (threads < 1)
+    {
+        threads = 1;
+    }
+    if (threads > MAX_BATCH_THREADS)
+    {
+        threads = MAX_BATCH_THREADS;
+    }
+
+    // 每段按整块对齐, 块不会跨线程
+    size_t blocks = (rows + BATCH_BLOCK - 1) / BATCH_BLOCK;
+    size_t perThread = (blocks + threads - 1) / threads * BATCH_BLOCK;
+    if (perThread == 0)
+    {
+        perThread = BATCH_BLOCK;
+    }
+    for (int t = 0; t < threads; t++)
+    {
+        BatchTask *task = &tasks[t];
+        memset(task, 0, sizeof(BatchTask));
+        task->prog = prog;
+        task->columns = columns;
+        task->out = out;
+        task->errors = errors;
+        task->begin = t * perThread < rows ? t * perThread : rows;
+        task->end = task->begin + perThread < rows ? task->begin + perThread : rows;
+        if (t > 0 && task->begin < task->end && pthread_create(&tids[t], NULL, batchWorker, task) == 0)
+        {
+            started[t] = 1;
+        }
+    }
+
+    // 第 0 段和没起来的线程的段都在当前线程里做
+    for (int t = 0; t < threads; t++)
+    {
+        if (!started[t] && tasks[t].begin < tasks[t].end)
+        {
+            batchWorker(&tasks[t]);
+        }
+    }
+    for (int t = 0; t < threads; t++)
+    {
+        if (started[t])
+        {
+            pthread_join(tids[t], NULL);
+        }
+        if (tasks[t].status != EVAL_OK)
+        {
+            return -1;
+        }
+        errorRows += tasks[t].errorRows;
+    }
+    return errorRows;
+}
+
+// ---------------- x86-64 JIT ----------------
+// 把语法树直接翻译成 SSE2 标量指令: 求值栈的第 k 层就是 xmmk, 最多 16 层.
+// 每个运算和解释器一样是一条 IEEE 运算, 所以结果逐位一致.
+// 生成的函数: int fn(const double *vars, double *out), 成功返回 0,
+// 除数为 ±0 时返回 EVAL_DIV_ZERO. 只用 rax 和 xmm0-15, 都是调用者保存的寄存器;
+// 公共子表达式的临时槽位放在 [rsp - 8 * (k + 1)], 不调用别的函数, red zone 够用
+
+#define JIT_REGISTERS 16
+
+// 解释执行多少次之后编译成机器码, 0 表示不用 JIT
+static unsigned long g_jitThreshold = 1000;
+
+typedef struct
+{
+    unsigned char *code;
+    size_t len;
+    size_t cap;
+    int depth;
+    int failed;
+    unsigned char tempReady[MAX_TEMPS];
+} JitBuffer;
+
+static void jitByte(JitBuffer *b, unsigned char value)
+{
+    if (b->len < b->cap)
+    {
+        b->code[b->len++] = value;
+    }
+    else
+    {
+        b->failed = 1;
+    }
+}
+
+static void jitBytes(JitBuffer *b, const void *data, size_t len)
+{
+    for (size_t i = 0; i < len; i++)
+    {
+        jitByte(b, ((const unsigned char *)data)[i]);
+    }
+}
+
+// addsd/subsd/mulsd/divsd dst, src: F2 [REX] 0F op /r
+static void jitSseOp(JitBuffer *b, unsigned char op, int dst, int src)
+{
+    jitByte(b, 0xF2);
+    if (dst >= 8 || src >= 8)
+    {
+        jitByte(b, 0x40 | (dst >= 8 ? 0x04 : 0) | (src >= 8 ? 0x01 : 0));
+    }
+    jitByte(b, 0x0F);
+    jitByte(b, op);
+    jitByte(b, 0xC0 | (dst & 7) << 3 | (src & 7));
+}
+
+// movq rax, xmm / movq xmm, rax: 66 REX.W 0F 7E|6E /r
+static void jitMovq(JitBuffer *b, unsigned char op, int xmm)
+{
+    jitByte(b, 0x66);
+    jitByte(b, 0x48 | (xmm >= 8 ? 0x04 : 0));
+    jitByte(b, 0x0F);
+    jitByte(b, op);
+    jitByte(b, 0xC0 | (xmm & 7) << 3);
+}
+
+static int jitPush(JitBuffer *b)
+{
+    if (b->depth == JIT_REGISTERS)
+    {
+        b->failed = 1;
+        return 0;
+    }
+    return b->depth++;
+}
+
+// movsd [rsp - 8 * (temp + 1)], xmm / movsd xmm, [rsp - 8 * (temp + 1)]: F2 [REX] 0F 11|10 /r SIB disp8
+static void jitTemp(JitBuffer *b, unsigned char op, int xmm, int temp)
+{
+    jitByte(b, 0xF2);
+    if (xmm >= 8)
+    {
+        jitByte(b, 0x44);
+    }
+    jitByte(b, 0x0F);
+    jitByte(b, op);
+    jitByte(b, 0x44 | (xmm & 7) << 3);
+    jitByte(b, 0x24);
+    jitByte(b, (unsigned char)(-8 * (temp + 1)));
+}
+
+static void jitNode(JitBuffer *b, const Ast *ast, int index)
+{
+    const Node *node = &ast->nodes[index];
+
+    if (b->failed)
+    {
+        return;
+    }
+    if (node->temp >= 0 && b->tempReady[node->temp])
+    {
+        jitTemp(b, 0x10, jitPush(b), node->temp);
+        return;
+    }
+    switch (node->type)
+    {
+    case NODE_NUM:
+    {
+        // mov rax, imm64; movq xmm, rax
+        int reg = jitPush(b);
+        jitByte(b, 0x48);
+        jitByte(b, 0xB8);
+        jitBytes(b, &node->value, sizeof(double));
+        jitMovq(b, 0x6E, reg);
+        break;
+    }
+    case NODE_VAR:
+    {
+        // movsd xmm, [rdi + var * 8]
+        int reg = jitPush(b);
+        int32_t disp = node->var * (int32_t)sizeof(double);
+        jitByte(b, 0xF2);
+        if (reg >= 8)
+        {
+            jitByte(b, 0x44);
+        }
+        jitByte(b, 0x0F);
+        jitByte(b, 0x10);
+        jitByte(b, 0x80 | (reg & 7) << 3 | 7);
+        jitBytes(b, &disp, sizeof(disp));
+        break;
+    }
+    case NODE_NEG:
+    {
+        // 翻转符号位, 和 -x 完全相同: movq rax, xmm; btc rax, 63; movq xmm, rax
+        static const unsigned char btc[] = { 0x48, 0x0F, 0xBA, 0xF8, 0x3F };
+        jitNode(b, ast, node->left);
+        jitMovq(b, 0x7E, b->depth - 1);
+        jitBytes(b, btc, sizeof(btc));
+        jitMovq(b, 0x6E, b->depth - 1);
+        break;
+    }
+    default:
+    {
+        static const unsigned char ops[] = { [NODE_ADD] = 0x58, [NODE_SUB] = 0x5C, [NODE_MUL] = 0x59, [NODE_DIV] = 0x5E };
+        jitNode(b, ast, node->left);
+        jitNode(b, ast, node->right);
+        if (b->failed)
+        {
+            return;
+        }
+        int right = b->depth - 1;
+        int left = b->depth - 2;
+        if (node->type == NODE_DIV)
+        {
+            // movq rax, xmm; add rax, rax (去掉符号位, ±0 时 ZF=1); jz 出错出口 (代码开头)
+            static const unsigned char addRax[] = { 0x48, 0x01, 0xC0, 0x0F, 0x84 };
+            jitMovq(b, 0x7E, right);
+            jitBytes(b, addRax, sizeof(addRax));
+            int32_t rel = -(int32_t)(b->len + 4);
+            jitBytes(b, &rel, sizeof(rel));
+        }
+        jitSseOp(b, ops[node->type], left, right);
+        b->depth--;
+        break;
+    }
+    }
+    if (node->temp >= 0 && !b->failed)
+    {
+        jitTemp(b, 0x11, b->depth - 1, node->temp);
+        b->tempReady[node->temp] = 1;
+    }
+}
+
+void releaseJit(Program *prog)
+{
+    if (prog->jitCode != NULL)
+    {
+        munmap(prog->jitCode, prog->jitSize);
+    }
+    prog->jit = NULL;
+    prog->jitCode = NULL;
+    prog->jitSize = 0;
+    prog->jitState = 0;
+    prog->calls = 0;
+}
+
+// 生成机器码. 栈深超过 16 层或者系统不给可执行内存时返回 -1, 继续用解释器
+int jitProgram(Program *prog)
+{
+#if defined(__x86_64__)
+    static const unsigned char errorStub[] = { 0xB8, EVAL_DIV_ZERO, 0, 0, 0, 0xC3 };
+    static const unsigned char epilogue[] = { 0xF2, 0x0F, 0x11, 0x06, 0x31, 0xC0, 0xC3 };
+    long pageSize = sysconf(_SC_PAGESIZE);
+    JitBuffer b;
+
+    memset(&b, 0, sizeof(b));
+    b.cap = sizeof(errorStub) + (size_t)prog->length * 24 + sizeof(epilogue);
+    size_t size = (b.cap + pageSize - 1) / pageSize * pageSize;
+    b.code = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (b.code == MAP_FAILED)
+    {
+        prog->jitState = -1;
+        return -1;
+    }
+
+    // 出错出口放在最前面, 除法检查都往回跳到偏移 0; 入口紧跟在它后面
+    jitBytes(&b, errorStub, sizeof(errorStub));
+    jitNode(&b, &prog->ast, prog->ast.root);
+    jitBytes(&b, epilogue, sizeof(epilogue));
+
+    if (b.failed || b.depth != 1 || mprotect(b.code, size, PROT_READ | PROT_EXEC) != 0)
+    {
+        munmap(b.code, size);
+        prog->jitState = -1;
+        return -1;
+    }
+    prog->jitCode = b.code;
+    prog->jitSize = size;
+    prog->jitState = 1;
+    __atomic_store_n(&prog->jit, (JitFunction)(void *)(b.code + sizeof(errorStub)), __ATOMIC_RELEASE);
+    return 0;
+#else
+    prog->jitState = -1;
+    return -1;
+#endif
+}
+
+// 热点求值入口: 已经编译成机器码就直接调用; 否则解释执行并计数,
+// 正好到达阈值的那一次调用 (只有一个线程) 负责编译
+EvalStatus evaluateHot(Program *prog, const double *vars, double *result)
+{
+    JitFunction fn = __atomic_load_n(&prog->jit, __ATOMIC_ACQUIRE);
+    if (fn != NULL)
+    {
+        return (EvalStatus)fn(vars, result);
+    }
+    if (g_jitThreshold > 0 && __atomic_add_fetch(&prog->calls, 1, __ATOMIC_RELAXED) == g_jitThreshold)
+    {
+        jitProgram(prog);
+    }
+    return evaluateProgram(prog, vars, result);
+}
+
+// ---------------- 文件批量求值 ----------------
+// 每行一个表达式, 结果按输入顺序每行一个写到 stdout. 出错的行输出 ERROR,
+// 原因写到 stderr (文件名:行号[:列号]: 原因), 不影响后面的行. 空行原样输出空行.
+// 普通文件整个 mmap 进来, 管道等按块 read; 输入切成按行对齐的块交给工作线程,
+// 行直接在输入缓冲区里求值, 不复制也不按行分配内存. 输出按块编号依次写出
+
+// 每块输入的大小, 和每个线程对应的块槽位数 (在途的块数上限)
+#define BULK_CHUNK (1 << 20)
+#define BULK_SLOTS_PER_THREAD 2
+
+// 默认的表达式缓存项数
+#define BULK_CACHE_CAPACITY (1 << 16)
+
+// 缓存按窗口自适应: 每个线程数最近 BULK_CACHE_WINDOW 次查找的命中数. 未命中比直接解析多一次探测和插入,
+// 命中率低于 1/3 时省下的抵不过多花的 (实测三成重复时走缓存还比直接解析慢), 接下来若干行不查也不插,
+// 之后再试一个窗口. 绕过的行数从一个窗口起, 连着不划算就加倍, 最多 BULK_CACHE_BYPASS;
+// 刚开始缓存还是空的, 重复多的输入头几个窗口也可能不够 1/3
+#define BULK_CACHE_WINDOW 4096
+#define BULK_CACHE_BYPASS (16 * BULK_CACHE_WINDOW)
+
+typedef struct
+{
+    long line; // 块内的行号, 从 0 开始
+    int status;
+    int column; // 从 1 开始, 0 表示不知道
+} BulkError;
+
+enum
+{
+    SLOT_FREE,
+    SLOT_BUSY,
+    SLOT_DONE
+};
+
+typedef struct
+{
+    int state;
+    long index;
+    const char *begin;
+    const char *end;
+    long lines;
+
+    char *input; // 按块读入时的输入缓冲区
+    size_t inputCap;
+    char *out;
+    size_t outLen;
+    size_t outCap;
+    BulkError *errors;
+    long errorCount;
+    long errorCap;
+    int failed;
+} BulkSlot;
+
+// 一个工作线程用缓存的情况
+typedef struct
+{
+    ExprCache *cache; // NULL 表示不用缓存
+    long lookups;     // 当前窗口里查了几次
+    long hits;
+    long bypass;  // 还要绕过缓存的行数
+    long backoff; // 下次不划算时绕过的行数
+    long bypassed;
+} BulkCacheUse;
+
+typedef struct
+{
+    BulkSlot *slots;
+    int slotCount;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    long nextChunk;
+    long chunkCount; // 输入读完后才知道, 之前是 -1
+    int readError;
+
+    // mmap 的输入
+    const char *map;
+    size_t mapSize;
+    size_t cursor;
+
+    // 按块读的输入, 上一块末尾不完整的行留在 carry 里. 同一时间只有一个线程在读 (reading 为 1),
+    // 它不占着锁 read, 这几个字段只归它用
+    int fd;
+    char *carry;
+    size_t carryLen;
+    size_t carryCap;
+    int eof;
+    int reading;
+
+    ExprCache *cache; // NULL 表示不用缓存
+} BulkJob;
+
+static void *growBuffer(void *buffer, size_t *capacity, size_t need, size_t itemSize)
+{
+    if (need <= *capacity)
+    {
+        return buffer;
+    }
+    size_t cap = *capacity ? *capacity : 4096;
+    while (cap < need)
+    {
+        cap *= 2;
+    }
+    void *grown = realloc(buffer, cap * itemSize);
+    if (grown != NULL)
+    {
+        *capacity = cap;
+    }
+    return grown;
+}
+
+// 按块读: carry + 读到至少 BULK_CHUNK 字节或者 EOF, 在最后一个换行处切开.
+// 一行比一块还长时继续读, 缓冲区跟着变大. 由置了 job->reading 的线程不持锁调用
+static int bulkReadChunk(BulkJob *job, BulkSlot *slot)
+{
+    char *grown = growBuffer(slot->input, &slot->inputCap, job->carryLen + BULK_CHUNK, 1);
+    if (grown == NULL)
+    {
+        return -1;
+    }
+    slot->input = grown;
+    if (job->carryLen > 0)
+    {
+        memcpy(slot->input, job->carry, job->carryLen);
+    }
+    size_t len = job->carryLen;
+    job->carryLen = 0;
+
+    while (!job->eof)
+    {
+        if (len == slot->inputCap)
+        {
+            grown = growBuffer(slot->input, &slot->inputCap, len + BULK_CHUNK, 1);
+            if (grown == NULL)
+            {
+                return -1;
+            }
+            slot->input = grown;
+        }
+        ssize_t n = read(job->fd, slot->input + len, slot->inputCap - len);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            job->readError = errno;
+            job->eof = 1;
+            break;
+        }
+        if (n == 0)
+        {
+            job->eof = 1;
+            break;
+        }
+        len += (size_t)n;
+        if (len >= BULK_CHUNK && memchr(slot->input + len - n, '\n', n) != NULL)
+        {
+            break;
+        }
+    }
+
+    size_t cut = len;
+    if (!job->eof)
+    {
+        const char *lastNewline = memrchr(slot->input, '\n', len);
+        cut = lastNewline != NULL ? (size_t)(lastNewline - slot->input) + 1 : 0;
+        grown = growBuffer(job->carry, &job->carryCap, len - cut, 1);
+        if (grown == NULL)
+        {
+            return -1;
+        }
+        job->carry = grown;
+        memcpy(job->carry, slot->input + cut, len - cut);
+        job->carryLen = len - cut;
+    }
+    slot->begin = slot->input;
+    slot->end = slot->input + cut;
+    return 0;
+}
+
+// 给槽位分配下一块输入; 输入读完了返回 0. mmap 的输入持锁调用, 按块读的输入见 bulkReadChunk
+static int bulkNextChunk(BulkJob *job, BulkSlot *slot)
+{
+    if (job->map != NULL)
+    {
+        if (job->cursor == job->mapSize)
+        {
+            return 0;
+        }
+        size_t end = job->cursor + BULK_CHUNK;
+        if (end >= job->mapSize)
+        {
+            end = job->mapSize;
+        }
+        else
+        {
+            const char *newline = memchr(job->map + end, '\n', job->mapSize - end);
+            end = newline != NULL ? (size_t)(newline - job->map) + 1 : job->mapSize;
+        }
+        slot->begin = job->map + job->cursor;
+        slot->end = job->map + end;
+        job->cursor = end;
+        return 1;
+    }
+
+    if (job->eof && job->carryLen == 0)
+    {
+        return 0;
+    }
+    slot->failed = 0;
+    if (bulkReadChunk(job, slot) != 0)
+    {
+        slot->failed = 1;
+        slot->begin = slot->end = NULL;
+        job->eof = 1;
+        job->carryLen = 0;
+    }
+    return slot->begin != slot->end || slot->failed;
+}
+
+static int bulkAppend(BulkSlot *slot, const char *text, size_t len)
+{
+    char *grown = growBuffer(slot->out, &slot->outCap, slot->outLen + len, 1);
+    if (grown == NULL)
+    {
+        slot->failed = 1;
+        return -1;
+    }
+    slot->out = grown;
+    memcpy(slot->out + slot->outLen, text, len);
+    slot->outLen += len;
+    return 0;
+}
+
+// digits 是 count 位十进制数 d1 d2 ..., 值为 d1.d2... x 10^k. 和 %g 一样, -4 <= k < 17 时用定点表示,
+// 否则用科学计数法, 末尾的 0 去掉
+static int formatDigits(char *buffer, uint64_t digits, int count, int k)
+{
+    char text[20];
+    int len = 0;
+
+    for (int i = count - 1; i >= 0; i--)
+    {
+        text[i] = (char)('0' + digits % 10);
+        digits /= 10;
+    }
+    while (count > 1 && text[count - 1] == '0')
+    {
+        count--;
+    }
+
+    if (k >= -4 && k < 17)
+    {
+        if (k >= 0)
+        {
+            for (int i = 0; i <= k; i++)
+            {
+                buffer[len++] = i < count ? text[i] : '0';
+            }
+            if (count > k + 1)
+            {
+                buffer[len++] = '.';
+                memcpy(buffer + len, text + k + 1, count - k - 1);
+                len += count - k - 1;
+            }
+        }
+        else
+        {
+            buffer[len++] = '0';
+            buffer[len++] = '.';
+            for (int i = 0; i < -k - 1; i++)
+            {
+                buffer[len++] = '0';
+            }
+            memcpy(buffer + len, text, count);
+            len += count;
+        }
+        return len;
+    }
+
+    buffer[len++] = text[0];
+    if (count > 1)
+    {
+        buffer[len++] = '.';
+        memcpy(buffer + len, text + 1, count - 1);
+        len += count - 1;
+    }
+    buffer[len++] = 'e';
+    buffer[len++] = k < 0 ? '-' : '+';
+    int exponent = k < 0 ? -k : k;
+    if (exponent >= 100)
+    {
+        buffer[len++] = (char)('0' + exponent / 100);
+    }
+    buffer[len++] = (char)('0' + exponent / 10 % 10);
+    buffer[len++] = (char)('0' + exponent % 10);
+    return len;
+}
+
+// 正数 value 乘 10^(16 - k) 四舍五入成整数, 用数字解析的 5^q 表, 误差远小于 1.
+// 超出表的范围返回 -1
+static int scaleToDigits(double value, int k, uint64_t *digits)
+{
+    int q = 16 - k;
+    if (q < POW5_MIN_EXPONENT || q > POW5_MAX_EXPONENT)
+    {
+        return -1;
+    }
+
+    uint64_t bits = doubleBits(value);
+    int exponent = (int)(bits >> 52) & 0x7FF;
+    uint64_t mantissa = bits & ((1ULL << 52) - 1);
+    if (exponent == 0)
+    {
+        exponent = 1;
+    }
+    else
+    {
+        mantissa |= 1ULL << 52;
+    }
+    int lz = __builtin_clzll(mantissa);
+    mantissa <<= lz;
+
+    // value * 10^q = mantissa * 2^(exponent - 1075 - lz) * 5^q * 2^q, 5^q ~ table * 2^(floor(log2 5^q) - 63)
+    int log2Pow5 = (int)(((217706 * (int64_t)q) >> 16) - q);
+    int shift = 63 - (exponent - 1075 - lz) - q - log2Pow5;
+    if (shift <= 0 || shift >= 128)
+    {
+        return -1;
+    }
+    unsigned __int128 product = (unsigned __int128)mantissa * g_pow5Table[2 * (q - POW5_MIN_EXPONENT)];
+    *digits = (uint64_t)(product >> shift) + (uint64_t)((product >> (shift - 1)) & 1);
+    return 0;
+}
+
+// 正的有限数: 先算出 17 位有效数字, 再依次试 15, 16, 17 位, 用 parseNumber 读回来
+// 和原值相同的就用它. 近似值恰好舍入错时一个都对不上, 返回 -1 交给 snprintf
+static int formatShortest(char *buffer, double value)
+{
+    static const uint64_t powers[] = { 1, 10, 100 };
+    uint64_t bits = doubleBits(value);
+    int exponent = (int)(bits >> 52) & 0x7FF;
+    int binaryExponent = exponent != 0 ? exponent - 1023 : -1011 - __builtin_clzll(bits & ((1ULL << 52) - 1));
+    // floor(binaryExponent * log10(2)), 可能小 1
+    int k = (int)((binaryExponent * 78913LL) >> 18);
+    uint64_t digits;
+
+    if (scaleToDigits(value, k, &digits) != 0)
+    {
+        return -1;
+    }
+    if (digits >= 100000000000000000ULL)
+    {
+        k++;
+        if (scaleToDigits(value, k, &digits) != 0)
+        {
+            return -1;
+        }
+    }
+
+    for (int count = 15; count <= 17; count++)
+    {
+        uint64_t divisor = powers[17 - count];
+        uint64_t rounded = (digits + divisor / 2) / divisor;
+        int roundedK = k;
+        if (rounded >= 100000000000000000ULL / divisor)
+        {
+            rounded /= 10;
+            roundedK++;
+        }
+        int len = formatDigits(buffer, rounded, count, roundedK);
+        const char *pos = buffer;
+        if (parseNumber(&pos, buffer + len) == value && pos == buffer + len)
+        {
+            return len;
+        }
+    }
+    return -1;
+}
+
+// 整数值直接转成十进制, 其余用最短的能读回同一个 double 的 15 到 17 位有效数字
+static int formatResult(char *buffer, size_t size, double value)
 {
-    double result = 0;
-    double decimal = 0;
-    int decimalPlace = 0;
+    if (isnan(value))
+    {
+        return snprintf(buffer, size, "nan");
+    }
+    if (isinf(value))
+    {
+        return snprintf(buffer, size, value < 0 ? "-inf" : "inf");
+    }
+    if (value > -9007199254740992.0 && value < 9007199254740992.0 && value == (double)(int64_t)value &&
+        !(value == 0 && signbit(value)))
+    {
+        char digits[20];
+        int64_t integer = (int64_t)value;
+        uint64_t magnitude = integer < 0 ? -(uint64_t)integer : (uint64_t)integer;
+        int count = 0;
+        do
+        {
+            digits[count++] = (char)('0' + magnitude % 10);
+            magnitude /= 10;
+        } while (magnitude != 0);
+        int len = 0;
+        if (integer < 0)
+        {
+            buffer[len++] = '-';
+        }
+        while (count > 0)
+        {
+            buffer[len++] = digits[--count];
+        }
+        return len;
+    }
 
-    while (isdigit(**expr))
+    int negative = signbit(value) != 0;
+    if (negative)
     {
-        result = result * 10 + (**expr - '0');
-        (*expr)++;
+        buffer[0] = '-';
     }
+    int len = value != 0 ? formatShortest(buffer + negative, fabs(value)) : -1;
+    if (len < 0)
+    {
+        return snprintf(buffer, size, "%.17g", value);
+    }
+    return len + negative;
+}
 
-    if (**expr == '.')
+// 按 use 的窗口决定这一行查不查缓存
+static EvalStatus bulkEvaluateLine(BulkCacheUse *use, const char *line, size_t len, double *result,
+                                   const char **errorPos)
+{
+    if (use->cache == NULL || use->bypass > 0)
     {
-        (*expr)++;
-        while (isdigit(**expr))
+        if (use->bypass > 0)
         {
-            decimal = decimal * 10 + (**expr - '0');
-            (*expr)++;
-            decimalPlace++;
+            use->bypass--;
+            use->bypassed++;
         }
+        return evaluateText(line, len, result, errorPos);
+    }
 
-        while (decimalPlace > 0)
+    int hit;
+    EvalStatus status = cacheEvaluateHit(use->cache, line, len, result, errorPos, &hit);
+    use->hits += hit;
+    if (++use->lookups == BULK_CACHE_WINDOW)
+    {
+        if (use->hits * 3 < BULK_CACHE_WINDOW)
+        {
+            use->bypass = use->backoff;
+            use->backoff = use->backoff < BULK_CACHE_BYPASS ? use->backoff * 2 : BULK_CACHE_BYPASS;
+        }
+        else
         {
-            decimal /= 10;
-            decimalPlace--;
+            use->backoff = BULK_CACHE_WINDOW;
         }
-        result += decimal;
+        use->lookups = 0;
+        use->hits = 0;
     }
+    return status;
+}
 
-    return result;
+static void bulkEvaluateChunk(BulkSlot *slot, BulkCacheUse *use)
+{
+    const char *line = slot->begin;
+
+    slot->outLen = 0;
+    slot->errorCount = 0;
+    slot->lines = 0;
+    while (line < slot->end && !slot->failed)
+    {
+        const char *newline = memchr(line, '\n', slot->end - line);
+        const char *lineEnd = newline != NULL ? newline : slot->end;
+        const char *next = newline != NULL ? newline + 1 : slot->end;
+        size_t len = lineEnd - line;
+        if (len > 0 && line[len - 1] == '\r')
+        {
+            len--;
+        }
+
+        char text[32];
+        int textLen = 0;
+        size_t blank = 0;
+        while (blank < len && isSpace((unsigned char)line[blank]))
+        {
+            blank++;
+        }
+        if (blank < len)
+        {
+            double result;
+            const char *errorPos = NULL;
+            EvalStatus status = bulkEvaluateLine(use, line, len, &result, &errorPos);
+            if (status == EVAL_OK)
+            {
+                textLen = formatResult(text, sizeof(text), result);
+            }
+            else
+            {
+                if (slot->errorCount == slot->errorCap)
+                {
+                    size_t cap = (size_t)slot->errorCap;
+                    BulkError *grown = growBuffer(slot->errors, &cap, cap + 1, sizeof(BulkError));
+                    if (grown == NULL)
+                    {
+                        slot->failed = 1;
+                        break;
+                    }
+                    slot->errors = grown;
+                    slot->errorCap = (long)cap;
+                }
+                BulkError *error = &slot->errors[slot->errorCount++];
+                error->line = slot->lines;
+                error->status = status;
+                error->column = errorPos != NULL && errorPos >= line && errorPos <= line + len &&
+                                        (status == EVAL_SYNTAX || status == EVAL_TRAILING)
+                                    ? (int)(errorPos - line) + 1
+                                    : 0;
+                textLen = snprintf(text, sizeof(text), "ERROR");
+            }
+        }
+        text[textLen++] = '\n';
+        bulkAppend(slot, text, textLen);
+        slot->lines++;
+        line = next;
+    }
 }
 
-void skipWhitespace(const char **expr)
+static void *bulkWorker(void *arg)
 {
-    while (isspace(**expr))
+    BulkJob *job = arg;
+    BulkCacheUse use = { job->cache, 0, 0, 0, BULK_CACHE_WINDOW, 0 };
+
+    pthread_mutex_lock(&job->lock);
+    while (job->chunkCount < 0)
+    {
+        // 写出去之前槽位不能复用, 这里同时起到限制在途块数的作用
+        BulkSlot *slot = &job->slots[job->nextChunk % job->slotCount];
+        if (slot->state != SLOT_FREE || job->reading)
+        {
+            pthread_cond_wait(&job->cond, &job->lock);
+            continue;
+        }
+        slot->index = job->nextChunk++;
+        slot->state = SLOT_BUSY;
+        int more;
+        if (job->map != NULL)
+        {
+            more = bulkNextChunk(job, slot);
+        }
+        else
+        {
+            // 管道可能很久才来一块: read 时放开锁, 别的线程照样交付算完的块, 写出线程照样写出和释放槽位
+            job->reading = 1;
+            pthread_mutex_unlock(&job->lock);
+            more = bulkNextChunk(job, slot);
+            pthread_mutex_lock(&job->lock);
+            job->reading = 0;
+            pthread_cond_broadcast(&job->cond);
+        }
+        if (!more)
+        {
+            // 只有读的线程会走到这里, 这个编号就是块数
+            slot->state = SLOT_FREE;
+            job->chunkCount = slot->index;
+            pthread_cond_broadcast(&job->cond);
+            break;
+        }
+        pthread_mutex_unlock(&job->lock);
+
+        if (!slot->failed)
+        {
+            bulkEvaluateChunk(slot, &use);
+        }
+
+        pthread_mutex_lock(&job->lock);
+        slot->state = SLOT_DONE;
+        pthread_cond_broadcast(&job->cond);
+    }
+    pthread_mutex_unlock(&job->lock);
+    if (use.bypassed > 0)
     {
-        (*expr)++;
+        __atomic_add_fetch(&job->cache->bypassed, (unsigned long)use.bypassed, __ATOMIC_RELAXED);
     }
+    releaseWorkspace();
+    return NULL;
 }
 
-double parseExpression(const char **expr);
+static int writeAll(int fd, const char *data, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = write(fd, data, len);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        data += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
 
-double parseFactor(const char **expr)
+// 对文件 (path 为 "-" 时是 stdin) 里的每一行求值, cache 可以为 NULL.
+// 返回出错的行数, 读写失败时返回 -1
+long evaluateFile(const char *path, int threads, ExprCache *cache)
 {
-    skipWhitespace(expr);
-    double result = 0;
+    BulkJob job;
+    pthread_t tids[MAX_BATCH_THREADS];
+    int started = 0;
+    long errorLines = 0;
+    int failed = 0;
 
-    if (**expr == '(')
+    memset(&job, 0, sizeof(job));
+    job.cache = cache;
+    job.fd = strcmp(path, "-") == 0 ? STDIN_FILENO : open(path, O_RDONLY);
+    if (job.fd < 0)
+    {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    struct stat st;
+    if (fstat(job.fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
     {
-        (*expr)++;
-        result = parseExpression(expr);
-        skipWhitespace(expr);
-        if (**expr == ')')
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, job.fd, 0);
+        if (map != MAP_FAILED)
         {
-            (*expr)++;
+            madvise(map, st.st_size, MADV_SEQUENTIAL);
+            job.map = map;
+            job.mapSize = st.st_size;
         }
     }
-    else if (**expr == '-')
+
+    threads = threads < 1 ? 1 : threads > MAX_BATCH_THREADS ? MAX_BATCH_THREADS : threads;
+    job.slotCount = threads * BULK_SLOTS_PER_THREAD;
+    job.slots = calloc(job.slotCount, sizeof(BulkSlot));
+    job.chunkCount = -1;
+    pthread_mutex_init(&job.lock, NULL);
+    pthread_cond_init(&job.cond, NULL);
+    if (job.slots == NULL)
     {
-        (*expr)++;
-        result = -parseFactor(expr);
+        fprintf(stderr, "%s: %s\n", path, strerror(ENOMEM));
+        failed = 1;
+        job.chunkCount = 0;
     }
-    else if (**expr == '+')
+    for (int t = 0; t < threads && job.slots != NULL; t++)
     {
-        (*expr)++;
-        result = parseFactor(expr);
+        if (pthread_create(&tids[started], NULL, bulkWorker, &job) == 0)
+        {
+            started++;
+        }
     }
-    else
+    if (started == 0 && job.slots != NULL)
     {
-        result = parseNumber(expr);
+        fprintf(stderr, "pthread_create: %s\n", strerror(errno));
+        failed = 1;
+        job.chunkCount = 0;
     }
 
-    skipWhitespace(expr);
-    return result;
+    // 当前线程按块编号顺序写出结果
+    long lineBase = 0;
+    for (long index = 0;; index++)
+    {
+        pthread_mutex_lock(&job.lock);
+        BulkSlot *slot = job.slots != NULL ? &job.slots[index % job.slotCount] : NULL;
+        while (!(job.chunkCount >= 0 && index >= job.chunkCount) &&
+               !(slot->state == SLOT_DONE && slot->index == index))
+        {
+            pthread_cond_wait(&job.cond, &job.lock);
+        }
+        int finished = job.chunkCount >= 0 && index >= job.chunkCount;
+        pthread_mutex_unlock(&job.lock);
+        if (finished)
+        {
+            break;
+        }
+
+        if (slot->failed)
+        {
+            fprintf(stderr, "%s: %s\n", path, strerror(ENOMEM));
+            failed = 1;
+        }
+        else if (!failed && writeAll(STDOUT_FILENO, slot->out, slot->outLen) != 0)
+        {
+            fprintf(stderr, "write: %s\n", strerror(errno));
+            failed = 1;
+        }
+        for (long i = 0; i < slot->errorCount; i++)
+        {
+            const BulkError *error = &slot->errors[i];
+            if (error->column > 0)
+            {
+                fprintf(stderr, "%s:%ld:%d: %s\n", path, lineBase + error->line + 1, error->column,
+                        evalStatusMessage(error->status));
+            }
+            else
+            {
+                fprintf(stderr, "%s:%ld: %s\n", path, lineBase + error->line + 1, evalStatusMessage(error->status));
+            }
+        }
+        errorLines += slot->errorCount;
+        lineBase += slot->lines;
+
+        pthread_mutex_lock(&job.lock);
+        slot->state = SLOT_FREE;
+        pthread_cond_broadcast(&job.cond);
+        pthread_mutex_unlock(&job.lock);
+    }
+
+    for (int t = 0; t < started; t++)
+    {
+        pthread_join(tids[t], NULL);
+    }
+    if (job.readError != 0)
+    {
+        fprintf(stderr, "%s: %s\n", path, strerror(job.readError));
+        failed = 1;
+    }
+    for (int i = 0; job.slots != NULL && i < job.slotCount; i++)
+    {
+        free(job.slots[i].input);
+        free(job.slots[i].out);
+        free(job.slots[i].errors);
+    }
+    free(job.slots);
+    free(job.carry);
+    pthread_mutex_destroy(&job.lock);
+    pthread_cond_destroy(&job.cond);
+    if (job.map != NULL)
+    {
+        munmap((void *)job.map, job.mapSize);
+    }
+    if (job.fd != STDIN_FILENO)
+    {
+        close(job.fd);
+    }
+    return failed ? -1 : errorLines;
 }
 
-double parseTerm(const char **expr)
+// 解释器和 JIT 在一组特殊值 (±0, 非规格化数, ±inf, NaN) 上必须逐位一致
+void testJit(const char *expression)
 {
-    double result = parseFactor(expr);
+    static const double specials[] = { 0.0, -0.0, 1.0, -2.5, 3.0, 1e308, -4.9e-324, 1e-310, INFINITY, -INFINITY, NAN };
+    const int count = sizeof(specials) / sizeof(specials[0]);
+    Program prog;
+    const char *errorPos;
 
-    while (**expr == '*' || **expr == '/')
+    memset(&prog, 0, sizeof(prog));
+    printf("JIT: %s\n", expression);
+    if (compileExpression(expression, strlen(expression), &prog, &errorPos) != EVAL_OK)
+    {
+        freeProgram(&prog);
+        return;
+    }
+    if (jitProgram(&prog) != 0)
     {
-        char operator = **expr;
-        (*expr)++;
-        double operand = parseFactor(expr);
+        printf("  stack %d: not compiled, using the interpreter\n", prog.maxStack);
+        freeProgram(&prog);
+        return;
+    }
 
-        if (operator == '*')
+    int checked = 0, mismatched = 0;
+    for (int i = 0; i < count; i++)
+    {
+        for (int j = 0; j < count; j++)
         {
-            result *= operand;
+            double vars[MAX_VARS] = { specials[i], specials[j] };
+            double expected = 0, actual = 0;
+            EvalStatus want = evaluateProgram(&prog, vars, &expected);
+            EvalStatus got = (EvalStatus)prog.jit(vars, &actual);
+            if (want != got || (want == EVAL_OK && memcmp(&expected, &actual, sizeof(double)) != 0))
+            {
+                mismatched++;
+            }
+            checked++;
         }
-        else
+    }
+    printf("  stack %d: %d inputs, %d mismatches\n", prog.maxStack, checked, mismatched);
+    freeProgram(&prog);
+}
+
+// 优化前后在一组特殊值上逐位对比, 并报告指令数的变化
+void testOptimize(const char *expression)
+{
+    static const double specials[] = { 0.0, -0.0, 1.0, -2.5, 0.5, 1e308, 4.9e-324, INFINITY, -INFINITY, NAN };
+    const int count = sizeof(specials) / sizeof(specials[0]);
+    Program plain, optimized;
+    const char *errorPos;
+
+    memset(&plain, 0, sizeof(plain));
+    memset(&optimized, 0, sizeof(optimized));
+    printf("Optimize: %s\n", expression);
+    g_optimize = 0;
+    EvalStatus status = compileExpression(expression, strlen(expression), &plain, &errorPos);
+    g_optimize = 1;
+    if (status != EVAL_OK || compileExpression(expression, strlen(expression), &optimized, &errorPos) != EVAL_OK)
+    {
+        freeProgram(&plain);
+        freeProgram(&optimized);
+        return;
+    }
+
+    int checked = 0, mismatched = 0;
+    for (int i = 0; i < count; i++)
+    {
+        for (int j = 0; j < count; j++)
         {
-            if (operand == 0)
+            double vars[MAX_VARS] = { specials[i], specials[j] };
+            double expected = 0, actual = 0;
+            EvalStatus want = evaluateProgram(&plain, vars, &expected);
+            EvalStatus got = evaluateProgram(&optimized, vars, &actual);
+            if (want != got || (want == EVAL_OK && memcmp(&expected, &actual, sizeof(double)) != 0))
             {
-                printf("Error: Division by zero\n");
-                exit(0);
+                mismatched++;
             }
-            result /= operand;
+            checked++;
         }
     }
+    printf("  %d -> %d instructions, %d temps, %d inputs, %d mismatches\n", plain.length, optimized.length,
+           optimized.tempCount, checked, mismatched);
+    freeProgram(&plain);
+    freeProgram(&optimized);
+}
 
-    return result;
+static double nowSeconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
 }
 
-double parseExpression(const char **expr)
+// 同一个公式求值 iterations 次: 预编译 + 换变量值 对比 每次重新解析
+void runBenchmark(long iterations)
 {
-    double result = parseTerm(expr);
+    const char *formula = "(x + 1.5) * (y - 2) / (x * x + 1) - 3 * y";
+    const char *literal = "(3.25 + 1.5) * (4 - 2) / (3.25 * 3.25 + 1) - 3 * 4";
+    Program prog;
+    const char *errorPos;
+    double sum = 0;
+    double result;
+
+    printf("=== 基准测试: %ld 次求值 ===\n", iterations);
+    printf("公式: %s\n", formula);
 
-    while (**expr == '+' || **expr == '-')
+    double start = nowSeconds();
+    for (long i = 0; i < iterations; i++)
     {
-        char operator = **expr;
-        (*expr)++;
-        double operand = parseTerm(expr);
+        if (evaluateText(literal, strlen(literal), &result, &errorPos) == EVAL_OK)
+        {
+            sum += result;
+        }
+    }
+    double reparse = nowSeconds() - start;
 
-        if (operator == '+')
+    memset(&prog, 0, sizeof(prog));
+    if (compileExpression(formula, strlen(formula), &prog, &errorPos) != EVAL_OK)
+    {
+        freeProgram(&prog);
+        return;
+    }
+    int x = findVariable(&prog, "x");
+    int y = findVariable(&prog, "y");
+    double vars[MAX_VARS] = { 0 };
+    start = nowSeconds();
+    for (long i = 0; i < iterations; i++)
+    {
+        vars[x] = 3.25 + (i & 1023) * 0.001;
+        vars[y] = 4 - (i & 511) * 0.002;
+        if (evaluateProgram(&prog, vars, &result) == EVAL_OK)
         {
-            result += operand;
+            sum += result;
         }
-        else
+    }
+    double compiled = nowSeconds() - start;
+
+    // 前 g_jitThreshold 次解释执行, 之后走机器码
+    double jitSum = 0;
+    start = nowSeconds();
+    for (long i = 0; i < iterations; i++)
+    {
+        vars[x] = 3.25 + (i & 1023) * 0.001;
+        vars[y] = 4 - (i & 511) * 0.002;
+        if (evaluateHot(&prog, vars, &result) == EVAL_OK)
         {
-            result -= operand;
+            jitSum += result;
         }
     }
+    double jitted = nowSeconds() - start;
+    int jitState = prog.jitState;
+    freeProgram(&prog);
 
-    return result;
+    printf("每次重新解析: %8.3f s  %7.1f ns/次\n", reparse, reparse * 1e9 / iterations);
+    printf("预编译字节码: %8.3f s  %7.1f ns/次  (%.1fx)\n", compiled, compiled * 1e9 / iterations,
+           reparse / compiled);
+    if (jitState == 1)
+    {
+        printf("JIT 机器码  : %8.3f s  %7.1f ns/次  (比字节码快 %.1fx)\n", jitted, jitted * 1e9 / iterations,
+               compiled / jitted);
+    }
+    else
+    {
+        printf("JIT 机器码  : 不可用, 用的是解释器\n");
+    }
+    printf("(checksum %g)\n", sum);
+}
+
+// 生成的公式里常见的常量运算和重复子表达式: 优化前后的字节码各求值 iterations 次
+void runOptimizeBenchmark(long iterations)
+{
+    static const char *formulas[] = {
+        "(a + b) * (a + b) + 2 * 3",
+        "(x * 2 + 1) * (x * 2 + 1) / (y * 4 - 3) + (x * 2 + 1) / (y * 4 - 3) - 3 * 4 / 2",
+        "((x - 1.5) * (y + 2) + (x - 1.5) * (y + 2) / (1 + 2 * 3)) * ((x - 1.5) * (y + 2) - 0.5 / 2) * 1",
+        "(x / 2 + y / 4) * (x / 2 + y / 4) - (x / 2 - y / 4) * (x / 2 - y / 4) + (60 * 60 * 24 - 1) / 1000",
+    };
+
+    printf("\n=== 常量折叠和公共子表达式: 每个公式 %ld 次求值 ===\n", iterations);
+    for (size_t f = 0; f < sizeof(formulas) / sizeof(formulas[0]); f++)
+    {
+        Program progs[2];
+        double elapsed[2];
+        uint64_t checksum[2] = { 0, 0 };
+        const char *errorPos;
+
+        memset(progs, 0, sizeof(progs));
+        for (int optimize = 0; optimize < 2; optimize++)
+        {
+            Program *prog = &progs[optimize];
+            g_optimize = optimize;
+            if (compileExpression(formulas[f], strlen(formulas[f]), prog, &errorPos) != EVAL_OK)
+            {
+                elapsed[optimize] = 0;
+                continue;
+            }
+            double vars[MAX_VARS] = { 0 };
+            double result;
+            double start = nowSeconds();
+            for (long i = 0; i < iterations; i++)
+            {
+                for (int v = 0; v < prog->ast.varCount; v++)
+                {
+                    vars[v] = 3.25 + v + (i & 1023) * 0.001;
+                }
+                if (evaluateProgram(prog, vars, &result) == EVAL_OK)
+                {
+                    checksum[optimize] ^= doubleBits(result) + (uint64_t)i;
+                }
+            }
+            elapsed[optimize] = nowSeconds() - start;
+        }
+        g_optimize = 1;
+
+        printf("%s\n", formulas[f]);
+        printf("  %2d -> %2d 条指令, %d 个临时槽位  %6.1f -> %6.1f ns/次  (%.2fx, %s)\n", progs[0].length,
+               progs[1].length, progs[1].tempCount, elapsed[0] * 1e9 / iterations, elapsed[1] * 1e9 / iterations,
+               elapsed[1] > 0 ? elapsed[0] / elapsed[1] : 0.0, checksum[0] == checksum[1] ? "结果一致" : "结果不一致!");
+        freeProgram(&progs[0]);
+        freeProgram(&progs[1]);
+    }
 }
 
-double evaluateExpression(const char *expression)
+// 同一个公式按列求值: 逐行解释执行 对比 批量 (标量 / AVX2 / 多线程), 结果必须逐位一致
+void runBatchBenchmark(long iterations)
 {
-    const char *expr = expression;
-    skipWhitespace(&expr);
+    const char *formula = "(x + 1.5) * (y - 2) / (x * x + 1) - 3 * y";
+    size_t rows = iterations < (1 << 20) ? (size_t)iterations : (1 << 20);
+    long repeat = (iterations + rows - 1) / rows;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int threads = cpus > 1 ? (int)(cpus < MAX_BATCH_THREADS ? cpus : MAX_BATCH_THREADS) : 1;
+    Program prog;
+    const char *errorPos;
 
-    if (*expr == '\0')
+    memset(&prog, 0, sizeof(prog));
+    if (compileExpression(formula, strlen(formula), &prog, &errorPos) != EVAL_OK)
     {
-        printf("Error: Invalid expression\n");
-        exit(0);
+        freeProgram(&prog);
+        return;
+    }
+    double *xs = malloc(rows * sizeof(double));
+    double *ys = malloc(rows * sizeof(double));
+    double *expected = malloc(rows * sizeof(double));
+    double *out = malloc(rows * sizeof(double));
+    if (xs == NULL || ys == NULL || expected == NULL || out == NULL)
+    {
+        perror("malloc");
+        free(xs);
+        free(ys);
+        free(expected);
+        free(out);
+        freeProgram(&prog);
+        return;
     }
 
-    double result = parseExpression(&expr);
-    skipWhitespace(&expr);
-    if (*expr != '\0')
+    int x = findVariable(&prog, "x");
+    int y = findVariable(&prog, "y");
+    double *columns[MAX_VARS] = { NULL };
+    columns[x] = xs;
+    columns[y] = ys;
+    for (size_t i = 0; i < rows; i++)
     {
-        printf("Error: not complete expression, remain %s", expr);
-        exit(0);
+        xs[i] = 3.25 + (i & 1023) * 0.001;
+        ys[i] = 4 - (i & 511) * 0.002;
     }
 
-    return result;
+    printf("\n=== 按列批量求值: %zu 行 x %ld 遍 ===\n", rows, repeat);
+
+    double vars[MAX_VARS] = { 0 };
+    double start = nowSeconds();
+    for (long r = 0; r < repeat; r++)
+    {
+        for (size_t i = 0; i < rows; i++)
+        {
+            vars[x] = xs[i];
+            vars[y] = ys[i];
+            evaluateProgram(&prog, vars, &expected[i]);
+        }
+    }
+    double rowTime = nowSeconds() - start;
+    printf("逐行解释执行: %8.3f s  %7.2f ns/行\n", rowTime, rowTime * 1e9 / (rows * repeat));
+
+    struct
+    {
+        const char *name;
+        int forceScalar;
+        int threads;
+    } variants[] = {
+        { "批量 标量    ", 1, 1 },
+        { "批量 AVX2    ", 0, 1 },
+        { "批量 多线程  ", 0, threads },
+    };
+    for (size_t v = 0; v < sizeof(variants) / sizeof(variants[0]); v++)
+    {
+        initBatchKernel(variants[v].forceScalar);
+        start = nowSeconds();
+        for (long r = 0; r < repeat; r++)
+        {
+            evaluateBatch(&prog, (const double *const *)columns, rows, out, NULL, variants[v].threads);
+        }
+        double elapsed = nowSeconds() - start;
+        printf("%s: %8.3f s  %7.2f ns/行  (%.1fx, %d 线程, %s)\n", variants[v].name, elapsed,
+               elapsed * 1e9 / (rows * repeat), rowTime / elapsed, variants[v].threads,
+               memcmp(out, expected, rows * sizeof(double)) == 0 ? "结果一致" : "结果不一致!");
+    }
+    initBatchKernel(0);
+
+    free(xs);
+    free(ys);
+    free(expected);
+    free(out);
+    freeProgram(&prog);
 }
 
-void testExpression(const char *expression)
+// 数字解析吞吐量: 整数, 定点小数, 科学计数法和 17 位有效数字的随机 double 各占一份,
+// parseNumber 对比 strtod, 并逐位核对结果
+void runNumberBenchmark(long count)
 {
-    printf("Expression: %s\n", expression);
-    double result = evaluateExpression(expression);
-    printf("Result: %.2f\n", result);
+    size_t capacity = (size_t)count * 32 + 1;
+    char *text = malloc(capacity);
+    double *values = malloc((size_t)count * sizeof(double));
+    double *expected = malloc((size_t)count * sizeof(double));
+    if (text == NULL || values == NULL || expected == NULL)
+    {
+        perror("malloc");
+        free(text);
+        free(values);
+        free(expected);
+        return;
+    }
+
+    uint64_t state = 0x9E3779B97F4A7C15ULL;
+    size_t length = 0;
+    for (long i = 0; i < count; i++)
+    {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        switch (i & 3)
+        {
+        case 0:
+            length += sprintf(text + length, "%u ", (unsigned)(state % 1000000));
+            break;
+        case 1:
+            length += sprintf(text + length, "%u.%02u ", (unsigned)(state % 100000), (unsigned)(state >> 32) % 100);
+            break;
+        case 2:
+            length += sprintf(text + length, "%.6e ", (double)(state >> 11) / (1ULL << 53) * 1e6);
+            break;
+        default:
+        {
+            double d;
+            uint64_t bits = state & 0x7FEFFFFFFFFFFFFFULL;
+            memcpy(&d, &bits, sizeof(d));
+            length += sprintf(text + length, "%.17g ", d);
+            break;
+        }
+        }
+    }
+    const char *end = text + length;
+
+    printf("\n=== 数字解析: %ld 个数, %zu 字节 ===\n", count, length);
+
+    double start = nowSeconds();
+    const char *pos = text;
+    for (long i = 0; i < count; i++)
+    {
+        char *next;
+        expected[i] = strtod(pos, &next);
+        pos = next + 1;
+    }
+    double strtodTime = nowSeconds() - start;
+
+    start = nowSeconds();
+    pos = text;
+    for (long i = 0; i < count; i++)
+    {
+        values[i] = parseNumber(&pos, end);
+        pos++;
+    }
+    double parseTime = nowSeconds() - start;
+
+    long mismatched = 0;
+    for (long i = 0; i < count; i++)
+    {
+        mismatched += memcmp(&values[i], &expected[i], sizeof(double)) != 0;
+    }
+    printf("strtod     : %8.3f s  %7.1f ns/个  %7.1f MB/s\n", strtodTime, strtodTime * 1e9 / count,
+           length / strtodTime / 1e6);
+    printf("parseNumber: %8.3f s  %7.1f ns/个  %7.1f MB/s  (%.1fx, %ld 个和 strtod 不一致)\n", parseTime,
+           parseTime * 1e9 / count, length / parseTime / 1e6, strtodTime / parseTime, mismatched);
+
+    free(text);
+    free(values);
+    free(expected);
+}
+
+// 按流行度偏斜的重复输入: 每个表达式以 repeatPercent% 的概率是前面出现过的,
+// 越早出现的越常被重复. 每次重新解析 对比 走缓存 (容量放得下全部表达式 / 只放得下 1/4)
+static void runCacheTrace(long count, int repeatPercent)
+{
+    long uniqueCap = count * (100 - repeatPercent) / 100 + 1;
+    char *text = malloc((size_t)uniqueCap * 64);
+    int *offsets = malloc((size_t)uniqueCap * sizeof(int));
+    int *trace = malloc((size_t)count * sizeof(int));
+    double *expected = malloc((size_t)count * sizeof(double));
+    double *results = malloc((size_t)count * sizeof(double));
+    if (text == NULL || offsets == NULL || trace == NULL || expected == NULL || results == NULL)
+    {
+        perror("malloc");
+        free(text);
+        free(offsets);
+        free(trace);
+        free(expected);
+        free(results);
+        return;
+    }
+
+    uint64_t state = 0x2545F4914F6CDD1DULL;
+    long unique = 0;
+    size_t length = 0;
+    for (long i = 0; i < count; i++)
+    {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        if (unique > 0 && ((long)(state % 100) < repeatPercent || unique == uniqueCap))
+        {
+            double u = (double)(state >> 11) / (1ULL << 53);
+            trace[i] = (int)(u * u * u * unique);
+            continue;
+        }
+        offsets[unique] = (int)length;
+        length += sprintf(text + length, "(%u.%02u + %u) * (%u - %u.5) / (%u + %u * %u)", (unsigned)(state >> 40) % 1000,
+                          (unsigned)(state >> 20) % 100, (unsigned)(state >> 12) % 100, (unsigned)(state >> 30) % 50,
+                          (unsigned)(state >> 36) % 50, (unsigned)(state >> 24) % 9 + 1, (unsigned)(state >> 16) % 7,
+                          (unsigned)(state >> 50) % 13) +
+                  1;
+        trace[i] = (int)unique++;
+    }
+
+    printf("重复率 %.1f%%, %ld 个不同的表达式:\n", 100.0 * (count - unique) / count, unique);
+
+    const char *errorPos;
+    double start = nowSeconds();
+    for (long i = 0; i < count; i++)
+    {
+        const char *expression = text + offsets[trace[i]];
+        expected[i] = 0;
+        evaluateText(expression, strlen(expression), &expected[i], &errorPos);
+    }
+    double reparse = nowSeconds() - start;
+    printf("  每次重新解析   : %8.3f s  %7.1f ns/次\n", reparse, reparse * 1e9 / count);
+
+    const long capacities[] = { unique * 2, unique / 4 };
+    for (int c = 0; c < 2; c++)
+    {
+        ExprCache *cache = createExprCache(capacities[c]);
+        if (cache == NULL)
+        {
+            break;
+        }
+        start = nowSeconds();
+        for (long i = 0; i < count; i++)
+        {
+            const char *expression = text + offsets[trace[i]];
+            results[i] = 0;
+            cacheEvaluate(cache, expression, strlen(expression), &results[i], &errorPos);
+        }
+        double elapsed = nowSeconds() - start;
+        CacheStats stats;
+        cacheStats(cache, &stats);
+        printf("  缓存 %7ld 项 : %8.3f s  %7.1f ns/次  (%.1fx, 命中 %.1f%%, 淘汰 %lu, %s)\n", capacities[c], elapsed,
+               elapsed * 1e9 / count, reparse / elapsed, 100.0 * stats.hits / (stats.hits + stats.misses),
+               stats.evictions, memcmp(results, expected, count * sizeof(double)) == 0 ? "结果一致" : "结果不一致!");
+        freeExprCache(cache);
+    }
+
+    free(text);
+    free(offsets);
+    free(trace);
+    free(expected);
+    free(results);
+}
+
+// 未命中的那部分仍然要完整解析, 所以重复率 90% 时加速比的上限是 10 倍.
+// 重复率 0% 的一组全是未命中, 比重新解析多出来的就是一次探测加一次插入
+void runCacheBenchmark(long count)
+{
+    printf("\n=== 表达式缓存: %ld 次求值 ===\n", count);
+    runCacheTrace(count / 10, 0);
+    runCacheTrace(count, 90);
+    runCacheTrace(count, 99);
+}
+
+// 批量求值时除数为 0 只标记那一行
+void testBatch(const char *expression, const double *xs, int count)
+{
+    Program prog;
+    const char *errorPos;
+    double out[16];
+    unsigned char errors[16];
+
+    memset(&prog, 0, sizeof(prog));
+    printf("Batch: %s\n", expression);
+    if (compileExpression(expression, strlen(expression), &prog, &errorPos) != EVAL_OK || count > 16)
+    {
+        freeProgram(&prog);
+        return;
+    }
+    const double *columns[MAX_VARS] = { xs };
+    long errorRows = evaluateBatch(&prog, columns, count, out, errors, 1);
+    for (int i = 0; i < count; i++)
+    {
+        if (errors[i])
+        {
+            printf("  x = %g: Error: %s\n", xs[i], evalStatusMessage(EVAL_DIV_ZERO));
+        }
+        else
+        {
+            printf("  x = %g: %.4f\n", xs[i], out[i]);
+        }
+    }
+    printf("  %ld rows with errors\n", errorRows);
+    freeProgram(&prog);
+}
+
+void printUsage(const char *programName)
+{
+    printf("用法: %s [-f 文件 [-t 线程数]] | --bench [次数]\n", programName);
+    printf("  (无参数)  自测后进入交互模式\n");
+    printf("  -f 文件   每行一个表达式, 结果按行写到 stdout, 出错的行输出 ERROR; 文件为 - 时读 stdin\n");
+    printf("  -t N      -f 用的工作线程数, 默认为 CPU 数\n");
+    printf("  -c N      -f 用的表达式缓存项数, 默认 %d, 0 表示不缓存. 每 %d 行里命中不到 1/3 时\n", BULK_CACHE_CAPACITY,
+           BULK_CACHE_WINDOW);
+    printf("            (重复的表达式很少), 接下来的行绕过缓存直接解析, 之后再试; 连着不划算时绕过的行数\n");
+    printf("            从 %d 起加倍, 最多 %d\n", BULK_CACHE_WINDOW, BULK_CACHE_BYPASS);
+    printf("  -v        -f 结束后把缓存命中情况 (包括绕过缓存的行数) 写到 stderr\n");
+    printf("  --bench   基准测试\n");
 }
 
-int main()
+int main(int argc, char *argv[])
 {
+    if (argc > 1 && strcmp(argv[1], "--bench") == 0)
+    {
+        long iterations = argc > 2 ? atol(argv[2]) : 10000000;
+        runBenchmark(iterations > 0 ? iterations : 10000000);
+        runBatchBenchmark(iterations > 0 ? iterations : 10000000);
+        runOptimizeBenchmark(iterations > 0 ? iterations : 10000000);
+        runNumberBenchmark(1000000);
+        runCacheBenchmark(iterations > 0 && iterations < 2000000 ? iterations : 2000000);
+        return 0;
+    }
+
+    if (argc > 1)
+    {
+        const char *path = NULL;
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        int threads = cpus > 0 ? (int)cpus : 1;
+        long cacheCapacity = BULK_CACHE_CAPACITY;
+        int verbose = 0;
+        for (int i = 1; i < argc; i++)
+        {
+            if (strcmp(argv[i], "-f") == 0 && i + 1 < argc)
+            {
+                path = argv[++i];
+            }
+            else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0)
+            {
+                threads = atoi(argv[++i]);
+            }
+            else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc && atol(argv[i + 1]) >= 0)
+            {
+                cacheCapacity = atol(argv[++i]);
+            }
+            else if (strcmp(argv[i], "-v") == 0)
+            {
+                verbose = 1;
+            }
+            else
+            {
+                printUsage(argv[0]);
+                return 2;
+            }
+        }
+        if (path == NULL)
+        {
+            printUsage(argv[0]);
+            return 2;
+        }
+        // 出错的行可能很多, stderr 也要缓冲
+        setvbuf(stderr, NULL, _IOFBF, 1 << 16);
+        ExprCache *cache = cacheCapacity > 0 ? createExprCache(cacheCapacity) : NULL;
+        long errorLines = evaluateFile(path, threads, cache);
+        if (cache != NULL && verbose)
+        {
+            CacheStats stats;
+            cacheStats(cache, &stats);
+            fprintf(stderr, "cache: %lu hits, %lu misses (%.1f%% hit), %lu evictions, %lu entries, %lu bypassed\n",
+                    stats.hits, stats.misses,
+                    stats.hits + stats.misses ? 100.0 * stats.hits / (stats.hits + stats.misses) : 0.0,
+                    stats.evictions, stats.entries, stats.bypassed);
+        }
+        freeExprCache(cache);
+        fflush(stderr);
+        return errorLines < 0 ? 2 : errorLines > 0 ? 1 : 0;
+    }
+
     printf("=== 字符串表达式解析器 ===\n\n");
 
     // 测试各种表达式
@@ -180,15 +3661,56 @@ int main()
     testExpression("2*3+4*5");
     testExpression("(1+2)*(3+4)");
     testExpression("100/(2+3)");
+    testExpression("1/0");
+    testExpression("(1+2");
+    testExpression("2+3)");
+    testExpression("1e-9 * 2.5E+12");
+    testExpression("6.02e23 / 1e23");
+    testExpression("1e");
+
+    // 数字解析和 strtod 逐位对比
+    testNumber("0.1");
+    testNumber("1e-9");
+    testNumber("9007199254740993");
+    testNumber("2.2250738585072011e-308");
+    testNumber("4.9e-324");
+    testNumber("1.7976931348623157e308");
+    testNumber("1e400");
+    testNumber("123456789012345678901234567890");
+    testNumber("0.00000000000000000000123456789012345678901234567890");
+
+    // 编译一次, 换变量值反复求值
+    const double xs[] = { -1, 0, 2.5 };
+    testProgram("x*x + 2*x + 1", "x", xs, 3);
+    testProgram("(rate + 1) * (rate - 1) / rate", "rate", xs, 3);
+
+    // 按列批量求值
+    const double column[] = { 0, 1, 2, 3, 4, 5 };
+    testBatch("1 / (x - 2) + x", column, 6);
+
+    // JIT 和解释器逐位对比
+    testJit("x / y");
+    testJit("-(x - y) * (x + y) / (y * y)");
+    testJit("((x + 1) * (y - 2) - x / (y + 3)) / -x + 0.1");
+    testJit("(x - y) * (x - y) / ((x - y) * (x - y) + 1) - (x - y)");
+    testJit("1+(2+(3+(4+(5+(6+(7+(8+(9+(10+(11+(12+(13+(14+x/y)))))))))))))");
+    testJit("1+(2+(3+(4+(5+(6+(7+(8+(9+(10+(11+(12+(13+(14+(15+x/y))))))))))))))");
+
+    // 优化前后逐位对比
+    testOptimize("(a + b) * (a + b) + 2 * 3");
+    testOptimize("x * 1 + 1 * y - x / 1 + (x - 0) + (y + -0) + --x + (x + 0)");
+    testOptimize("(x / 4 - y / 0.5) / (3 - 3) + 1 / 0 * x");
+    testOptimize("((x - y) * (x - y) + (x - y)) / ((x - y) * (x - y) + (x - y) + 1e400 * 0)");
 
     // 交互式输入
-    char input[256];
+    char *input = NULL;
+    size_t inputCap = 0;
     printf("请输入表达式 (输入 'quit' 退出):\n");
 
     while (1)
     {
         printf("> ");
-        if (fgets(input, sizeof(input), stdin) == NULL)
+        if (getline(&input, &inputCap, stdin) < 0)
         {
             break;
         }
@@ -206,10 +3728,19 @@ int main()
             continue;
         }
 
-        double result = evaluateExpression(input);
+        double result;
+        const char *errorPos;
+        EvalStatus status = evaluateExpression(input, &result, &errorPos);
+        if (status != EVAL_OK)
+        {
+            printError(status, errorPos);
+            continue;
+        }
         printf("结果: %.2f\n", result);
     }
 
+    free(input);
+    releaseWorkspace();
     printf("程序结束。\n");
     return 0;
-}
\ No newline at end of file
+}